@@ -0,0 +1,64 @@
+#!/usr/bin/env lua
+
+
+--
+-- A micro-benchmark of the batch (getlist/putlist/outlist) conversions and the per-call overhead of
+-- Lua-TTyrant.
+--
+-- Copyright (C)2010 by Valeriu Palos. All rights reserved.
+-- This library is under the MIT license (see doc/LICENSE).
+--
+-- Usage: lua bench/batch.lua [items = 1000] [rounds = 1000]
+-- (needs a hash database ttserver running on localhost:1978)
+--
+
+
+--
+-- Import API.
+--
+local ttyrant = require('ttyrant')
+
+
+--
+-- Parameters.
+--
+local items = tonumber(arg[1]) or 1000
+local rounds = tonumber(arg[2]) or 1000
+local th = assert(ttyrant.hash:open('localhost', 1978))
+
+
+--
+-- Batches.
+--
+local records, keys = {}, {}
+for i = 1, items do
+    local key = ('bench:%08d'):format(i)
+    records[key] = ('%064d'):format(i)
+    keys[i] = key
+end
+
+
+--
+-- Measure a function over the given number of rounds.
+--
+local function measure(name, fn)
+    collectgarbage('collect')
+    local start = os.clock()
+    for round = 1, rounds do
+        fn()
+    end
+    local elapsed = os.clock() - start
+    print(('%-12s %6d items x %6d rounds: %8.3f s cpu, %10.0f items/s'):format(
+          name, items, rounds, elapsed, items * rounds / elapsed))
+end
+
+
+--
+-- Run.
+--
+measure('put{}', function() assert(th:put(records)) end)
+measure('get{}', function() assert(th:get(keys)) end)
+measure('get(...)', function() assert(th:get(unpack(keys))) end)
+measure('get(key)', function() for i = 1, items do assert(th:get(keys[i])) end end)
+measure('out{}', function() assert(th:out(keys)) end)
+assert(th:close())
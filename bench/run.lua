@@ -0,0 +1,577 @@
+#!/usr/bin/env lua
+
+
+--
+-- A benchmark suite for Lua-TTyrant.
+--
+-- Copyright (C)2010 by Valeriu Palos. All rights reserved.
+-- This library is under the MIT license (see doc/LICENSE).
+--
+-- Usage: lua bench/run.lua [options]
+--
+--   --hash <host:port>     hash database ttserver (default localhost:1978)
+--   --table <host:port>    table database ttserver (default localhost:1979)
+--   --ops <n>              operations per case and worker (default 10000)
+--   --keysize <n>          key size in bytes (default 16)
+--   --valuesize <n>        value size in bytes (default 64)
+--   --batch <n>            batch size of the batched cases (default 100)
+--   --concurrency <n>      number of worker processes (default 1)
+--   --cases <a,b,...>      cases to run (default all): put, put{}, get, getlist, putcat, putshl,
+--                          increment, iterator, fwmkeys, table.put, table.get, query.search
+--                          and query.searchget
+--   --output <file>        write the JSON report to a file (default stdout)
+--   --baseline <file>      compare with a previously saved JSON report
+--   --threshold <f>        tolerated relative slowdown (default 0.10)
+--   --fake <seconds>       use in-process fake servers (one pair per worker) answering after the
+--                          given delay instead of the ttservers (e.g. 0.0002 for a LAN round trip)
+--   --jitter <seconds>     random extra delay of the fake servers (default 0)
+--
+-- Each worker uses its own keys (removed at the end), so the servers may hold
+-- other data. Latencies are measured per call (i.e. per batch for the batched
+-- cases); throughput counts items (keys, pairs or tuples). The exit code is 1
+-- if any case regressed against the baseline by more than the threshold (in
+-- ops/s or p99 latency).
+--
+
+
+--
+-- Import API.
+--
+local ttyrant = require('ttyrant')
+local clock = ttyrant.clock
+
+
+--
+-- Options.
+--
+local options = {
+    hash = 'localhost:1978',
+    table = 'localhost:1979',
+    ops = 10000,
+    keysize = 16,
+    valuesize = 64,
+    batch = 100,
+    concurrency = 1,
+    threshold = 0.10,
+}
+local index = 1
+while arg[index] do
+    local name = arg[index]:match('^%-%-(%w+)$')
+    if not name or arg[index + 1] == nil then
+        io.stderr:write(('Invalid argument «%s» (see the header of %s)!\n'):format(arg[index], arg[0]))
+        os.exit(2)
+    end
+    options[name] = tonumber(arg[index + 1]) or arg[index + 1]
+    index = index + 2
+end
+
+
+--
+-- Minimal JSON encoding/decoding (objects, arrays, strings, numbers, booleans).
+-- Non-empty sequences are arrays; empty tables are objects unless marked with
+-- json.array() (so that an empty list is still encoded as []).
+--
+local json = {}
+local array = {}
+
+function json.array(list)
+    return setmetatable(list or {}, array)
+end
+
+function json.encode(value, indent)
+    indent = indent or ''
+    local kind = type(value)
+    if kind == 'table' then
+        local inner, items = indent .. '  ', {}
+        if #value > 0 or getmetatable(value) == array then
+            for _, item in ipairs(value) do
+                items[#items + 1] = inner .. json.encode(item, inner)
+            end
+            return #items > 0 and '[\n' .. table.concat(items, ',\n') .. '\n' .. indent .. ']' or '[]'
+        end
+        local keys = {}
+        for key in pairs(value) do
+            keys[#keys + 1] = tostring(key)
+        end
+        table.sort(keys)
+        for _, key in ipairs(keys) do
+            items[#items + 1] = inner .. json.encode(key) .. ': ' .. json.encode(value[key], inner)
+        end
+        return #items > 0 and '{\n' .. table.concat(items, ',\n') .. '\n' .. indent .. '}' or '{}'
+    elseif kind == 'string' then
+        return '"' .. value:gsub('[%c"\\]', function(c)
+            return ('\\u%04x'):format(c:byte())
+        end) .. '"'
+    elseif kind == 'number' then
+        return value == math.floor(value) and ('%d'):format(value) or ('%.3f'):format(value)
+    end
+    return tostring(value)
+end
+
+function json.decode(text)
+    local position = 1
+    local value
+    local function skip()
+        position = text:find('[^%s]', position) or #text + 1
+    end
+    local function fail()
+        error(('Invalid JSON at position %d!'):format(position), 0)
+    end
+    function value()
+        skip()
+        local char = text:sub(position, position)
+        if char == '{' or char == '[' then
+            local result, close = char == '{' and {} or json.array(), char == '{' and '}' or ']'
+            position = position + 1
+            skip()
+            if text:sub(position, position) == close then
+                position = position + 1
+                return result
+            end
+            repeat
+                if close == '}' then
+                    local key = value()
+                    skip()
+                    if text:sub(position, position) ~= ':' then
+                        fail()
+                    end
+                    position = position + 1
+                    result[key] = value()
+                else
+                    result[#result + 1] = value()
+                end
+                skip()
+                char = text:sub(position, position)
+                position = position + 1
+            until char ~= ','
+            if char ~= close then
+                fail()
+            end
+            return result
+        elseif char == '"' then
+            local finish = text:find('"', position + 1, true) or fail()
+            local result = text:sub(position + 1, finish - 1):gsub('\\u(%x%x%x%x)', function(code)
+                return string.char(tonumber(code, 16) % 256)
+            end)
+            position = finish + 1
+            return result
+        end
+        local token = text:match('^[%w%.%+%-]+', position) or fail()
+        position = position + #token
+        if token == 'true' or token == 'false' then
+            return token == 'true'
+        elseif token == 'null' then
+            return nil
+        end
+        return tonumber(token) or fail()
+    end
+    return value()
+end
+
+
+--
+-- Keys and values.
+--
+local function key(worker, tag, number)
+    local prefix = ('b%d%s:'):format(worker, tag)
+    return prefix .. ('%0' .. math.max(options.keysize - #prefix, 1) .. 'd'):format(number)
+end
+local function keys(worker, tag)
+    local list = {}
+    for number = 1, options.ops do
+        list[number] = key(worker, tag, number)
+    end
+    return list
+end
+local function batches(list, value)
+    local result = {}
+    for first = 1, #list, options.batch do
+        local batch = {}
+        for number = first, math.min(first + options.batch - 1, #list) do
+            if value then
+                batch[list[number]] = value
+            else
+                batch[#batch + 1] = list[number]
+            end
+        end
+        result[#result + 1] = batch
+    end
+    return result
+end
+
+
+--
+-- Cases (run in this order, each returns the number of items and of payload
+-- bytes and appends the latency of each call to 'samples').
+--
+local cases = {}
+local function case(name, fn)
+    cases[#cases + 1] = { name = name, fn = fn }
+end
+
+case('put', function(ctx, samples)
+    local th, value, bytes = ctx.th, ctx.value, 0
+    for _, key in ipairs(ctx.keys.p) do
+        local start = clock()
+        assert(th:put(key, value))
+        samples[#samples + 1] = clock() - start
+        bytes = bytes + #key + #value
+    end
+    return #ctx.keys.p, bytes
+end)
+
+case('put{}', function(ctx, samples)
+    local th, bytes = ctx.th, 0
+    for _, batch in ipairs(batches(ctx.keys.p, ctx.value)) do
+        local start = clock()
+        assert(th:put(batch))
+        samples[#samples + 1] = clock() - start
+    end
+    for _, key in ipairs(ctx.keys.p) do
+        bytes = bytes + #key + #ctx.value
+    end
+    return #ctx.keys.p, bytes
+end)
+
+case('get', function(ctx, samples)
+    local th, bytes = ctx.th, 0
+    for _, key in ipairs(ctx.keys.p) do
+        local start = clock()
+        local value = assert(th:get(key))
+        samples[#samples + 1] = clock() - start
+        bytes = bytes + #key + #value
+    end
+    return #ctx.keys.p, bytes
+end)
+
+case('getlist', function(ctx, samples)
+    local th, items, bytes = ctx.th, 0, 0
+    for _, batch in ipairs(batches(ctx.keys.p)) do
+        local start = clock()
+        local result = assert(th:get(batch))
+        samples[#samples + 1] = clock() - start
+        for key, value in pairs(result) do
+            items, bytes = items + 1, bytes + #key + #value
+        end
+    end
+    return items, bytes
+end)
+
+case('putcat', function(ctx, samples)
+    local th, value, bytes = ctx.th, ctx.value, 0
+    for _, key in ipairs(ctx.keys.c) do
+        local start = clock()
+        assert(th:putcat(key, value))
+        samples[#samples + 1] = clock() - start
+        bytes = bytes + #key + #value
+    end
+    return #ctx.keys.c, bytes
+end)
+
+case('putshl', function(ctx, samples)
+    local th, value, bytes = ctx.th, ctx.value, 0
+    for _, key in ipairs(ctx.keys.s) do
+        local start = clock()
+        assert(th:putshl(key, value, #value))
+        samples[#samples + 1] = clock() - start
+        bytes = bytes + #key + #value
+    end
+    return #ctx.keys.s, bytes
+end)
+
+case('increment', function(ctx, samples)
+    local th, bytes = ctx.th, 0
+    for _, key in ipairs(ctx.keys.i) do
+        local start = clock()
+        assert(th:increment(key))
+        samples[#samples + 1] = clock() - start
+        bytes = bytes + #key + 8
+    end
+    return #ctx.keys.i, bytes
+end)
+
+case('iterator', function(ctx, samples)
+    local items, bytes = 0, 0
+    local last = clock()
+    for key in ctx.th:iterator{ batch = options.batch } do
+        local now = clock()
+        samples[#samples + 1] = now - last
+        items, bytes = items + 1, bytes + #key
+        if items >= options.ops then
+            break
+        end
+        last = clock()
+    end
+    return items, bytes
+end)
+
+case('fwmkeys', function(ctx, samples)
+    local th, items, bytes = ctx.th, 0, 0
+    local prefix = ctx.keys.p[1]:sub(1, -3)
+    for round = 1, math.max(math.floor(options.ops / options.batch), 1) do
+        local start = clock()
+        local result = assert(th:fwmkeys(prefix, options.batch))
+        samples[#samples + 1] = clock() - start
+        for _, key in ipairs(result) do
+            items, bytes = items + 1, bytes + #key
+        end
+    end
+    return items, bytes
+end)
+
+case('table.put', function(ctx, samples)
+    local tt, value, bytes = ctx.tt, ctx.value, 0
+    for number, key in ipairs(ctx.keys.t) do
+        local start = clock()
+        assert(tt:put(key, { value = value, number = number }))
+        samples[#samples + 1] = clock() - start
+        bytes = bytes + #key + #value + 16
+    end
+    return #ctx.keys.t, bytes
+end)
+
+case('table.get', function(ctx, samples)
+    local tt, bytes = ctx.tt, 0
+    for _, key in ipairs(ctx.keys.t) do
+        local start = clock()
+        local tuple = assert(tt:get(key))
+        samples[#samples + 1] = clock() - start
+        bytes = bytes + #key + #tuple.value + 16
+    end
+    return #ctx.keys.t, bytes
+end)
+
+case('query.search', function(ctx, samples)
+    local items, bytes = 0, 0
+    for round = 1, math.max(math.floor(options.ops / options.batch), 1) do
+        local qr = assert(ttyrant.query:new(ctx.tt))
+        qr:addcond('', 'STRBW', ctx.keys.t[1]:sub(1, -3))
+        qr:addcond('number', 'NUMGE', tostring(round % options.ops))
+        qr:setlimit(options.batch)
+        local start = clock()
+        local result = assert(qr:search())
+        samples[#samples + 1] = clock() - start
+        for _, key in ipairs(result) do
+            items, bytes = items + 1, bytes + #key
+        end
+    end
+    return items, bytes
+end)
+
+case('query.searchget', function(ctx, samples)
+    local items, bytes = 0, 0
+    for round = 1, math.max(math.floor(options.ops / options.batch), 1) do
+        local qr = assert(ttyrant.query:new(ctx.tt))
+        qr:addcond('', 'STRBW', ctx.keys.t[1]:sub(1, -3))
+        qr:addcond('number', 'NUMGE', tostring(round % options.ops))
+        qr:setlimit(options.batch)
+        local start = clock()
+        local result = assert(qr:searchget())
+        samples[#samples + 1] = clock() - start
+        for key, tuple in pairs(result) do
+            items, bytes = items + 1, bytes + #key + #(tuple.value or '') + 16
+        end
+    end
+    return items, bytes
+end)
+
+
+--
+-- Run all (selected) cases in this process.
+--
+local function run(worker)
+    local selected = {}
+    for name in tostring(options.cases or ''):gmatch('[^,]+') do
+        selected[name] = true
+    end
+    local fakes = {}
+    if options.fake then
+        for _, kind in ipairs{ 'hash', 'table' } do
+            fakes[kind] = assert(ttyrant.fake:start{
+                table = kind == 'table', delay = options.fake, jitter = options.jitter
+            })
+        end
+    end
+    local ctx = {
+        th = assert(ttyrant.hash:open(fakes.hash and fakes.hash:address() or options.hash)),
+        tt = assert(ttyrant.table:open(fakes.table and fakes.table:address() or options.table)),
+        value = ('v'):rep(options.valuesize),
+        keys = {},
+    }
+    for _, tag in ipairs{ 'p', 'c', 's', 'i', 't' } do
+        ctx.keys[tag] = keys(worker, tag)
+    end
+
+    -- data read by the cases (so that any of them can run alone)
+    for _, batch in ipairs(batches(ctx.keys.p, ctx.value)) do
+        assert(ctx.th:put(batch))
+    end
+    for number, key in ipairs(ctx.keys.t) do
+        assert(ctx.tt:put(key, { value = ctx.value, number = number }))
+    end
+
+    local results = {}
+    for _, case in ipairs(cases) do
+        if not options.cases or selected[case.name] then
+            local samples = {}
+            collectgarbage('collect')
+            local start = clock()
+            local items, bytes = case.fn(ctx, samples)
+            results[case.name] = {
+                items = items, bytes = bytes, elapsed = clock() - start, samples = samples
+            }
+        end
+    end
+    for _, tag in ipairs{ 'p', 'c', 's', 'i' } do
+        for _, batch in ipairs(batches(ctx.keys[tag])) do
+            ctx.th:out(batch)
+        end
+    end
+    for _, key in ipairs(ctx.keys.t) do
+        ctx.tt:out(key)
+    end
+    ctx.th:close()
+    ctx.tt:close()
+    for _, fake in pairs(fakes) do
+        fake:stop()
+    end
+    return results
+end
+
+
+--
+-- Worker mode (results are written as text lines to be read by the parent).
+--
+if options.worker then
+    for name, result in pairs(run(options.worker)) do
+        local samples = {}
+        for number, sample in ipairs(result.samples) do
+            samples[number] = ('%.1f'):format(sample * 1e6)
+        end
+        print(('case %s %d %d %.9f'):format(name, result.items, result.bytes, result.elapsed))
+        print('samples ' .. table.concat(samples, ' '))
+    end
+    os.exit(0)
+end
+
+
+--
+-- Collect the results of all workers (running concurrently).
+--
+local workers = {}
+if options.concurrency > 1 then
+    local command = { arg[-1] or 'lua', arg[0] }
+    for number = 1, #arg do
+        command[#command + 1] = "'" .. arg[number]:gsub("'", "'\\''") .. "'"
+    end
+    command = table.concat(command, ' ')
+    local pipes = {}
+    for worker = 1, options.concurrency do
+        pipes[worker] = assert(io.popen(command .. ' --worker ' .. worker))
+    end
+    for worker, pipe in ipairs(pipes) do
+        local results, current = {}, nil
+        for line in pipe:lines() do
+            local name, items, bytes, elapsed = line:match('^case (%S+) (%d+) (%d+) (%S+)$')
+            if name then
+                current = { items = tonumber(items), bytes = tonumber(bytes), elapsed = tonumber(elapsed), samples = {} }
+                results[name] = current
+            elseif current and line:match('^samples') then
+                for sample in line:gmatch('[%d%.]+') do
+                    current.samples[#current.samples + 1] = tonumber(sample) / 1e6
+                end
+            end
+        end
+        pipe:close()
+        workers[worker] = results
+    end
+else
+    workers[1] = run(1)
+end
+
+
+--
+-- Report.
+--
+local function percentile(samples, fraction)
+    if #samples == 0 then
+        return 0
+    end
+    return samples[math.max(math.ceil(#samples * fraction), 1)] * 1e6
+end
+
+local report = { options = {}, results = {} }
+for name, value in pairs(options) do
+    report.options[name] = value
+end
+for _, case in ipairs(cases) do
+    local merged = { items = 0, bytes = 0, ops_per_sec = 0, mb_per_sec = 0, calls = 0 }
+    local samples = {}
+    for _, results in ipairs(workers) do
+        local result = results[case.name]
+        if result then
+            local elapsed = math.max(result.elapsed, 1e-9)
+            merged.items = merged.items + result.items
+            merged.bytes = merged.bytes + result.bytes
+            merged.ops_per_sec = merged.ops_per_sec + result.items / elapsed
+            merged.mb_per_sec = merged.mb_per_sec + result.bytes / elapsed / 1048576
+            for _, sample in ipairs(result.samples) do
+                samples[#samples + 1] = sample
+            end
+        end
+    end
+    if #samples > 0 then
+        table.sort(samples)
+        merged.calls = #samples
+        merged.p50_us = percentile(samples, 0.50)
+        merged.p90_us = percentile(samples, 0.90)
+        merged.p99_us = percentile(samples, 0.99)
+        merged.p999_us = percentile(samples, 0.999)
+        merged.max_us = samples[#samples] * 1e6
+        report.results[case.name] = merged
+    end
+end
+
+
+--
+-- Compare with the baseline.
+--
+local regressions = json.array()
+if options.baseline then
+    local file = assert(io.open(options.baseline))
+    local baseline = json.decode(file:read('*a'))
+    file:close()
+    for _, case in ipairs(cases) do
+        local current, base = report.results[case.name], (baseline.results or {})[case.name]
+        if current and base then
+            if base.ops_per_sec and current.ops_per_sec < base.ops_per_sec * (1 - options.threshold) then
+                regressions[#regressions + 1] = ('%s: %.0f ops/s, baseline %.0f ops/s (%+.1f%%)'):format(
+                    case.name, current.ops_per_sec, base.ops_per_sec,
+                    (current.ops_per_sec / base.ops_per_sec - 1) * 100)
+            end
+            if base.p99_us and current.p99_us > base.p99_us * (1 + options.threshold) then
+                regressions[#regressions + 1] = ('%s: p99 %.1f us, baseline %.1f us (%+.1f%%)'):format(
+                    case.name, current.p99_us, base.p99_us, (current.p99_us / base.p99_us - 1) * 100)
+            end
+        end
+    end
+    report.baseline = options.baseline
+    report.regressions = regressions
+end
+
+
+--
+-- Output.
+--
+local output = json.encode(report) .. '\n'
+if options.output then
+    local file = assert(io.open(options.output, 'w'))
+    file:write(output)
+    file:close()
+else
+    io.stdout:write(output)
+end
+for _, regression in ipairs(regressions) do
+    io.stderr:write('REGRESSION ', regression, '\n')
+end
+os.exit(#regressions > 0 and 1 or 0)
@@ -6,12 +6,28 @@
  * This library is under the MIT license (see doc/LICENSE).
  */
 
+#include <arpa/inet.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <lua.h>
 #include <lauxlib.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <tcrdb.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ttyrant.h"
 
 /*----------------------------------------------------------------------------------------------------------*/
 
@@ -22,14 +38,25 @@
                             lua_pushstring(L, ##__VA_ARGS__); \
                             return 2; }
 
+/*
+ * Instance metatables, held as upvalues of every published function (so that
+ * type checks are pointer comparisons instead of field lookups).
+ */
+#define UPV_HASH            lua_upvalueindex(1)
+#define UPV_TABLE           lua_upvalueindex(2)
+#define UPV_QUERY           lua_upvalueindex(3)
+
 /*
  * Self-extraction macros.
  */
 #define _self_xyz(L, F, C)  _self(L, 1, "__" #F, "Invalid «self», expected «" C "» instance!")
-#define _self_hdb(L)        (TCRDB*)_self_xyz(L, rdb, "ttyrant")
-#define _self_tdb(L)        (TCRDB*)_self_xyz(L, tdb, "ttyrant.table")
-#define _self_any(L)        (TCRDB*)_self_xyz(L, any, "ttyrant or ttyrant.table")
-#define _self_qry(L)        (RDBQRY*)_self_xyz(L, qry, "ttyrant.query")
+#define _self_hdb(L)        _self_db(L, 1, 1, 0, "ttyrant")
+#define _self_tdb(L)        _self_db(L, 1, 0, 1, "ttyrant.table")
+#define _self_any(L)        _self_db(L, 1, 1, 1, "ttyrant or ttyrant.table")
+#define _self_qry(L)        _self_query(L, 1)
+#define _self_pool(L)       (_pool*)_self_xyz(L, pool, "ttyrant.pool")
+#define _self_cluster(L)    (_cluster*)_self_xyz(L, cluster, "ttyrant.cluster")
+#define _self_replicaset(L) (_replicaset*)_self_xyz(L, replicaset, "ttyrant.replicaset")
 
 /*
  * Extract 'self' userdata from '__xyz' field of first parameter.
@@ -54,1247 +81,7867 @@ static void* _self(lua_State* L, int level, const char* __xyz, const char* error
 }
 
 /*
- * Turn a Lua list (of parameters) into a TCLIST object,
- * starting from the 'index' position in the given stack.
+ * Database and query objects (full userdata).
  */
-static TCLIST* _lualist2tclist(lua_State* L, int index) {
-
-    // initialize
-    size_t itemsz;
-    const char* item;
-    int items = lua_gettop(L);
-    TCLIST* list = tclistnew2(items - index + 1);
+struct _pool_slot;
+
+struct _metrics;
+struct _cache;
+struct _filter;
+struct _hedge;
+struct _parallel;
+struct _iterator;
+struct _cursor;
+
+typedef struct ttyrant_handle {
+    TCRDB*              db;             // NULL once closed
+    struct _pool_slot*  slot;           // pooled connections only
+    struct _metrics*    metrics;        // allocated on first call
+    struct _cache*      cache;          // read cache (hash databases only)
+    struct _filter*     filter;         // negative lookup filter (hash databases only)
+    struct _hedge*      hedge;          // hedged read connections
+    struct _parallel*   parallel;       // parallel batch connections
+    struct _iterator*   iterator;       // read-ahead iterator with responses in flight
+    struct _cursor*     cursors;        // query cursors (whose next page may be being fetched)
+} _handle;
+
+typedef struct {
+    RDBQRY*             qry;
+    _handle*            handle;         // kept alive by the query (fenv)
+} _query;
 
-    // traverse
-    for (; index <= items; index++) {
-        item = luaL_checklstring(L, index, &itemsz);
-        tclistpush(list, item, itemsz);
+/*
+ * Get the database object at the 'level' position in the given stack if it is
+ * a hash (when 'hash' is 1) or a table (when 'table' is 1) database (or NULL).
+ */
+static _handle* _handle_test(lua_State* L, int level, int hash, int table) {
+    _handle* handle = NULL;
+    if (lua_type(L, level) == LUA_TUSERDATA && lua_getmetatable(L, level)) {
+        if ((hash && lua_rawequal(L, -1, UPV_HASH)) || (table && lua_rawequal(L, -1, UPV_TABLE))) {
+            handle = lua_touserdata(L, level);
+        }
+        lua_pop(L, 1);
     }
-
-    // done
-    return list;
+    return handle;
 }
 
+static void _iterator_settle(struct _iterator* it);
+static void _handle_quiesce(_handle* handle);
+
 /*
- * Turn a Lua table found at the 'index' position in the given
- * stack into a TCLIST object by the following conversion rules:
- * full == 0: { k1 = v1, v2, v3, k4 = v4, v5, ...}  -->  k1, v2, v3, k4, v5, ...
- * full == 1: { k1 = v1, v2, v3, k4 = v4, v5, ...}  -->  k1, v1, k4, v4, ...
- * Keys must be strings to be taken into account!
+ * Get the connection of a database object for a call (NULL once closed),
+ * reading back the responses a read-ahead iterator left in flight first.
  */
-static TCLIST* _luatable2tclist(lua_State* L, int index, int full) {
-
-    // initialize
-    const char* key;
-    size_t      keysz;
-    char        skey[64];
-    int         skeysz;
-    const char* val;
-    size_t      valsz;
-    TCLIST*     list = tclistnew();
+static TCRDB* _handle_db(_handle* handle) {
+    if (handle->db && handle->iterator) {
+        _iterator_settle(handle->iterator);
+    }
+    return handle->db;
+}
 
-    // traverse
-    lua_pushnil(L);
-    while (lua_next(L, index)) {
+/*
+ * Extract the (open) connection of the database object at 'level' (see
+ * _handle_db()).
+ */
+static TCRDB* _self_db(lua_State* L, int level, int hash, int table, const char* class) {
+    _handle* handle = _handle_test(L, level, hash, table);
+    if (!handle) {
+        luaL_error(L, "Invalid «self», expected «%s» instance!", class);
+    }
+    if (!handle->db) {
+        luaL_error(L, "Attempt to use a closed «%s» instance!", class);
+    }
+    return _handle_db(handle);
+}
 
-        // key
-        key = NULL;
-        if (lua_type(L, -2) == LUA_TSTRING) {
-            key = lua_tolstring(L, -2, &keysz);
-            tclistpush(list, key, keysz);
-        }
+/*
+ * Make sure the table database object of a query is still open.
+ */
+static void _query_check(lua_State* L, _query* query) {
+    if (!query->handle->db) {
+        luaL_error(L, "Attempt to use a «ttyrant.query» of a closed «ttyrant.table» instance!");
+    }
+    if (query->handle->iterator) {
+        _iterator_settle(query->handle->iterator);
+    }
+}
 
-        // value
-        if ((lua_type(L, -1) == LUA_TSTRING) && 
-            ((full && key) || (!full && !key))) {
-            val = lua_tolstring(L, -1, &valsz);
-            tclistpush(list, val, valsz);
+/*
+ * Extract the query of the query object at 'level'.
+ */
+static RDBQRY* _self_query(lua_State* L, int level) {
+    _query* query = NULL;
+    if (lua_type(L, level) == LUA_TUSERDATA && lua_getmetatable(L, level)) {
+        if (lua_rawequal(L, -1, UPV_QUERY)) {
+            query = lua_touserdata(L, level);
         }
         lua_pop(L, 1);
     }
+    if (!query || !query->qry) {
+        luaL_error(L, "Invalid «self», expected «ttyrant.query» instance!");
+    }
+    _query_check(L, query);
+    return query->qry;
+}
 
-    // ready
-    return list;
+/*
+ * Push a new database object (of the table kind if 'table' is 1) on the stack.
+ */
+static _handle* _handle_push(lua_State* L, TCRDB* db, int table) {
+    _handle* handle = lua_newuserdata(L, sizeof(_handle));
+    handle->db = db;
+    handle->slot = NULL;
+    handle->metrics = NULL;
+    handle->cache = NULL;
+    handle->filter = NULL;
+    handle->hedge = NULL;
+    handle->parallel = NULL;
+    handle->iterator = NULL;
+    handle->cursors = NULL;
+    lua_pushvalue(L, table ? UPV_TABLE : UPV_HASH);
+    lua_setmetatable(L, -2);
+    return handle;
 }
 
 /*
- * Assemble the items of the given TCLIST object into a Lua table
- * at the top of the given Lua stack. Elements are taken in order
- * from start to end as key1, value1, key2... if keys is 1, or as
- * value1, value2... if keys is 0.
+ * Call metrics.
+ *
+ * Every method of the hash, table and query objects is published through
+ * _instrumented() which times the call with the monotonic clock and accounts
+ * it to the object (query methods to their table database object), per
+ * method, in a log-linear latency histogram (8 sub-buckets per power of two of
+ * nanoseconds, i.e. within 12.5%) along with call, error, item and payload
+ * byte counters. Items and bytes inside tables are counted by the conversion
+ * functions into the thread-local '_io' counters, which are sampled before and
+ * after each call.
  */
-static int _tclist2luatable(lua_State* L, TCLIST* items, int keys) {
+#define OPS_MAX             96
+#define HISTOGRAM_SUB       3
+#define HISTOGRAM_SIZE      ((64 - HISTOGRAM_SUB + 1) << HISTOGRAM_SUB)
+
+typedef struct {
+    const char*         name;
+    lua_CFunction       func;
+} _op;
+
+typedef struct {
+    uint64_t            calls;
+    uint64_t            errors;
+    uint64_t            items;          // keys or pairs in batches
+    uint64_t            batches;        // calls with items
+    uint64_t            batchmax;
+    uint64_t            sent;           // payload bytes (keys, values, columns)
+    uint64_t            received;
+    uint64_t            time;           // nanoseconds
+    uint64_t            timemax;
+    uint32_t*           histogram;      // HISTOGRAM_SIZE buckets
+} _op_metrics;
+
+typedef struct _metrics {
+    _op_metrics         ops[OPS_MAX];
+} _metrics;
+
+typedef struct {
+    uint64_t            items;
+    uint64_t            sent;
+    uint64_t            received;
+} _io_counters;
+
+static pthread_mutex_t _ops_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _op             _ops[OPS_MAX];
+static int             _ops_count = 0;
+static __thread        _io_counters _io;
 
-    // initialize
-    lua_newtable(L);
-    int itemsz;
-    char* item;
-    int pairs = tclistnum(items) / (keys ? 2 : 1);
-    int index = 1;
+/*
+ * Monotonic time in nanoseconds.
+ */
+static uint64_t _nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    // traverse
-    for (; pairs > 0; pairs--) {
+/*
+ * Histogram bucket of a value and (representative) value of a bucket.
+ */
+static int _histogram_bucket(uint64_t value) {
+    if (value < (1 << HISTOGRAM_SUB)) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - HISTOGRAM_SUB;
+    return ((shift + 1) << HISTOGRAM_SUB) + ((value >> shift) & ((1 << HISTOGRAM_SUB) - 1));
+}
+static uint64_t _histogram_value(int bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB)) {
+        return bucket;
+    }
+    int shift = (bucket >> HISTOGRAM_SUB) - 1;
+    uint64_t base = ((uint64_t)(bucket & ((1 << HISTOGRAM_SUB) - 1)) | (1 << HISTOGRAM_SUB)) << shift;
+    return base + (((uint64_t)1 << shift) >> 1);
+}
 
-        // key
-        if (keys) {
-            item = tclistshift(items, &itemsz);
-            lua_pushlstring(L, item, itemsz);
-            free(item);
-        } else {
-            lua_pushinteger(L, index++);
+/*
+ * Get the value at the given quantile (0..1) of a histogram.
+ */
+static uint64_t _histogram_quantile(const _op_metrics* op, double quantile) {
+    uint64_t rank = (uint64_t)(quantile * op->calls + 0.5);
+    uint64_t seen = 0;
+    int bucket;
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (bucket = 0; bucket < HISTOGRAM_SIZE; bucket++) {
+        seen += op->histogram[bucket];
+        if (seen >= rank) {
+            uint64_t value = _histogram_value(bucket);
+            return value < op->timemax ? value : op->timemax;
         }
-
-        // value
-        item = tclistshift(items, &itemsz);
-        lua_pushlstring(L, item, itemsz);
-        free(item);
-
-        // store
-        lua_settable(L, -3);
     }
-
-    // ready
-    return 1;
+    return op->timemax;
 }
 
-
 /*
- * Open a database.
+ * Find (or add) the slot of a method (by name and function, so that aliases
+ * are counted apart) in the process-wide list of operations (-1 if there is
+ * no room left, in which case the method is not instrumented).
  */
-static int _any_open(lua_State* L, const char* class, const char* __xyz) {
-
-    // instance
-    if (!lua_istable(L, 1)) {
-        return luaL_error(L, "Invalid «self» for %s:open(), expected «%s»!", class, class);
-    } 
-    
-    // prepare
-    TCRDB* db = tcrdbnew();
-    const char* host;
-    int port = -1;
-    
-    // depreciated (table-argument version)
-    if (lua_gettop(L) == 2 && lua_istable(L, 2)) {
-        lua_getfield(L, 2, "host");
-        lua_getfield(L, 2, "port");
-        host = luaL_checkstring(L, -2);
-        port = luaL_checkinteger(L, -1);
-        lua_pop(L, 2);
-    } else {
-        host = luaL_checkstring(L, 2);
-        if (!lua_isnoneornil(L, 3)) {
-            port = lua_tointeger(L, 3);
+static int _op_register(const char* name, lua_CFunction func) {
+    int index;
+    pthread_mutex_lock(&_ops_mutex);
+    for (index = 0; index < _ops_count && (_ops[index].func != func || strcmp(_ops[index].name, name)); index++);
+    if (index == _ops_count) {
+        if (_ops_count < OPS_MAX) {
+            _ops[index].name = name;
+            _ops[index].func = func;
+            _ops_count++;
+        } else {
+            index = -1;
         }
-        lua_newtable(L);
     }
+    pthread_mutex_unlock(&_ops_mutex);
+    return index;
+}
 
-    // metatable
-    lua_pushvalue(L, 1);
-    lua_setfield(L, 1, "__index");      // self.__index = self
-    lua_pushvalue(L, 1);
-    lua_setmetatable(L, -2);            // setmetatable(instance, self)
-
-    // open db
-    int result = port == -1 ? tcrdbopen2(db, host) : tcrdbopen(db, host, port);
-    if (!result) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
-    } else {
-        lua_pushlightuserdata(L, db);
-        lua_setfield(L, -2, __xyz);     // instance.__xyz = <userdata>
-        lua_pushlightuserdata(L, db);
-        lua_setfield(L, -2, "__any");   // instance.__any = <userdata>
+/*
+ * Account one call to the given object.
+ */
+static void _metrics_record(_handle* handle, int op, uint64_t time, int error,
+                            uint64_t items, uint64_t sent, uint64_t received) {
+    if (!handle->metrics) {
+        handle->metrics = calloc(1, sizeof(_metrics));
+        if (!handle->metrics) {
+            return;
+        }
     }
-
-    // ready
-    return 1;
+    _op_metrics* m = &handle->metrics->ops[op];
+    if (!m->histogram) {
+        m->histogram = calloc(HISTOGRAM_SIZE, sizeof(uint32_t));
+        if (!m->histogram) {
+            return;
+        }
+    }
+    m->calls++;
+    m->errors += error;
+    m->sent += sent;
+    m->received += received;
+    m->time += time;
+    if (time > m->timemax) {
+        m->timemax = time;
+    }
+    if (items) {
+        m->items += items;
+        m->batches++;
+        if (items > m->batchmax) {
+            m->batchmax = items;
+        }
+    }
+    m->histogram[_histogram_bucket(time)]++;
 }
 
 /*
- * Put kinds.
+ * Clear all metrics of an object (keeping the histograms allocated).
  */
-#define PUT_NORMAL  0
-#define PUT_NR      1
-#define PUT_CAT     2
-#define PUT_KEEP    3
+static void _metrics_reset(_metrics* metrics) {
+    int op;
+    for (op = 0; op < OPS_MAX; op++) {
+        uint32_t* histogram = metrics->ops[op].histogram;
+        memset(&metrics->ops[op], 0, sizeof(_op_metrics));
+        if (histogram) {
+            memset(histogram, 0, HISTOGRAM_SIZE * sizeof(uint32_t));
+            metrics->ops[op].histogram = histogram;
+        }
+    }
+}
 
 /*
- * Store value at given key in db.
+ * Release the metrics of an object.
  */
-static int _hash_put(lua_State* L, int kind) {
-   
-    // initialize
-    TCRDB*  db = _self_hdb(L);
-
-    // extract
-    size_t keysz, valuesz;
-    const char* key = luaL_checklstring(L, 2, &keysz);
-    const char* value = luaL_checklstring(L, 3, &valuesz);
-
-    // store
-    int result = 0;
-    switch (kind) {
-        case PUT_CAT:
-            result = tcrdbputcat(db, key, keysz, value, valuesz);
-            break;
-        case PUT_KEEP:
-            result = tcrdbputkeep(db, key, keysz, value, valuesz);
-            break;
-        default:
-            result = tcrdbput(db, key, keysz, value, valuesz);
-            break;
+static void _metrics_free(_handle* handle) {
+    if (handle->metrics) {
+        int op;
+        for (op = 0; op < OPS_MAX; op++) {
+            free(handle->metrics->ops[op].histogram);
+        }
+        free(handle->metrics);
+        handle->metrics = NULL;
     }
+}
 
-    // result
-    if (!result) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+/*
+ * Sum the sizes of the string values found at and above 'index' on the stack.
+ */
+static uint64_t _metrics_strings(lua_State* L, int index) {
+    uint64_t size = 0;
+    int top = lua_gettop(L);
+    for (; index <= top; index++) {
+        if (lua_type(L, index) == LUA_TSTRING) {
+            size += lua_objlen(L, index);
+        }
     }
-    lua_pushboolean(L, 1);
-
-    // ready
-    return 1;
+    return size;
 }
 
 /*
- * Store tuple or extend an existing one in a table db.
+ * Call the method in slot 'UPV_OP' and account it to the object it was called
+ * upon (if any; e.g. open() has none). Calls raising an error are not counted.
  */
-static int _table_put(lua_State* L, const char* error, int kind) {
-
-    // db
-    TCRDB* db = _self_tdb(L);
-
-    // tuple check
-    if (!lua_istable(L, 3)) {
-        luaL_error(L, error);
-    }
+#define UPV_OP              lua_upvalueindex(4)
 
-    // key
-    size_t keysz;
-    const char* key = luaL_checklstring(L, 2, &keysz);
+static int _instrumented(lua_State* L) {
 
-    // assemble tuple
-    TCMAP* tuple = tcmapnew();
-    lua_pushnil(L);
-    while (lua_next(L, 3)) {
+    // method
+    int op = lua_tointeger(L, UPV_OP);
+    lua_CFunction func = _ops[op].func;
 
-        // key
-        ssize_t colsz;
-        const char* col = NULL;
-        char scol[64];
-        if (lua_type(L, -2) == LUA_TSTRING) {
-            col = luaL_checklstring(L, -2, &colsz);
-        } else {
-            colsz = snprintf(scol, 64, "%li", (long int)luaL_checkinteger(L, -2));
-            if (colsz < 0) {
-                _failure(L, tcrdberrmsg(tcrdbecode(db)));
-            }
+    // object
+    _handle* handle = NULL;
+    if (lua_type(L, 1) == LUA_TUSERDATA && lua_getmetatable(L, 1)) {
+        if (lua_rawequal(L, -1, UPV_HASH) || lua_rawequal(L, -1, UPV_TABLE)) {
+            handle = lua_touserdata(L, 1);
+        } else if (lua_rawequal(L, -1, UPV_QUERY)) {
+            handle = ((_query*)lua_touserdata(L, 1))->handle;
         }
-
-        // value
-        size_t valsz;
-        const char* val = luaL_checklstring(L, -1, &valsz);
-
-        // push
-        tcmapput(tuple, col ? col : scol, colsz, val, valsz);
         lua_pop(L, 1);
     }
-
-    // store
-    int result = 0;
-    switch (kind) {
-        case PUT_CAT:
-            result = tcrdbtblputcat(db, key, keysz, tuple);
-            break;
-        case PUT_KEEP:
-            result = tcrdbtblputkeep(db, key, keysz, tuple);
-            break;
-        default:
-            result = tcrdbtblput(db, key, keysz, tuple);
-            break;
-    }
-    lua_pop(L, 1);
-    tcmapdel(tuple);
-    if (!result) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
-    } else {
-        lua_pushboolean(L, 1);
+    if (!handle) {
+        return func(L);
     }
 
+    // execute
+    _io_counters io = _io;
+    uint64_t sent = _metrics_strings(L, 2);
+    int base = lua_gettop(L);
+    uint64_t start = _nsec();
+    int results = func(L);
+    uint64_t time = _nsec() - start;
+
+    // account
+    int first = lua_gettop(L) - results + 1;
+    int error = results > 0 && lua_isnil(L, first) && base < first;
+    _metrics_record(handle, op, time, error,
+                    _io.items - io.items,
+                    sent + _io.sent - io.sent,
+                    _metrics_strings(L, first) + _io.received - io.received);
+
     // ready
-    return 1;
+    return results;
 }
 
-/*----------------------------------------------------------------------------------------------------------*/
-
 /*
- * Close a database.
+ * Read cache (optional, per hash database object).
  *
- * <boolean> = <any>:close()
+ * Values read by get() are kept in a TCMAP in least-recently-used order (hits
+ * move their record to the end, evictions cut from the front) within a byte
+ * budget, each prefixed by its expiration time (0 = never). Writes done
+ * through the same object drop the keys they touch; writes done by anyone else
+ * are only seen once the entries expire.
  */
-static int luaF_any_close(lua_State* L) {
+#define CACHE_OVERHEAD      64          // per entry (map record and bookkeeping)
+
+typedef struct _cache {
+    TCMAP*              map;
+    uint64_t            budget;         // bytes
+    uint64_t            bytes;
+    uint64_t            ttl;            // microseconds (0 = none)
+    uint64_t            hits;
+    uint64_t            misses;
+    uint64_t            evictions;
+    uint64_t            expirations;
+    uint64_t            invalidations;
+} _cache;
 
-    // extract/execute
-    TCRDB* db = _self_any(L);
-    if (!tcrdbclose(db)) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
-    }
-    tcrdbdel(db);
-    
-    // ready
-    lua_pushboolean(L, 1);
-    return 1;
-}
+/*
+ * Monotonic time in microseconds (see _usec(), defined with the pools).
+ */
+static uint64_t _usec(void);
 
 /*
- * Increment value at key or '_num' column of tuple at key.
- *
- * <number> = <any>:add(key[, amount = 1])
+ * Get the cache of the (already checked) hash database object at 'level'.
  */
-static int luaF_any_increment(lua_State* L) {
+static _cache* _cache_of(lua_State* L, int level) {
+    return ((_handle*)lua_touserdata(L, level))->cache;
+}
 
-    // extract
-    TCRDB* db = _self_any(L);
+/*
+ * Size accounted for a cache entry.
+ */
+static uint64_t _cache_size(int keysz, int entrysz) {
+    return CACHE_OVERHEAD + keysz + entrysz;
+}
 
-    // arguments
-    size_t keysz;
-    const char* key = luaL_checklstring(L, 2, &keysz);
-    double amount = 1;
-    if (!lua_isnoneornil(L, 3)) {
-        amount = luaL_checknumber(L, 3);
+/*
+ * Drop a key from the cache (if cached).
+ */
+static void _cache_out(_cache* cache, const char* key, int keysz) {
+    int entrysz;
+    if (tcmapget(cache->map, key, keysz, &entrysz)) {
+        cache->bytes -= _cache_size(keysz, entrysz);
+        tcmapout(cache->map, key, keysz);
+        cache->invalidations++;
     }
+}
 
-    // increment
-    double result = tcrdbadddouble(db, key, keysz, amount);
-    if (result == INT_MIN) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+/*
+ * Drop every 'step'th key of a list from the cache, starting with the first
+ * (i.e. step is 2 for key-value lists and 1 for key lists).
+ */
+static void _cache_out_list(_cache* cache, const TCLIST* items, int step) {
+    int index, keysz;
+    for (index = 0; index < tclistnum(items); index += step) {
+        const char* key = tclistval(items, index, &keysz);
+        _cache_out(cache, key, keysz);
     }
+}
 
-    // sum
-    lua_pushnumber(L, result);
-
-    // ready
-    return 1;
+/*
+ * Look up a key, returning its value (valid until the cache changes) or NULL.
+ */
+static const char* _cache_get(_cache* cache, const char* key, int keysz, int* valuesz) {
+    int entrysz;
+    const char* entry = tcmapget(cache->map, key, keysz, &entrysz);
+    if (entry) {
+        uint64_t expires;
+        memcpy(&expires, entry, sizeof(expires));
+        if (expires && expires <= _usec()) {
+            cache->bytes -= _cache_size(keysz, entrysz);
+            tcmapout(cache->map, key, keysz);
+            cache->expirations++;
+        } else {
+            tcmapmove(cache->map, key, keysz, false);
+            cache->hits++;
+            *valuesz = entrysz - sizeof(expires);
+            return entry + sizeof(expires);
+        }
+    }
+    cache->misses++;
+    return NULL;
 }
 
 /*
- * Erase key(s) from any db.
- *
- * <boolean> = <any>:out(key1, key2, ...)
- * <boolean> = <any>:out{key1, key2, ...}
+ * Store a value, evicting the least recently used entries over the budget.
  */
-static int luaF_any_out(lua_State* L) {
+static void _cache_put(_cache* cache, const char* key, int keysz, const char* value, int valuesz) {
+
+    // too large
+    uint64_t expires = cache->ttl ? _usec() + cache->ttl : 0;
+    uint64_t size = _cache_size(keysz, sizeof(expires) + valuesz);
+    int entrysz;
+    if (tcmapget(cache->map, key, keysz, &entrysz)) {
+        cache->bytes -= _cache_size(keysz, entrysz);
+        tcmapout(cache->map, key, keysz);
+    }
+    if (size > cache->budget) {
+        return;
+    }
 
-    // initialize
-    TCRDB*  db = _self_any(L);
-    TCLIST* items = NULL;
-    int     status = 0;
+    // store (at the end)
+    tcmapput4(cache->map, key, keysz, &expires, sizeof(expires), value, valuesz);
+    cache->bytes += size;
 
-    // table
-    if (lua_istable(L, 2)) {
-        items = _luatable2tclist(L, 2, 0);
+    // evict (from the front)
+    while (cache->bytes > cache->budget) {
+        int oldsz;
+        tcmapiterinit(cache->map);
+        const char* old = tcmapiternext(cache->map, &oldsz);
+        if (!old) {
+            break;
+        }
+        tcmapiterval(old, &entrysz);
+        cache->bytes -= _cache_size(oldsz, entrysz);
+        tcmapcutfront(cache->map, 1);
+        cache->evictions++;
+    }
+}
 
-    // item
-    } else if (lua_gettop(L) == 2) {
-        size_t keysz;
-        const char* key = luaL_checklstring(L, 2, &keysz);
-        status = tcrdbout(db, key, keysz);
+/*
+ * Drop all entries.
+ */
+static void _cache_clear(_cache* cache) {
+    tcmapclear(cache->map);
+    cache->bytes = 0;
+}
 
-    // list
-    } else {
-        items = _lualist2tclist(L, 2);
+/*
+ * Release the cache of an object.
+ */
+static void _cache_free(_handle* handle) {
+    if (handle->cache) {
+        tcmapdel(handle->cache->map);
+        free(handle->cache);
+        handle->cache = NULL;
     }
+}
 
-    // clear items
-    if (items) {
-        TCLIST* result = tcrdbmisc(db, "outlist", 0, items);
-        if (result) {
-            status = 1;
-            tclistdel(result);
-        }
-        tclistdel(items);
-    }
+/*
+ * Negative lookup filter (optional, per hash database object).
+ *
+ * A blocked Bloom filter: each key sets (and is tested against) 'hashes' bits
+ * within a single 512 bit block (one cache line), chosen by one 64 bit hash.
+ * It never gives false negatives for the keys it was told about (the ones
+ * found when building it plus the ones written through the same object), so
+ * lookups of keys it rejects are answered without a round trip. Removed keys
+ * keep their bits (only costing false positives until the filter is rebuilt).
+ */
+#define FILTER_BLOCK_WORDS  8           // uint64_t words per block
+#define FILTER_BLOCK_BITS   (FILTER_BLOCK_WORDS * 64)
+#define FILTER_MAGIC        "TTBF"
+#define FILTER_VERSION      1
+
+typedef struct _filter {
+    uint64_t*           bits;
+    uint64_t            blocks;
+    int                 hashes;
+    uint64_t            keys;           // added (including duplicates)
+    uint64_t            negatives;      // lookups answered locally
+    uint64_t            positives;      // lookups passed on to the server
+} _filter;
 
-    // result
-    if (!status) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
-    }
-    lua_pushboolean(L, 1);
+/*
+ * File header (followed by the blocks; in native byte order).
+ */
+typedef struct {
+    char                magic[4];
+    uint32_t            version;
+    uint32_t            hashes;
+    uint32_t            reserved;
+    uint64_t            blocks;
+    uint64_t            keys;
+} _filter_header;
 
-    // ready
-    return 1;
+/*
+ * Get the filter of the (already checked) hash database object at 'level'.
+ */
+static _filter* _filter_of(lua_State* L, int level) {
+    return ((_handle*)lua_touserdata(L, level))->filter;
 }
 
 /*
- * Erase all records from any database.
- *
- * <boolean> = <any>:vanish()
+ * 64 bit key hash (FNV-1a, finalized by the splitmix64 mixer).
  */
-static int luaF_any_vanish(lua_State* L) {
-    TCRDB* db = _self_any(L);
-    if (!tcrdbvanish(db)) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+static uint64_t _filter_hash(const void* key, int keysz) {
+    const unsigned char* p = key;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; keysz > 0; keysz--) {
+        h = (h ^ *p++) * 0x100000001b3ULL;
     }
-    lua_pushboolean(L, 1);
-    return 1;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
 }
 
 /*
- * Synchronize any database with the storage back-end (i.e. disk).
- *
- * <boolean> = <any>:sync()
+ * Allocate an empty filter of 'blocks' blocks (NULL if out of memory).
  */
-static int luaF_any_sync(lua_State* L) {
-    TCRDB* db = _self_any(L);
-    if (!tcrdbsync(db)) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+static _filter* _filter_new(uint64_t blocks, int hashes) {
+    _filter* filter = calloc(1, sizeof(_filter));
+    if (!filter) {
+        return NULL;
     }
-    lua_pushboolean(L, 1);
-    return 1;
+    filter->bits = calloc(blocks, FILTER_BLOCK_WORDS * sizeof(uint64_t));
+    if (!filter->bits) {
+        free(filter);
+        return NULL;
+    }
+    filter->blocks = blocks;
+    filter->hashes = hashes;
+    return filter;
 }
 
 /*
- * Get the number of recods in a database.
- *
- * <number> = <any>:rnum()
+ * Add a key, or test whether it may have been added (0 means it never was).
  */
-static int luaF_any_rnum(lua_State* L) {
-    TCRDB* db = _self_any(L);
-    uint64_t rnum = tcrdbrnum(db);
-    if (!rnum) {
-        int ecode = tcrdbecode(db);
-        if (ecode != TTESUCCESS) {
-            _failure(L, tcrdberrmsg(ecode));
+static int _filter_probe(_filter* filter, const void* key, int keysz, int add) {
+    uint64_t  h = _filter_hash(key, keysz);
+    uint64_t* block = filter->bits + ((h >> 32) % filter->blocks) * FILTER_BLOCK_WORDS;
+    uint32_t  h1 = (uint32_t)h;
+    uint32_t  h2 = (uint32_t)((h * 0x9e3779b97f4a7c15ULL) >> 32) | 1;
+    int i;
+    for (i = 0; i < filter->hashes; i++) {
+        uint32_t bit = (h1 + i * h2) % FILTER_BLOCK_BITS;
+        uint64_t mask = 1ULL << (bit % 64);
+        if (add) {
+            block[bit / 64] |= mask;
+        } else if (!(block[bit / 64] & mask)) {
+            return 0;
         }
     }
-    lua_pushinteger(L, rnum);
+    filter->keys += add;
     return 1;
 }
+static void _filter_add(_filter* filter, const void* key, int keysz) {
+    _filter_probe(filter, key, keysz, 1);
+}
 
 /*
- * Get size of a database.
- *
- * <number> = <any>:size()
+ * Add every 'step'th key of a list, starting with the first (i.e. step is 2
+ * for key-value lists and 1 for key lists).
  */
-static int luaF_any_size(lua_State* L) {
-    TCRDB* db = _self_any(L);
-    uint64_t size = tcrdbsize(db);
-    if (!size) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+static void _filter_add_list(_filter* filter, const TCLIST* items, int step) {
+    int index, keysz;
+    for (index = 0; index < tclistnum(items); index += step) {
+        const char* key = tclistval(items, index, &keysz);
+        _filter_add(filter, key, keysz);
     }
-    lua_pushinteger(L, size);
-    return 1;
 }
 
 /*
- * Clone database into another file.
- *
- * <boolean> = <any>:copy(file)
+ * Test a key, counting the outcome.
  */
-static int luaF_any_copy(lua_State* L) {
-    TCRDB* db = _self_any(L);
-    const char* file = luaL_checkstring(L, 2);
-    uint64_t size = tcrdbsize(db);
-    if (!tcrdbcopy(db, file)) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+static int _filter_test(_filter* filter, const void* key, int keysz) {
+    if (_filter_probe(filter, key, keysz, 0)) {
+        filter->positives++;
+        return 1;
     }
-    lua_pushboolean(L, 1);
-    return 1;
+    filter->negatives++;
+    return 0;
 }
 
 /*
- * Get database status.
- *
- * <table> = <any>:stat()
+ * Remove (in place) the keys of a list which are certainly absent.
  */
-static int luaF_any_stat(lua_State* L) {
-
-    // extract/execute
-    TCRDB* db = _self_any(L);
-    char* stats = tcrdbstat(db);
-    if (!stats) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
-    }
-    
-    // parse
-    TCLIST* list = tclistnew();
-    char* p1 = stats;
-    char* p2 = stats;
-    while (*p2) {
-        if (*p2 == '\t' || *p2 == '\n') {
-            tclistpush(list, p1, p2 - p1);
-            p1 = p2 + 1;
+static void _filter_list(_filter* filter, TCLIST* keys) {
+    int index, keysz;
+    for (index = tclistnum(keys) - 1; index >= 0; index--) {
+        const char* key = tclistval(keys, index, &keysz);
+        if (!_filter_test(filter, key, keysz)) {
+            free(tclistremove(keys, index, &keysz));
         }
-        ++p2;
     }
-    _tclist2luatable(L, list, 1);
-    tclistdel(list);
-    free(stats);
-    
-    // ready
-    return 1;
 }
 
 /*
- * Iterate over all keys in db.
- *
- * for key in <any>:keys() do ... end
+ * Drop all keys (i.e. after the database was vanished).
  */
-static int _luaF_any_keys_iterator(lua_State* L) {
-    
-    // extract
-    TCRDB* db = lua_touserdata(L, lua_upvalueindex(1));
-    
-    // execute
-    int keysz = 0;
-    void* key = tcrdbiternext(db, &keysz);
-    if (!key) {
-        lua_pushnil(L);
-    } else {
-        lua_pushlstring(L, key, keysz);
-        free(key);
-    }
-    
-    return 1;
-}
-static int luaF_any_iterator(lua_State* L) {
-    
-    // extract
-    TCRDB* db = _self_any(L);
-    
-    // cursor
-    tcrdbiterinit(db);
-    lua_pushlightuserdata(L, db);
-    
-    // iterator
-    lua_pushcclosure(L, _luaF_any_keys_iterator, 1);
-    
-    // ready
-    return 1;
+static void _filter_clear(_filter* filter) {
+    memset(filter->bits, 0, filter->blocks * FILTER_BLOCK_WORDS * sizeof(uint64_t));
+    filter->keys = 0;
 }
 
 /*
- * Get keys by prefix (fporward-matching).
- *
- * <table> = <any>:fwmkeys(prefix[, max])
+ * Estimated false positive rate (from the fraction of bits set).
  */
-static int luaF_any_fwmkeys(lua_State* L) {
+static double _filter_fpr(const _filter* filter) {
+    uint64_t words = filter->blocks * FILTER_BLOCK_WORDS, set = 0, index;
+    for (index = 0; index < words; index++) {
+        set += __builtin_popcountll(filter->bits[index]);
+    }
+    return pow((double)set / (words * 64), filter->hashes);
+}
 
-    // extract
-    TCRDB* db = _self_any(L);
-    size_t prefixsz = 0;
-    const char* prefix = luaL_checklstring(L, 2, &prefixsz);
-    int max = -1;
-    if (!lua_isnoneornil(L, 3)) {
-        max = luaL_checkint(L, 3);
+/*
+ * Write a filter to a file (0 on failure, see errno).
+ */
+static int _filter_save(const _filter* filter, const char* path) {
+    _filter_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FILTER_MAGIC, sizeof(header.magic));
+    header.version = FILTER_VERSION;
+    header.hashes = filter->hashes;
+    header.blocks = filter->blocks;
+    header.keys = filter->keys;
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return 0;
     }
-    
-    // execute
-    TCLIST* list = tcrdbfwmkeys(db, prefix, prefixsz, max);
-    _tclist2luatable(L, list, 0);
-    tclistdel(list);
-    
-    // ready
-    return 1;
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(filter->bits, FILTER_BLOCK_WORDS * sizeof(uint64_t), filter->blocks, file) == filter->blocks;
+    return fclose(file) == 0 && ok;
 }
 
 /*
- * Restore a database file from an update log.
- *
- * <boolean> = <any>:restore(path, ts[, check])
+ * Read a filter from a file (NULL on failure, with 'error' set).
  */
-static int luaF_any_restore(lua_State* L) {
-    TCRDB* db = _self_any(L);
-    const char* path = luaL_checkstring(L, 2);
-    uint64_t ts = luaL_checkinteger(L, 3);
-    int check = lua_toboolean(L, 4);
-    if (!tcrdbrestore(db, path, ts, check)) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+static _filter* _filter_load(const char* path, const char** error) {
+    _filter_header header;
+    _filter* filter = NULL;
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        *error = strerror(errno);
+        return NULL;
     }
-    lua_pushboolean(L, 1);
-    return 1;
+    *error = "Invalid or truncated filter file!";
+    if (fread(&header, sizeof(header), 1, file) == 1 &&
+        !memcmp(header.magic, FILTER_MAGIC, sizeof(header.magic)) &&
+        header.version == FILTER_VERSION && header.hashes > 0 && header.blocks > 0 &&
+        (filter = _filter_new(header.blocks, header.hashes)) != NULL) {
+        filter->keys = header.keys;
+        if (fread(filter->bits, FILTER_BLOCK_WORDS * sizeof(uint64_t), filter->blocks, file) != filter->blocks) {
+            free(filter->bits);
+            free(filter);
+            filter = NULL;
+        }
+    }
+    fclose(file);
+    return filter;
 }
 
 /*
- * Optimize the storage of a database file.
- *
- * <boolean> = <any>:optimize(options)
+ * Release the filter of an object.
  */
-static int luaF_any_optimize(lua_State* L) {
-    TCRDB* db = _self_any(L);
-    if (!tcrdboptimize(db, lua_tostring(L, 2))) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+static void _filter_free(_handle* handle) {
+    if (handle->filter) {
+        free(handle->filter->bits);
+        free(handle->filter);
+        handle->filter = NULL;
     }
-    lua_pushboolean(L, 1);
-    return 1;
 }
 
-/*----------------------------------------------------------------------------------------------------------*/
+/*
+ * Value buffers (i.e. 'ttyrant.buffer' userdata) hand out memory returned by
+ * the C API as-is, instead of copying it into (interned) Lua strings.
+ */
+#define BUFFER_MALLOC   0               // owner is the buffer itself (free)
+#define BUFFER_TCMAP    1               // owner is a TCMAP object (tcmapdel)
+
+typedef struct {
+    const char* ptr;
+    size_t      size;
+    void*       owner;
+    int         kind;
+} _buffer;
 
 /*
- * Open a regular database.
- *
- * <object> = ttyrant.hash:open('localhost', 1978)
- * <object> = ttyrant.hash:open('localhost:1978')
+ * Wrap the given memory (see BUFFER_*) into a new buffer on top of the stack.
  */
-static int luaF_hash_open(lua_State* L) {
-    return _any_open(L, "ttyrant.hash", "__rdb");
+static _buffer* _buffer_push(lua_State* L, const char* ptr, size_t size, void* owner, int kind) {
+    _buffer* buffer = lua_newuserdata(L, sizeof(_buffer));
+    buffer->ptr = ptr;
+    buffer->size = size;
+    buffer->owner = owner;
+    buffer->kind = kind;
+    luaL_getmetatable(L, "ttyrant.buffer");
+    lua_setmetatable(L, -2);
+    return buffer;
 }
 
 /*
- * Store value(s) at given key(s) in db.
- *
- * <boolean> = ttyrant:put(key1, value1, key2, value2, ...)
- * <boolean> = ttyrant:put{ key1 = value1, key2 = value2, ... }
- *
- * Note: implemented explicitly since it translates multiple key-value
- *       pairs into single-shot operations (i.e. 'putlist') for speed.
+ * Get the buffer at the 'index' position in the given stack (or NULL).
  */
-static int luaF_hash_put(lua_State* L) {
+static _buffer* _buffer_test(lua_State* L, int index) {
+    _buffer* buffer = lua_touserdata(L, index);
+    if (buffer && lua_type(L, index) == LUA_TUSERDATA && lua_getmetatable(L, index)) {
+        luaL_getmetatable(L, "ttyrant.buffer");
+        if (!lua_rawequal(L, -1, -2)) {
+            buffer = NULL;
+        }
+        lua_pop(L, 2);
+        return buffer;
+    }
+    return NULL;
+}
 
-    // initialize
-    TCRDB*  db = _self_hdb(L);
-    TCLIST* items = NULL;
-    int     status = 0;
-
-    // input set
-    if (lua_istable(L, 2)) {
-        items = _luatable2tclist(L, 2, 1);
-    } else if (lua_gettop(L) == 3) {
-        size_t keysz, valuesz;
-        const char* key = luaL_checklstring(L, 2, &keysz);
-        const char* value = luaL_checklstring(L, 3, &valuesz);
-        status = tcrdbput(db, key, keysz, value, valuesz);
-    } else {
-        items = _lualist2tclist(L, 2);
-    }
-
-    // clear items
-    if (items) {
-        TCLIST* result = tcrdbmisc(db, "putlist", 0, items);
-        if (result) {
-            status = 1;
-            tclistdel(result);
-        }
-        tclistdel(items);
+/*
+ * Extract a value given either as a string or as a buffer (or NULL).
+ */
+static const char* _tovalue(lua_State* L, int index, size_t* size) {
+    if (lua_type(L, index) == LUA_TSTRING) {
+        return lua_tolstring(L, index, size);
     }
-
-    // result
-    if (!status) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    _buffer* buffer = _buffer_test(L, index);
+    if (buffer) {
+        *size = buffer->size;
+        return buffer->ptr ? buffer->ptr : "";
     }
-    lua_pushboolean(L, 1);
-
-    // ready
-    return 1;
+    return NULL;
 }
 
 /*
- * Append value at given key in db.
- *
- * <boolean> = ttyrant:putcat(key, value)
+ * Same as _tovalue() but also accepts numbers and raises an error otherwise.
  */
-static int luaF_hash_putcat(lua_State* L) {
-    return _hash_put(L, PUT_CAT);
+static const char* _checkvalue(lua_State* L, int index, size_t* size) {
+    const char* value = lua_type(L, index) == LUA_TUSERDATA ? _tovalue(L, index, size) : NULL;
+    return value ? value : luaL_checklstring(L, index, size);
 }
 
 /*
- * Store a value at given key in db only if it does not exist.
- *
- * <boolean> = ttyrant:putkeep(key, value)
+ * Extract a tuple column name given either as a string or as an integer (the
+ * digits are written, NUL-terminated, at the end of 'buffer', which must hold
+ * 24 bytes).
  */
-static int luaF_hash_putkeep(lua_State* L) {
-    return _hash_put(L, PUT_KEEP);
+static const char* _checkcolumn(lua_State* L, int index, char* buffer, size_t* size) {
+    if (lua_type(L, index) == LUA_TSTRING) {
+        return lua_tolstring(L, index, size);
+    }
+    long long number = luaL_checkinteger(L, index);
+    unsigned long long digits = number < 0 ? -(unsigned long long)number : (unsigned long long)number;
+    char* cursor = buffer + 23;
+    *cursor = '\0';
+    do {
+        *--cursor = '0' + digits % 10;
+        digits /= 10;
+    } while (digits);
+    if (number < 0) {
+        *--cursor = '-';
+    }
+    *size = buffer + 23 - cursor;
+    return cursor;
 }
 
 /*
- * Append value at given key in db and crop final value to given width.
- *
- * <boolean> = ttyrant:putshl(key, value, width)
+ * Per-thread scratch objects, reused by the conversions below so that batch
+ * calls do not allocate a fresh TCLIST/TCMAP every time (a Lua state only runs
+ * on one thread at a time and these are never held across calls). Being owned
+ * here, they are not leaked when a Lua error interrupts a call. Only the list
+ * array and map buckets are reused (items are still allocated one by one), so
+ * a list grown past SCRATCH_ITEMS is dropped rather than kept around, and both
+ * are freed when their thread exits.
  */
-static int luaF_hash_putshl(lua_State* L) {
+#define SCRATCH_ITEMS   65536
 
-    // initialize
-    TCRDB*  db = _self_hdb(L);
+typedef struct {
+    TCLIST*     list;
+    TCMAP*      map;
+} _scratch;
 
-    // extract
-    size_t keysz, valuesz;
-    const char* key = luaL_checklstring(L, 2, &keysz);
-    const char* value = luaL_checklstring(L, 3, &valuesz);
-    int width = luaL_checkint(L, 4);
+static pthread_key_t    _scratch_key;
+static pthread_once_t   _scratch_once = PTHREAD_ONCE_INIT;
+static __thread _scratch* _scratch_self = NULL;
 
-    // store
-    if (!tcrdbputshl(db, key, keysz, value, valuesz, width)) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+static void _scratch_free(void* data) {
+    _scratch* scratch = data;
+    if (scratch->list) {
+        tclistdel(scratch->list);
     }
-    lua_pushboolean(L, 1);
+    if (scratch->map) {
+        tcmapdel(scratch->map);
+    }
+    free(scratch);
+}
 
-    // ready
-    return 1;
+static void _scratch_init(void) {
+    pthread_key_create(&_scratch_key, _scratch_free);
+}
+
+static _scratch* _scratch_get(void) {
+    if (!_scratch_self) {
+        pthread_once(&_scratch_once, _scratch_init);
+        _scratch_self = calloc(1, sizeof(_scratch));
+        pthread_setspecific(_scratch_key, _scratch_self);
+    }
+    return _scratch_self;
+}
+
+static TCLIST* _scratch_tclist(void) {
+    _scratch* scratch = _scratch_get();
+    if (scratch->list && scratch->list->anum > SCRATCH_ITEMS) {
+        tclistdel(scratch->list);
+        scratch->list = NULL;
+    }
+    if (scratch->list) {
+        tclistclear(scratch->list);
+    } else {
+        scratch->list = tclistnew();
+    }
+    return scratch->list;
+}
+
+static TCMAP* _scratch_tcmap(void) {
+    _scratch* scratch = _scratch_get();
+    if (scratch->map) {
+        tcmapclear(scratch->map);
+    } else {
+        scratch->map = tcmapnew();
+    }
+    return scratch->map;
 }
 
 /*
- * Store a value at given key in db without waiting for a response.
- *
- * <boolean> = ttyrant:putnr(key, value)
+ * Turn a Lua list (of parameters) into a (scratch) TCLIST object,
+ * starting from the 'index' position in the given stack.
  */
-static int luaF_hash_putnr(lua_State* L) {
-    return _hash_put(L, PUT_NR);
+static TCLIST* _lualist2tclist(lua_State* L, int index) {
+
+    // initialize
+    size_t itemsz;
+    const char* item;
+    int items = lua_gettop(L);
+    TCLIST* list = _scratch_tclist();
+
+    // traverse
+    _io.items += index <= items ? items - index + 1 : 0;
+    for (; index <= items; index++) {
+        item = _checkvalue(L, index, &itemsz);
+        tclistpush(list, item, itemsz);
+    }
+
+    // done
+    return list;
 }
 
 /*
- * Get value(s) at key(s) from db.
- *
- * <value> = ttyrant:get(key1, key2, ...)
- * <value> = ttyrant:get{key1, key2, ...}
+ * Turn a Lua table found at the 'index' position in the given
+ * stack into a (scratch) TCLIST object by the following rules:
+ * full == 0: { k1 = v1, v2, v3, k4 = v4, v5, ...}  -->  k1, v2, v3, k4, v5, ...
+ * full == 1: { k1 = v1, v2, v3, k4 = v4, v5, ...}  -->  k1, v1, k4, v4, ...
+ * Keys must be strings to be taken into account!
  */
- #include <stdio.h>
-static int luaF_hash_get(lua_State* L) {
+static TCLIST* _luatable2tclist(lua_State* L, int index, int full) {
 
     // initialize
-    TCRDB*  db = _self_hdb(L);
-    TCLIST* keys = NULL;
-    TCLIST* items = NULL;
-    char*   item = NULL;
-    int     itemsz = 0;
+    const char* key;
+    size_t      keysz;
+    const char* val;
+    size_t      valsz;
+    TCLIST*     list = _scratch_tclist();
 
-    // input set
-    if (lua_istable(L, 2)) {
-        keys = _luatable2tclist(L, 2, 0);
-    } else if (lua_gettop(L) == 2) {
-        size_t keysz;
-        const char* key = luaL_checklstring(L, 2, &keysz);
-        item = tcrdbget(db, key, keysz, &itemsz);
-    } else {
-        keys = _lualist2tclist(L, 2);
+    // traverse
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+
+        // key
+        key = lua_type(L, -2) == LUA_TSTRING ? lua_tolstring(L, -2, &keysz) : NULL;
+
+        // pair
+        if (full) {
+            if (key && (val = _tovalue(L, -1, &valsz)) != NULL) {
+                tclistpush(list, key, keysz);
+                tclistpush(list, val, valsz);
+                _io.sent += keysz + valsz;
+                _io.items++;
+            }
+
+        // key or value
+        } else if (key) {
+            tclistpush(list, key, keysz);
+            _io.sent += keysz;
+            _io.items++;
+        } else if ((val = _tovalue(L, -1, &valsz)) != NULL) {
+            tclistpush(list, val, valsz);
+            _io.sent += valsz;
+            _io.items++;
+        }
+        lua_pop(L, 1);
     }
 
-    // act on set
+    // ready
+    return list;
+}
+
+/*
+ * Assemble the items of the given TCLIST object into a Lua table
+ * at the top of the given Lua stack. Elements are taken in order
+ * from start to end as key1, value1, key2... if keys is 1, or as
+ * value1, value2... if keys is 0. The items are read in place.
+ */
+static int _tclist2luatable(lua_State* L, const TCLIST* items, int keys) {
+
+    // initialize
+    int count = tclistnum(items);
+    int index;
+
+    // pairs
     if (keys) {
-        items = tcrdbmisc(db, "getlist", 0, keys);
-        tclistdel(keys);
-    }
+        lua_createtable(L, 0, count / 2);
+        for (index = 0; index + 1 < count; index += 2) {
+            lua_pushlstring(L, TCLISTVALPTR(items, index), TCLISTVALSIZ(items, index));
+            lua_pushlstring(L, TCLISTVALPTR(items, index + 1), TCLISTVALSIZ(items, index + 1));
+            lua_rawset(L, -3);
+            _io.received += TCLISTVALSIZ(items, index) + TCLISTVALSIZ(items, index + 1);
+        }
 
-    // result set
-    if (item) {
-        lua_pushlstring(L, item, itemsz);
-        free(item);
-    } else if (items) {
-        _tclist2luatable(L, items, 1);
-        tclistdel(items);
+    // values
     } else {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+        lua_createtable(L, count, 0);
+        for (index = 0; index < count; index++) {
+            lua_pushlstring(L, TCLISTVALPTR(items, index), TCLISTVALSIZ(items, index));
+            lua_rawseti(L, -2, index + 1);
+            _io.received += TCLISTVALSIZ(items, index);
+        }
     }
 
-    // done
+    // ready
     return 1;
 }
 
 /*
- * Return the width of the value stored at given key.
- *
- * <number> = ttyrant:vsiz(key)
+ * Assemble a serialized tuple (i.e. zero-separated column names and values,
+ * as sent by the server for table databases) into a Lua table at the top of
+ * the given Lua stack.
  */
-static int luaF_hash_vsiz(lua_State* L) {
+static int _tuple2luatable(lua_State* L, const char* tuple, int tuplesz) {
 
     // initialize
-    TCRDB*  db = _self_hdb(L);
-
-    // extract
-    size_t keysz;
-    const char* key = luaL_checklstring(L, 2, &keysz);
+    lua_newtable(L);
+    const char* end = tuple + tuplesz;
+    _io.received += tuplesz;
+    const char* col;
+    const char* val;
 
-    // store
-    int vsiz = tcrdbvsiz(db, key, keysz);
-    if (vsiz < 0) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    // traverse
+    while (tuple < end) {
+        col = tuple;
+        tuple += strnlen(tuple, end - tuple) + 1;
+        if (tuple > end) {
+            break;
+        }
+        val = tuple;
+        tuple += strnlen(tuple, end - tuple) + 1;
+        lua_pushlstring(L, col, val - col - 1);
+        lua_pushlstring(L, val, tuple - val - 1);
+        lua_settable(L, -3);
     }
-    lua_pushinteger(L, vsiz);
 
     // ready
     return 1;
 }
 
-/*----------------------------------------------------------------------------------------------------------*/
+/*
+ * Push the primary key and the tuple of a search result row (i.e. a serialized
+ * tuple whose first column, having an empty name, holds the primary key) on the
+ * given Lua stack.
+ */
+static int _row2luatable(lua_State* L, const char* row, int rowsz) {
+    const char* end = row + rowsz;
+    const char* key = row + 1;
+    const char* tuple = key + strnlen(key, end > key ? end - key : 0) + 1;
+    if (rowsz < 1 || tuple > end) {
+        lua_pushlstring(L, "", 0);
+        lua_newtable(L);
+        return 2;
+    }
+    lua_pushlstring(L, key, tuple - key - 1);
+    _tuple2luatable(L, tuple, end - tuple);
+    return 2;
+}
 
 /*
- * Open a table database.
+ * Raw protocol helpers.
  *
- * <object> = ttyrant.table:open('localhost', 1978)
- * <object> = ttyrant.table:open('localhost:1978')
+ * The C API does one full round trip per call, so pipelined operations pack
+ * their commands (exactly as the tcrdb*() functions would) into one buffer,
+ * send it with a single write and then read the responses back in order.
+ * Callers hold the connection mutex between sending and reading.
  */
-static int luaF_table_open(lua_State* L) {
-    return _any_open(L, "ttyrant.table", "__tdb");
+static void _tt_head(TCXSTR* packets, int cmd) {
+    unsigned char head[2] = { TTMAGICNUM, cmd };
+    tcxstrcat(packets, head, sizeof(head));
+}
+static void _tt_int32(TCXSTR* packets, int num) {
+    uint32_t value = htonl((uint32_t)num);
+    tcxstrcat(packets, &value, sizeof(value));
+}
+static void _tt_misc(TCXSTR* packets, const char* name, int opts, int count) {
+    int namesz = strlen(name);
+    _tt_head(packets, TTCMDMISC);
+    _tt_int32(packets, namesz);
+    _tt_int32(packets, opts);
+    _tt_int32(packets, count);
+    tcxstrcat(packets, name, namesz);
+}
+static void _tt_misc_arg(TCXSTR* packets, const void* arg, int argsz) {
+    _tt_int32(packets, argsz);
+    tcxstrcat(packets, arg, argsz);
+}
+static void _tt_ext(TCXSTR* packets, const char* name, int opts,
+                    const char* key, int keysz, const char* value, int valuesz) {
+    int namesz = strlen(name);
+    _tt_head(packets, TTCMDEXT);
+    _tt_int32(packets, namesz);
+    _tt_int32(packets, opts);
+    _tt_int32(packets, keysz);
+    _tt_int32(packets, valuesz);
+    tcxstrcat(packets, name, namesz);
+    tcxstrcat(packets, key, keysz);
+    tcxstrcat(packets, value, valuesz);
+}
+static int _tt_send(TCRDB* db, TCXSTR* packets) {
+    return db->fd >= 0 && ttsocksend(db->sock, tcxstrptr(packets), tcxstrsize(packets));
 }
 
 /*
- * Create new tuple in the table db using given column values.
- *
- * <boolean> = ttyrant.table:put(key, {})
+ * Set the error code reported by tcrdbecode() (kept per thread, like tcrdb.c).
  */
-static int luaF_table_put(lua_State* L) {
-    return _table_put(L, "Invalid value for «ttyrant.table:put()», expected a table/tuple!", PUT_NORMAL);
+static void _tt_ecode(TCRDB* db, int ecode) {
+    pthread_setspecific(db->eckey, (void*)(intptr_t)ecode);
 }
 
 /*
- * Append given column values an existing tuple in the table db.
- *
- * <boolean> = ttyrant.table:putcat(key, {})
+ * Reopen a dropped connection to the same server, as tcrdb.c does for RDBTRECON
+ * (the timeout and options set by tcrdbtune() are kept). The connection mutex
+ * must not be held.
  */
-static int luaF_table_putcat(lua_State* L) {
-    return _table_put(L, "Invalid value for «ttyrant.table:putcat()», expected a table/tuple!", PUT_CAT);
+static int _tt_reopen(TCRDB* db) {
+    if (!db->host) {
+        return 0;
+    }
+    char* host = strdup(db->host);
+    int port = db->port;
+    if (db->fd >= 0) {
+        tcrdbclose(db);
+    }
+    int result = tcrdbopen(db, host, port);
+    free(host);
+    return result;
 }
 
 /*
- * Create new tuple in the table db using given column values only if it does not exist.
- *
- * <boolean> = ttyrant.table:putkeep(key, {})
+ * Read a response status byte (0 on success, -1 on socket failure).
  */
-static int luaF_table_putkeep(lua_State* L) {
-    return _table_put(L, "Invalid value for «ttyrant.table:putkeep()», expected a table/tuple!", PUT_KEEP);
+static int _tt_code(TCRDB* db) {
+    return ttsockgetc(db->sock);
 }
 
 /*
- * Get tuple from db.
- *
- * <table> = ttyrant.table:get(key)
+ * Read a length-prefixed buffer from the socket into 'list' (or skip it if
+ * 'list' is NULL). Returns 0 on socket failure.
  */
-static int luaF_table_get(lua_State* L) {
+static int _tt_recv(TCRDB* db, TCLIST* list) {
+    int size = ttsockgetint32(db->sock);
+    if (ttsockcheckend(db->sock) || size < 0) {
+        return 0;
+    }
+    char  stack[1024];
+    char* buffer = size < (int)sizeof(stack) ? stack : malloc(size + 1);
+    int   result = ttsockrecv(db->sock, buffer, size);
+    if (result && list) {
+        tclistpush(list, buffer, size);
+    }
+    if (buffer != stack) {
+        free(buffer);
+    }
+    return result;
+}
 
-    // db
-    TCRDB* db = _self_tdb(L);
+/*
+ * Read a 'misc' response, appending its items to 'list' (if not NULL).
+ * Returns 1 on success, 0 if the server reported failure, -1 on socket failure.
+ */
+static int _tt_recv_misc(TCRDB* db, TCLIST* list) {
+    int code = _tt_code(db);
+    if (code != 0) {
+        return code == -1 ? -1 : 0;
+    }
+    int count = ttsockgetint32(db->sock);
+    if (ttsockcheckend(db->sock)) {
+        return -1;
+    }
+    for (; count > 0; count--) {
+        if (!_tt_recv(db, list)) {
+            return -1;
+        }
+    }
+    return 1;
+}
 
-    // tools
-    int colsz;
-    const char* col = NULL;
-    int valsz;
-    const char* val = NULL;
-    size_t keysz;
-    const char* key = luaL_checklstring(L, 2, &keysz);
+/*
+ * Pipelined exchange of many requests, packed back to back in 'packets' (the
+ * end offsets of which are in 'ends'). Sending everything before reading would
+ * deadlock on large exchanges (the server blocks writing responses nobody reads
+ * and stops reading requests), so requests are written in chunks of at most
+ * PIPE_CHUNK_OPS requests (and about PIPE_CHUNK_BYTES) and the next chunk only
+ * goes out while fewer than PIPE_WINDOW chunks' worth are unanswered. 'recv'
+ * reads the response of the request at 'index' (recording server-side errors
+ * itself) and returns 0 when the stream is broken. After a failed send, the
+ * responses of the requests already sent are still read. Returns the error
+ * code (TTESEND or TTERECV, in which case the requests from '*done' on are
+ * unanswered and the caller must _tt_reset() the connection), or TTESUCCESS.
+ */
+#define PIPE_CHUNK_OPS      256
+#define PIPE_CHUNK_BYTES    (64 << 10)
+#define PIPE_WINDOW         2
+
+static int _tt_pipeline(TCRDB* db, const char* packets, const int* ends, int count,
+                        int (*recv)(TCRDB* db, int index, void* data), void* data, int* done) {
+    int sent = 0, ecode = TTESUCCESS;
+    *done = 0;
+    while (*done < count) {
+
+        // send the next chunk (while the window allows)
+        if (ecode == TTESUCCESS && sent < count && sent - *done < PIPE_WINDOW * PIPE_CHUNK_OPS) {
+            int start = sent ? ends[sent - 1] : 0;
+            int last = sent + 1;
+            while (last < count && last - sent < PIPE_CHUNK_OPS && ends[last] - start <= PIPE_CHUNK_BYTES) {
+                last++;
+            }
+            if (db->fd < 0 || !ttsocksend(db->sock, packets + start, ends[last - 1] - start)) {
+                ecode = TTESEND;
+            } else {
+                sent = last;
+            }
+            continue;
+        }
 
-    // retrieve
-    TCMAP* tuple = tcrdbtblget(db, key, keysz);
-    if (!tuple) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
-    } else {
-        lua_newtable(L);
-        tcmapiterinit(tuple);
-        while ((col = tcmapiternext(tuple, &colsz)) != NULL) {
-            val = tcmapget(tuple, col, colsz, &valsz);
-            lua_pushlstring(L, col, colsz);
-            lua_pushlstring(L, val, valsz);
-            lua_settable(L, -3);
+        // read the next response (of the requests sent, after a failed send)
+        if (*done == sent) {
+            break;
+        }
+        if (!recv(db, *done, data)) {
+            ecode = ecode == TTESUCCESS ? TTERECV : ecode;
+            break;
         }
+        (*done)++;
     }
-    tcmapdel(tuple);
+    return ecode;
+}
 
-    // ready
-    return 1;
+/*
+ * Start a connection over after a failed pipelined exchange, which may have
+ * left part of a request or of a response behind, keeping 'ecode' as the error
+ * reported by tcrdbecode(). The connection mutex must not be held.
+ */
+static void _tt_reset(TCRDB* db, int ecode) {
+    _tt_reopen(db);
+    _tt_ecode(db, ecode);
 }
 
 /*
- * Create an index on a column.
+ * Connection pools (process-wide, shared by all Lua states).
  *
- * <boolean> = ttyrant.table:setindex(column, type[, keep = false])
+ * A pool is a fixed array of slots, each holding at most one connected TCRDB
+ * object. A slot is taken and given back by atomically flipping its state so
+ * checkout/checkin do not lock while slots are free; only finding (or creating)
+ * a pool by its server expression and waiting for a busy pool (on a condition
+ * variable signaled by checkin) go through a mutex. Pools are never destroyed.
  */
-static int luaF_table_setindex(lua_State* L) {
+#define SLOT_FREE   0
+#define SLOT_BUSY   1
+
+struct _pool;
+
+typedef struct _pool_slot {
+    volatile int        state;
+    TCRDB*              db;
+    uint64_t            since;          // checkout moment (usec)
+    uint64_t            used;           // last checkin moment (usec)
+    struct _pool*       pool;
+} _pool_slot;
+
+typedef struct _pool {
+    char*               expr;
+    int                 size;
+    int                 warm;
+    uint64_t            idle;           // usec, 0 means never evict
+    uint64_t            wait;           // usec, maximum checkout wait
+    uint64_t            created;        // usec
+    volatile int        hint;
+    volatile int        connected;
+    volatile uint64_t   checkouts;
+    volatile uint64_t   waits;
+    volatile uint64_t   timeouts;
+    volatile uint64_t   waittime;
+    volatile uint64_t   waitmax;
+    volatile uint64_t   busytime;
+    volatile uint64_t   evictions;
+    volatile int        waiters;        // checkouts blocked on 'freed'
+    pthread_mutex_t     mutex;
+    pthread_cond_t      freed;
+    struct _pool*       next;
+    _pool_slot          slots[1];
+} _pool;
+
+static pthread_mutex_t _pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _pool* _pools = NULL;
 
-    // db
-    TCRDB* db = _self_tdb(L);
-
-    // column
+/*
+ * Monotonic time in microseconds.
+ */
+static uint64_t _usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Connect the (owned) slot to the pool server.
+ */
+static int _pool_connect(_pool_slot* slot) {
+    TCRDB* db = tcrdbnew();
+    tcrdbtune(db, 0, RDBTRECON);
+    if (!tcrdbopen2(db, slot->pool->expr)) {
+        tcrdbdel(db);
+        return 0;
+    }
+    slot->db = db;
+    __sync_fetch_and_add(&slot->pool->connected, 1);
+    return 1;
+}
+
+/*
+ * Close the (owned) slot connection.
+ */
+static void _pool_disconnect(_pool_slot* slot) {
+    tcrdbclose(slot->db);
+    tcrdbdel(slot->db);
+    slot->db = NULL;
+    __sync_fetch_and_sub(&slot->pool->connected, 1);
+}
+
+/*
+ * Find the pool for the given server expression or create (and warm) it.
+ * The options are only taken into account when the pool is created.
+ */
+static _pool* _pool_acquire(const char* expr, int size, int warm, double idle, double wait) {
+
+    // lookup
+    pthread_mutex_lock(&_pools_mutex);
+    _pool* pool = _pools;
+    while (pool && strcmp(pool->expr, expr)) {
+        pool = pool->next;
+    }
+
+    // create
+    if (!pool) {
+        pool = calloc(1, sizeof(_pool) + (size - 1) * sizeof(_pool_slot));
+        pool->expr = strdup(expr);
+        pool->size = size;
+        pool->warm = warm < size ? warm : size;
+        pool->idle = idle > 0 ? idle * 1000000 : 0;
+        pool->wait = wait > 0 ? wait * 1000000 : 0;
+        pool->created = _usec();
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&pool->freed, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_init(&pool->mutex, NULL);
+        int index;
+        for (index = 0; index < size; index++) {
+            pool->slots[index].pool = pool;
+        }
+
+        // warm-up
+        for (index = 0; index < pool->warm; index++) {
+            if (!_pool_connect(&pool->slots[index])) {
+                while (index-- > 0) {
+                    _pool_disconnect(&pool->slots[index]);
+                }
+                pthread_cond_destroy(&pool->freed);
+                pthread_mutex_destroy(&pool->mutex);
+                free(pool->expr);
+                free(pool);
+                pool = NULL;
+                break;
+            }
+            pool->slots[index].used = pool->created;
+        }
+        if (pool) {
+            pool->next = _pools;
+            _pools = pool;
+        }
+    }
+    pthread_mutex_unlock(&_pools_mutex);
+
+    // ready
+    return pool;
+}
+
+/*
+ * Wake up a checkout waiting for a slot (after one was given back).
+ */
+static void _pool_signal(_pool* pool) {
+    __sync_synchronize();
+    if (pool->waiters) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_signal(&pool->freed);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/*
+ * Close connections idle for too long (but always keep at least the warm-up
+ * number of them alive).
+ */
+static void _pool_evict(_pool* pool, uint64_t now) {
+    int index;
+    for (index = 0; index < pool->size && pool->connected > pool->warm; index++) {
+        _pool_slot* candidate = &pool->slots[index];
+        if (candidate->db && now - candidate->used > pool->idle &&
+            __sync_bool_compare_and_swap(&candidate->state, SLOT_FREE, SLOT_BUSY)) {
+            if (candidate->db && now - candidate->used > pool->idle) {
+                _pool_disconnect(candidate);
+                __sync_fetch_and_add(&pool->evictions, 1);
+            }
+            __sync_lock_release(&candidate->state);
+            _pool_signal(pool);
+        }
+    }
+}
+
+/*
+ * Try to take a free slot, preferring connected ones (or NULL).
+ */
+static _pool_slot* _pool_take(_pool* pool) {
+    int first = __sync_fetch_and_add(&pool->hint, 1);
+    int pass, index;
+    for (pass = 0; pass < 2; pass++) {
+        for (index = 0; index < pool->size; index++) {
+            _pool_slot* candidate = &pool->slots[(unsigned)(first + index) % pool->size];
+            if ((pass == 0) == (candidate->db != NULL) &&
+                __sync_bool_compare_and_swap(&candidate->state, SLOT_FREE, SLOT_BUSY)) {
+                return candidate;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Take a slot out of the pool, waiting (on the pool condition variable) for
+ * one to become free. Connected slots are preferred; empty ones get connected
+ * on the spot. Idle connections are evicted first.
+ */
+static _pool_slot* _pool_checkout(_pool* pool) {
+
+    // initialize
+    uint64_t start = _usec();
+    if (pool->idle) {
+        _pool_evict(pool, start);
+    }
+
+    // scan
+    _pool_slot* slot = _pool_take(pool);
+
+    // wait (checkin signals under the mutex once 'waiters' is seen, so a slot
+    // freed after the scan below is never missed)
+    if (!slot) {
+        uint64_t deadline = start + pool->wait;
+        struct timespec ts = { deadline / 1000000, (deadline % 1000000) * 1000 };
+        int timedout = 0;
+        pthread_mutex_lock(&pool->mutex);
+        __sync_fetch_and_add(&pool->waiters, 1);
+        while (!(slot = _pool_take(pool)) && !timedout) {
+            timedout = pthread_cond_timedwait(&pool->freed, &pool->mutex, &ts) == ETIMEDOUT;
+        }
+        __sync_fetch_and_sub(&pool->waiters, 1);
+        pthread_mutex_unlock(&pool->mutex);
+        if (!slot) {
+            __sync_fetch_and_add(&pool->timeouts, 1);
+            return NULL;
+        }
+
+        // statistics
+        uint64_t elapsed = _usec() - start;
+        uint64_t max = pool->waitmax;
+        __sync_fetch_and_add(&pool->waits, 1);
+        __sync_fetch_and_add(&pool->waittime, elapsed);
+        while (elapsed > max && !__sync_bool_compare_and_swap(&pool->waitmax, max, elapsed)) {
+            max = pool->waitmax;
+        }
+    }
+    __sync_fetch_and_add(&pool->checkouts, 1);
+
+    // connect
+    if (!slot->db && !_pool_connect(slot)) {
+        __sync_lock_release(&slot->state);
+        return NULL;
+    }
+    slot->since = _usec();
+
+    // ready
+    return slot;
+}
+
+/*
+ * Give a slot back to its pool (waking up a waiting checkout, if any) and
+ * evict connections idle for too long.
+ */
+static void _pool_checkin(_pool_slot* slot) {
+
+    // release
+    _pool* pool = slot->pool;
+    uint64_t now = _usec();
+    __sync_fetch_and_add(&pool->busytime, now - slot->since);
+    slot->used = now;
+    __sync_lock_release(&slot->state);
+    _pool_signal(pool);
+
+    // evict
+    if (pool->idle) {
+        _pool_evict(pool, now);
+    }
+}
+
+/*
+ * Give back the pooled connection of the given database object (if any) and
+ * detach the object from it. Returns 0 if the object is not pooled.
+ */
+static int _pool_release(_handle* handle) {
+    if (!handle->slot) {
+        return 0;
+    }
+    _pool_checkin(handle->slot);
+    handle->slot = NULL;
+    handle->db = NULL;
+    return 1;
+}
+
+/*
+ * Connection options (see <any>:open()).
+ *
+ * Timeouts and automatic reconnection are the tcrdbtune() settings. The probe
+ * timeout bounds a non-blocking connection attempt made (and closed) before
+ * tcrdbopen(), so that unreachable servers fail fast; it is not an upper bound
+ * of the open itself, since tcrdbopen() then connects again with a blocking
+ * connect(2) (which only hangs if the server went away in between).
+ */
+typedef struct {
+    double      timeout;                // seconds per operation (0 = none)
+    double      probe;                  // seconds to probe the server (0 = none)
+    int         reconnect;              // RDBTRECON
+} _tuning;
+
+/*
+ * Split a 'host:port' expression as tcrdbopen2() does: without a port, a path
+ * names a UNIX domain socket (port 0) and a host gets the default port 1978.
+ */
+static void _open_address(const char* expr, char* host, size_t hostsz, int* port) {
+    const char* colon = strrchr(expr, ':');
+    *port = colon ? atoi(colon + 1) : strchr(expr, '/') ? 0 : 1978;
+    snprintf(host, hostsz, "%.*s", colon ? (int)(colon - expr) : (int)strlen(expr), expr);
+}
+
+/*
+ * Check that the server accepts connections within 'timeout' seconds (the
+ * probe connection is closed right away).
+ */
+static int _open_probe(const char* host, int port, double timeout, int* ecode) {
+
+    // resolve
+    char service[16];
+    struct addrinfo hints, *info;
+    snprintf(service, sizeof(service), "%d", port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, service, &hints, &info) != 0) {
+        *ecode = TTENOHOST;
+        return 0;
+    }
+
+    // connect
+    int fd = socket(info->ai_family, SOCK_STREAM, 0);
+    int result = fd >= 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0;
+    if (result && connect(fd, info->ai_addr, info->ai_addrlen) < 0) {
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        int error = 0;
+        socklen_t errorsz = sizeof(error);
+        result = errno == EINPROGRESS && poll(&pfd, 1, (int)ceil(timeout * 1000)) == 1 &&
+                 getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorsz) == 0 && error == 0;
+    }
+    freeaddrinfo(info);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!result) {
+        *ecode = TTEREFUSED;
+    }
+    return result;
+}
+
+/*
+ * Open a tuned connection (NULL on failure, with '*ecode' set).
+ */
+static TCRDB* _open_tuned(const char* host, int port, const _tuning* tuning, int* ecode) {
+    if (tuning->probe > 0 && port > 0 && !_open_probe(host, port, tuning->probe, ecode)) {
+        return NULL;
+    }
+    TCRDB* db = tcrdbnew();
+    tcrdbtune(db, tuning->timeout, tuning->reconnect ? RDBTRECON : 0);
+    if (!tcrdbopen(db, host, port)) {
+        *ecode = tcrdbecode(db);
+        tcrdbdel(db);
+        return NULL;
+    }
+    return db;
+}
+
+/*
+ * Hedged reads.
+ *
+ * A hedged object keeps two private connections, one to its own server and one
+ * to the hedge server (possibly the same). A read is sent on the first of them
+ * that is idle and, if no answer arrives within the hedge delay, sent again on
+ * the other one; whichever answers first wins. The loser still owes its answer,
+ * which is discarded as soon as it arrives (the connection is skipped until
+ * then). When neither connection is idle the read goes through the connection
+ * of the object itself, as usual. The private connections are only ever used
+ * by the object (and its Lua state), so they are not locked.
+ */
+#define HEDGE_NONE          0
+#define HEDGE_VALUE         1           // status, int32 size, value
+#define HEDGE_MISC          2           // status, int32 count, count x (int32 size, value)
+
+typedef struct _hedge {
+    TCRDB*      conns[2];               // own server, hedge server (NULL while broken)
+    char*       hosts[2];
+    int         ports[2];
+    int         owed[2];                // kind of the answer still pending
+    _tuning     tuning;
+    uint64_t    delay;                  // microseconds
+    uint64_t    reads;
+    uint64_t    hedged;                 // reads sent twice
+    uint64_t    wins;                   // reads answered by the second connection
+    uint64_t    fallbacks;              // reads through the object connection
+} _hedge;
+
+/*
+ * Create the hedge of an object (NULL on failure, with '*ecode' set).
+ */
+static _hedge* _hedge_new(const char* host, int port, const char* hedgehost, int hedgeport,
+                          const _tuning* tuning, double delay, int* ecode) {
+    _hedge* hedge = calloc(1, sizeof(_hedge));
+    hedge->hosts[0] = strdup(host);
+    hedge->hosts[1] = strdup(hedgehost);
+    hedge->ports[0] = port;
+    hedge->ports[1] = hedgeport;
+    hedge->tuning = *tuning;
+    hedge->delay = delay > 0 ? delay * 1000000 : 0;
+    int index;
+    for (index = 0; index < 2; index++) {
+        hedge->conns[index] = _open_tuned(hedge->hosts[index], hedge->ports[index], tuning, ecode);
+        if (!hedge->conns[index]) {
+            while (index-- > 0) {
+                tcrdbclose(hedge->conns[index]);
+                tcrdbdel(hedge->conns[index]);
+            }
+            free(hedge->hosts[0]);
+            free(hedge->hosts[1]);
+            free(hedge);
+            return NULL;
+        }
+    }
+    return hedge;
+}
+
+/*
+ * Read an answer of the given kind, appending the value(s) to 'list' (if not
+ * NULL). Returns 1 on success, 0 if the server reported failure, -1 on socket
+ * failure.
+ */
+static int _hedge_recv(TCRDB* db, int kind, TCLIST* list) {
+    if (kind == HEDGE_MISC) {
+        return _tt_recv_misc(db, list);
+    }
+    int code = _tt_code(db);
+    if (code != 0) {
+        return code == -1 ? -1 : 0;
+    }
+    return _tt_recv(db, list) ? 1 : -1;
+}
+
+/*
+ * Drop a broken connection (it is reopened on next use if 'reconnect' is set).
+ */
+static void _hedge_broken(_hedge* hedge, int index) {
+    tcrdbclose(hedge->conns[index]);
+    tcrdbdel(hedge->conns[index]);
+    hedge->conns[index] = NULL;
+    hedge->owed[index] = HEDGE_NONE;
+}
+
+/*
+ * Wait up to 'timeout' milliseconds (-1 = forever) for answers, returning a
+ * bit mask of the connections (1 for 'first', 2 for 'second') with data.
+ */
+static int _hedge_poll(TCRDB* first, TCRDB* second, int timeout) {
+    struct pollfd pfds[2] = { { first->fd, POLLIN, 0 }, { second ? second->fd : -1, POLLIN, 0 } };
+    if (poll(pfds, second ? 2 : 1, timeout) <= 0) {
+        return 0;
+    }
+    return (pfds[0].revents ? 1 : 0) | (second && pfds[1].revents ? 2 : 0);
+}
+
+/*
+ * Get an idle connection (discarding the owed answer if it arrived meanwhile).
+ */
+static TCRDB* _hedge_conn(_hedge* hedge, int index) {
+    int ecode;
+    if (!hedge->conns[index]) {
+        if (hedge->tuning.reconnect) {
+            hedge->conns[index] = _open_tuned(hedge->hosts[index], hedge->ports[index], &hedge->tuning, &ecode);
+        }
+        return hedge->conns[index];
+    }
+    if (hedge->owed[index] && _hedge_poll(hedge->conns[index], NULL, 0)) {
+        if (_hedge_recv(hedge->conns[index], hedge->owed[index], NULL) < 0) {
+            _hedge_broken(hedge, index);
+            return NULL;
+        }
+        hedge->owed[index] = HEDGE_NONE;
+    }
+    return hedge->owed[index] ? NULL : hedge->conns[index];
+}
+
+/*
+ * Send a read on the hedge connections and get its answer into 'list'.
+ * Returns 1 on success, 0 on failure (with '*ecode' set) or -1 if no
+ * connection was idle (nothing was sent).
+ */
+static int _hedge_exchange(_hedge* hedge, TCXSTR* packets, int kind, TCLIST* list, int* ecode) {
+
+    // first
+    int first = 0;
+    TCRDB* db = _hedge_conn(hedge, 0);
+    if (!db) {
+        first = 1;
+        db = _hedge_conn(hedge, 1);
+    }
+    if (!db || !_tt_send(db, packets)) {
+        if (db) {
+            _hedge_broken(hedge, first);
+        }
+        hedge->fallbacks++;
+        return -1;
+    }
+    hedge->reads++;
+
+    // second
+    int winner = first;
+    int timeout = hedge->tuning.timeout > 0 ? (int)ceil(hedge->tuning.timeout * 1000) : -1;
+    if (!_hedge_poll(db, NULL, (int)((hedge->delay + 999) / 1000))) {
+        int second = 1 - first;
+        TCRDB* other = first == 0 ? _hedge_conn(hedge, second) : NULL;     // the own connection is owed
+        if (other && _tt_send(other, packets)) {
+            hedge->hedged++;
+            if (_hedge_poll(db, other, timeout) == 2) {
+                winner = second;
+                hedge->wins++;
+            }
+            hedge->owed[winner == first ? second : first] = kind;
+        } else if (other) {
+            _hedge_broken(hedge, second);
+        }
+    }
+
+    // answer
+    int result = _hedge_recv(hedge->conns[winner], kind, list);
+    if (result < 0) {
+        _hedge_broken(hedge, winner);
+        *ecode = TTERECV;
+        return 0;
+    }
+    if (!result) {
+        *ecode = kind == HEDGE_VALUE ? TTENOREC : TTEMISC;
+    }
+    return result;
+}
+
+/*
+ * tcrdbget() through the hedge of the object (if any). Returns the value
+ * (to be freed) or NULL, with '*ecode' set.
+ */
+static char* _hedge_get(_handle* handle, const char* key, int keysz, int* valuesz, int* ecode) {
+    if (handle->hedge) {
+        TCXSTR* packets = tcxstrnew();
+        TCLIST* list = tclistnew2(1);
+        _tt_head(packets, TTCMDGET);
+        _tt_int32(packets, keysz);
+        tcxstrcat(packets, key, keysz);
+        int result = _hedge_exchange(handle->hedge, packets, HEDGE_VALUE, list, ecode);
+        tcxstrdel(packets);
+        if (result >= 0) {
+            char* value = result ? tclistshift(list, valuesz) : NULL;
+            tclistdel(list);
+            return value;
+        }
+        tclistdel(list);
+    }
+    char* value = tcrdbget(handle->db, key, keysz, valuesz);
+    if (!value) {
+        *ecode = tcrdbecode(handle->db);
+    }
+    return value;
+}
+
+/*
+ * tcrdbmisc(db, "getlist", 0, keys) through the hedge of the object (if any).
+ * Returns the key-value list (to be deleted) or NULL, with '*ecode' set.
+ */
+static TCLIST* _hedge_getlist(_handle* handle, const TCLIST* keys, int* ecode) {
+    if (handle->hedge) {
+        TCXSTR* packets = tcxstrnew();
+        TCLIST* items = tclistnew2(tclistnum(keys) * 2);
+        int index, keysz;
+        _tt_misc(packets, "getlist", 0, tclistnum(keys));
+        for (index = 0; index < tclistnum(keys); index++) {
+            const char* key = tclistval(keys, index, &keysz);
+            _tt_misc_arg(packets, key, keysz);
+        }
+        int result = _hedge_exchange(handle->hedge, packets, HEDGE_MISC, items, ecode);
+        tcxstrdel(packets);
+        if (result > 0) {
+            return items;
+        }
+        tclistdel(items);
+        if (result == 0) {
+            return NULL;
+        }
+    }
+    TCLIST* items = tcrdbmisc(handle->db, "getlist", 0, keys);
+    if (!items) {
+        *ecode = tcrdbecode(handle->db);
+    }
+    return items;
+}
+
+/*
+ * Release the hedge of an object.
+ */
+static void _hedge_free(_handle* handle) {
+    _hedge* hedge = handle->hedge;
+    if (hedge) {
+        int index;
+        for (index = 0; index < 2; index++) {
+            if (hedge->conns[index]) {
+                tcrdbclose(hedge->conns[index]);
+                tcrdbdel(hedge->conns[index]);
+            }
+            free(hedge->hosts[index]);
+        }
+        free(hedge);
+        handle->hedge = NULL;
+    }
+}
+
+/*
+ * Parallel batches.
+ *
+ * With <any>:parallel() set, 'putlist', 'getlist' and 'outlist' batches of more
+ * than 'chunk' keys are split into requests of 'chunk' keys which are sent over
+ * several connections of the object to the same server, one native thread per
+ * connection (the calling thread being one of them), so that neither side ever
+ * builds the whole batch as one message. Chunks are taken in order and their
+ * results appended in order; the bytes of the requests in flight are capped by
+ * 'inflight' (a chunk is always sent when nothing else is in flight). The first
+ * failure (by chunk) stops the run, although chunks already sent are applied.
+ */
+typedef struct _parallel {
+    int         count;                  // connections (and threads)
+    TCRDB**     conns;
+    char*       host;
+    int         port;
+    int         chunk;                  // keys (or pairs) per request
+    uint64_t    inflight;               // bytes
+    uint64_t    batches;
+    uint64_t    chunks;
+} _parallel;
+
+typedef struct {
+    _parallel*      par;
+    const char*     name;
+    const TCLIST*   items;              // only read by the threads
+    int             step;
+    int             chunks;
+    TCLIST**        results;            // per chunk ('getlist' only)
+    int             next;               // next chunk to take
+    int             failed;             // first failed chunk (chunks if none)
+    int             ecode;
+    uint64_t        bytes;              // in flight
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+} _parallel_run;
+
+typedef struct {
+    _parallel_run*  run;
+    TCRDB*          db;
+    pthread_t       thread;
+} _parallel_worker;
+
+/*
+ * Send chunks on one connection until there are none left (or a chunk failed).
+ */
+static void* _parallel_work(void* arg) {
+
+    // initialize
+    _parallel_worker* worker = arg;
+    _parallel_run* run = worker->run;
+    TCXSTR* packets = tcxstrnew();
+    int per = run->par->chunk * run->step;
+    int index, itemsz;
+
+    for (;;) {
+
+        // take
+        pthread_mutex_lock(&run->mutex);
+        int chunk = run->next;
+        if (chunk >= run->chunks || run->failed < run->chunks) {
+            pthread_mutex_unlock(&run->mutex);
+            break;
+        }
+        run->next++;
+        pthread_mutex_unlock(&run->mutex);
+
+        // encode
+        int first = chunk * per;
+        int last = first + per < tclistnum(run->items) ? first + per : tclistnum(run->items);
+        tcxstrclear(packets);
+        _tt_misc(packets, run->name, 0, last - first);
+        for (index = first; index < last; index++) {
+            const char* item = tclistval(run->items, index, &itemsz);
+            _tt_misc_arg(packets, item, itemsz);
+        }
+        uint64_t size = tcxstrsize(packets);
+
+        // wait for room
+        pthread_mutex_lock(&run->mutex);
+        while (run->bytes > 0 && run->bytes + size > run->par->inflight) {
+            pthread_cond_wait(&run->cond, &run->mutex);
+        }
+        run->bytes += size;
+        pthread_mutex_unlock(&run->mutex);
+
+        // exchange
+        int ecode = TTESUCCESS;
+        if (!_tt_send(worker->db, packets)) {
+            ecode = TTESEND;
+        } else {
+            int status = _tt_recv_misc(worker->db, run->results ? run->results[chunk] : NULL);
+            ecode = status > 0 ? TTESUCCESS : status == 0 ? TTEMISC : TTERECV;
+        }
+
+        // account
+        pthread_mutex_lock(&run->mutex);
+        run->bytes -= size;
+        if (ecode != TTESUCCESS && chunk < run->failed) {
+            run->failed = chunk;
+            run->ecode = ecode;
+        }
+        pthread_cond_broadcast(&run->cond);
+        pthread_mutex_unlock(&run->mutex);
+        if (ecode == TTESEND || ecode == TTERECV) {
+            tcrdbclose(worker->db);
+            break;
+        }
+    }
+
+    // done
+    tcxstrdel(packets);
+    return NULL;
+}
+
+/*
+ * Run a 'misc' batch command over the parallel connections. Returns the result
+ * list (to be deleted) or NULL with '*ecode' set.
+ */
+static TCLIST* _parallel_misc(_parallel* par, const char* name, const TCLIST* items, int step, int* ecode) {
+
+    // initialize
+    _parallel_run run;
+    memset(&run, 0, sizeof(run));
+    run.par = par;
+    run.name = name;
+    run.items = items;
+    run.step = step;
+    run.chunks = (tclistnum(items) / step + par->chunk - 1) / par->chunk;
+    run.failed = run.chunks;
+    pthread_mutex_init(&run.mutex, NULL);
+    pthread_cond_init(&run.cond, NULL);
+    int index;
+    if (!strcmp(name, "getlist")) {
+        run.results = malloc(run.chunks * sizeof(TCLIST*));
+        for (index = 0; index < run.chunks; index++) {
+            run.results[index] = tclistnew();
+        }
+    }
+
+    // workers (reconnecting dropped connections)
+    int count = par->count < run.chunks ? par->count : run.chunks;
+    _parallel_worker* workers = calloc(count, sizeof(_parallel_worker));
+    int started = 0;
+    for (index = 0; index < par->count && started < count; index++) {
+        TCRDB* db = par->conns[index];
+        if (db->fd < 0 && !tcrdbopen(db, par->host, par->port)) {
+            continue;
+        }
+        workers[started].run = &run;
+        workers[started].db = db;
+        if (started > 0 && pthread_create(&workers[started].thread, NULL, _parallel_work, &workers[started]) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    // execute
+    if (started > 0) {
+        _parallel_work(&workers[0]);
+    } else {
+        run.failed = 0;
+        run.ecode = TTEREFUSED;
+    }
+    for (index = 1; index < started; index++) {
+        pthread_join(workers[index].thread, NULL);
+    }
+    free(workers);
+    par->batches++;
+    par->chunks += run.next;
+
+    // results (in order)
+    TCLIST* result = run.failed < run.chunks ? NULL : tclistnew();
+    if (run.results) {
+        for (index = 0; index < run.chunks; index++) {
+            int itemsz;
+            void* item;
+            while (result && (item = tclistshift(run.results[index], &itemsz)) != NULL) {
+                tclistpushmalloc(result, item, itemsz);
+            }
+            tclistdel(run.results[index]);
+        }
+        free(run.results);
+    }
+    if (!result) {
+        *ecode = run.ecode;
+    }
+
+    // done
+    pthread_mutex_destroy(&run.mutex);
+    pthread_cond_destroy(&run.cond);
+    return result;
+}
+
+/*
+ * tcrdbmisc(db, name, 0, items) for 'putlist', 'getlist' and 'outlist' batches
+ * of the object ('step' being 2 for key-value pairs), in parallel if the batch
+ * is large enough. Returns the result list (to be deleted) or NULL with
+ * '*ecode' set.
+ */
+static TCLIST* _parallel_list(_handle* handle, const char* name, const TCLIST* items, int step, int* ecode) {
+    if (handle->parallel && tclistnum(items) / step > handle->parallel->chunk) {
+        return _parallel_misc(handle->parallel, name, items, step, ecode);
+    }
+    TCLIST* result = tcrdbmisc(handle->db, name, 0, items);
+    if (!result) {
+        *ecode = tcrdbecode(handle->db);
+    }
+    return result;
+}
+
+/*
+ * Get the values of a list of keys (in parallel if the batch is large enough,
+ * otherwise through the hedge of the object, if any).
+ */
+static TCLIST* _hash_getlist(_handle* handle, const TCLIST* keys, int* ecode) {
+    if (handle->parallel && tclistnum(keys) > handle->parallel->chunk) {
+        return _parallel_misc(handle->parallel, "getlist", keys, 1, ecode);
+    }
+    return _hedge_getlist(handle, keys, ecode);
+}
+
+/*
+ * Release the parallel connections of an object.
+ */
+static void _parallel_free(_handle* handle) {
+    _parallel* par = handle->parallel;
+    if (par) {
+        int index;
+        for (index = 0; index < par->count; index++) {
+            tcrdbclose(par->conns[index]);
+            tcrdbdel(par->conns[index]);
+        }
+        free(par->conns);
+        free(par->host);
+        free(par);
+        handle->parallel = NULL;
+    }
+}
+
+/*
+ * Open a database.
+ */
+static int _any_open(lua_State* L, const char* class, int table) {
+
+    // instance
+    if (!lua_istable(L, 1)) {
+        return luaL_error(L, "Invalid «self» for %s:open(), expected «%s»!", class, class);
+    } 
+    
+    // prepare
+    const char* host;
+    int port = -1;
+    int options = 0;
+    
+    // depreciated (table-argument version)
+    if (lua_gettop(L) == 2 && lua_istable(L, 2)) {
+        lua_getfield(L, 2, "host");
+        lua_getfield(L, 2, "port");
+        host = luaL_checkstring(L, -2);
+        port = luaL_checkinteger(L, -1);
+        lua_pop(L, 2);
+    } else {
+        host = luaL_checkstring(L, 2);
+        if (lua_istable(L, 3)) {
+            options = 3;
+        } else if (!lua_isnoneornil(L, 3)) {
+            port = lua_tointeger(L, 3);
+            options = lua_istable(L, 4) ? 4 : 0;
+        }
+    }
+
+    // open db (plain)
+    if (!options) {
+        TCRDB* db = tcrdbnew();
+        int result = port == -1 ? tcrdbopen2(db, host) : tcrdbopen(db, host, port);
+        if (!result) {
+            int ecode = tcrdbecode(db);
+            tcrdbdel(db);
+            _failure(L, tcrdberrmsg(ecode));
+        }
+        _handle_push(L, db, table);
+        return 1;
+    }
+
+    // options
+    char address[256];
+    _tuning tuning;
+    lua_getfield(L, options, "timeout");
+    lua_getfield(L, options, "probe");
+    lua_getfield(L, options, "reconnect");
+    tuning.timeout = luaL_optnumber(L, -3, 0);
+    tuning.probe = luaL_optnumber(L, -2, 0);
+    tuning.reconnect = lua_toboolean(L, -1);
+    lua_pop(L, 3);
+    if (port == -1) {
+        _open_address(host, address, sizeof(address), &port);
+        host = address;
+    }
+
+    // open db (tuned)
+    int ecode = 0;
+    TCRDB* db = _open_tuned(host, port, &tuning, &ecode);
+    if (!db) {
+        _failure(L, tcrdberrmsg(ecode));
+    }
+    _handle* handle = _handle_push(L, db, table);
+
+    // hedge
+    lua_getfield(L, options, "hedge");
+    if (lua_istable(L, -1)) {
+        char hedgeaddress[256];
+        const char* hedgehost = host;
+        int hedgeport = port;
+        lua_getfield(L, -1, "delay");
+        lua_getfield(L, -2, "host");
+        lua_getfield(L, -3, "port");
+        double delay = luaL_optnumber(L, -3, 0.005);
+        if (lua_isstring(L, -2)) {
+            hedgehost = lua_tostring(L, -2);
+            if (lua_isnil(L, -1)) {
+                _open_address(hedgehost, hedgeaddress, sizeof(hedgeaddress), &hedgeport);
+                hedgehost = hedgeaddress;
+            }
+        }
+        if (!lua_isnil(L, -1)) {
+            hedgeport = luaL_checkint(L, -1);
+        }
+        handle->hedge = _hedge_new(host, port, hedgehost, hedgeport, &tuning, delay, &ecode);
+        if (!handle->hedge) {
+            _failure(L, tcrdberrmsg(ecode));
+        }
+        lua_pop(L, 3);
+    }
+    lua_pop(L, 1);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Put kinds.
+ */
+#define PUT_NORMAL  0
+#define PUT_NR      1
+#define PUT_CAT     2
+#define PUT_KEEP    3
+
+/*
+ * Store value at given key in db.
+ */
+static int _hash_put(lua_State* L, int kind) {
+   
+    // initialize
+    TCRDB*  db = _self_hdb(L);
+
+    // extract
+    size_t keysz, valuesz;
+    const char* key = luaL_checklstring(L, 2, &keysz);
+    const char* value = _checkvalue(L, 3, &valuesz);
+
+    // store
+    int result = 0;
+    switch (kind) {
+        case PUT_CAT:
+            result = tcrdbputcat(db, key, keysz, value, valuesz);
+            break;
+        case PUT_KEEP:
+            result = tcrdbputkeep(db, key, keysz, value, valuesz);
+            break;
+        case PUT_NR:
+            result = tcrdbputnr(db, key, keysz, value, valuesz);
+            break;
+        default:
+            result = tcrdbput(db, key, keysz, value, valuesz);
+            break;
+    }
+    _cache* cache = _cache_of(L, 1);
+    if (cache) {
+        _cache_out(cache, key, keysz);
+    }
+    if (_filter_of(L, 1)) {
+        _filter_add(_filter_of(L, 1), key, keysz);
+    }
+
+    // result
+    if (!result) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    lua_pushboolean(L, 1);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Stream all key-value pairs of the given TCLIST object (k1, v1, k2, v2...)
+ * as 'putnr' commands packed together in a single socket write. There is no
+ * 'putnrlist' in the Tyrant protocol so the packets are assembled here exactly
+ * the way tcrdbputnr() does it, one after the other (a trailing key without a
+ * value is ignored, just like 'putlist' does).
+ */
+static int _hash_putnr_list(TCRDB* db, TCLIST* items) {
+
+    // initialize
+    int     pairs = tclistnum(items) / 2;
+    int     index = 0;
+    int     keysz, valuesz;
+    TCXSTR* packets = tcxstrnew();
+
+    // assemble
+    for (; pairs > 0; pairs--) {
+        const char* key = tclistval(items, index++, &keysz);
+        const char* value = tclistval(items, index++, &valuesz);
+        _tt_head(packets, TTCMDPUTNR);
+        _tt_int32(packets, keysz);
+        _tt_int32(packets, valuesz);
+        tcxstrcat(packets, key, keysz);
+        tcxstrcat(packets, value, valuesz);
+    }
+
+    // send (no response is ever read back), reconnecting once like tcrdbputnr()
+    int result = 1;
+    int retry;
+    for (retry = 0; tcxstrsize(packets) > 0; retry++) {
+        pthread_mutex_lock(&db->mmtx);
+        result = _tt_send(db, packets);
+        pthread_mutex_unlock(&db->mmtx);
+        if (result || retry) {
+            break;
+        }
+        _tt_ecode(db, db->fd < 0 ? TTEINVALID : TTESEND);
+        if (!(db->opts & RDBTRECON) || !_tt_reopen(db)) {
+            break;
+        }
+    }
+    if (!result && retry) {
+        _tt_ecode(db, TTESEND);
+    }
+    tcxstrdel(packets);
+
+    // ready
+    return result;
+}
+
+/*
+ * Read the response of a tuple put of _table_put_many() (0 when the stream is
+ * broken).
+ */
+typedef struct {
+    int*        status;
+    int         ecode;                  // reported when the put is refused
+} _table_exchange;
+
+static int _table_recv(TCRDB* db, int index, void* data) {
+    _table_exchange* ex = data;
+    int result = _tt_recv_misc(db, NULL);
+    if (result == 0) {
+        ex->status[index] = ex->ecode;
+    }
+    return result >= 0;
+}
+
+/*
+ * Store many tuples (given as a table of primary keys to tuples) with the
+ * 'misc' functions behind tcrdbtblput() and alike, pipelined (see
+ * _tt_pipeline()) with the responses read back in order. Returns the status by
+ * primary key and a table of error messages by primary key.
+ */
+static int _table_put_many(lua_State* L, int kind) {
+
+    // initialize
+    TCRDB* db = _self_tdb(L);
+    const char* misc = kind == PUT_CAT ? "putcat" : kind == PUT_KEEP ? "putkeep" : "put";
+    TCXSTR* packets = tcxstrnew();
+    TCXSTR* ends = tcxstrnew();
+    TCLIST* keys = tclistnew();
+    TCLIST* args = _scratch_tclist();
+
+    // encode
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+        char skey[24];
+        size_t keysz;
+        int keytype = lua_type(L, -2);
+        const char* key = keytype == LUA_TSTRING || keytype == LUA_TNUMBER ? _checkcolumn(L, -2, skey, &keysz) : NULL;
+        if (!key || !lua_istable(L, -1)) {
+            tcxstrdel(packets);
+            tcxstrdel(ends);
+            tclistdel(keys);
+            luaL_error(L, "Invalid tuples for «ttyrant.table:%s()», expected { [key] = {...}, ... }!", misc);
+        }
+        tclistclear(args);
+        tclistpush(keys, key, keysz);
+        int top = lua_gettop(L);
+        lua_pushnil(L);
+        while (lua_next(L, top)) {
+            char scol[24];
+            size_t colsz, valsz;
+            int coltype = lua_type(L, -2);
+            const char* col = coltype == LUA_TSTRING || coltype == LUA_TNUMBER ? _checkcolumn(L, -2, scol, &colsz) : NULL;
+            const char* val = lua_type(L, -1) == LUA_TNUMBER ? lua_tolstring(L, -1, &valsz) : _tovalue(L, -1, &valsz);
+            if (!col || !val) {
+                tcxstrdel(packets);
+                tcxstrdel(ends);
+                tclistdel(keys);
+                luaL_error(L, "Invalid tuple «%s» for «ttyrant.table:%s()», expected columns and values!", key, misc);
+            }
+            tclistpush(args, col, colsz);
+            tclistpush(args, val, valsz);
+            lua_pop(L, 1);
+        }
+        int index;
+        _tt_misc(packets, misc, 0, tclistnum(args) + 1);
+        _tt_misc_arg(packets, key, keysz);
+        for (index = 0; index < tclistnum(args); index++) {
+            _tt_misc_arg(packets, TCLISTVALPTR(args, index), TCLISTVALSIZ(args, index));
+        }
+        int end = tcxstrsize(packets);
+        tcxstrcat(ends, &end, sizeof(end));
+        lua_pop(L, 1);
+    }
+
+    // exchange
+    int count = tclistnum(keys);
+    int* status = calloc(count + 1, sizeof(int));
+    _table_exchange ex = { status, kind == PUT_KEEP ? TTEKEEP : TTEMISC };
+    int index, done;
+    pthread_mutex_lock(&db->mmtx);
+    int ecode = _tt_pipeline(db, tcxstrptr(packets), tcxstrptr(ends), count, _table_recv, &ex, &done);
+    pthread_mutex_unlock(&db->mmtx);
+    if (ecode != TTESUCCESS) {
+        for (index = done; index < count; index++) {
+            status[index] = ecode;
+        }
+        _tt_reset(db, ecode);
+    }
+
+    // results
+    lua_createtable(L, 0, count);
+    lua_newtable(L);
+    for (index = 0; index < count; index++) {
+        lua_pushlstring(L, TCLISTVALPTR(keys, index), TCLISTVALSIZ(keys, index));
+        lua_pushboolean(L, !status[index]);
+        lua_rawset(L, -4);
+        if (status[index]) {
+            lua_pushlstring(L, TCLISTVALPTR(keys, index), TCLISTVALSIZ(keys, index));
+            lua_pushstring(L, tcrdberrmsg(status[index]));
+            lua_rawset(L, -3);
+        }
+    }
+    _io.items += count;
+    _io.sent += tcxstrsize(packets);
+    tcxstrdel(packets);
+    tcxstrdel(ends);
+    tclistdel(keys);
+    free(status);
+
+    // ready
+    return 2;
+}
+
+/*
+ * Store tuple or extend an existing one in a table db.
+ */
+static int _table_put(lua_State* L, const char* error, int kind) {
+
+    // db
+    TCRDB* db = _self_tdb(L);
+
+    // many tuples
+    if (lua_istable(L, 2) && lua_isnoneornil(L, 3)) {
+        return _table_put_many(L, kind);
+    }
+
+    // tuple check
+    if (!lua_istable(L, 3)) {
+        luaL_error(L, error);
+    }
+
+    // key
+    size_t keysz;
+    const char* key = luaL_checklstring(L, 2, &keysz);
+
+    // assemble tuple
+    TCMAP* tuple = _scratch_tcmap();
+    lua_pushnil(L);
+    while (lua_next(L, 3)) {
+
+        // key
+        char scol[24];
+        size_t colsz;
+        const char* col = _checkcolumn(L, -2, scol, &colsz);
+
+        // value
+        size_t valsz;
+        const char* val = _checkvalue(L, -1, &valsz);
+
+        // push
+        tcmapput(tuple, col, colsz, val, valsz);
+        lua_pop(L, 1);
+    }
+
+    // store
+    int result = 0;
+    switch (kind) {
+        case PUT_CAT:
+            result = tcrdbtblputcat(db, key, keysz, tuple);
+            break;
+        case PUT_KEEP:
+            result = tcrdbtblputkeep(db, key, keysz, tuple);
+            break;
+        default:
+            result = tcrdbtblput(db, key, keysz, tuple);
+            break;
+    }
+    if (!result) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    } else {
+        lua_pushboolean(L, 1);
+    }
+
+    // ready
+    return 1;
+}
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Settle whatever is in flight on a database object and free its extensions,
+ * then give its connection back if it is pooled. Returns 1 if it was (the
+ * object is closed then), 0 if the connection is left to the caller.
+ */
+static int _handle_release(_handle* handle) {
+    _handle_quiesce(handle);
+    _cache_free(handle);
+    _filter_free(handle);
+    _hedge_free(handle);
+    _parallel_free(handle);
+    return _pool_release(handle);
+}
+
+/*
+ * Close a database.
+ *
+ * <boolean> = <any>:close()
+ */
+static int luaF_any_close(lua_State* L) {
+
+    // pooled connections are only given back
+    TCRDB* db = _self_any(L);
+    _handle* handle = lua_touserdata(L, 1);
+    if (_handle_release(handle)) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // extract/execute
+    handle->db = NULL;
+    int result = tcrdbclose(db);
+    int ecode = tcrdbecode(db);
+    tcrdbdel(db);
+    if (!result) {
+        _failure(L, tcrdberrmsg(ecode));
+    }
+    
+    // ready
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Release a database object (closing its connection or giving it back to its pool).
+ */
+static int _handle_gc(lua_State* L) {
+    _handle* handle = lua_touserdata(L, 1);
+    if (!_handle_release(handle) && handle->db) {
+        tcrdbclose(handle->db);
+        tcrdbdel(handle->db);
+        handle->db = NULL;
+    }
+    _metrics_free(handle);
+    return 0;
+}
+
+/*
+ * Describe a database or query object.
+ */
+static int _handle_tostring(lua_State* L) {
+    lua_getmetatable(L, 1);
+    lua_pushfstring(L, "%s (%p)", lua_rawequal(L, -1, UPV_QUERY) ? "ttyrant.query" :
+                                  lua_rawequal(L, -1, UPV_TABLE) ? "ttyrant.table" : "ttyrant.hash",
+                                  lua_touserdata(L, 1));
+    return 1;
+}
+
+/*
+ * Increment value at key or '_num' column of tuple at key.
+ *
+ * <number> = <any>:add(key[, amount = 1])
+ */
+static int luaF_any_increment(lua_State* L) {
+
+    // extract
+    TCRDB* db = _self_any(L);
+
+    // arguments
+    size_t keysz;
+    const char* key = luaL_checklstring(L, 2, &keysz);
+    double amount = 1;
+    if (!lua_isnoneornil(L, 3)) {
+        amount = luaL_checknumber(L, 3);
+    }
+
+    // increment
+    double result = tcrdbadddouble(db, key, keysz, amount);
+    _cache* cache = _cache_of(L, 1);
+    if (cache) {
+        _cache_out(cache, key, keysz);
+    }
+    if (_filter_of(L, 1)) {
+        _filter_add(_filter_of(L, 1), key, keysz);
+    }
+    if (result == INT_MIN) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+
+    // sum
+    lua_pushnumber(L, result);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Erase key(s) from any db.
+ *
+ * <boolean> = <any>:out(key1, key2, ...)
+ * <boolean> = <any>:out{key1, key2, ...}
+ */
+static int luaF_any_out(lua_State* L) {
+
+    // initialize
+    TCRDB*  db = _self_any(L);
+    TCLIST* items = NULL;
+    int     status = 0;
+    int     ecode = 0;
+
+    // table
+    if (lua_istable(L, 2)) {
+        items = _luatable2tclist(L, 2, 0);
+
+    // item
+    } else if (lua_gettop(L) == 2) {
+        size_t keysz;
+        const char* key = luaL_checklstring(L, 2, &keysz);
+        status = tcrdbout(db, key, keysz);
+        if (_cache_of(L, 1)) {
+            _cache_out(_cache_of(L, 1), key, keysz);
+        }
+
+    // list
+    } else {
+        items = _lualist2tclist(L, 2);
+    }
+
+    // clear items
+    if (items) {
+        if (_cache_of(L, 1)) {
+            _cache_out_list(_cache_of(L, 1), items, 1);
+        }
+        TCLIST* result = _parallel_list(lua_touserdata(L, 1), "outlist", items, 1, &ecode);
+        if (result) {
+            status = 1;
+            tclistdel(result);
+        }
+    }
+
+    // result
+    if (!status) {
+        _failure(L, tcrdberrmsg(ecode ? ecode : tcrdbecode(db)));
+    }
+    lua_pushboolean(L, 1);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Erase all records from any database.
+ *
+ * <boolean> = <any>:vanish()
+ */
+static int luaF_any_vanish(lua_State* L) {
+    TCRDB* db = _self_any(L);
+    if (_cache_of(L, 1)) {
+        _cache_clear(_cache_of(L, 1));
+    }
+    if (_filter_of(L, 1)) {
+        _filter_clear(_filter_of(L, 1));
+    }
+    if (!tcrdbvanish(db)) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Synchronize any database with the storage back-end (i.e. disk).
+ *
+ * <boolean> = <any>:sync()
+ */
+static int luaF_any_sync(lua_State* L) {
+    TCRDB* db = _self_any(L);
+    if (!tcrdbsync(db)) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get the number of recods in a database.
+ *
+ * <number> = <any>:rnum()
+ */
+static int luaF_any_rnum(lua_State* L) {
+    TCRDB* db = _self_any(L);
+    uint64_t rnum = tcrdbrnum(db);
+    if (!rnum) {
+        int ecode = tcrdbecode(db);
+        if (ecode != TTESUCCESS) {
+            _failure(L, tcrdberrmsg(ecode));
+        }
+    }
+    lua_pushinteger(L, rnum);
+    return 1;
+}
+
+/*
+ * Get size of a database.
+ *
+ * <number> = <any>:size()
+ */
+static int luaF_any_size(lua_State* L) {
+    TCRDB* db = _self_any(L);
+    uint64_t size = tcrdbsize(db);
+    if (!size) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    lua_pushinteger(L, size);
+    return 1;
+}
+
+/*
+ * Clone database into another file.
+ *
+ * <boolean> = <any>:copy(file)
+ */
+static int luaF_any_copy(lua_State* L) {
+    TCRDB* db = _self_any(L);
+    const char* file = luaL_checkstring(L, 2);
+    uint64_t size = tcrdbsize(db);
+    if (!tcrdbcopy(db, file)) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get database status.
+ *
+ * <table> = <any>:stat()
+ */
+static int luaF_any_stat(lua_State* L) {
+
+    // extract/execute
+    TCRDB* db = _self_any(L);
+    char* stats = tcrdbstat(db);
+    if (!stats) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    
+    // parse
+    TCLIST* list = _scratch_tclist();
+    char* p1 = stats;
+    char* p2 = stats;
+    while (*p2) {
+        if (*p2 == '\t' || *p2 == '\n') {
+            tclistpush(list, p1, p2 - p1);
+            p1 = p2 + 1;
+        }
+        ++p2;
+    }
+    _tclist2luatable(L, list, 1);
+    free(stats);
+    
+    // ready
+    return 1;
+}
+
+/*
+ * Read-ahead iteration over all keys (and values) in db.
+ *
+ * for key in <any>:iterator{ batch = 256 } do ... end
+ * for key, value in <any>:iterator{ batch = 256, values = true[, prefetch = true] } do ... end
+ *
+ * Keys are requested 'batch' at a time with pipelined 'iternext' commands and
+ * their values with a single 'getlist' (values of a table db are tuples). With
+ * 'prefetch' the next batch of keys is requested together with the values of
+ * the current one and left in flight while the loop consumes it; using the
+ * database object meanwhile first reads those responses back and keeps their
+ * keys for after the current window (other commands leave the server-side
+ * iterator alone), so the loop goes on. Closing the database object ends it.
+ */
+typedef struct _iterator {
+    _handle* handle;                    // kept alive by the iterator (fenv)
+    int     batch;
+    int     values;
+    int     tuples;
+    int     prefetch;
+    int     pending;                    // 'iternext' responses in flight
+    int     done;
+    int     ecode;                      // reason of the last failure
+    int     index;
+    TCLIST* window;                     // key1, value1, key2... or key1, key2...
+    TCLIST* settled;                    // keys read back early, next in line
+} _iterator;
+
+/*
+ * Read back the keys still in flight (so that the connection can be used for
+ * something else) into the 'settled' list. A failure ends the iteration with
+ * an error raised by its next step.
+ */
+static void _iterator_settle(_iterator* it) {
+    TCRDB* db = it->handle->db;
+    int    ok = 1;
+    if (it->pending && db) {
+        pthread_mutex_lock(&db->mmtx);
+        for (; ok && it->pending > 0; it->pending--) {
+            int code = _tt_code(db);
+            if (code == 0) {
+                ok = _tt_recv(db, it->settled);
+            } else if (code == -1) {
+                ok = 0;
+            } else {
+                it->done = 1;
+            }
+        }
+        pthread_mutex_unlock(&db->mmtx);
+    }
+    it->pending = 0;
+    if (!ok) {
+        _tt_reset(db, TTERECV);
+        it->ecode = TTERECV;
+        it->done = 1;
+    }
+    if (it->handle->iterator == it) {
+        it->handle->iterator = NULL;
+    }
+}
+
+static void _iterator_release(_iterator* it) {
+    if (it->window) {
+        _iterator_settle(it);
+        tclistdel(it->window);
+        tclistdel(it->settled);
+        it->window = NULL;
+        it->settled = NULL;
+    }
+}
+
+static int _iterator_gc(lua_State* L) {
+    _iterator_release(lua_touserdata(L, 1));
+    return 0;
+}
+
+static int _iterator_fill(_iterator* it) {
+
+    // initialize
+    TCRDB*  db = it->handle->db;
+    TCLIST* keys = tclistnew2(it->batch);
+    TCXSTR* packets = tcxstrnew();
+    int     ok = 1;
+    int     count;
+    tclistclear(it->window);
+    it->index = 0;
+    pthread_mutex_lock(&db->mmtx);
+
+    // request keys (unless already in flight or read back meanwhile)
+    if (tclistnum(it->settled) > 0) {
+        TCLIST* swap = it->settled;
+        it->settled = keys;
+        keys = swap;
+    } else if (!it->pending) {
+        for (count = 0; count < it->batch; count++) {
+            _tt_head(packets, TTCMDITERNEXT);
+        }
+        ok = _tt_send(db, packets);
+        it->pending = ok ? it->batch : 0;
+        it->ecode = ok ? TTESUCCESS : TTESEND;
+        tcxstrclear(packets);
+    }
+
+    // collect keys (once the iterator is exhausted, all remaining responses are failures)
+    for (; ok && it->pending > 0; it->pending--) {
+        int code = _tt_code(db);
+        if (code == 0) {
+            ok = _tt_recv(db, keys);
+        } else if (code == -1) {
+            ok = 0;
+        } else {
+            it->done = 1;
+        }
+        it->ecode = ok ? TTESUCCESS : TTERECV;
+    }
+
+    // request values and/or the next keys in one go
+    if (ok && it->values && tclistnum(keys) > 0) {
+        _tt_misc(packets, "getlist", 0, tclistnum(keys));
+        for (count = 0; count < tclistnum(keys); count++) {
+            _tt_misc_arg(packets, TCLISTVALPTR(keys, count), TCLISTVALSIZ(keys, count));
+        }
+    }
+    if (ok && it->prefetch && !it->done) {
+        for (count = 0; count < it->batch; count++) {
+            _tt_head(packets, TTCMDITERNEXT);
+        }
+    }
+    if (ok && tcxstrsize(packets) > 0) {
+        ok = _tt_send(db, packets);
+        it->ecode = ok ? TTESUCCESS : TTESEND;
+        if (ok && it->prefetch && !it->done) {
+            it->pending = it->batch;
+        }
+    }
+
+    // values
+    if (ok && it->values && tclistnum(keys) > 0) {
+        ok = _tt_recv_misc(db, it->window) == 1;
+        it->ecode = ok ? TTESUCCESS : TTERECV;
+    } else if (ok) {
+        TCLIST* swap = it->window;
+        it->window = keys;
+        keys = swap;
+    }
+
+    // done
+    pthread_mutex_unlock(&db->mmtx);
+    tcxstrdel(packets);
+    tclistdel(keys);
+    if (!ok) {
+        _tt_ecode(db, it->ecode);
+        it->pending = 0;
+        it->done = 1;
+    }
+    it->handle->iterator = it->pending ? it : NULL;
+    return ok;
+}
+
+static int _luaF_any_batch_iterator(lua_State* L) {
+
+    // extract
+    _iterator* it = lua_touserdata(L, lua_upvalueindex(1));
+    if (!it->handle->db && it->window) {
+        _iterator_release(it);
+        return luaL_error(L, "Attempt to iterate over a closed database instance!");
+    }
+
+    // refill (skipping windows whose keys all vanished meanwhile)
+    while (it->window && it->index >= tclistnum(it->window)) {
+        if (it->done && !it->pending && !tclistnum(it->settled)) {
+            if (it->ecode != TTESUCCESS) {
+                return luaL_error(L, tcrdberrmsg(it->ecode));
+            }
+            _iterator_release(it);
+            lua_pushnil(L);
+            return 1;
+        }
+        if (!_iterator_fill(it)) {
+            return luaL_error(L, tcrdberrmsg(it->ecode));
+        }
+    }
+    if (!it->window) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // key
+    int itemsz;
+    const char* item = tclistval(it->window, it->index++, &itemsz);
+    lua_pushlstring(L, item, itemsz);
+    if (!it->values) {
+        return 1;
+    }
+
+    // value
+    item = tclistval(it->window, it->index++, &itemsz);
+    if (it->tuples) {
+        _tuple2luatable(L, item, itemsz);
+    } else {
+        lua_pushlstring(L, item, itemsz);
+    }
+    return 2;
+}
+
+/*
+ * Iterate over all keys in db.
+ *
+ * for key in <any>:keys() do ... end
+ */
+static int _luaF_any_keys_iterator(lua_State* L) {
+    
+    // extract
+    _handle* handle = lua_touserdata(L, lua_upvalueindex(1));
+    if (!handle->db) {
+        return luaL_error(L, "Attempt to iterate over a closed database instance!");
+    }
+    if (handle->iterator) {
+        _iterator_settle(handle->iterator);
+    }
+    TCRDB* db = handle->db;
+    
+    // execute
+    int keysz = 0;
+    void* key = tcrdbiternext(db, &keysz);
+    if (!key) {
+        lua_pushnil(L);
+    } else {
+        lua_pushlstring(L, key, keysz);
+        free(key);
+    }
+    
+    return 1;
+}
+static int luaF_any_iterator(lua_State* L) {
+    
+    // extract
+    TCRDB* db = _self_any(L);
+    
+    // cursor
+    tcrdbiterinit(db);
+
+    // read-ahead iterator
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "batch");
+        lua_getfield(L, 2, "values");
+        lua_getfield(L, 2, "prefetch");
+        lua_pushboolean(L, _handle_test(L, 1, 0, 1) != NULL);
+        _iterator* it = lua_newuserdata(L, sizeof(_iterator));
+        it->handle = lua_touserdata(L, 1);
+        it->batch = luaL_optint(L, -5, 64);
+        it->values = lua_toboolean(L, -4);
+        it->prefetch = lua_toboolean(L, -3);
+        it->tuples = lua_toboolean(L, -2);
+        it->pending = 0;
+        it->done = 0;
+        it->ecode = TTESUCCESS;
+        it->index = 0;
+        it->window = tclistnew();
+        it->settled = tclistnew();
+        if (it->batch < 1) {
+            it->batch = 1;
+        }
+        luaL_getmetatable(L, "ttyrant.iterator");
+        lua_setmetatable(L, -2);
+        lua_createtable(L, 1, 0);       // keeps the connection open for the collector
+        lua_pushvalue(L, 1);
+        lua_rawseti(L, -2, 1);
+        lua_setfenv(L, -2);
+        lua_pushvalue(L, 1);            // keeps the connection open
+        lua_pushcclosure(L, _luaF_any_batch_iterator, 2);
+        return 1;
+    }
+    lua_pushvalue(L, 1);                // keeps the connection open
+    
+    // iterator
+    lua_pushcclosure(L, _luaF_any_keys_iterator, 1);
+    
+    // ready
+    return 1;
+}
+
+/*
+ * Get keys by prefix (fporward-matching).
+ *
+ * <table> = <any>:fwmkeys(prefix[, max])
+ */
+static int luaF_any_fwmkeys(lua_State* L) {
+
+    // extract
+    TCRDB* db = _self_any(L);
+    size_t prefixsz = 0;
+    const char* prefix = luaL_checklstring(L, 2, &prefixsz);
+    int max = -1;
+    if (!lua_isnoneornil(L, 3)) {
+        max = luaL_checkint(L, 3);
+    }
+    
+    // execute
+    TCLIST* list = tcrdbfwmkeys(db, prefix, prefixsz, max);
+    _tclist2luatable(L, list, 0);
+    tclistdel(list);
+    
+    // ready
+    return 1;
+}
+
+/*
+ * Get the locking option of an extension call ('record', 'global' or none).
+ */
+static int _ext_lock(const char* lock) {
+    if (!lock) {
+        return 0;
+    } else if (!strcmp(lock, "record")) {
+        return RDBXOLCKREC;
+    } else if (!strcmp(lock, "global")) {
+        return RDBXOLCKGLB;
+    }
+    return -1;
+}
+static int _ext_opts(lua_State* L, int index) {
+    const char* lock = luaL_optstring(L, index, NULL);
+    int opts = _ext_lock(lock);
+    if (opts < 0) {
+        luaL_error(L, "Invalid lock «%s», expected «record» or «global»!", lock);
+    }
+    return opts;
+}
+
+/*
+ * Note an extension call on a key (which the script may have written).
+ */
+static void _ext_written(lua_State* L, const char* key, int keysz) {
+    _handle* handle = lua_touserdata(L, 1);
+    if (handle->cache) {
+        _cache_out(handle->cache, key, keysz);
+    }
+    if (handle->filter) {
+        _filter_add(handle->filter, key, keysz);
+    }
+}
+
+/*
+ * Call a function of the script extension of the server (ttserver -ext), with
+ * the record ('record') or the whole database ('global') locked while it runs.
+ *
+ * <string> = <any>:ext(name[, key = ''[, value = ''[, lock]]])
+ */
+static int luaF_any_ext(lua_State* L) {
+
+    // extract
+    TCRDB* db = _self_any(L);
+    size_t keysz = 0, valuesz = 0;
+    const char* name = luaL_checkstring(L, 2);
+    const char* key = lua_isnoneornil(L, 3) ? "" : _checkvalue(L, 3, &keysz);
+    const char* value = lua_isnoneornil(L, 4) ? "" : _checkvalue(L, 4, &valuesz);
+    int opts = _ext_opts(L, 5);
+
+    // call
+    int resultsz;
+    char* result = tcrdbext(db, name, opts, key, keysz, value, valuesz, &resultsz);
+    _ext_written(L, key, keysz);
+    if (!result) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    lua_pushlstring(L, result, resultsz);
+    free(result);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Read the response of an extension call of extmany() (0 when the stream is
+ * broken).
+ */
+typedef struct {
+    int*        status;
+    TCLIST*     results;                // of successful calls, in order
+} _ext_exchange;
+
+static int _ext_recv(TCRDB* db, int index, void* data) {
+    _ext_exchange* ex = data;
+    int code = _tt_code(db);
+    if (code > 0) {
+        ex->status[index] = TTEMISC;
+        return 1;
+    }
+    return code == 0 && _tt_recv(db, ex->results);
+}
+
+/*
+ * Make many extension calls at once: they are pipelined (see _tt_pipeline())
+ * and the responses read back in order. Each call is a list of name, key, value and
+ * lock (the lock argument applies to calls without one). Returns the results
+ * by call index (false on failure) and a table of error messages by index.
+ *
+ * <table>, <table> = <any>:extmany({ { name, key, value[, lock] }, ... }[, lock])
+ */
+static int luaF_any_extmany(lua_State* L) {
+
+    // initialize
+    TCRDB* db = _self_any(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int opts = _ext_opts(L, 3);
+    int count = lua_objlen(L, 2);
+    int index;
+    TCXSTR* packets = tcxstrnew();
+    int* ends = malloc((count + 1) * sizeof(int));
+
+    // encode
+    for (index = 1; index <= count; index++) {
+        lua_rawgeti(L, 2, index);
+        if (!lua_istable(L, -1)) {
+            tcxstrdel(packets);
+            free(ends);
+            luaL_error(L, "Invalid extension call #%d, expected { name, key, value[, lock] }!", index);
+        }
+        int top = lua_gettop(L);
+        size_t keysz = 0, valuesz = 0;
+        lua_rawgeti(L, top, 1);
+        lua_rawgeti(L, top, 2);
+        lua_rawgeti(L, top, 3);
+        lua_rawgeti(L, top, 4);
+        const char* name = lua_tostring(L, top + 1);
+        const char* key = lua_isnil(L, top + 2) ? "" : _tovalue(L, top + 2, &keysz);
+        const char* value = lua_isnil(L, top + 3) ? "" : _tovalue(L, top + 3, &valuesz);
+        int callopts = lua_isnil(L, top + 4) ? opts : _ext_lock(lua_tostring(L, top + 4));
+        if (!name || !key || !value || callopts < 0) {
+            tcxstrdel(packets);
+            free(ends);
+            luaL_error(L, "Invalid extension call #%d, expected { name, key, value[, lock] }!", index);
+        }
+        _tt_ext(packets, name, callopts, key, keysz, value, valuesz);
+        ends[index - 1] = tcxstrsize(packets);
+        _ext_written(L, key, keysz);
+        lua_settop(L, top - 1);
+    }
+
+    // exchange
+    TCLIST* results = tclistnew2(count);
+    int* status = calloc(count + 1, sizeof(int));
+    _ext_exchange ex = { status, results };
+    int done;
+    pthread_mutex_lock(&db->mmtx);
+    int ecode = _tt_pipeline(db, tcxstrptr(packets), ends, count, _ext_recv, &ex, &done);
+    pthread_mutex_unlock(&db->mmtx);
+    if (ecode != TTESUCCESS) {
+        for (index = done; index < count; index++) {
+            status[index] = ecode;
+        }
+        _tt_reset(db, ecode);
+    }
+    free(ends);
+
+    // results
+    int result = 0;
+    lua_createtable(L, count, 0);
+    lua_newtable(L);
+    for (index = 0; index < count; index++) {
+        if (status[index]) {
+            lua_pushboolean(L, 0);
+            lua_rawseti(L, -3, index + 1);
+            lua_pushstring(L, tcrdberrmsg(status[index]));
+            lua_rawseti(L, -2, index + 1);
+        } else {
+            lua_pushlstring(L, TCLISTVALPTR(results, result), TCLISTVALSIZ(results, result));
+            lua_rawseti(L, -3, index + 1);
+            result++;
+        }
+    }
+    _io.items += count;
+    _io.sent += tcxstrsize(packets);
+    tcxstrdel(packets);
+    tclistdel(results);
+    free(status);
+
+    // ready
+    return 2;
+}
+
+/*
+ * Bulk import and export.
+ *
+ * Snapshots are a header ("TTSN", then the format version and the database kind
+ * as big-endian 32-bit integers) followed by the records (32-bit key and value
+ * sizes, key, value; values of table databases being serialized tuples) and an
+ * end mark (a key size of 0xffffffff followed by the 64-bit record count), so
+ * that truncated files are detected. TSV files hold one record per line: key,
+ * TAB, value (key, TAB, column, TAB, value... for table databases), with tabs,
+ * newlines, carriage returns and backslashes within them written as \t, \n,
+ * \r and \\ (any other backslash is taken literally on import).
+ */
+#define SNAPSHOT_MAGIC      "TTSN"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_HEADER     12
+#define SNAPSHOT_END        0xffffffffu
+
+typedef struct {
+    const char* ptr;
+    const char* end;
+    int         bin;
+    int         tuples;
+    uint64_t    count;
+    TCXSTR*     key;                    // TSV key being unescaped
+    TCXSTR*     scratch;                // TSV value (or tuple) being unescaped
+} _import;
+
+static uint32_t _import_int32(const char* ptr) {
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return ntohl(value);
+}
+static void _export_int32(FILE* file, uint32_t value) {
+    value = htonl(value);
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+/*
+ * Unescape a TSV field into 'out' (the tabs separating the columns of a tuple
+ * becoming NULs if 'tuples' is 1).
+ */
+static void _import_unescape(TCXSTR* out, const char* ptr, int size, int tuples) {
+    const char* end = ptr + size;
+    tcxstrclear(out);
+    while (ptr < end) {
+        char c = *ptr++;
+        if (c == '\\' && ptr < end) {
+            switch (*ptr) {
+                case 't':  c = '\t'; ptr++; break;
+                case 'n':  c = '\n'; ptr++; break;
+                case 'r':  c = '\r'; ptr++; break;
+                case '\\': ptr++; break;
+            }
+        } else if (c == '\t' && tuples) {
+            c = '\0';
+        }
+        tcxstrcat(out, &c, 1);
+    }
+}
+
+/*
+ * Write a TSV field, escaped (the NULs separating the columns of a tuple
+ * becoming tabs if 'tuples' is 1).
+ */
+static void _export_escape(FILE* file, const char* ptr, int size, int tuples) {
+    const char* end = ptr + size;
+    for (; ptr < end; ptr++) {
+        switch (*ptr) {
+            case '\t':  fputs("\\t", file); break;
+            case '\n':  fputs("\\n", file); break;
+            case '\r':  fputs("\\r", file); break;
+            case '\\': fputs("\\\\", file); break;
+            case '\0':  putc(tuples ? '\t' : '\0', file); break;
+            default:    putc(*ptr, file); break;
+        }
+    }
+}
+
+/*
+ * Parse the next record. Returns 1 if there is one, 0 at the end of the input
+ * or -1 if a snapshot is invalid or truncated.
+ */
+static int _import_next(_import* in, const char** key, int* keysz, const char** value, int* valuesz) {
+
+    // snapshot
+    if (in->bin) {
+        if (in->end - in->ptr < 8) {
+            return -1;
+        }
+        uint32_t ksiz = _import_int32(in->ptr);
+        uint32_t vsiz = _import_int32(in->ptr + 4);
+        if (ksiz == SNAPSHOT_END) {
+            return in->end - in->ptr >= 12 &&
+                   (((uint64_t)vsiz << 32) | _import_int32(in->ptr + 8)) == in->count ? 0 : -1;
+        }
+        if (ksiz > INT_MAX || vsiz > INT_MAX || (uint64_t)(in->end - in->ptr - 8) < (uint64_t)ksiz + vsiz) {
+            return -1;
+        }
+        *key = in->ptr + 8;
+        *keysz = ksiz;
+        *value = *key + ksiz;
+        *valuesz = vsiz;
+        in->ptr = *value + vsiz;
+        in->count++;
+        return 1;
+    }
+
+    // text (skipping empty lines)
+    while (in->ptr < in->end) {
+        const char* line = in->ptr;
+        const char* eol = memchr(line, '\n', in->end - line);
+        const char* stop = eol ? eol : in->end;
+        in->ptr = eol ? eol + 1 : in->end;
+        if (stop > line && stop[-1] == '\r') {
+            stop--;
+        }
+        if (stop == line) {
+            continue;
+        }
+        const char* tab = memchr(line, '\t', stop - line);
+        *key = line;
+        *keysz = (tab ? tab : stop) - line;
+        *value = tab ? tab + 1 : stop;
+        *valuesz = stop - *value;
+        if (memchr(*key, '\\', *keysz)) {
+            _import_unescape(in->key, *key, *keysz, 0);
+            *key = tcxstrptr(in->key);
+            *keysz = tcxstrsize(in->key);
+        }
+        if (in->tuples || memchr(*value, '\\', *valuesz)) {
+            _import_unescape(in->scratch, *value, *valuesz, in->tuples);
+            *value = tcxstrptr(in->scratch);
+            *valuesz = tcxstrsize(in->scratch);
+        }
+        in->count++;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Load the records of a snapshot (see export()) or TSV file into db. The file
+ * is memory-mapped and streamed as 'putlist' commands of 'chunk' records, at
+ * most 'window' of them in flight (the next one is only sent once an earlier
+ * one is answered), so memory use does not depend on the size of the file. The
+ * format is told by the file header unless given. Returns the number of records.
+ *
+ * <number> = <any>:import(path[, { format = 'bin' | 'tsv', chunk = 1000, window = 8 }])
+ *
+ * Note: on failure the chunks already answered stay stored. The read cache is
+ *       cleared and imported keys are added to the negative lookup filter.
+ */
+static int luaF_any_import(lua_State* L) {
+
+    // initialize
+    TCRDB* db = _self_any(L);
+    int tuples = _handle_test(L, 1, 0, 1) != NULL;
+    const char* path = luaL_checkstring(L, 2);
+    const char* format = NULL;
+    int chunk = 1000, window = 8;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "format");
+        lua_getfield(L, 3, "chunk");
+        lua_getfield(L, 3, "window");
+        format = lua_tostring(L, -3);
+        chunk = luaL_optint(L, -2, chunk);
+        window = luaL_optint(L, -1, window);
+    }
+    if (format && strcmp(format, "bin") && strcmp(format, "tsv")) {
+        luaL_error(L, "Invalid import format «%s», expected 'bin' or 'tsv'!", format);
+    }
+    if (chunk < 1 || window < 1) {
+        luaL_error(L, "Invalid import options, expected positive «chunk» and «window»!");
+    }
+
+    // map
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        int error = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        _failure(L, strerror(error));
+    }
+    char* data = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    int error = errno;
+    close(fd);
+    if (data == MAP_FAILED) {
+        _failure(L, strerror(error));
+    }
+    if (data) {
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    // format
+    _import in;
+    memset(&in, 0, sizeof(in));
+    in.ptr = data;
+    in.end = data + st.st_size;
+    in.tuples = tuples;
+    int magic = st.st_size >= SNAPSHOT_HEADER && !memcmp(data, SNAPSHOT_MAGIC, 4);
+    in.bin = format ? !strcmp(format, "bin") : magic;
+    if (in.bin) {
+        if (!magic || _import_int32(data + 4) != SNAPSHOT_VERSION || _import_int32(data + 8) != (uint32_t)tuples) {
+            if (data) {
+                munmap(data, st.st_size);
+            }
+            _failure(L, "Invalid snapshot header (or snapshot of another kind of database)!");
+        }
+        in.ptr += SNAPSHOT_HEADER;
+    }
+    in.key = tcxstrnew();
+    in.scratch = tcxstrnew();
+
+    // stream
+    _cache* cache = _cache_of(L, 1);
+    _filter* filter = _filter_of(L, 1);
+    if (cache) {
+        _cache_clear(cache);
+    }
+    TCXSTR* body = tcxstrnew();
+    TCXSTR* packets = tcxstrnew();
+    const char* key;
+    const char* value;
+    int keysz, valuesz;
+    int status = 1, items = 0, pending = 0, ecode = TTESUCCESS;
+    pthread_mutex_lock(&db->mmtx);
+    while (ecode == TTESUCCESS && status > 0) {
+
+        // next record
+        status = _import_next(&in, &key, &keysz, &value, &valuesz);
+        if (status > 0) {
+            _tt_misc_arg(body, key, keysz);
+            _tt_misc_arg(body, value, valuesz);
+            if (filter) {
+                _filter_add(filter, key, keysz);
+            }
+            items++;
+        }
+
+        // send a full (or the last) chunk
+        if (items == chunk || (status <= 0 && items > 0)) {
+            tcxstrclear(packets);
+            _tt_misc(packets, "putlist", 0, items * 2);
+            tcxstrcat(packets, tcxstrptr(body), tcxstrsize(body));
+            tcxstrclear(body);
+            items = 0;
+            if (_tt_send(db, packets)) {
+                pending++;
+            } else {
+                ecode = TTESEND;
+            }
+        }
+
+        // wait for answers while the window is full (or for all of them at the end)
+        while (pending > 0 && (pending >= window || status <= 0 || ecode != TTESUCCESS)) {
+            int result = _tt_recv_misc(db, NULL);
+            pending--;
+            if (result < 0) {
+                ecode = ecode == TTESUCCESS ? TTERECV : ecode;
+                pending = 0;
+            } else if (result == 0 && ecode == TTESUCCESS) {
+                ecode = TTEMISC;
+            }
+        }
+    }
+    pthread_mutex_unlock(&db->mmtx);
+
+    // a failed send may have left part of a request behind (and a failed read
+    // part of a response), so the connection is started over
+    if (ecode == TTESEND || ecode == TTERECV) {
+        _tt_reopen(db);
+        _tt_ecode(db, ecode);
+    }
+
+    // done
+    tcxstrdel(packets);
+    tcxstrdel(body);
+    tcxstrdel(in.key);
+    tcxstrdel(in.scratch);
+    if (data) {
+        munmap(data, st.st_size);
+    }
+    if (ecode != TTESUCCESS) {
+        _failure(L, tcrdberrmsg(ecode));
+    }
+    if (status < 0) {
+        _failure(L, "Invalid or truncated snapshot!");
+    }
+    lua_pushnumber(L, in.count);
+    return 1;
+}
+
+/*
+ * Write all records of db into a snapshot (or TSV) file, fetching them with the
+ * read-ahead iterator ('batch' keys per pipelined round and their values with
+ * one 'getlist'), so memory use does not depend on the size of the database.
+ * Returns the number of records.
+ *
+ * <number> = <any>:export(path[, { format = 'bin' | 'tsv', batch = 1000 }])
+ *
+ * Note: this resets the iterator of the connection; records written meanwhile
+ *       may or may not be exported.
+ */
+static int luaF_any_export(lua_State* L) {
+
+    // initialize
+    TCRDB* db = _self_any(L);
+    int tuples = _handle_test(L, 1, 0, 1) != NULL;
+    const char* path = luaL_checkstring(L, 2);
+    const char* format = "bin";
+    int batch = 1000;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "format");
+        lua_getfield(L, 3, "batch");
+        format = luaL_optstring(L, -2, format);
+        batch = luaL_optint(L, -1, batch);
+    }
+    if (strcmp(format, "bin") && strcmp(format, "tsv")) {
+        luaL_error(L, "Invalid export format «%s», expected 'bin' or 'tsv'!", format);
+    }
+    if (batch < 1) {
+        luaL_error(L, "Invalid export batch, expected a positive number!");
+    }
+    int bin = !strcmp(format, "bin");
+
+    // open
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        _failure(L, strerror(errno));
+    }
+    _iterator it;
+    memset(&it, 0, sizeof(it));
+    it.handle = lua_touserdata(L, 1);
+    it.batch = batch;
+    it.values = 1;
+    it.prefetch = 1;
+    it.window = tclistnew();
+    it.settled = tclistnew();
+    if (!tcrdbiterinit(db)) {
+        tclistdel(it.window);
+        tclistdel(it.settled);
+        fclose(file);
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    if (bin) {
+        fwrite(SNAPSHOT_MAGIC, 4, 1, file);
+        _export_int32(file, SNAPSHOT_VERSION);
+        _export_int32(file, tuples);
+    }
+
+    // records
+    uint64_t count = 0;
+    int ok = 1;
+    int index, keysz, valuesz;
+    do {
+        ok = _iterator_fill(&it);
+        for (index = 0; ok && index + 1 < tclistnum(it.window); index += 2) {
+            const char* key = tclistval(it.window, index, &keysz);
+            const char* value = tclistval(it.window, index + 1, &valuesz);
+            if (bin) {
+                _export_int32(file, keysz);
+                _export_int32(file, valuesz);
+                fwrite(key, 1, keysz, file);
+                fwrite(value, 1, valuesz, file);
+            } else {
+                _export_escape(file, key, keysz, 0);
+                putc('\t', file);
+                _export_escape(file, value, valuesz, tuples);
+                putc('\n', file);
+            }
+            count++;
+        }
+    } while (ok && (!it.done || it.pending || tclistnum(it.settled)));
+    _iterator_release(&it);
+
+    // done
+    if (bin) {
+        _export_int32(file, SNAPSHOT_END);
+        _export_int32(file, count >> 32);
+        _export_int32(file, count & 0xffffffffu);
+    }
+    int failed = ferror(file);
+    failed |= fclose(file) != 0;
+    if (!ok) {
+        _failure(L, tcrdberrmsg(it.ecode));
+    }
+    if (failed) {
+        _failure(L, strerror(errno));
+    }
+    lua_pushnumber(L, count);
+    return 1;
+}
+
+/*
+ * Restore a database file from an update log.
+ *
+ * <boolean> = <any>:restore(path, ts[, check])
+ */
+static int luaF_any_restore(lua_State* L) {
+    TCRDB* db = _self_any(L);
+    const char* path = luaL_checkstring(L, 2);
+    uint64_t ts = luaL_checkinteger(L, 3);
+    int check = lua_toboolean(L, 4);
+    if (!tcrdbrestore(db, path, ts, check)) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Optimize the storage of a database file.
+ *
+ * <boolean> = <any>:optimize(options)
+ */
+static int luaF_any_optimize(lua_State* L) {
+    TCRDB* db = _self_any(L);
+    if (!tcrdboptimize(db, lua_tostring(L, 2))) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get the call metrics of the object (also of its queries), by method: number
+ * of calls and of failed calls, items (keys or pairs) sent in batches, number
+ * of batches and largest batch, payload bytes sent and received, total, mean,
+ * median, 99th and 99.9th percentile and maximum latency (in seconds). The
+ * metrics are cleared after being read if 'reset' is true.
+ *
+ * <table> = <any>:metrics([reset])
+ */
+#define _metrics_set(L, F, V)   { lua_pushnumber(L, (V)); lua_setfield(L, -2, F); }
+
+static int luaF_any_metrics(lua_State* L) {
+
+    // extract (closed objects keep their metrics)
+    _handle* handle = _handle_test(L, 1, 1, 1);
+    if (!handle) {
+        luaL_error(L, "Invalid «self», expected «ttyrant or ttyrant.table» instance!");
+    }
+
+    // methods
+    lua_newtable(L);
+    int op;
+    for (op = 0; handle->metrics && op < OPS_MAX; op++) {
+        const _op_metrics* m = &handle->metrics->ops[op];
+        if (!m->calls) {
+            continue;
+        }
+        lua_createtable(L, 0, 14);
+        _metrics_set(L, "calls", m->calls);
+        _metrics_set(L, "errors", m->errors);
+        _metrics_set(L, "items", m->items);
+        _metrics_set(L, "batches", m->batches);
+        _metrics_set(L, "batchmax", m->batchmax);
+        _metrics_set(L, "sent", m->sent);
+        _metrics_set(L, "received", m->received);
+        _metrics_set(L, "time", m->time / 1e9);
+        _metrics_set(L, "mean", m->time / 1e9 / m->calls);
+        _metrics_set(L, "p50", _histogram_quantile(m, 0.5) / 1e9);
+        _metrics_set(L, "p99", _histogram_quantile(m, 0.99) / 1e9);
+        _metrics_set(L, "p999", _histogram_quantile(m, 0.999) / 1e9);
+        _metrics_set(L, "max", m->timemax / 1e9);
+        lua_setfield(L, -2, _ops[op].name);
+    }
+
+    // reset
+    if (lua_toboolean(L, 2) && handle->metrics) {
+        _metrics_reset(handle->metrics);
+    }
+
+    // ready
+    return 1;
+}
+
+/*
+ * Get the hedged read statistics (nil if the object was not opened with a
+ * 'hedge' option), optionally resetting them.
+ *
+ * <table> = <any>:hedgestats([reset = false])
+ */
+static int luaF_any_hedgestats(lua_State* L) {
+
+    // initialize
+    _self_any(L);
+    _hedge* hedge = ((_handle*)lua_touserdata(L, 1))->hedge;
+    if (!hedge) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // statistics
+    lua_createtable(L, 0, 5);
+    _metrics_set(L, "reads", hedge->reads);
+    _metrics_set(L, "hedged", hedge->hedged);
+    _metrics_set(L, "wins", hedge->wins);
+    _metrics_set(L, "fallbacks", hedge->fallbacks);
+    _metrics_set(L, "delay", hedge->delay / 1e6);
+
+    // reset
+    if (lua_toboolean(L, 2)) {
+        hedge->reads = hedge->hedged = hedge->wins = hedge->fallbacks = 0;
+    }
+
+    // ready
+    return 1;
+}
+
+/*
+ * Enable (or reconfigure) parallel batches: put{...}, get{...} (hash databases)
+ * and out{...} with more than 'chunk' keys are split into requests of 'chunk'
+ * keys sent over 'connections' extra connections to the same server by as many
+ * threads, with at most 'inflight' bytes of requests in flight. Passing false
+ * disables it (closing the extra connections).
+ *
+ * <boolean> = <any>:parallel{ connections = 4, chunk = 10000, inflight = 67108864 }
+ * <boolean> = <any>:parallel(false)
+ */
+static int luaF_any_parallel(lua_State* L) {
+
+    // initialize
+    TCRDB* db = _self_any(L);
+    _handle* handle = lua_touserdata(L, 1);
+
+    // disable
+    _parallel_free(handle);
+    if (!lua_isnoneornil(L, 2) && !lua_toboolean(L, 2)) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // options
+    int connections = 4, chunk = 10000;
+    double inflight = 64 << 20;
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "connections");
+        lua_getfield(L, 2, "chunk");
+        lua_getfield(L, 2, "inflight");
+        connections = luaL_optint(L, -3, connections);
+        chunk = luaL_optint(L, -2, chunk);
+        inflight = luaL_optnumber(L, -1, inflight);
+        lua_pop(L, 3);
+    }
+    if (connections < 1 || chunk < 1 || inflight < 1) {
+        luaL_error(L, "Invalid parallel options, expected positive «connections», «chunk» and «inflight»!");
+    }
+
+    // connect
+    _parallel* par = calloc(1, sizeof(_parallel));
+    par->conns = calloc(connections, sizeof(TCRDB*));
+    par->host = strdup(db->host ? db->host : "");
+    par->port = db->port;
+    par->chunk = chunk;
+    par->inflight = (uint64_t)inflight;
+    handle->parallel = par;
+    for (; par->count < connections; par->count++) {
+        TCRDB* conn = tcrdbnew();
+        par->conns[par->count] = conn;
+        tcrdbtune(conn, db->timeout, db->opts);
+        if (!tcrdbopen(conn, par->host, par->port)) {
+            int ecode = tcrdbecode(conn);
+            par->count++;
+            _parallel_free(handle);
+            _failure(L, tcrdberrmsg(ecode));
+        }
+    }
+
+    // ready
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get the parallel batch statistics (nil if not enabled): batches run in
+ * parallel and chunks sent, optionally resetting them.
+ *
+ * <table> = <any>:parallelstats([reset = false])
+ */
+static int luaF_any_parallelstats(lua_State* L) {
+
+    // initialize
+    _self_any(L);
+    _parallel* par = ((_handle*)lua_touserdata(L, 1))->parallel;
+    if (!par) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // statistics
+    lua_createtable(L, 0, 5);
+    _metrics_set(L, "batches", par->batches);
+    _metrics_set(L, "chunks", par->chunks);
+    _metrics_set(L, "connections", par->count);
+    _metrics_set(L, "chunk", par->chunk);
+    _metrics_set(L, "inflight", par->inflight);
+
+    // reset
+    if (lua_toboolean(L, 2)) {
+        par->batches = par->chunks = 0;
+    }
+
+    // ready
+    return 1;
+}
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Open a regular database.
+ *
+ * <object> = ttyrant.hash:open('localhost', 1978[, options])
+ * <object> = ttyrant.hash:open('localhost:1978'[, options])
+ *
+ * options = { timeout = 0, probe = 0, reconnect = false,        -- timeout, probe in seconds
+ *             hedge = { delay = 0.005, host = 'localhost:1978'[, port = 1978] } }
+ */
+static int luaF_hash_open(lua_State* L) {
+    return _any_open(L, "ttyrant.hash", 0);
+}
+
+/*
+ * Store value(s) at given key(s) in db.
+ *
+ * <boolean> = ttyrant:put(key1, value1, key2, value2, ...)
+ * <boolean> = ttyrant:put{ key1 = value1, key2 = value2, ... }
+ *
+ * Note: implemented explicitly since it translates multiple key-value
+ *       pairs into single-shot operations (i.e. 'putlist') for speed.
+ */
+static int luaF_hash_put(lua_State* L) {
+
+    // initialize
+    TCRDB*  db = _self_hdb(L);
+    TCLIST* items = NULL;
+    int     status = 0;
+    int     ecode = 0;
+
+    // input set
+    if (lua_istable(L, 2)) {
+        items = _luatable2tclist(L, 2, 1);
+    } else if (lua_gettop(L) == 3) {
+        size_t keysz, valuesz;
+        const char* key = luaL_checklstring(L, 2, &keysz);
+        const char* value = _checkvalue(L, 3, &valuesz);
+        status = tcrdbput(db, key, keysz, value, valuesz);
+        if (_cache_of(L, 1)) {
+            _cache_out(_cache_of(L, 1), key, keysz);
+        }
+        if (_filter_of(L, 1)) {
+            _filter_add(_filter_of(L, 1), key, keysz);
+        }
+    } else {
+        items = _lualist2tclist(L, 2);
+    }
+
+    // clear items
+    if (items) {
+        if (_cache_of(L, 1)) {
+            _cache_out_list(_cache_of(L, 1), items, 2);
+        }
+        if (_filter_of(L, 1)) {
+            _filter_add_list(_filter_of(L, 1), items, 2);
+        }
+        TCLIST* result = _parallel_list(lua_touserdata(L, 1), "putlist", items, 2, &ecode);
+        if (result) {
+            status = 1;
+            tclistdel(result);
+        }
+    }
+
+    // result
+    if (!status) {
+        _failure(L, tcrdberrmsg(ecode ? ecode : tcrdbecode(db)));
+    }
+    lua_pushboolean(L, 1);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Append value at given key in db.
+ *
+ * <boolean> = ttyrant:putcat(key, value)
+ */
+static int luaF_hash_putcat(lua_State* L) {
+    return _hash_put(L, PUT_CAT);
+}
+
+/*
+ * Store a value at given key in db only if it does not exist.
+ *
+ * <boolean> = ttyrant:putkeep(key, value)
+ */
+static int luaF_hash_putkeep(lua_State* L) {
+    return _hash_put(L, PUT_KEEP);
+}
+
+/*
+ * Append value at given key in db and crop final value to given width.
+ *
+ * <boolean> = ttyrant:putshl(key, value, width)
+ */
+static int luaF_hash_putshl(lua_State* L) {
+
+    // initialize
+    TCRDB*  db = _self_hdb(L);
+
+    // extract
+    size_t keysz, valuesz;
+    const char* key = luaL_checklstring(L, 2, &keysz);
+    const char* value = _checkvalue(L, 3, &valuesz);
+    int width = luaL_checkint(L, 4);
+
+    // store
+    if (_cache_of(L, 1)) {
+        _cache_out(_cache_of(L, 1), key, keysz);
+    }
+    if (_filter_of(L, 1)) {
+        _filter_add(_filter_of(L, 1), key, keysz);
+    }
+    if (!tcrdbputshl(db, key, keysz, value, valuesz, width)) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    lua_pushboolean(L, 1);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Store value(s) at given key(s) in db without waiting for a response.
+ *
+ * <boolean> = ttyrant:putnr(key, value)
+ * <boolean> = ttyrant:putnr(key1, value1, key2, value2, ...)
+ * <boolean> = ttyrant:putnr{ key1 = value1, key2 = value2, ... }
+ *
+ * Note: multiple key-value pairs are streamed as a batch of 'putnr' commands
+ *       within a single socket write; a true result only means it was sent.
+ */
+static int luaF_hash_putnr(lua_State* L) {
+
+    // single pair
+    if (!lua_istable(L, 2) && lua_gettop(L) == 3) {
+        return _hash_put(L, PUT_NR);
+    }
+
+    // initialize
+    TCRDB*  db = _self_hdb(L);
+    TCLIST* items = lua_istable(L, 2) ? _luatable2tclist(L, 2, 1) : _lualist2tclist(L, 2);
+    if (_cache_of(L, 1)) {
+        _cache_out_list(_cache_of(L, 1), items, 2);
+    }
+    if (_filter_of(L, 1)) {
+        _filter_add_list(_filter_of(L, 1), items, 2);
+    }
+
+    // stream items
+    int status = _hash_putnr_list(db, items);
+
+    // result
+    if (!status) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    lua_pushboolean(L, 1);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Get multiple values through the read cache, requesting only the missing keys
+ * from the server (and caching what comes back).
+ */
+static int _hash_get_cached(lua_State* L, _handle* handle, _cache* cache, const TCLIST* keys) {
+
+    // initialize
+    TCLIST* missing = tclistnew();
+    int     index, keysz, valuesz, ecode;
+
+    // hits
+    lua_newtable(L);
+    for (index = 0; index < tclistnum(keys); index++) {
+        const char* key = tclistval(keys, index, &keysz);
+        const char* value = _cache_get(cache, key, keysz, &valuesz);
+        if (value) {
+            lua_pushlstring(L, key, keysz);
+            lua_pushlstring(L, value, valuesz);
+            lua_rawset(L, -3);
+        } else {
+            tclistpush(missing, key, keysz);
+        }
+    }
+
+    // misses
+    if (tclistnum(missing) > 0) {
+        TCLIST* items = _hash_getlist(handle, missing, &ecode);
+        tclistdel(missing);
+        if (!items) {
+            _failure(L, tcrdberrmsg(ecode));
+        }
+        for (index = 0; index + 1 < tclistnum(items); index += 2) {
+            const char* key = tclistval(items, index, &keysz);
+            const char* value = tclistval(items, index + 1, &valuesz);
+            lua_pushlstring(L, key, keysz);
+            lua_pushlstring(L, value, valuesz);
+            lua_rawset(L, -3);
+            _cache_put(cache, key, keysz, value, valuesz);
+            _io.received += keysz + valuesz;
+        }
+        tclistdel(items);
+    } else {
+        tclistdel(missing);
+    }
+
+    // done
+    return 1;
+}
+
+/*
+ * Get value(s) at key(s) from db.
+ *
+ * <value> = ttyrant:get(key1, key2, ...)
+ * <value> = ttyrant:get{key1, key2, ...}
+ *
+ * Note: with a read cache (see ttyrant:cache()) only the keys missing from the
+ *       cache are requested from the server.
+ */
+static int luaF_hash_get(lua_State* L) {
+
+    // initialize
+    _self_hdb(L);
+    _handle* handle = lua_touserdata(L, 1);
+    _cache* cache = _cache_of(L, 1);
+    _filter* filter = _filter_of(L, 1);
+    TCLIST* keys = NULL;
+    TCLIST* items = NULL;
+    char*   item = NULL;
+    int     itemsz = 0;
+    int     ecode = 0;
+
+    // input set
+    if (lua_istable(L, 2)) {
+        keys = _luatable2tclist(L, 2, 0);
+    } else if (lua_gettop(L) == 2) {
+        size_t keysz;
+        const char* key = luaL_checklstring(L, 2, &keysz);
+        if (filter && !_filter_test(filter, key, keysz)) {
+            _failure(L, tcrdberrmsg(TTENOREC));
+        }
+        if (cache) {
+            const char* cached = _cache_get(cache, key, keysz, &itemsz);
+            if (cached) {
+                lua_pushlstring(L, cached, itemsz);
+                return 1;
+            }
+        }
+        item = _hedge_get(handle, key, keysz, &itemsz, &ecode);
+        if (item && cache) {
+            _cache_put(cache, key, keysz, item, itemsz);
+        }
+    } else {
+        keys = _lualist2tclist(L, 2);
+    }
+
+    // certainly absent keys
+    if (keys && filter) {
+        _filter_list(filter, keys);
+        if (tclistnum(keys) == 0) {
+            lua_newtable(L);
+            return 1;
+        }
+    }
+
+    // cached set
+    if (keys && cache) {
+        return _hash_get_cached(L, handle, cache, keys);
+    }
+
+    // act on set
+    if (keys) {
+        items = _hash_getlist(handle, keys, &ecode);
+    }
+
+    // result set
+    if (item) {
+        lua_pushlstring(L, item, itemsz);
+        free(item);
+    } else if (items) {
+        _tclist2luatable(L, items, 1);
+        tclistdel(items);
+    } else {
+        _failure(L, tcrdberrmsg(ecode));
+    }
+
+    // done
+    return 1;
+}
+
+/*
+ * Get the value at key from db as a buffer (i.e. without copying it into a Lua string).
+ *
+ * <buffer> = ttyrant:getbuffer(key)
+ */
+static int luaF_hash_getbuffer(lua_State* L) {
+
+    // initialize
+    TCRDB*  db = _self_hdb(L);
+    size_t  keysz;
+    int     valuesz;
+    const char* key = _checkvalue(L, 2, &keysz);
+    if (_filter_of(L, 1) && !_filter_test(_filter_of(L, 1), key, keysz)) {
+        _failure(L, tcrdberrmsg(TTENOREC));
+    }
+
+    // retrieve
+    char* value = tcrdbget(db, key, keysz, &valuesz);
+    if (!value) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    _buffer_push(L, value, valuesz, value, BUFFER_MALLOC);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Return the width of the value stored at given key.
+ *
+ * <number> = ttyrant:vsiz(key)
+ */
+static int luaF_hash_vsiz(lua_State* L) {
+
+    // initialize
+    TCRDB*  db = _self_hdb(L);
+
+    // extract
+    size_t keysz;
+    const char* key = luaL_checklstring(L, 2, &keysz);
+    if (_filter_of(L, 1) && !_filter_test(_filter_of(L, 1), key, keysz)) {
+        _failure(L, tcrdberrmsg(TTENOREC));
+    }
+
+    // store
+    int vsiz = tcrdbvsiz(db, key, keysz);
+    if (vsiz < 0) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    lua_pushinteger(L, vsiz);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Enable (or reconfigure) the client-side read cache of the object, keeping
+ * the most recently read values within 'bytes' (default 1MB) and for at most
+ * 'ttl' seconds (default forever). Writes through this object drop the keys
+ * they touch and vanish() drops everything; writes by other clients are only
+ * seen after the entries expire (or are evicted). Passing false disables it.
+ *
+ * <boolean> = ttyrant:cache{ bytes = 1048576, ttl = 0 }
+ * <boolean> = ttyrant:cache(false)
+ *
+ * Note: getbuffer() and the plain C interface bypass the cache (although the
+ *       writes of the latter still drop cached keys).
+ */
+static int luaF_hash_cache(lua_State* L) {
+
+    // initialize
+    _self_hdb(L);
+    _handle* handle = lua_touserdata(L, 1);
+
+    // disable
+    if (!lua_isnoneornil(L, 2) && !lua_toboolean(L, 2)) {
+        _cache_free(handle);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // options
+    double bytes = 1 << 20, ttl = 0;
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "bytes");
+        bytes = luaL_optnumber(L, -1, bytes);
+        lua_getfield(L, 2, "ttl");
+        ttl = luaL_optnumber(L, -1, ttl);
+        lua_pop(L, 2);
+    }
+    if (bytes < 1 || ttl < 0) {
+        luaL_error(L, "Invalid cache options, expected positive «bytes» and «ttl»!");
+    }
+
+    // (re)configure
+    if (!handle->cache) {
+        handle->cache = calloc(1, sizeof(_cache));
+        handle->cache->map = tcmapnew();
+    }
+    _cache* cache = handle->cache;
+    cache->budget = (uint64_t)bytes;
+    cache->ttl = (uint64_t)(ttl * 1e6);
+    _cache_clear(cache);
+
+    // ready
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get the read cache statistics of the object (nil if there is no cache): hits,
+ * misses, expirations (counted as misses too), evictions, invalidations, number
+ * of entries and bytes used out of budget. The counters are cleared after being
+ * read if 'reset' is true.
+ *
+ * <table> = ttyrant:cachestats([reset])
+ */
+static int luaF_hash_cachestats(lua_State* L) {
+
+    // initialize
+    _self_hdb(L);
+    _cache* cache = _cache_of(L, 1);
+    if (!cache) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // statistics
+    lua_createtable(L, 0, 8);
+    _metrics_set(L, "hits", cache->hits);
+    _metrics_set(L, "misses", cache->misses);
+    _metrics_set(L, "expirations", cache->expirations);
+    _metrics_set(L, "evictions", cache->evictions);
+    _metrics_set(L, "invalidations", cache->invalidations);
+    _metrics_set(L, "entries", tcmaprnum(cache->map));
+    _metrics_set(L, "bytes", cache->bytes);
+    _metrics_set(L, "budget", cache->budget);
+
+    // reset
+    if (lua_toboolean(L, 2)) {
+        cache->hits = cache->misses = cache->expirations = 0;
+        cache->evictions = cache->invalidations = 0;
+    }
+
+    // ready
+    return 1;
+}
+
+/*
+ * Add all keys of db to a filter (using pipelined 'iternext' batches, like
+ * the read-ahead iterator). Returns 0 on failure.
+ */
+static int _filter_build(_filter* filter, _handle* handle) {
+
+    // initialize
+    TCRDB* db = handle->db;
+    _iterator it;
+    memset(&it, 0, sizeof(it));
+    it.handle = handle;
+    it.batch = 1024;
+    it.prefetch = 1;
+    it.window = tclistnew();
+    it.settled = tclistnew();
+    if (!tcrdbiterinit(db)) {
+        tclistdel(it.window);
+        tclistdel(it.settled);
+        return 0;
+    }
+
+    // collect
+    int ok = 1;
+    do {
+        ok = _iterator_fill(&it);
+        _filter_add_list(filter, it.window, 1);
+    } while (ok && (!it.done || it.pending || tclistnum(it.settled)));
+
+    // ready
+    _iterator_release(&it);
+    return ok;
+}
+
+/*
+ * Enable the negative lookup filter of the object, so that get(), getbuffer()
+ * and vsiz() of keys it rejects return nil, "no record found" without asking
+ * the server. The filter is sized for 'keys' keys at a false positive rate of
+ * 'fpr' and built from all the keys of db (unless 'build' is false), or loaded
+ * from a file written by filtersave(). Keys written through the object are
+ * added to it, vanish() empties it and removed keys stay in it. Keys written by
+ * other clients are NOT seen, so use it only when this object is the only
+ * writer (or rebuild it regularly). Passing false disables it.
+ *
+ * <boolean> = ttyrant:filter{ keys = 1000000, fpr = 0.01, build = true }
+ * <boolean> = ttyrant:filter{ file = '/path/to/filter' }
+ * <boolean> = ttyrant:filter(false)
+ *
+ * Note: building iterates over the whole database (resetting the iterator of
+ *       the connection).
+ */
+static int luaF_hash_filter(lua_State* L) {
+
+    // initialize
+    TCRDB* db = _self_hdb(L);
+    _handle* handle = lua_touserdata(L, 1);
+    _filter* filter = NULL;
+
+    // disable
+    if (!lua_istable(L, 2)) {
+        if (lua_toboolean(L, 2)) {
+            luaL_error(L, "Invalid filter options, expected table or false!");
+        }
+        _filter_free(handle);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // load
+    lua_getfield(L, 2, "file");
+    if (!lua_isnil(L, -1)) {
+        const char* error = NULL;
+        filter = _filter_load(luaL_checkstring(L, -1), &error);
+        if (!filter) {
+            _failure(L, error);
+        }
+
+    // size
+    } else {
+        lua_getfield(L, 2, "keys");
+        lua_getfield(L, 2, "fpr");
+        lua_getfield(L, 2, "build");
+        double keys = luaL_optnumber(L, -3, 1000000);
+        double fpr = luaL_optnumber(L, -2, 0.01);
+        int build = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        if (keys < 1 || fpr <= 0 || fpr >= 1) {
+            luaL_error(L, "Invalid filter options, expected positive «keys» and «fpr» below 1!");
+        }
+        double bits = ceil(-keys * log(fpr) / (M_LN2 * M_LN2));
+        int hashes = (int)(bits / keys * M_LN2 + 0.5);
+        hashes = hashes < 1 ? 1 : hashes > 16 ? 16 : hashes;
+        filter = _filter_new((uint64_t)ceil(bits / FILTER_BLOCK_BITS), hashes);
+        if (!filter) {
+            _failure(L, strerror(ENOMEM));
+        }
+
+        // bootstrap
+        if (build && !_filter_build(filter, lua_touserdata(L, 1))) {
+            free(filter->bits);
+            free(filter);
+            _failure(L, tcrdberrmsg(tcrdbecode(db) ? tcrdbecode(db) : TTERECV));
+        }
+    }
+
+    // replace
+    _filter_free(handle);
+    handle->filter = filter;
+
+    // ready
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Write the filter of the object to a file (for fast warm starts; the file is
+ * only meant for machines of the same byte order).
+ *
+ * <boolean> = ttyrant:filtersave(path)
+ */
+static int luaF_hash_filtersave(lua_State* L) {
+    _self_hdb(L);
+    const char* path = luaL_checkstring(L, 2);
+    _filter* filter = _filter_of(L, 1);
+    if (!filter) {
+        _failure(L, "No filter is enabled!");
+    }
+    if (!_filter_save(filter, path)) {
+        _failure(L, strerror(errno));
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get the negative lookup filter statistics of the object (nil if there is
+ * no filter): keys added, size in bytes, number of hash functions, estimated
+ * false positive rate, lookups answered locally (negatives) and passed on to
+ * the server (positives). The counters are cleared after being read if 'reset'
+ * is true.
+ *
+ * <table> = ttyrant:filterstats([reset])
+ */
+static int luaF_hash_filterstats(lua_State* L) {
+
+    // initialize
+    _self_hdb(L);
+    _filter* filter = _filter_of(L, 1);
+    if (!filter) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // statistics
+    lua_createtable(L, 0, 6);
+    _metrics_set(L, "keys", filter->keys);
+    _metrics_set(L, "bytes", filter->blocks * FILTER_BLOCK_WORDS * sizeof(uint64_t));
+    _metrics_set(L, "hashes", filter->hashes);
+    _metrics_set(L, "fpr", _filter_fpr(filter));
+    _metrics_set(L, "negatives", filter->negatives);
+    _metrics_set(L, "positives", filter->positives);
+
+    // reset
+    if (lua_toboolean(L, 2)) {
+        filter->negatives = filter->positives = 0;
+    }
+
+    // ready
+    return 1;
+}
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Open a table database.
+ *
+ * <object> = ttyrant.table:open('localhost', 1978[, options])
+ * <object> = ttyrant.table:open('localhost:1978'[, options])
+ *
+ * Note: the options are those of ttyrant.hash:open().
+ */
+static int luaF_table_open(lua_State* L) {
+    return _any_open(L, "ttyrant.table", 1);
+}
+
+/*
+ * Create new tuple in the table db using given column values.
+ *
+ * <boolean> = ttyrant.table:put(key, {})
+ * <table>, <table> = ttyrant.table:put{ [key1] = {}, [key2] = {}, ... }
+ */
+static int luaF_table_put(lua_State* L) {
+    return _table_put(L, "Invalid value for «ttyrant.table:put()», expected a table/tuple!", PUT_NORMAL);
+}
+
+/*
+ * Append given column values an existing tuple in the table db.
+ *
+ * <boolean> = ttyrant.table:putcat(key, {})
+ * <table>, <table> = ttyrant.table:putcat{ [key1] = {}, [key2] = {}, ... }
+ */
+static int luaF_table_putcat(lua_State* L) {
+    return _table_put(L, "Invalid value for «ttyrant.table:putcat()», expected a table/tuple!", PUT_CAT);
+}
+
+/*
+ * Create new tuple in the table db using given column values only if it does not exist.
+ *
+ * <boolean> = ttyrant.table:putkeep(key, {})
+ * <table>, <table> = ttyrant.table:putkeep{ [key1] = {}, [key2] = {}, ... }
+ */
+static int luaF_table_putkeep(lua_State* L) {
+    return _table_put(L, "Invalid value for «ttyrant.table:putkeep()», expected a table/tuple!", PUT_KEEP);
+}
+
+/*
+ * Get tuple from db.
+ *
+ * <table> = ttyrant.table:get(key)
+ */
+static int luaF_table_get(lua_State* L) {
+
+    // db
+    _self_tdb(L);
+    _handle* handle = lua_touserdata(L, 1);
+
+    // tools
+    int tuplesz;
+    int ecode = 0;
+    size_t keysz;
+    const char* key = luaL_checklstring(L, 2, &keysz);
+
+    // retrieve (the serialized tuple, as tcrdbtblget() does before splitting it)
+    char* tuple = _hedge_get(handle, key, keysz, &tuplesz, &ecode);
+    if (!tuple) {
+        _failure(L, tcrdberrmsg(ecode));
+    }
+    _tuple2luatable(L, tuple, tuplesz);
+    free(tuple);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Get a column value of a tuple from db as a buffer (the whole tuple is kept
+ * alive by the buffer, but nothing is copied into Lua strings).
+ *
+ * <buffer> = ttyrant.table:getbuffer(key, column)
+ */
+static int luaF_table_getbuffer(lua_State* L) {
+
+    // initialize
+    TCRDB*  db = _self_tdb(L);
+    size_t  keysz, colsz;
+    int     valsz;
+    const char* key = _checkvalue(L, 2, &keysz);
+    const char* col = luaL_checklstring(L, 3, &colsz);
+
+    // retrieve
+    TCMAP* tuple = tcrdbtblget(db, key, keysz);
+    if (!tuple) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    const char* val = tcmapget(tuple, col, colsz, &valsz);
+    if (!val) {
+        tcmapdel(tuple);
+        _failure(L, tcrdberrmsg(TTENOREC));
+    }
+    _buffer_push(L, val, valsz, tuple, BUFFER_TCMAP);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Create an index on a column.
+ *
+ * <boolean> = ttyrant.table:setindex(column, type[, keep = false])
+ */
+static int luaF_table_setindex(lua_State* L) {
+
+    // db
+    TCRDB* db = _self_tdb(L);
+
+    // column
+    const char* column = luaL_checkstring(L, 2);
+    int keep = lua_toboolean(L, 4);
+
+    // nominal indicator table
+    static const char* const type_names[] = {
+        "LEXICAL",
+        "DECIMAL",
+        "TOKEN",
+        "QGRAM",
+        "OPT",
+        "VOID",
+        NULL
+    };
+
+    // scalar indicator table
+    static const int type_values[] = {
+        RDBITLEXICAL,
+        RDBITDECIMAL,
+        RDBITTOKEN,
+        RDBITQGRAM,
+        RDBITOPT,
+        RDBITVOID,
+        0
+    };
+
+    // extract indicator
+    const char* type = luaL_checkstring(L, 3);
+    char* p = (char*)type - 1;
+    while (*(++p)) if (islower(*p)) *p = toupper(*p);
+    
+    // make "RDBIT" prefix optional
+    if (strstr(type, "RDBIT") == type) {
+        type += 5; // strlen("RDBIT") == 5
+    }
+
+    // extract operator
+    lua_pushstring(L, type);
+    int index = luaL_checkoption(L, -1, NULL, type_names);
+    lua_pop(L, 1);
+
+    // execute
+    if (!tcrdbtblsetindex(db, column, type_values[index] | (keep ? RDBITKEEP : 0))) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+
+    // ready
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Generate an unique ID.
+ *
+ * <number> = <table>:genuid()
+ */
+static int luaF_table_genuid(lua_State* L) {
+
+    // extract/execute
+    TCRDB* db = _self_tdb(L);
+    int64_t uid = tcrdbtblgenuid(db);
+    if (uid == -1) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    } else {
+        lua_pushinteger(L, uid);
+    }
+    
+    // ready
+    return 1;
+}
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Create a query object.
+ *
+ * <object> = ttyrant.query:new()
+ */
+static int _luaF_query_gc(lua_State* L) {
+    _query* query = lua_touserdata(L, 1);
+    if (query->qry) {
+        tcrdbqrydel(query->qry);
+        query->qry = NULL;
+    }
+    return 0;
+}
+static int luaF_query_new(lua_State* L) {
+
+    // instance
+    if (!lua_istable(L, 1)) {
+        luaL_error(L, "Invalid «self» for ttyrant.query:new(), expected «ttyrant.query»!");
+    }
+    if (!_handle_test(L, 2, 0, 1)) {
+        luaL_error(L, "Invalid «ttyrant.table» instance for ttyrant.query:new()!");
+    }
+    TCRDB* db = _self_db(L, 2, 0, 1, "ttyrant.table");
+
+    // spawn query
+    RDBQRY* qry = tcrdbqrynew(db);
+    if (!qry) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    _query* query = lua_newuserdata(L, sizeof(_query));
+    query->qry = qry;
+    query->handle = _handle_test(L, 2, 0, 1);
+    lua_pushvalue(L, UPV_QUERY);
+    lua_setmetatable(L, -2);            // setmetatable(instance, <query metatable>)
+
+    // keep the table db alive for as long as the query
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Depreciated query destroyer.
+ */
+static int luaF_query_delete(lua_State* L) {
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Add a filtering rule to a query object.
+ *
+ * <boolean> = ttyrant.query:addcond(column, operator, expression[, negate = false[, noidx = false]])
+ */
+static int luaF_query_addcond(lua_State* L) {
+
+    // instance
+    RDBQRY* qry = _self_qry(L);
+
+    // column
     const char* column = luaL_checkstring(L, 2);
-    int keep = lua_toboolean(L, 4);
+    int options = (lua_toboolean(L, 5) ? RDBQCNEGATE : 0) |
+                  (lua_toboolean(L, 5) ? RDBQCNOIDX : 0);
+
+    // nominal indicator table
+    static const char* const operator_names[] = {
+        "STREQ",
+        "STRINC",
+        "STRBW",
+        "STREW",
+        "STRAND",
+        "STROR",
+        "STROREQ",
+        "STRRX",
+        "NUMEQ",
+        "NUMGT",
+        "NUMGE",
+        "NUMLT",
+        "NUMLE",
+        "NUMBT",
+        "NUMOREQ",
+        "FTSPH",
+        "FTSAND",
+        "FTSOR",
+        "FTSEX",
+        NULL
+    };
+
+    // scalar indicator table
+    static const int operator_values[] = {
+        RDBQCSTREQ,
+        RDBQCSTRINC,
+        RDBQCSTRBW,
+        RDBQCSTREW,
+        RDBQCSTRAND,
+        RDBQCSTROR,
+        RDBQCSTROREQ,
+        RDBQCSTRRX,
+        RDBQCNUMEQ,
+        RDBQCNUMGT,
+        RDBQCNUMGE,
+        RDBQCNUMLT,
+        RDBQCNUMLE,
+        RDBQCNUMBT,
+        RDBQCNUMOREQ,
+        RDBQCFTSPH,
+        RDBQCFTSAND,
+        RDBQCFTSOR,
+        RDBQCFTSEX,
+        0
+    };
+
+    // extract indicator
+    const char* indicator = luaL_checkstring(L, 3);
+    char* p = (char*)indicator - 1;
+    while (*(++p)) if (islower(*p)) *p = toupper(*p);
+    
+    // make "RDBQC" prefix optional
+    if (strstr(indicator, "RDBQC") == indicator) {
+        indicator += 5; // strlen("RDBQC") == 5
+    }
+
+    // extract operator
+    lua_pushstring(L, indicator);
+    int operator = luaL_checkoption(L, -1, NULL, operator_names);
+    lua_pop(L, 1);
+
+    // operand expression
+    char buffer[64];
+    const char* expression = NULL;
+    if (lua_type(L, 4) == LUA_TSTRING) {
+        expression = luaL_checkstring(L, 4);
+    } else {
+        if (snprintf(buffer, 64, "%f", luaL_checknumber(L, 4)) >= 0) {
+            expression = buffer;
+        }
+    }
+
+    // execute
+    if (expression) {
+        tcrdbqryaddcond(qry, column, operator_values[operator] | options, expression);
+    }
+
+    // ready
+    lua_pushboolean(L, expression != NULL);
+    return 1;
+}
+
+/*
+ * Limit the query result set.
+ *
+ * <boolean> = ttyrant.query:setlimit([limit = -1[, offset = 0]])
+ */
+static int luaF_query_setlimit(lua_State* L) {
+
+    // instance
+    RDBQRY* qry = _self_qry(L);
+
+    // limits
+    int limit = -1;
+    if (!lua_isnoneornil(L, 2)) {
+        limit = luaL_checkint(L, 2);
+    }
+    int offset = lua_tointeger(L, 3);
+
+    // apply
+    tcrdbqrysetlimit(qry, limit, offset);
+
+    // ready
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Choose a search ordering.
+ *
+ * <boolean> = ttyrant.query:setorder(column[, method = "STRASC"])
+ */
+static int luaF_query_setorder(lua_State* L) {
+
+    // instance
+    RDBQRY* qry = _self_qry(L);
+
+    // column
+    const char* column = luaL_checkstring(L, 2);
+
+    // nominal indicator table
+    static const char* const method_names[] = {
+        "STRASC",
+        "STRDESC",
+        "NUMASC",
+        "NUMDESC",
+        NULL
+    };
+
+    // scalar indicator table
+    static const int method_values[] = {
+        RDBQOSTRASC,
+        RDBQOSTRDESC,
+        RDBQONUMASC,
+        RDBQONUMDESC,
+        0
+    };
+
+    // extract indicator
+    int sort = 0;
+    if (!lua_isnoneornil(L, 3)) {
+        const char* method = luaL_checkstring(L, 3);
+        char* p = (char*)method - 1;
+        while (*(++p)) if (islower(*p)) *p = toupper(*p);
+        if (strstr(method, "RDBQO") == method) {
+            method += 5; // strlen("RDBQO") == 5
+        }
+
+        // extract method
+        lua_pushstring(L, method);
+        sort = luaL_checkoption(L, -1, NULL, method_names);
+        lua_pop(L, 1);
+    }
+    
+    // execute
+    tcrdbqrysetorder(qry, column, method_values[sort]);
+
+    // ready
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get the list of keys corresponding to the query object.
+ *
+ * <table> = ttyrant.query:search()
+ */
+static int luaF_query_search(lua_State* L) {
+    RDBQRY* qry = _self_qry(L);
+    TCLIST* items = tcrdbqrysearch(qry);
+    _tclist2luatable(L, items, 0);
+    tclistdel(items);
+    return 1;
+}
+
+/*
+ * Remove all tuples corresponding to the query object.
+ *
+ * <boolean> = ttyrant.query:searchout()
+ */
+static int luaF_query_searchout(lua_State* L) {
+    RDBQRY* qry = _self_qry(L);
+    lua_pushboolean(L, tcrdbqrysearchout(qry));
+    return 1;
+}
+
+/*
+ * Append a 'get' directive to the given query arguments; if there is a table
+ * at the 'index' position in the given stack, the returned tuples are limited
+ * to its columns (the primary key, i.e. the column with an empty name, is
+ * always requested too).
+ */
+static void _query_get(lua_State* L, int index, TCLIST* args) {
+
+    // all columns
+    if (index < 0) {
+        index += lua_gettop(L) + 1;
+    }
+    if (!lua_istable(L, index)) {
+        tclistpush(args, "get", 3);
+        return;
+    }
+
+    // projection
+    TCXSTR* get = tcxstrnew();
+    size_t  colsz;
+    int     col = 1;
+    tcxstrcat(get, "get\0", 4);
+    for (;; col++) {
+        lua_rawgeti(L, index, col);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        const char* column = luaL_checklstring(L, -1, &colsz);
+        tcxstrcat(get, "\0", 1);
+        tcxstrcat(get, column, colsz);
+        lua_pop(L, 1);
+    }
+    tclistpush(args, tcxstrptr(get), tcxstrsize(get));
+    tcxstrdel(get);
+}
+
+/*
+ * Get the values of tuples which correspond to the query object, optionally
+ * transferring only the given columns.
+ *
+ * <table> = ttyrant.query:searchget()
+ * <table> = ttyrant.query:searchget{ column1, column2, ... }
+ */
+static int luaF_query_searchget(lua_State* L) {
+
+    // instance
+    RDBQRY* qry = _self_qry(L);
+
+    // execute
+    TCLIST* items;
+    if (lua_istable(L, 2)) {
+        TCLIST* args = tclistdup(qry->args);
+        _query_get(L, 2, args);
+        items = tcrdbmisc(qry->rdb, "search", RDBMONOULOG, args);
+        tclistdel(args);
+        if (!items) {
+            _failure(L, tcrdberrmsg(tcrdbecode(qry->rdb)));
+        }
+    } else {
+        items = tcrdbqrysearchget(qry);
+    }
+
+    // initialize
+    int count = tclistnum(items);
+    int index, itemsz;
+    lua_createtable(L, 0, count);
+
+    // traverse
+    for (index = 0; index < count; index++) {
+        const char* item = tclistval(items, index, &itemsz);
+        _row2luatable(L, item, itemsz);
+        lua_settable(L, -3);
+    }
+    tclistdel(items);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Walk the tuples which correspond to the query object one page at a time.
+ *
+ * for key, tuple in ttyrant.query:cursor{ pagesize = 1000[, prefetch = true][, columns = {...}] } do ... end
+ *
+ * Each page is fetched with its own limit/offset (any limit set on the query is
+ * honored) so at most two pages are ever held in memory; unless 'prefetch' is
+ * false, the next page is fetched by a native thread while the current page is
+ * being consumed (the database object remains usable meanwhile). Like with
+ * searchget{...}, 'columns' limits the transferred columns.
+ */
+typedef struct _cursor {
+    TCRDB*      db;
+    _handle*    handle;                 // kept alive by the cursor (fenv)
+    struct _cursor* link;               // next cursor of the same handle
+    TCLIST*     args;                   // query arguments, without 'setlimit', with 'get'
+    int         pagesize;
+    int         offset;
+    int         remaining;              // -1 means no limit
+    int         requested;              // size of the page being fetched
+    int         done;
+    int         running;                // fetching thread is alive
+    pthread_t   thread;
+    TCLIST*     next;                   // page being fetched
+    int         ecode;
+    TCLIST*     page;                   // page being consumed
+    int         index;
+} _cursor;
+
+static void* _cursor_fetch(void* data) {
+
+    // arguments
+    _cursor* cur = data;
+    TCLIST*  args = tclistdup(cur->args);
+    char     limit[64];
+    int      limitsz = snprintf(limit, sizeof(limit), "setlimit%c%d%c%d", 0, cur->requested, 0, cur->offset);
+    tclistpush(args, limit, limitsz);
+
+    // search
+    cur->next = tcrdbmisc(cur->db, "search", RDBMONOULOG, args);
+    cur->ecode = cur->next ? TTESUCCESS : tcrdbecode(cur->db);
+    tclistdel(args);
+    return NULL;
+}
+
+static void _cursor_start(_cursor* cur, int prefetch) {
+    cur->requested = cur->remaining < 0 || cur->remaining > cur->pagesize ? cur->pagesize : cur->remaining;
+    cur->running = prefetch && pthread_create(&cur->thread, NULL, _cursor_fetch, cur) == 0;
+    if (!cur->running) {
+        _cursor_fetch(cur);
+    }
+}
+
+static void _cursor_wait(_cursor* cur) {
+    if (cur->running) {
+        pthread_join(cur->thread, NULL);
+        cur->running = 0;
+    }
+}
+
+/*
+ * Wait for the page fetches of all cursors of a database object and read back
+ * what its read-ahead iterator left in flight (before it gets closed).
+ */
+static void _handle_quiesce(_handle* handle) {
+    _cursor* cur;
+    for (cur = handle->cursors; cur; cur = cur->link) {
+        _cursor_wait(cur);
+    }
+    if (handle->iterator) {
+        _iterator_settle(handle->iterator);
+    }
+}
+
+static int _cursor_gc(lua_State* L) {
+    _cursor* cur = lua_touserdata(L, 1);
+    _cursor_wait(cur);
+    if (cur->handle) {
+        _cursor** link = &cur->handle->cursors;
+        while (*link && *link != cur) {
+            link = &(*link)->link;
+        }
+        if (*link) {
+            *link = cur->link;
+        }
+        cur->handle = NULL;
+    }
+    if (cur->next) {
+        tclistdel(cur->next);
+        cur->next = NULL;
+    }
+    if (cur->page) {
+        tclistdel(cur->page);
+        cur->page = NULL;
+    }
+    if (cur->args) {
+        tclistdel(cur->args);
+        cur->args = NULL;
+    }
+    return 0;
+}
+
+static int _luaF_query_cursor_iterator(lua_State* L) {
+
+    // extract
+    _cursor* cur = lua_touserdata(L, lua_upvalueindex(1));
+    int prefetch = lua_toboolean(L, lua_upvalueindex(2));
+
+    // next page
+    if (!cur->page || cur->index >= tclistnum(cur->page)) {
+        if (cur->done) {
+            lua_pushnil(L);
+            return 1;
+        }
+        if (!cur->handle->db) {
+            cur->done = 1;
+            return luaL_error(L, "Attempt to use a «ttyrant.query» of a closed «ttyrant.table» instance!");
+        }
+        _cursor_wait(cur);
+        if (cur->page) {
+            tclistdel(cur->page);
+        }
+        cur->page = cur->next;
+        cur->next = NULL;
+        cur->index = 0;
+        if (!cur->page) {
+            cur->done = 1;
+            return luaL_error(L, tcrdberrmsg(cur->ecode));
+        }
+
+        // advance
+        int count = tclistnum(cur->page);
+        cur->offset += count;
+        if (cur->remaining > 0) {
+            cur->remaining -= count;
+        }
+        if (count < cur->requested || cur->remaining == 0) {
+            cur->done = 1;
+        } else {
+            _cursor_start(cur, prefetch);
+        }
+        if (count == 0) {
+            lua_pushnil(L);
+            return 1;
+        }
+    }
+
+    // tuple
+    int itemsz;
+    const char* item = tclistval(cur->page, cur->index++, &itemsz);
+    return _row2luatable(L, item, itemsz);
+}
+
+static int luaF_query_cursor(lua_State* L) {
+
+    // instance
+    RDBQRY* qry = _self_qry(L);
+    _query* query = lua_touserdata(L, 1);
+
+    // options
+    int pagesize = 1000;
+    int prefetch = 1;
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "pagesize");
+        lua_getfield(L, 2, "prefetch");
+        pagesize = luaL_optint(L, -2, pagesize);
+        prefetch = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_pop(L, 2);
+    }
+    if (pagesize < 1) {
+        pagesize = 1;
+    }
+
+    // state
+    _cursor* cur = lua_newuserdata(L, sizeof(_cursor));
+    memset(cur, 0, sizeof(_cursor));
+    cur->db = qry->rdb;
+    cur->handle = query->handle;
+    cur->link = query->handle->cursors;
+    query->handle->cursors = cur;
+    cur->pagesize = pagesize;
+    cur->remaining = -1;
+    cur->args = tclistnew();
+    luaL_getmetatable(L, "ttyrant.cursor");
+    lua_setmetatable(L, -2);
+    lua_createtable(L, 1, 0);           // keeps the query (and connection) alive for the collector
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
+
+    // arguments (the limit set on the query bounds the whole walk)
+    int index, argsz;
+    for (index = 0; index < tclistnum(qry->args); index++) {
+        const char* arg = tclistval(qry->args, index, &argsz);
+        if (argsz > 9 && !memcmp(arg, "setlimit", 9)) {
+            cur->remaining = atoi(arg + 9);
+            cur->offset = atoi(arg + 10 + strlen(arg + 9));
+        } else {
+            tclistpush(cur->args, arg, argsz);
+        }
+    }
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "columns");
+        _query_get(L, -1, cur->args);
+        lua_pop(L, 1);
+    } else {
+        tclistpush(cur->args, "get", 3);
+    }
+    if (cur->remaining < -1) {
+        cur->remaining = -1;
+    }
+    if (cur->offset < 0) {
+        cur->offset = 0;
+    }
+
+    // first page
+    if (cur->remaining == 0) {
+        cur->done = 1;
+    } else {
+        _cursor_start(cur, prefetch);
+    }
+
+    // iterator
+    lua_pushboolean(L, prefetch);
+    lua_pushvalue(L, 1);                // keeps the connection open
+    lua_pushcclosure(L, _luaF_query_cursor_iterator, 3);
+    return 1;
+}
+
+/*
+ * Count the tuples which correspond to the query object.
+ *
+ * <table> = ttyrant.query:searchcount()
+ */
+static int luaF_query_searchcount(lua_State* L) {
+    RDBQRY* qry = _self_qry(L);
+    lua_pushinteger(L, tcrdbqrysearchcount(qry));
+    return 1;
+}
+
+/*
+ * Return the query hint string.
+ *
+ * <string> = ttyrant.query:hint()
+ */
+static int luaF_query_hint(lua_State* L) {
+    RDBQRY* qry = _self_qry(L);
+
+    // execute
+    lua_pushstring(L, tcrdbqryhint(qry));
+
+    // ready
+    return 1;
+}
+
+/*
+ * Collect the query objects listed in the first table argument (which may also
+ * follow the ttyrant.query class itself, if called with ':') into an array of
+ * RDBQRY pointers (a userdata left on the stack, so it is garbage collected).
+ * Returns the stack index of the table argument.
+ */
+static int _query_list(lua_State* L, RDBQRY*** qrys, int* num) {
+
+    // arguments
+    int index = 1;
+    if (lua_istable(L, 1) && lua_istable(L, 2)) {
+        lua_rawgeti(L, 1, 1);
+        index = lua_isnil(L, -1) ? 2 : 1;
+        lua_pop(L, 1);
+    }
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    // queries
+    *num = lua_objlen(L, index);
+    if (*num < 1) {
+        luaL_error(L, "Invalid list of queries, expected at least one «ttyrant.query» instance!");
+    }
+    *qrys = lua_newuserdata(L, *num * sizeof(RDBQRY*));
+    int item;
+    for (item = 0; item < *num; item++) {
+        lua_rawgeti(L, index, item + 1);
+        _query* query = NULL;
+        if (lua_type(L, -1) == LUA_TUSERDATA && lua_getmetatable(L, -1)) {
+            if (lua_rawequal(L, -1, UPV_QUERY)) {
+                query = lua_touserdata(L, -2);
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+        if (!query || !query->qry) {
+            luaL_error(L, "Invalid list of queries, expected only «ttyrant.query» instances!");
+        }
+        _query_check(L, query);
+        (*qrys)[item] = query->qry;
+    }
+
+    // ready
+    return index;
+}
+
+/*
+ * Push the results of a searchget-like operation (given as a list of serialized
+ * rows) as an ordered list of keys and a table of tuples indexed by key.
+ */
+static int _rows2luatables(lua_State* L, TCLIST* rows) {
+
+    // initialize
+    int count = tclistnum(rows);
+    int index, rowsz;
+    lua_createtable(L, count, 0);
+    lua_createtable(L, 0, count);
+
+    // traverse
+    for (index = 0; index < count; index++) {
+        const char* row = tclistval(rows, index, &rowsz);
+        _row2luatable(L, row, rowsz);
+        lua_pushvalue(L, -2);
+        lua_rawseti(L, -5, index + 1);
+        lua_settable(L, -3);
+    }
+
+    // ready
+    return 2;
+}
+
+/*
+ * Run several queries (usually on different servers) in parallel and merge their
+ * results. The merged tuples are ordered and limited as set on the first query.
+ *
+ * <keys>, <tuples> = ttyrant.query.parasearch{ query1, query2, ... }
+ */
+static int luaF_query_parasearch(lua_State* L) {
+
+    // queries
+    RDBQRY** qrys;
+    int num;
+    _query_list(L, &qrys, &num);
+
+    // execute
+    TCLIST* rows = tcrdbparasearch(qrys, num);
+
+    // results
+    _rows2luatables(L, rows);
+    tclistdel(rows);
+
+    // ready
+    return 2;
+}
+
+/*
+ * Assemble the arguments of a 'metasearch' command combining the given queries
+ * with the given set operation (just like tcrdbmetasearch() does).
+ */
+static TCLIST* _metasearch_args(RDBQRY** qrys, int num, int type) {
+
+    // initialize
+    TCLIST* args = tclistnew();
+    int     index, item, argsz;
+
+    // queries
+    for (index = 0; index < num; index++) {
+        for (item = 0; item < tclistnum(qrys[index]->args); item++) {
+            const char* arg = tclistval(qrys[index]->args, item, &argsz);
+            tclistpush(args, arg, argsz);
+        }
+        if (index < num - 1) {
+            tclistpush(args, "next", 4);
+        }
+    }
+
+    // operation
+    char mstype[32];
+    tclistpush(args, mstype, snprintf(mstype, sizeof(mstype), "mstype%c%d", 0, type));
+
+    // ready
+    return args;
+}
+
+/*
+ * Extract the set operation for a meta search from the given stack position.
+ */
+static int _metasearch_type(lua_State* L, int index) {
+
+    // nominal indicator table
+    static const char* const type_names[] = {
+        "UNION",
+        "ISECT",
+        "DIFF",
+        NULL
+    };
+
+    // scalar indicator table
+    static const int type_values[] = {
+        RDBMSUNION,
+        RDBMSISECT,
+        RDBMSDIFF,
+        0
+    };
+
+    // extract indicator (case-insensitive, "RDBMS" prefix optional)
+    char type[16] = "UNION";
+    if (!lua_isnoneornil(L, index)) {
+        const char* name = luaL_checkstring(L, index);
+        int length = 0;
+        for (; name[length] && length < (int)sizeof(type) - 1; length++) {
+            type[length] = toupper(name[length]);
+        }
+        type[length] = 0;
+    }
+    const char* method = strstr(type, "RDBMS") == type ? type + 5 : type;
+
+    // extract operation
+    lua_pushstring(L, method);
+    int operation = luaL_checkoption(L, -1, NULL, type_names);
+    lua_pop(L, 1);
+
+    // ready
+    return type_values[operation];
+}
+
+/*
+ * Combine the results of several queries (on the same server) with a set operation
+ * performed by the server, so only the final result gets transferred.
+ *
+ * <table> = ttyrant.query.metasearch({ query1, query2, ... }[, "UNION" | "ISECT" | "DIFF"])
+ */
+static int luaF_query_metasearch(lua_State* L) {
+
+    // queries
+    RDBQRY** qrys;
+    int num;
+    int index = _query_list(L, &qrys, &num);
+
+    // execute
+    TCLIST* keys = tcrdbmetasearch(qrys, num, _metasearch_type(L, index + 1));
+
+    // results
+    _tclist2luatable(L, keys, 0);
+    tclistdel(keys);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Get the tuples resulting from a meta search, optionally limited to the given
+ * columns (like <query>:searchget()).
+ *
+ * <keys>, <tuples> = ttyrant.query.metasearchget({ query1, query2, ... }[, type[, { column1, ... }]])
+ */
+static int luaF_query_metasearchget(lua_State* L) {
+
+    // queries
+    RDBQRY** qrys;
+    int num;
+    int index = _query_list(L, &qrys, &num);
+    TCRDB* db = qrys[0]->rdb;
+
+    // execute
+    TCLIST* args = _metasearch_args(qrys, num, _metasearch_type(L, index + 1));
+    _query_get(L, index + 2, args);
+    TCLIST* rows = tcrdbmisc(db, "metasearch", RDBMONOULOG, args);
+    tclistdel(args);
+    if (!rows) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+
+    // results
+    _rows2luatables(L, rows);
+    tclistdel(rows);
+
+    // ready
+    return 2;
+}
+
+/*
+ * Count the tuples resulting from a meta search (the keys are counted on the C
+ * side so no Lua strings get created for them).
+ *
+ * <number> = ttyrant.query.metasearchcount({ query1, query2, ... }[, type])
+ */
+static int luaF_query_metasearchcount(lua_State* L) {
+
+    // queries
+    RDBQRY** qrys;
+    int num;
+    int index = _query_list(L, &qrys, &num);
+
+    // execute
+    TCLIST* keys = tcrdbmetasearch(qrys, num, _metasearch_type(L, index + 1));
+
+    // result
+    lua_pushinteger(L, tclistnum(keys));
+    tclistdel(keys);
+
+    // ready
+    return 1;
+}
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Open (i.e. attach to) a process-wide connection pool. Every Lua state that opens
+ * the same server gets the same pool; options only matter for the first opener.
+ *
+ * <object> = ttyrant.pool:open('localhost', 1978[, options])
+ * <object> = ttyrant.pool:open('localhost:1978'[, options])
+ *
+ * options = { size = 8, warm = 1, idle = 0, wait = 10 }    -- idle, wait in seconds
+ */
+static int luaF_pool_open(lua_State* L) {
+
+    // instance
+    if (!lua_istable(L, 1)) {
+        return luaL_error(L, "Invalid «self» for ttyrant.pool:open(), expected «ttyrant.pool»!");
+    }
+
+    // server
+    int options = 3;
+    if (lua_type(L, 3) == LUA_TNUMBER) {
+        lua_pushfstring(L, "%s:%d", luaL_checkstring(L, 2), (int)lua_tointeger(L, 3));
+        options = 4;
+    } else {
+        lua_pushstring(L, luaL_checkstring(L, 2));
+    }
+    const char* expr = lua_tostring(L, -1);
+
+    // options
+    int    size = 8;
+    int    warm = 1;
+    double idle = 0;
+    double wait = 10;
+    if (lua_istable(L, options)) {
+        lua_getfield(L, options, "size");
+        lua_getfield(L, options, "warm");
+        lua_getfield(L, options, "idle");
+        lua_getfield(L, options, "wait");
+        size = luaL_optint(L, -4, size);
+        warm = luaL_optint(L, -3, warm);
+        idle = luaL_optnumber(L, -2, idle);
+        wait = luaL_optnumber(L, -1, wait);
+        lua_pop(L, 4);
+    }
+    if (size < 1) {
+        return luaL_error(L, "Invalid pool size for ttyrant.pool:open(), expected at least 1!");
+    }
+
+    // pool
+    _pool* pool = _pool_acquire(expr, size, warm, idle, wait);
+    if (!pool) {
+        _failure(L, tcrdberrmsg(TTEREFUSED));
+    }
+
+    // metatable
+    lua_newtable(L);
+    lua_pushvalue(L, 1);
+    lua_setfield(L, 1, "__index");      // self.__index = self
+    lua_pushvalue(L, 1);
+    lua_setmetatable(L, -2);            // setmetatable(instance, self)
+    lua_pushlightuserdata(L, pool);
+    lua_setfield(L, -2, "__pool");      // instance.__pool = <userdata>
+
+    // ready
+    return 1;
+}
+
+/*
+ * Borrow a connection from the pool as an instance of the given class (which
+ * defaults to ttyrant.hash). Calling close() on it gives it back to the pool.
+ *
+ * <object> = <pool>:checkout([ttyrant.hash | ttyrant.table])
+ */
+static int luaF_pool_checkout(lua_State* L) {
+
+    // initialize
+    _pool* pool = _self_pool(L);
+    lua_settop(L, 2);
+    if (lua_isnil(L, 2)) {
+        lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+        lua_getfield(L, -1, "ttyrant.hash");
+        lua_replace(L, 2);
+        lua_pop(L, 1);
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    // class
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    lua_getfield(L, -1, "ttyrant.table");
+    int table = lua_rawequal(L, 2, -1);
+    lua_pop(L, 2);
+
+    // borrow
+    _pool_slot* slot = _pool_checkout(pool);
+    if (!slot) {
+        _failure(L, "connection pool exhausted or server unreachable");
+    }
+
+    // instance
+    _handle* handle = _handle_push(L, slot->db, table);
+    handle->slot = slot;
+
+    // ready
+    return 1;
+}
+
+/*
+ * Give a borrowed connection back to the pool (same as <any>:close()).
+ *
+ * <boolean> = <pool>:checkin(<any>)
+ */
+static int luaF_pool_checkin(lua_State* L) {
+    _pool* pool = _self_pool(L);
+    _handle* handle = _handle_test(L, 2, 1, 1);
+    if (!handle) {
+        luaL_error(L, "Invalid «ttyrant» instance for ttyrant.pool:checkin()!");
+    }
+    if (handle->slot && handle->slot->pool != pool) {
+        luaL_error(L, "Attempt to check in a connection of another «ttyrant.pool»!");
+    }
+    lua_pushboolean(L, handle->slot && _handle_release(handle));
+    return 1;
+}
+
+/*
+ * Get pool statistics (times are in seconds, utilization is the fraction of
+ * the pool capacity spent checked out since the pool was created).
+ *
+ * <table> = <pool>:stats()
+ */
+static int luaF_pool_stats(lua_State* L) {
+
+    // extract
+    _pool* pool = _self_pool(L);
+    uint64_t now = _usec();
+    uint64_t busytime = pool->busytime;
+    int busy = 0;
+    int index;
+    for (index = 0; index < pool->size; index++) {
+        if (pool->slots[index].state == SLOT_BUSY) {
+            busy++;
+            busytime += now - pool->slots[index].since;
+        }
+    }
+
+    // assemble
+    lua_createtable(L, 0, 12);
+    lua_pushstring(L, pool->expr);
+    lua_setfield(L, -2, "server");
+    lua_pushinteger(L, pool->size);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, pool->connected);
+    lua_setfield(L, -2, "connected");
+    lua_pushinteger(L, busy);
+    lua_setfield(L, -2, "busy");
+    lua_pushnumber(L, pool->checkouts);
+    lua_setfield(L, -2, "checkouts");
+    lua_pushnumber(L, pool->waits);
+    lua_setfield(L, -2, "waits");
+    lua_pushnumber(L, pool->timeouts);
+    lua_setfield(L, -2, "timeouts");
+    lua_pushnumber(L, pool->evictions);
+    lua_setfield(L, -2, "evictions");
+    lua_pushnumber(L, pool->waittime / 1e6);
+    lua_setfield(L, -2, "waittime");
+    lua_pushnumber(L, pool->waitmax / 1e6);
+    lua_setfield(L, -2, "waitmax");
+    lua_pushnumber(L, pool->waits ? pool->waittime / 1e6 / pool->waits : 0);
+    lua_setfield(L, -2, "waitavg");
+    lua_pushnumber(L, now > pool->created ? (double)busytime / ((now - pool->created) * (double)pool->size) : 0);
+    lua_setfield(L, -2, "utilization");
+
+    // ready
+    return 1;
+}
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Clusters: keys spread over several hash databases by consistent hashing.
+ *
+ * Every node is placed on a ring of 32-bit hash values at a number of virtual
+ * points (derived from its name) and a key belongs to the node owning the first
+ * point following the key hash, so adding a node only remaps about 1/N keys.
+ */
+typedef struct {
+    uint32_t    point;
+    int         node;
+} _cluster_point;
+
+typedef struct {
+    int             vnodes;
+    int             nodes;
+    _handle**       handles;            // kept alive by the instance (__nodes)
+    char**          names;
+    int             points;
+    _cluster_point* ring;
+} _cluster;
+
+/*
+ * Hash a buffer onto the ring (FNV-1a followed by the murmur3 finalizer).
+ */
+static uint32_t _cluster_hash(const void* buffer, int size) {
+    const unsigned char* byte = buffer;
+    uint32_t hash = 2166136261u;
+    for (; size > 0; size--) {
+        hash = (hash ^ *byte++) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static int _cluster_cmp(const void* a, const void* b) {
+    const _cluster_point* pa = a;
+    const _cluster_point* pb = b;
+    return pa->point < pb->point ? -1 : pa->point > pb->point ? 1 : pa->node - pb->node;
+}
+
+/*
+ * Insert a node (with the given name) and rebuild the ring.
+ */
+static void _cluster_add(_cluster* cl, _handle* handle, const char* name) {
+
+    // node
+    cl->handles = realloc(cl->handles, (cl->nodes + 1) * sizeof(_handle*));
+    cl->names = realloc(cl->names, (cl->nodes + 1) * sizeof(char*));
+    cl->handles[cl->nodes] = handle;
+    cl->names[cl->nodes] = strdup(name);
+    cl->nodes++;
+
+    // points
+    cl->ring = realloc(cl->ring, (cl->points + cl->vnodes) * sizeof(_cluster_point));
+    char vnode[512];
+    int index;
+    for (index = 0; index < cl->vnodes; index++) {
+        int vnodesz = snprintf(vnode, sizeof(vnode), "%s-%d", name, index);
+        cl->ring[cl->points].point = _cluster_hash(vnode, vnodesz < (int)sizeof(vnode) ? vnodesz : (int)sizeof(vnode) - 1);
+        cl->ring[cl->points].node = cl->nodes - 1;
+        cl->points++;
+    }
+    qsort(cl->ring, cl->points, sizeof(_cluster_point), _cluster_cmp);
+}
+
+/*
+ * Find the node owning the given key.
+ */
+static int _cluster_node(_cluster* cl, const void* key, int keysz) {
+    uint32_t hash = _cluster_hash(key, keysz);
+    int low = 0;
+    int high = cl->points;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (cl->ring[middle].point < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return cl->ring[low < cl->points ? low : 0].node;
+}
+
+static int _cluster_gc(lua_State* L) {
+    _cluster* cl = lua_touserdata(L, 1);
+    int index;
+    for (index = 0; index < cl->nodes; index++) {
+        free(cl->names[index]);
+    }
+    free(cl->names);
+    free(cl->handles);
+    free(cl->ring);
+    cl->names = NULL;
+    cl->handles = NULL;
+    cl->ring = NULL;
+    cl->nodes = 0;
+    cl->points = 0;
+    return 0;
+}
+
+/*
+ * Make sure all nodes are still open (reading back what read-ahead iterators
+ * left in flight on them).
+ */
+static void _cluster_check(lua_State* L, _cluster* cl) {
+    int node;
+    for (node = 0; node < cl->nodes; node++) {
+        _handle* handle = cl->handles[node];
+        if (!handle->db) {
+            luaL_error(L, "Attempt to use a closed node «%s» of «ttyrant.cluster»!", cl->names[node]);
+        }
+        if (handle->iterator) {
+            _iterator_settle(handle->iterator);
+        }
+    }
+}
+
+/*
+ * Split the given TCLIST object (of keys or of key-value pairs if 'pairs' is 1)
+ * into one TCLIST object per node (NULL for nodes without items).
+ */
+static TCLIST** _cluster_split(_cluster* cl, TCLIST* items, int pairs) {
+    TCLIST** shards = calloc(cl->nodes, sizeof(TCLIST*));
+    int step = pairs ? 2 : 1;
+    int index, keysz, valuesz;
+    for (index = 0; index + step <= tclistnum(items); index += step) {
+        const char* key = tclistval(items, index, &keysz);
+        int node = _cluster_node(cl, key, keysz);
+        if (!shards[node]) {
+            shards[node] = tclistnew();
+        }
+        tclistpush(shards[node], key, keysz);
+        if (pairs) {
+            const char* value = tclistval(items, index + 1, &valuesz);
+            tclistpush(shards[node], value, valuesz);
+        }
+    }
+    return shards;
+}
+
+/*
+ * Bring the caches and filters of the nodes in line with the given shards of
+ * written key-value pairs ('pairs' is 1) or erased keys, as put() and out() of
+ * the node objects themselves do.
+ */
+static void _cluster_written(_cluster* cl, TCLIST** shards, int pairs) {
+    int node;
+    for (node = 0; node < cl->nodes; node++) {
+        _handle* handle = cl->handles[node];
+        if (!shards[node]) {
+            continue;
+        }
+        if (handle->cache) {
+            _cache_out_list(handle->cache, shards[node], pairs ? 2 : 1);
+        }
+        if (pairs && handle->filter) {
+            _filter_add_list(handle->filter, shards[node], 2);
+        }
+    }
+}
+
+/*
+ * Send the given 'misc' command to all nodes having items at once, then collect
+ * all responses (appending the resulting items to 'result' if not NULL). The
+ * shard lists are consumed. Returns the error code of the first failure.
+ *
+ * Note: the nodes must have been checked with _cluster_check() and each node
+ *       object appears once (add() refuses duplicates), so every connection
+ *       mutex is locked at most once.
+ */
+static int _cluster_misc(_cluster* cl, const char* name, TCLIST** shards, TCLIST* result) {
+
+    // initialize
+    int     ecode = TTESUCCESS;
+    int*    sent = calloc(cl->nodes, sizeof(int));
+    TCXSTR* packets = tcxstrnew();
+    int     node, index, itemsz;
+
+    // send to all nodes (locked in node order)
+    for (node = 0; node < cl->nodes; node++) {
+        if (!shards[node]) {
+            continue;
+        }
+        tcxstrclear(packets);
+        _tt_misc(packets, name, 0, tclistnum(shards[node]));
+        for (index = 0; index < tclistnum(shards[node]); index++) {
+            const char* item = tclistval(shards[node], index, &itemsz);
+            _tt_misc_arg(packets, item, itemsz);
+        }
+        tclistdel(shards[node]);
+        shards[node] = NULL;
+        TCRDB* db = cl->handles[node]->db;
+        pthread_mutex_lock(&db->mmtx);
+        sent[node] = _tt_send(db, packets) ? 1 : -1;
+        if (sent[node] < 0 && ecode == TTESUCCESS) {
+            ecode = TTESEND;
+        }
+    }
+
+    // collect responses
+    for (node = 0; node < cl->nodes; node++) {
+        if (!sent[node]) {
+            continue;
+        }
+        TCRDB* db = cl->handles[node]->db;
+        if (sent[node] > 0) {
+            int status = _tt_recv_misc(db, result);
+            if (status < 1 && ecode == TTESUCCESS) {
+                ecode = status < 0 ? TTERECV : TTEMISC;
+            }
+        }
+        pthread_mutex_unlock(&db->mmtx);
+    }
+
+    // done
+    tcxstrdel(packets);
+    free(sent);
+    free(shards);
+    return ecode;
+}
+
+/*
+ * Create a cluster over the given hash database objects, each one named either
+ * by its key in the given table or by its "host:port" otherwise (names define
+ * the placement on the ring, so keep them stable).
+ *
+ * <object> = ttyrant.cluster:new({ <hash>, <hash>, name = <hash>, ... }[, { vnodes = 160 }])
+ */
+static int luaF_cluster_new(lua_State* L) {
+
+    // instance
+    if (!lua_istable(L, 1)) {
+        return luaL_error(L, "Invalid «self» for ttyrant.cluster:new(), expected «ttyrant.cluster»!");
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    // options
+    int vnodes = 160;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "vnodes");
+        vnodes = luaL_optint(L, -1, vnodes);
+        lua_pop(L, 1);
+    }
+    lua_settop(L, 2);
+
+    // instance
+    lua_newtable(L);
+    lua_pushvalue(L, 1);
+    lua_setfield(L, 1, "__index");      // self.__index = self
+    lua_pushvalue(L, 1);
+    lua_setmetatable(L, 3);             // setmetatable(instance, self)
+
+    // ring
+    _cluster* cl = lua_newuserdata(L, sizeof(_cluster));
+    memset(cl, 0, sizeof(_cluster));
+    cl->vnodes = vnodes < 1 ? 1 : vnodes;
+    luaL_getmetatable(L, "ttyrant.cluster.ring");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, 3, "__cluster");    // instance.__cluster = <userdata>
+    lua_newtable(L);
+    lua_setfield(L, 3, "__nodes");      // instance.__nodes = {}
+
+    // nodes
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+        lua_getfield(L, 3, "add");
+        lua_pushvalue(L, 3);
+        lua_pushvalue(L, 5);            // node object
+        if (lua_type(L, 4) == LUA_TSTRING) {
+            lua_pushvalue(L, 4);        // node name
+        } else {
+            lua_pushnil(L);
+        }
+        lua_call(L, 3, 0);
+        lua_pop(L, 1);
+    }
+
+    // ready
+    return 1;
+}
+
+/*
+ * Add a hash database object to the cluster (about 1/N of the keys move to it).
+ *
+ * <boolean> = <cluster>:add(<hash>[, name])
+ */
+static int luaF_cluster_add(lua_State* L) {
+
+    // extract
+    _cluster* cl = _self_cluster(L);
+    if (!_handle_test(L, 2, 1, 0)) {
+        luaL_error(L, "Invalid «ttyrant.hash» instance for ttyrant.cluster:add()!");
+    }
+    TCRDB* db = _self_db(L, 2, 1, 0, "ttyrant.hash");
+    _handle* handle = lua_touserdata(L, 2);
+
+    // name
+    if (lua_isnoneornil(L, 3)) {
+        lua_settop(L, 2);
+        lua_pushfstring(L, "%s:%d", db->host ? db->host : "", db->port);
+    }
+    const char* name = luaL_checkstring(L, 3);
+    int index;
+    for (index = 0; index < cl->nodes; index++) {
+        if (!strcmp(cl->names[index], name)) {
+            return luaL_error(L, "Duplicate node name «%s» in ttyrant.cluster!", name);
+        }
+        if (cl->handles[index] == handle) {
+            return luaL_error(L, "Duplicate node object in ttyrant.cluster (already named «%s»)!", cl->names[index]);
+        }
+    }
+
+    // keep the node object alive
+    lua_getfield(L, 1, "__nodes");
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, cl->nodes + 1);
+    lua_pop(L, 1);
+
+    // place
+    _cluster_add(cl, handle, name);
+
+    // ready
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get the hash database object (and its name) owning the given key.
+ *
+ * <hash>, <name> = <cluster>:node(key)
+ */
+static int luaF_cluster_node(lua_State* L) {
+    _cluster* cl = _self_cluster(L);
+    size_t keysz;
+    const char* key = luaL_checklstring(L, 2, &keysz);
+    if (!cl->nodes) {
+        _failure(L, tcrdberrmsg(TTENOHOST));
+    }
+    int node = _cluster_node(cl, key, keysz);
+    lua_getfield(L, 1, "__nodes");
+    lua_rawgeti(L, -1, node + 1);
+    lua_pushstring(L, cl->names[node]);
+    return 2;
+}
+
+/*
+ * Store value(s) at given key(s), sending one 'putlist' per node (all at once).
+ *
+ * <boolean> = <cluster>:put(key1, value1, key2, value2, ...)
+ * <boolean> = <cluster>:put{ key1 = value1, key2 = value2, ... }
+ */
+static int luaF_cluster_put(lua_State* L) {
+
+    // initialize
+    _cluster* cl = _self_cluster(L);
+    if (!cl->nodes) {
+        _failure(L, tcrdberrmsg(TTENOHOST));
+    }
+    _cluster_check(L, cl);
+    TCLIST* items = lua_istable(L, 2) ? _luatable2tclist(L, 2, 1) : _lualist2tclist(L, 2);
+
+    // execute
+    TCLIST** shards = _cluster_split(cl, items, 1);
+    _cluster_written(cl, shards, 1);
+    int ecode = _cluster_misc(cl, "putlist", shards, NULL);
+    if (ecode != TTESUCCESS) {
+        _failure(L, tcrdberrmsg(ecode));
+    }
+
+    // ready
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get value(s) at key(s), sending one 'getlist' per node (all at once).
+ *
+ * <value> = <cluster>:get(key)
+ * <table> = <cluster>:get(key1, key2, ...)
+ * <table> = <cluster>:get{key1, key2, ...}
+ */
+static int luaF_cluster_get(lua_State* L) {
+
+    // initialize
+    _cluster* cl = _self_cluster(L);
+    if (!cl->nodes) {
+        _failure(L, tcrdberrmsg(TTENOHOST));
+    }
+    _cluster_check(L, cl);
+
+    // single key
+    if (!lua_istable(L, 2) && lua_gettop(L) == 2) {
+        size_t keysz;
+        int valuesz;
+        const char* key = luaL_checklstring(L, 2, &keysz);
+        TCRDB* db = cl->handles[_cluster_node(cl, key, keysz)]->db;
+        char* value = tcrdbget(db, key, keysz, &valuesz);
+        if (!value) {
+            _failure(L, tcrdberrmsg(tcrdbecode(db)));
+        }
+        lua_pushlstring(L, value, valuesz);
+        free(value);
+        return 1;
+    }
+
+    // execute
+    TCLIST* keys = lua_istable(L, 2) ? _luatable2tclist(L, 2, 0) : _lualist2tclist(L, 2);
+    TCLIST* items = tclistnew();
+    int ecode = _cluster_misc(cl, "getlist", _cluster_split(cl, keys, 0), items);
+    if (ecode != TTESUCCESS) {
+        tclistdel(items);
+        _failure(L, tcrdberrmsg(ecode));
+    }
+
+    // result
+    _tclist2luatable(L, items, 1);
+    tclistdel(items);
+    return 1;
+}
 
-    // nominal indicator table
-    static const char* const type_names[] = {
-        "LEXICAL",
-        "DECIMAL",
-        "TOKEN",
-        "QGRAM",
-        "OPT",
-        "VOID",
-        NULL
-    };
+/*
+ * Erase key(s), sending one 'outlist' per node (all at once).
+ *
+ * <boolean> = <cluster>:out(key1, key2, ...)
+ * <boolean> = <cluster>:out{key1, key2, ...}
+ */
+static int luaF_cluster_out(lua_State* L) {
+
+    // initialize
+    _cluster* cl = _self_cluster(L);
+    if (!cl->nodes) {
+        _failure(L, tcrdberrmsg(TTENOHOST));
+    }
+    _cluster_check(L, cl);
+    TCLIST* keys = lua_istable(L, 2) ? _luatable2tclist(L, 2, 0) : _lualist2tclist(L, 2);
+
+    // execute
+    TCLIST** shards = _cluster_split(cl, keys, 0);
+    _cluster_written(cl, shards, 0);
+    int ecode = _cluster_misc(cl, "outlist", shards, NULL);
+    if (ecode != TTESUCCESS) {
+        _failure(L, tcrdberrmsg(ecode));
+    }
+
+    // ready
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Replica sets: a master and its slaves (database objects of the same kind),
+ * with writes sent to the master and reads spread over the slaves.
+ *
+ * A read goes to the better (by latency EWMA) of two slaves picked at random,
+ * so most reads hit the fastest slave while the others keep being sampled.
+ * Slaves are skipped while their replication delay (the 'delay' field of
+ * <any>:stat(), refreshed every 'interval' seconds on the read path) exceeds
+ * 'maxdelay' or cannot be read (or once they are closed); reads go to the master
+ * when no slave is left.
+ */
+typedef struct {
+    _handle*    handle;                 // kept alive by the '__nodes' table
+    char*       name;                   // "host:port" (as opened)
+    double      ewma;                   // seconds (0 = not measured yet)
+    double      delay;                  // replication delay in seconds (-1 = unknown)
+    uint64_t    checked;                // time of the last delay check (0 = never)
+    uint64_t    reads;
+} _replica;
+
+typedef struct {
+    int         master;
+    int         count;
+    _replica*   replicas;               // in the order of the '__nodes' objects
+    double      maxdelay;
+    double      alpha;
+    uint64_t    interval;               // microseconds
+    unsigned    seed;
+} _replicaset;
+
+static int _replicaset_gc(lua_State* L) {
+    _replicaset* rs = lua_touserdata(L, 1);
+    int node;
+    for (node = 0; node < rs->count; node++) {
+        free(rs->replicas[node].name);
+    }
+    free(rs->replicas);
+    rs->replicas = NULL;
+    rs->count = 0;
+    return 0;
+}
+
+/*
+ * Push the database object of the given node.
+ */
+static void _replicaset_node(lua_State* L, int node) {
+    lua_getfield(L, 1, "__nodes");
+    lua_rawgeti(L, -1, node + 1);
+    lua_remove(L, -2);
+}
+
+/*
+ * Get the connection of a node for direct use (NULL once closed), settling any
+ * iterator left with responses in flight on it first.
+ */
+static TCRDB* _replicaset_db(_replica* replica) {
+    _handle* handle = replica->handle;
+    if (handle->db && handle->iterator) {
+        _iterator_settle(handle->iterator);
+    }
+    return handle->db;
+}
+
+/*
+ * Read a numeric field of the <any>:stat() table of a node ('missing' if the
+ * field is absent, -1 if the node cannot be reached).
+ */
+static double _replicaset_stat(lua_State* L, int node, const char* field, double missing) {
+    double value = -1;
+    _replicaset_node(L, node);
+    lua_getfield(L, -1, "stat");
+    lua_insert(L, -2);
+    if (lua_pcall(L, 1, 1, 0) == 0 && lua_istable(L, -1)) {
+        lua_getfield(L, -1, field);
+        value = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : missing;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return value;
+}
+
+/*
+ * Choose the node for a read.
+ */
+static int _replicaset_pick(lua_State* L, _replicaset* rs) {
+
+    // usable slaves
+    uint64_t now = _usec();
+    int* usable = malloc(rs->count * sizeof(int));
+    int count = 0;
+    int node;
+    for (node = 0; node < rs->count; node++) {
+        _replica* replica = &rs->replicas[node];
+        if (node == rs->master || !replica->handle->db) {
+            continue;
+        }
+        if (!replica->checked || now - replica->checked >= rs->interval) {
+            replica->delay = _replicaset_stat(L, node, "delay", 0);
+            replica->checked = now;
+        }
+        if (replica->delay >= 0 && replica->delay <= rs->maxdelay) {
+            usable[count++] = node;
+        }
+    }
+
+    // best of two
+    node = rs->master;
+    if (count > 0) {
+        int first = usable[rand_r(&rs->seed) % count];
+        int second = usable[rand_r(&rs->seed) % count];
+        node = rs->replicas[second].ewma < rs->replicas[first].ewma ? second : first;
+    }
+    free(usable);
+    return node;
+}
+
+/*
+ * Call the given method of the master (or of the node chosen for a read)
+ * with the arguments following 'self', returning all its results.
+ */
+static int _replicaset_call(lua_State* L, const char* method, int read) {
+
+    // node
+    _replicaset* rs = _self_replicaset(L);
+    int node = read ? _replicaset_pick(L, rs) : rs->master;
+    int top = lua_gettop(L);
+    int index;
+    _replicaset_node(L, node);
+    lua_getfield(L, -1, method);
+    if (!lua_isfunction(L, -1)) {
+        return luaL_error(L, "Invalid method «%s» for the nodes of ttyrant.replicaset!", method);
+    }
+    lua_insert(L, -2);
+    for (index = 2; index <= top; index++) {
+        lua_pushvalue(L, index);
+    }
+
+    // execute
+    uint64_t start = _usec();
+    lua_call(L, top, LUA_MULTRET);
+    if (read) {
+        _replica* replica = &rs->replicas[node];
+        double elapsed = (_usec() - start) / 1e6;
+        replica->ewma = replica->ewma > 0 ? rs->alpha * elapsed + (1 - rs->alpha) * replica->ewma : elapsed;
+        replica->reads++;
+    }
+
+    // ready
+    return lua_gettop(L) - top;
+}
+
+/*
+ * Create a replica set from a master and its slaves (all hash or all table
+ * database objects, already open).
+ *
+ * <object> = ttyrant.replicaset:new(<master>, { <slave>, <slave>, ... }[, options])
+ *
+ * options = { maxdelay = 1, interval = 1, alpha = 0.2 }    -- maxdelay, interval in seconds
+ */
+static int luaF_replicaset_new(lua_State* L) {
+
+    // instance
+    if (!lua_istable(L, 1)) {
+        return luaL_error(L, "Invalid «self» for ttyrant.replicaset:new(), expected «ttyrant.replicaset»!");
+    }
+    int table = _handle_test(L, 2, 0, 1) != NULL;
+    _self_db(L, 2, 1, 1, "ttyrant or ttyrant.table");
+    luaL_checktype(L, 3, LUA_TTABLE);
+
+    // options
+    double maxdelay = 1;
+    double interval = 1;
+    double alpha = 0.2;
+    if (lua_istable(L, 4)) {
+        lua_getfield(L, 4, "maxdelay");
+        lua_getfield(L, 4, "interval");
+        lua_getfield(L, 4, "alpha");
+        maxdelay = luaL_optnumber(L, -3, maxdelay);
+        interval = luaL_optnumber(L, -2, interval);
+        alpha = luaL_optnumber(L, -1, alpha);
+        lua_pop(L, 3);
+    }
+    if (alpha <= 0 || alpha > 1) {
+        return luaL_error(L, "Invalid EWMA weight for ttyrant.replicaset:new(), expected (0, 1]!");
+    }
+    lua_settop(L, 3);
+
+    // instance
+    lua_newtable(L);
+    lua_pushvalue(L, 1);
+    lua_setfield(L, 1, "__index");      // self.__index = self
+    lua_pushvalue(L, 1);
+    lua_setmetatable(L, 4);             // setmetatable(instance, self)
+
+    // nodes
+    int count = lua_objlen(L, 3) + 1;
+    _replicaset* rs = lua_newuserdata(L, sizeof(_replicaset));
+    memset(rs, 0, sizeof(_replicaset));
+    luaL_getmetatable(L, "ttyrant.replicaset.nodes");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, 4, "__replicaset"); // instance.__replicaset = <userdata>
+    rs->replicas = calloc(count, sizeof(_replica));
+    rs->maxdelay = maxdelay;
+    rs->interval = interval > 0 ? interval * 1000000 : 0;
+    rs->alpha = alpha;
+    rs->seed = (unsigned)_usec();
+    lua_newtable(L);
+    int node;
+    for (node = 0; node < count; node++) {
+        if (node == 0) {
+            lua_pushvalue(L, 2);
+        } else {
+            lua_rawgeti(L, 3, node);
+        }
+        if (!_handle_test(L, -1, !table, table)) {
+            return luaL_error(L, "Invalid node #%d for ttyrant.replicaset:new(), expected «%s»!",
+                              node + 1, table ? "ttyrant.table" : "ttyrant.hash");
+        }
+        TCRDB* db = _self_db(L, lua_gettop(L), 1, 1, "ttyrant or ttyrant.table");
+        lua_pushfstring(L, "%s:%d", db->host ? db->host : "", db->port);
+        rs->replicas[node].handle = lua_touserdata(L, -2);
+        rs->replicas[node].name = strdup(lua_tostring(L, -1));
+        rs->replicas[node].delay = -1;
+        rs->count++;
+        lua_pop(L, 1);
+        lua_rawseti(L, -2, node + 1);
+    }
+    lua_setfield(L, 4, "__nodes");      // instance.__nodes = { <master>, <slave>, ... }
+
+    // ready
+    return 1;
+}
+
+/*
+ * Get the current master (for writes) or the node chosen for a read (e.g. to
+ * run queries on it).
+ *
+ * <any> = <replicaset>:master()
+ * <any> = <replicaset>:reader()
+ */
+static int luaF_replicaset_master(lua_State* L) {
+    _replicaset* rs = _self_replicaset(L);
+    _replicaset_node(L, rs->master);
+    return 1;
+}
+static int luaF_replicaset_reader(lua_State* L) {
+    _replicaset* rs = _self_replicaset(L);
+    _replicaset_node(L, _replicaset_pick(L, rs));
+    return 1;
+}
+
+/*
+ * Reads, sent to one of the slaves (see <hash>:get(), <hash>:getbuffer(),
+ * <hash>:vsiz(), <any>:fwmkeys() and <any>:iterator()).
+ */
+static int luaF_replicaset_get(lua_State* L) {
+    return _replicaset_call(L, "get", 1);
+}
+static int luaF_replicaset_getbuffer(lua_State* L) {
+    return _replicaset_call(L, "getbuffer", 1);
+}
+static int luaF_replicaset_vsiz(lua_State* L) {
+    return _replicaset_call(L, "vsiz", 1);
+}
+static int luaF_replicaset_fwmkeys(lua_State* L) {
+    return _replicaset_call(L, "fwmkeys", 1);
+}
+static int luaF_replicaset_iterator(lua_State* L) {
+    return _replicaset_call(L, "iterator", 1);
+}
+
+/*
+ * Writes, sent to the master (see <hash>:put() and friends, <any>:out() and
+ * <any>:increment()).
+ */
+static int luaF_replicaset_put(lua_State* L) {
+    return _replicaset_call(L, "put", 0);
+}
+static int luaF_replicaset_putkeep(lua_State* L) {
+    return _replicaset_call(L, "putkeep", 0);
+}
+static int luaF_replicaset_putcat(lua_State* L) {
+    return _replicaset_call(L, "putcat", 0);
+}
+static int luaF_replicaset_putshl(lua_State* L) {
+    return _replicaset_call(L, "putshl", 0);
+}
+static int luaF_replicaset_putnr(lua_State* L) {
+    return _replicaset_call(L, "putnr", 0);
+}
+static int luaF_replicaset_out(lua_State* L) {
+    return _replicaset_call(L, "out", 0);
+}
+static int luaF_replicaset_increment(lua_State* L) {
+    return _replicaset_call(L, "increment", 0);
+}
+
+/*
+ * Promote a slave to master, without reopening anything: replication is turned
+ * off on it (tcrdbsetmst() with no master) and the other nodes, the old master
+ * included, are pointed to it starting from their own replication timestamp
+ * (the 'rts' field of <any>:stat()). The address the other nodes replicate
+ * from is 'address' if given, else the one the new master was opened with
+ * (which the servers may not be able to reach, e.g. 'localhost'). Nodes which
+ * cannot be reached or are closed (usually the old master) are reported by
+ * name in the returned table and left as slaves that are skipped until their
+ * replication delay can be read again.
+ *
+ * <boolean>, <table> = <replicaset>:failover(<slave>[, { check = false, address = 'host:port' }])
+ */
+static int luaF_replicaset_failover(lua_State* L) {
+
+    // initialize
+    _replicaset* rs = _self_replicaset(L);
+    char host[256] = "";
+    int port = 0, opts = 0;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "check");
+        lua_getfield(L, 3, "address");
+        opts = lua_toboolean(L, -2) ? RDBROCHKCON : 0;
+        if (!lua_isnil(L, -1)) {
+            _open_address(luaL_checkstring(L, -1), host, sizeof(host), &port);
+        }
+        lua_pop(L, 2);
+    }
+    lua_settop(L, 2);
+
+    // new master
+    int master;
+    for (master = 0; master < rs->count; master++) {
+        _replicaset_node(L, master);
+        int found = lua_rawequal(L, -1, 2);
+        lua_pop(L, 1);
+        if (found) {
+            break;
+        }
+    }
+    if (master == rs->count || master == rs->master) {
+        return luaL_error(L, "Invalid node for ttyrant.replicaset:failover(), expected one of its slaves!");
+    }
+    TCRDB* db = _replicaset_db(&rs->replicas[master]);
+    if (!db) {
+        return luaL_error(L, "Attempt to use a closed node «%s» of «ttyrant.replicaset»!",
+                          rs->replicas[master].name);
+    }
+    if (!port) {
+        snprintf(host, sizeof(host), "%s", db->host ? db->host : "");
+        port = db->port;
+    }
+    if (!tcrdbsetmst(db, NULL, 0, 0, opts)) {
+        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+    }
+    rs->master = master;
+
+    // other nodes
+    lua_pushboolean(L, 1);
+    lua_newtable(L);
+    int node;
+    for (node = 0; node < rs->count; node++) {
+        _replica* replica = &rs->replicas[node];
+        replica->checked = 0;
+        if (node == master) {
+            continue;
+        }
+        if (!replica->handle->db) {
+            lua_pushstring(L, replica->name);
+            lua_pushliteral(L, "closed");
+            lua_rawset(L, -3);
+            continue;
+        }
+        double rts = _replicaset_stat(L, node, "rts", 0);
+        TCRDB* slave = _replicaset_db(replica);
+        if (rts < 0 || !slave || !tcrdbsetmst(slave, host, port, (uint64_t)rts, opts)) {
+            lua_pushstring(L, replica->name);
+            lua_pushstring(L, tcrdberrmsg(rts < 0 || !slave ? TTEREFUSED : tcrdbecode(slave)));
+            lua_rawset(L, -3);
+        }
+    }
+
+    // ready
+    return 2;
+}
+
+/*
+ * Get the state of the nodes (in the order given to new(), the first one being
+ * the master until a failover).
+ *
+ * <table> = <replicaset>:stats()
+ */
+static int luaF_replicaset_stats(lua_State* L) {
+    _replicaset* rs = _self_replicaset(L);
+    lua_createtable(L, rs->count, 0);
+    int node;
+    for (node = 0; node < rs->count; node++) {
+        _replica* replica = &rs->replicas[node];
+        lua_createtable(L, 0, 6);
+        lua_pushstring(L, replica->name);
+        lua_setfield(L, -2, "name");
+        lua_pushboolean(L, node == rs->master);
+        lua_setfield(L, -2, "master");
+        lua_pushboolean(L, !replica->handle->db);
+        lua_setfield(L, -2, "closed");
+        _metrics_set(L, "reads", replica->reads);
+        _metrics_set(L, "ewma", replica->ewma);
+        _metrics_set(L, "delay", replica->delay);
+        lua_rawseti(L, -2, node + 1);
+    }
+    return 1;
+}
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Release the memory held by a buffer.
+ *
+ * <boolean> = <buffer>:free()
+ */
+static int luaF_buffer_free(lua_State* L) {
+    _buffer* buffer = luaL_checkudata(L, 1, "ttyrant.buffer");
+    if (buffer->owner) {
+        if (buffer->kind == BUFFER_TCMAP) {
+            tcmapdel(buffer->owner);
+        } else {
+            free(buffer->owner);
+        }
+    }
+    buffer->owner = NULL;
+    buffer->ptr = NULL;
+    buffer->size = 0;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get the size of a buffer.
+ *
+ * <number> = #<buffer>
+ */
+static int luaF_buffer_len(lua_State* L) {
+    _buffer* buffer = luaL_checkudata(L, 1, "ttyrant.buffer");
+    lua_pushinteger(L, buffer->size);
+    return 1;
+}
+
+/*
+ * Copy (part of) a buffer into a Lua string (indexes behave as in string.sub).
+ *
+ * <string> = <buffer>:tostring()
+ * <string> = <buffer>:sub(i[, j])
+ */
+static int luaF_buffer_tostring(lua_State* L) {
+    _buffer* buffer = luaL_checkudata(L, 1, "ttyrant.buffer");
+    lua_pushlstring(L, buffer->ptr ? buffer->ptr : "", buffer->size);
+    return 1;
+}
+static int luaF_buffer_sub(lua_State* L) {
+    _buffer* buffer = luaL_checkudata(L, 1, "ttyrant.buffer");
+    ptrdiff_t size = buffer->size;
+    ptrdiff_t start = luaL_checkinteger(L, 2);
+    ptrdiff_t end = luaL_optinteger(L, 3, -1);
+    if (start < 0) start += size + 1;
+    if (end < 0) end += size + 1;
+    if (start < 1) start = 1;
+    if (end > size) end = size;
+    if (start <= end) {
+        lua_pushlstring(L, buffer->ptr + start - 1, end - start + 1);
+    } else {
+        lua_pushliteral(L, "");
+    }
+    return 1;
+}
+
+/*
+ * Write the contents of a buffer straight into an (io library) file.
+ *
+ * <boolean> = <buffer>:write(file)
+ */
+static int luaF_buffer_write(lua_State* L) {
+    _buffer* buffer = luaL_checkudata(L, 1, "ttyrant.buffer");
+    FILE** file = luaL_checkudata(L, 2, "FILE*");
+    if (!*file) {
+        return luaL_error(L, "Attempt to use a closed file in «ttyrant.buffer:write()»!");
+    }
+    if (buffer->size && fwrite(buffer->ptr, 1, buffer->size, *file) != buffer->size) {
+        _failure(L, strerror(errno));
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get the address and size of a buffer (e.g. for use with the LuaJIT FFI); the
+ * address is only valid for as long as the buffer is alive.
+ *
+ * <lightuserdata>, <number> = <buffer>:ptr()
+ */
+static int luaF_buffer_ptr(lua_State* L) {
+    _buffer* buffer = luaL_checkudata(L, 1, "ttyrant.buffer");
+    lua_pushlightuserdata(L, (void*)buffer->ptr);
+    lua_pushinteger(L, buffer->size);
+    return 2;
+}
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Extract the fake server at the first position (raising an error if stopped).
+ */
+static ttyrant_fake* _self_fake(lua_State* L) {
+    ttyrant_fake** fake = luaL_checkudata(L, 1, "ttyrant.fake");
+    if (!*fake) {
+        luaL_error(L, "Attempt to use a stopped «ttyrant.fake» instance!");
+    }
+    return *fake;
+}
+
+/*
+ * Start an in-process fake server with an in-memory database, answering the
+ * subset of the Tyrant protocol used by this library after the given delay
+ * (plus up to 'jitter' random seconds). Port 0 picks any free port.
+ *
+ * <fake> = ttyrant.fake:start{ host = '127.0.0.1', port = 0, table = false, delay = 0, jitter = 0 }
+ */
+static int luaF_fake_start(lua_State* L) {
+
+    // options
+    const char* host = "127.0.0.1";
+    int port = 0, table = 0;
+    double delay = 0, jitter = 0;
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "host");
+        lua_getfield(L, 2, "port");
+        lua_getfield(L, 2, "table");
+        lua_getfield(L, 2, "delay");
+        lua_getfield(L, 2, "jitter");
+        host = luaL_optstring(L, -5, host);
+        port = luaL_optint(L, -4, 0);
+        table = lua_toboolean(L, -3);
+        delay = luaL_optnumber(L, -2, 0);
+        jitter = luaL_optnumber(L, -1, 0);
+    }
+
+    // start
+    ttyrant_fake** fake = lua_newuserdata(L, sizeof(ttyrant_fake*));
+    *fake = ttyrant_fake_start(host, port, table, delay, jitter);
+    if (!*fake) {
+        _failure(L, strerror(errno));
+    }
+    luaL_getmetatable(L, "ttyrant.fake");
+    lua_setmetatable(L, -2);
+
+    // ready
+    return 1;
+}
+
+/*
+ * Stop the server (also done when the object is collected).
+ *
+ * <boolean> = <fake>:stop()
+ */
+static int luaF_fake_stop(lua_State* L) {
+    ttyrant_fake** fake = luaL_checkudata(L, 1, "ttyrant.fake");
+    if (*fake) {
+        ttyrant_fake_stop(*fake);
+        *fake = NULL;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get the listening port, or the "host:port" expression to open databases with.
+ *
+ * <number> = <fake>:port()
+ * <string> = <fake>:address()
+ */
+static int luaF_fake_port(lua_State* L) {
+    lua_pushinteger(L, ttyrant_fake_port(_self_fake(L)));
+    return 1;
+}
+static int luaF_fake_address(lua_State* L) {
+    lua_pushfstring(L, "127.0.0.1:%d", ttyrant_fake_port(_self_fake(L)));
+    return 1;
+}
+
+/*
+ * Change the response delay (in seconds).
+ *
+ * <boolean> = <fake>:delay(delay[, jitter = 0])
+ */
+static int luaF_fake_delay(lua_State* L) {
+    ttyrant_fake_delay(_self_fake(L), luaL_checknumber(L, 2), luaL_optnumber(L, 3, 0));
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Change the replication delay (in seconds) reported by 'stat'.
+ *
+ * <boolean> = <fake>:lag(lag)
+ */
+static int luaF_fake_lag(lua_State* L) {
+    ttyrant_fake_lag(_self_fake(L), luaL_checknumber(L, 2));
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Get the number of requests answered so far (i.e. of round trips).
+ *
+ * <number> = <fake>:requests()
+ */
+static int luaF_fake_requests(lua_State* L) {
+    lua_pushnumber(L, ttyrant_fake_requests(_self_fake(L)));
+    return 1;
+}
 
-    // scalar indicator table
-    static const int type_values[] = {
-        RDBITLEXICAL,
-        RDBITDECIMAL,
-        RDBITTOKEN,
-        RDBITQGRAM,
-        RDBITOPT,
-        RDBITVOID,
-        0
-    };
+/*----------------------------------------------------------------------------------------------------------*/
 
-    // extract indicator
-    const char* type = luaL_checkstring(L, 3);
-    char* p = (char*)type - 1;
-    while (*(++p)) if (islower(*p)) *p = toupper(*p);
-    
-    // make "RDBIT" prefix optional
-    if (strstr(type, "RDBIT") == type) {
-        type += 5; // strlen("RDBIT") == 5
+/*
+ * Mixed batches (i.e. 'ttyrant.batch' userdata).
+ *
+ * Operations of any kind are encoded (exactly as the tcrdb*() functions would
+ * send them) into one buffer as they are queued; flush() pipelines them (see
+ * _tt_pipeline()) and reads all the responses in order, so the whole batch
+ * costs about one round trip per window of operations. Queued writes drop their keys from the read cache and
+ * add them to the negative lookup filter of the object right away, and again
+ * once flushed (a get or a filter rebuild in between would see the old state);
+ * queued gets do not use the cache.
+ */
+#define BATCH_NONE          0           // no response ('putnr')
+#define BATCH_CODE          1           // status
+#define BATCH_VALUE         2           // status, int32 size, value
+#define BATCH_TUPLE         3           // same as BATCH_VALUE (decoded as a tuple)
+#define BATCH_INT32         4           // status, int32
+#define BATCH_DOUBLE        5           // status, int64 integral part, int64 fraction (* 1e12)
+#define BATCH_MISC          6           // 'misc' response (items ignored)
+
+typedef struct {
+    int     kind;
+    int     ecode;                      // reported when the status is not 0
+    int     end;                        // end offset of the request in 'packets'
+} _batch_op;
+
+typedef struct {
+    _handle*    handle;
+    int         table;
+    TCXSTR*     packets;
+    TCXSTR*     ops;                    // _batch_op records
+    TCLIST*     written;                // keys of queued writes
+    TCLIST*     removed;                // keys of queued outs
+} _batch;
+
+static _batch* _self_batch(lua_State* L) {
+    _batch* batch = luaL_checkudata(L, 1, "ttyrant.batch");
+    if (!batch->packets) {
+        luaL_error(L, "Attempt to use a collected «ttyrant.batch» instance!");
     }
+    return batch;
+}
 
-    // extract operator
-    lua_pushstring(L, type);
-    int index = luaL_checkoption(L, -1, NULL, type_names);
-    lua_pop(L, 1);
+/*
+ * Record an operation, returning its (1-based) index in the batch.
+ */
+static int _batch_op_push(lua_State* L, _batch* batch, int kind, int ecode) {
+    _batch_op op = { kind, ecode, tcxstrsize(batch->packets) };
+    tcxstrcat(batch->ops, &op, sizeof(op));
+    lua_pushinteger(L, tcxstrsize(batch->ops) / sizeof(op));
+    return 1;
+}
 
-    // execute
-    if (!tcrdbtblsetindex(db, column, type_values[index] | (keep ? RDBITKEEP : 0))) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+/*
+ * Note a queued write of a key (for the read cache and the filter).
+ */
+static void _batch_written(_batch* batch, const char* key, int keysz) {
+    tclistpush(batch->written, key, keysz);
+    if (batch->handle->cache) {
+        _cache_out(batch->handle->cache, key, keysz);
     }
+    if (batch->handle->filter) {
+        _filter_add(batch->handle->filter, key, keysz);
+    }
+}
+
+/*
+ * Start a batch of operations on the object (which is kept alive by it).
+ *
+ * <batch> = <any>:batch()
+ */
+static int luaF_any_batch(lua_State* L) {
+
+    // initialize
+    _self_any(L);
+    _batch* batch = lua_newuserdata(L, sizeof(_batch));
+    batch->handle = lua_touserdata(L, 1);
+    batch->table = _handle_test(L, 1, 0, 1) != NULL;
+    batch->packets = tcxstrnew();
+    batch->ops = tcxstrnew();
+    batch->written = tclistnew();
+    batch->removed = tclistnew();
+    luaL_getmetatable(L, "ttyrant.batch");
+    lua_setmetatable(L, -2);
+
+    // keep the db alive for as long as the batch
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
 
     // ready
-    lua_pushboolean(L, 1);
     return 1;
 }
 
 /*
- * Generate an unique ID.
- *
- * <number> = <table>:genuid()
+ * Queue a write: a value (hash db) or a tuple (table db).
  */
-static int luaF_table_genuid(lua_State* L) {
+static int _batch_put(lua_State* L, int cmd, const char* misc, int ecode) {
 
-    // extract/execute
-    TCRDB* db = _self_tdb(L);
-    int64_t uid = tcrdbtblgenuid(db);
-    if (uid == -1) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
-    } else {
-        lua_pushinteger(L, uid);
+    // initialize
+    _batch* batch = _self_batch(L);
+    size_t keysz, valuesz;
+    const char* key = _checkvalue(L, 2, &keysz);
+
+    // tuple (as the 'misc' function of tcrdbtblput() and alike)
+    if (batch->table) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        TCLIST* args = _scratch_tclist();
+        tclistpush(args, key, keysz);
+        lua_pushnil(L);
+        while (lua_next(L, 3)) {
+            char scol[24];
+            size_t colsz;
+            const char* col = _checkcolumn(L, -2, scol, &colsz);
+            const char* val = _checkvalue(L, -1, &valuesz);
+            tclistpush(args, col, colsz);
+            tclistpush(args, val, valuesz);
+            lua_pop(L, 1);
+        }
+        int index;
+        _batch_written(batch, key, keysz);
+        _tt_misc(batch->packets, misc, 0, tclistnum(args));
+        for (index = 0; index < tclistnum(args); index++) {
+            _tt_misc_arg(batch->packets, TCLISTVALPTR(args, index), TCLISTVALSIZ(args, index));
+        }
+        return _batch_op_push(L, batch, BATCH_MISC, ecode);
     }
-    
-    // ready
-    return 1;
+
+    // value
+    const char* value = _checkvalue(L, 3, &valuesz);
+    _tt_head(batch->packets, cmd);
+    _tt_int32(batch->packets, keysz);
+    _tt_int32(batch->packets, valuesz);
+    tcxstrcat(batch->packets, key, keysz);
+    tcxstrcat(batch->packets, value, valuesz);
+    _batch_written(batch, key, keysz);
+    return _batch_op_push(L, batch, cmd == TTCMDPUTNR ? BATCH_NONE : BATCH_CODE, ecode);
 }
 
-/*----------------------------------------------------------------------------------------------------------*/
+/*
+ * Queue an operation on a single key.
+ */
+static int _batch_key(lua_State* L, int cmd, int kind, int ecode) {
+    _batch* batch = _self_batch(L);
+    size_t keysz;
+    const char* key = _checkvalue(L, 2, &keysz);
+    _tt_head(batch->packets, cmd);
+    _tt_int32(batch->packets, keysz);
+    tcxstrcat(batch->packets, key, keysz);
+    if (cmd == TTCMDOUT) {
+        tclistpush(batch->removed, key, keysz);
+        if (batch->handle->cache) {
+            _cache_out(batch->handle->cache, key, keysz);
+        }
+    }
+    return _batch_op_push(L, batch, kind == BATCH_VALUE && batch->table ? BATCH_TUPLE : kind, ecode);
+}
 
 /*
- * Create a query object.
+ * Queue a write (the index of the operation in the batch is returned by all
+ * queueing methods).
  *
- * <object> = ttyrant.query:new()
+ * <number> = <batch>:put(key, value | tuple)
+ * <number> = <batch>:putkeep(key, value | tuple)
+ * <number> = <batch>:putcat(key, value | tuple)
+ * <number> = <batch>:putnr(key, value)
  */
-static int _luaF_query_gc(lua_State* L) {
-    tcrdbqrydel(_self_qry(L));
-    return 0;
+static int luaF_batch_put(lua_State* L) {
+    return _batch_put(L, TTCMDPUT, "put", TTEMISC);
+}
+static int luaF_batch_putkeep(lua_State* L) {
+    return _batch_put(L, TTCMDPUTKEEP, "putkeep", TTEKEEP);
+}
+static int luaF_batch_putcat(lua_State* L) {
+    return _batch_put(L, TTCMDPUTCAT, "putcat", TTEMISC);
+}
+static int luaF_batch_putnr(lua_State* L) {
+    if (_self_batch(L)->table) {
+        luaL_error(L, "Invalid operation «putnr» for a «ttyrant.table» batch!");
+    }
+    return _batch_put(L, TTCMDPUTNR, NULL, TTEMISC);
 }
-static int luaF_query_new(lua_State* L) {
 
-    // instance
-    if (!lua_istable(L, 1)) {
-        luaL_error(L, "Invalid «self» for ttyrant.query:new(), expected «ttyrant.query»!");
+/*
+ * <number> = <batch>:putshl(key, value, width)
+ */
+static int luaF_batch_putshl(lua_State* L) {
+    _batch* batch = _self_batch(L);
+    if (batch->table) {
+        luaL_error(L, "Invalid operation «putshl» for a «ttyrant.table» batch!");
     }
-    TCRDB* db = _self(L, 2, "__tdb", "Invalid «ttyrant.table» instance for ttyrant.query:new()!");
-    lua_newtable(L);
+    size_t keysz, valuesz;
+    const char* key = _checkvalue(L, 2, &keysz);
+    const char* value = _checkvalue(L, 3, &valuesz);
+    int width = luaL_checkint(L, 4);
+    _tt_head(batch->packets, TTCMDPUTSHL);
+    _tt_int32(batch->packets, keysz);
+    _tt_int32(batch->packets, valuesz);
+    _tt_int32(batch->packets, width);
+    tcxstrcat(batch->packets, key, keysz);
+    tcxstrcat(batch->packets, value, valuesz);
+    _batch_written(batch, key, keysz);
+    return _batch_op_push(L, batch, BATCH_CODE, TTEMISC);
+}
 
-    // metatable
-    lua_pushvalue(L, 1);
-    lua_setfield(L, 1, "__index");      // self.__index = self
-    lua_pushcfunction(L, _luaF_query_gc);
-    lua_setfield(L, 1, "__gc");         // self.__gc = _luaF_query_gc
-    lua_pushvalue(L, 1);
-    lua_setmetatable(L, 3);             // setmetatable(instance, self)
+/*
+ * <number> = <batch>:get(key)
+ * <number> = <batch>:out(key)
+ * <number> = <batch>:vsiz(key)
+ */
+static int luaF_batch_get(lua_State* L) {
+    return _batch_key(L, TTCMDGET, BATCH_VALUE, TTENOREC);
+}
+static int luaF_batch_out(lua_State* L) {
+    return _batch_key(L, TTCMDOUT, BATCH_CODE, TTENOREC);
+}
+static int luaF_batch_vsiz(lua_State* L) {
+    return _batch_key(L, TTCMDVSIZ, BATCH_INT32, TTENOREC);
+}
 
-    // spawn query
-    RDBQRY* qry = tcrdbqrynew(db);
-    if (!qry) {
-        _failure(L, tcrdberrmsg(tcrdbecode(db)));
+/*
+ * Integer (4 byte) or real addition (like <any>:increment()).
+ *
+ * <number> = <batch>:addint(key[, num = 1])
+ * <number> = <batch>:increment(key[, amount = 1])
+ */
+static int luaF_batch_addint(lua_State* L) {
+    _batch* batch = _self_batch(L);
+    size_t keysz;
+    const char* key = _checkvalue(L, 2, &keysz);
+    int num = luaL_optint(L, 3, 1);
+    _tt_head(batch->packets, TTCMDADDINT);
+    _tt_int32(batch->packets, keysz);
+    _tt_int32(batch->packets, num);
+    tcxstrcat(batch->packets, key, keysz);
+    _batch_written(batch, key, keysz);
+    return _batch_op_push(L, batch, BATCH_INT32, TTEKEEP);
+}
+static int luaF_batch_increment(lua_State* L) {
+    _batch* batch = _self_batch(L);
+    size_t keysz;
+    const char* key = _checkvalue(L, 2, &keysz);
+    double integ, fract = modf(luaL_optnumber(L, 3, 1), &integ);
+    int64_t parts[2] = { (int64_t)integ, (int64_t)(fract * 1e12) };
+    int index;
+    _tt_head(batch->packets, TTCMDADDDOUBLE);
+    _tt_int32(batch->packets, keysz);
+    for (index = 0; index < 2; index++) {
+        _tt_int32(batch->packets, (int)((uint64_t)parts[index] >> 32));
+        _tt_int32(batch->packets, (int)(uint32_t)parts[index]);
+    }
+    tcxstrcat(batch->packets, key, keysz);
+    _batch_written(batch, key, keysz);
+    return _batch_op_push(L, batch, BATCH_DOUBLE, TTEKEEP);
+}
+
+/*
+ * Extension call (see <any>:ext()).
+ *
+ * <number> = <batch>:ext(name[, key = ''[, value = ''[, lock]]])
+ */
+static int luaF_batch_ext(lua_State* L) {
+    _batch* batch = _self_batch(L);
+    size_t keysz = 0, valuesz = 0;
+    const char* name = luaL_checkstring(L, 2);
+    const char* key = lua_isnoneornil(L, 3) ? "" : _checkvalue(L, 3, &keysz);
+    const char* value = lua_isnoneornil(L, 4) ? "" : _checkvalue(L, 4, &valuesz);
+    _tt_ext(batch->packets, name, _ext_opts(L, 5), key, keysz, value, valuesz);
+    _batch_written(batch, key, keysz);
+    return _batch_op_push(L, batch, BATCH_VALUE, TTEMISC);
+}
+
+/*
+ * Read the response of a batch operation (0 when the stream is broken).
+ */
+typedef struct {
+    const _batch_op*    ops;
+    int*                status;
+    double*             numbers;
+    TCLIST*             values;         // of successful gets, in order
+} _batch_exchange;
+
+static int _batch_recv(TCRDB* db, int index, void* data) {
+    _batch_exchange* ex = data;
+    int kind = ex->ops[index].kind;
+    int code, ok = 1;
+    if (kind == BATCH_NONE) {
+        return 1;
+    } else if (kind == BATCH_MISC) {
+        int result = _tt_recv_misc(db, NULL);
+        code = result == 1 ? 0 : result == 0 ? 1 : -1;
     } else {
-        lua_pushlightuserdata(L, qry);
-        lua_setfield(L, 3, "__qry");    // instance.__qry = <userdata>
+        code = _tt_code(db);
+    }
+    if (code == -1) {
+        return 0;
+    } else if (code != 0) {
+        ex->status[index] = ex->ops[index].ecode;
+        return 1;
+    }
+    switch (kind) {
+        case BATCH_VALUE:
+        case BATCH_TUPLE:
+            ok = _tt_recv(db, ex->values);
+            break;
+        case BATCH_INT32:
+            ex->numbers[index] = (int32_t)ttsockgetint32(db->sock);
+            break;
+        case BATCH_DOUBLE: {
+            int64_t integ = ttsockgetint64(db->sock);
+            int64_t fract = ttsockgetint64(db->sock);
+            ex->numbers[index] = integ + fract / 1e12;
+            break;
+        }
+    }
+    return ok && !ttsockcheckend(db->sock);
+}
+
+/*
+ * Send all queued operations (pipelined) and read their responses in order. The
+ * results list holds, by operation index, what the corresponding method of the
+ * object would return (true, values, tuples or numbers) or false on failure,
+ * in which case the errors table holds the message at the same index. The
+ * batch is empty (and reusable) afterwards.
+ *
+ * <table>, <table> = <batch>:flush()
+ */
+static int luaF_batch_flush(lua_State* L) {
+
+    // initialize
+    _batch* batch = _self_batch(L);
+    TCRDB* db = batch->handle->db;
+    int count = tcxstrsize(batch->ops) / sizeof(_batch_op);
+    const _batch_op* ops = tcxstrptr(batch->ops);
+    if (!db) {
+        luaL_error(L, "Attempt to flush a batch of a closed database object!");
+    }
+    if (batch->handle->iterator) {
+        _iterator_settle(batch->handle->iterator);
+    }
+
+    // exchange (statuses, numbers and values are only collected here)
+    int*    status = calloc(count + 1, sizeof(int));
+    double* numbers = malloc((count + 1) * sizeof(double));
+    TCLIST* values = tclistnew();
+    int*    ends = malloc((count + 1) * sizeof(int));
+    int     index, done;
+    _batch_exchange ex = { ops, status, numbers, values };
+    for (index = 0; index < count; index++) {
+        ends[index] = ops[index].end;
+    }
+    pthread_mutex_lock(&db->mmtx);
+    int ecode = _tt_pipeline(db, tcxstrptr(batch->packets), ends, count, _batch_recv, &ex, &done);
+    pthread_mutex_unlock(&db->mmtx);
+    if (ecode != TTESUCCESS) {
+        for (index = done; index < count; index++) {
+            status[index] = ecode;
+        }
+        _tt_reset(db, ecode);
+    }
+    free(ends);
+
+    // invalidate (again, now that the server applied the writes)
+    if (batch->handle->cache) {
+        _cache_out_list(batch->handle->cache, batch->written, 1);
+        _cache_out_list(batch->handle->cache, batch->removed, 1);
+    }
+    if (batch->handle->filter) {
+        _filter_add_list(batch->handle->filter, batch->written, 1);
+    }
+
+    // results
+    int value = 0;
+    lua_createtable(L, count, 0);
+    lua_newtable(L);
+    for (index = 0; index < count; index++) {
+        if (status[index]) {
+            lua_pushboolean(L, 0);
+            lua_rawseti(L, -3, index + 1);
+            lua_pushstring(L, tcrdberrmsg(status[index]));
+            lua_rawseti(L, -2, index + 1);
+            continue;
+        }
+        switch (ops[index].kind) {
+            case BATCH_VALUE:
+                lua_pushlstring(L, TCLISTVALPTR(values, value), TCLISTVALSIZ(values, value));
+                _io.received += TCLISTVALSIZ(values, value);
+                value++;
+                break;
+            case BATCH_TUPLE:
+                _tuple2luatable(L, TCLISTVALPTR(values, value), TCLISTVALSIZ(values, value));
+                value++;
+                break;
+            case BATCH_INT32:
+            case BATCH_DOUBLE:
+                lua_pushnumber(L, numbers[index]);
+                break;
+            default:
+                lua_pushboolean(L, 1);
+                break;
+        }
+        lua_rawseti(L, -3, index + 1);
     }
 
+    // reset
+    _io.items += count;
+    _io.sent += tcxstrsize(batch->packets);
+    tcxstrclear(batch->packets);
+    tcxstrclear(batch->ops);
+    tclistclear(batch->written);
+    tclistclear(batch->removed);
+    tclistdel(values);
+    free(numbers);
+    free(status);
+
     // ready
-    return 1;
+    return 2;
 }
 
 /*
- * Depreciated query destroyer.
+ * Drop all queued operations.
+ *
+ * <boolean> = <batch>:clear()
  */
-static int luaF_query_delete(lua_State* L) {
+static int luaF_batch_clear(lua_State* L) {
+    _batch* batch = _self_batch(L);
+    tcxstrclear(batch->packets);
+    tcxstrclear(batch->ops);
+    tclistclear(batch->written);
+    tclistclear(batch->removed);
     lua_pushboolean(L, 1);
     return 1;
 }
 
 /*
- * Add a filtering rule to a query object.
+ * Number of queued operations.
  *
- * <boolean> = ttyrant.query:addcond(column, operator, expression[, negate = false[, noidx = false]])
+ * <number> = #<batch>
  */
-static int luaF_query_addcond(lua_State* L) {
+static int luaF_batch_len(lua_State* L) {
+    lua_pushinteger(L, tcxstrsize(_self_batch(L)->ops) / sizeof(_batch_op));
+    return 1;
+}
 
-    // instance
-    RDBQRY* qry = _self_qry(L);
+static int _batch_gc(lua_State* L) {
+    _batch* batch = lua_touserdata(L, 1);
+    if (batch->packets) {
+        tcxstrdel(batch->packets);
+        tcxstrdel(batch->ops);
+        tclistdel(batch->written);
+        tclistdel(batch->removed);
+        batch->packets = NULL;
+    }
+    return 0;
+}
 
-    // column
-    const char* column = luaL_checkstring(L, 2);
-    int options = (lua_toboolean(L, 5) ? RDBQCNEGATE : 0) |
-                  (lua_toboolean(L, 5) ? RDBQCNOIDX : 0);
+/*----------------------------------------------------------------------------------------------------------*/
 
-    // nominal indicator table
-    static const char* const operator_names[] = {
-        "STREQ",
-        "STRINC",
-        "STRBW",
-        "STREW",
-        "STRAND",
-        "STROR",
-        "STROREQ",
-        "STRRX",
-        "NUMEQ",
-        "NUMGT",
-        "NUMGE",
-        "NUMLT",
-        "NUMLE",
-        "NUMBT",
-        "NUMOREQ",
-        "FTSPH",
-        "FTSAND",
-        "FTSOR",
-        "FTSEX",
-        NULL
-    };
+/*
+ * Non-blocking connections (i.e. 'ttyrant.socket' userdata), the building
+ * blocks of the ttyrant.async module (src/ttyrant_async.lua).
+ *
+ * Requests are encoded into an output buffer (exactly as the tcrdb*() functions
+ * would send them) and written by flush() as far as the socket allows, while
+ * responses are read by fill() into an input buffer as they arrive and decoded
+ * by response() in request order. No call ever blocks (except for resolving
+ * the host name on connect), so the caller decides how to wait for the socket,
+ * e.g. by yielding to an event loop or with ttyrant.socket.poll().
+ */
+#define ASYNC_NONE          0           // no response at all
+#define ASYNC_CODE          1           // status
+#define ASYNC_VALUE         2           // status, int32 size, value
+#define ASYNC_INT32         3           // status, int32
+#define ASYNC_INT64         4           // status, int64
+#define ASYNC_LIST          5           // status, int32 count, count x (int32 size, value)
+
+#define ASYNC_ARGS_NONE     0
+#define ASYNC_ARGS_KEY      1           // int32 ksiz, key
+#define ASYNC_ARGS_PAIR     2           // int32 ksiz, int32 vsiz, key, value
+#define ASYNC_ARGS_KEYNUM   3           // int32 ksiz, int32 num, key
+#define ASYNC_ARGS_MISC     4           // int32 nsiz, int32 opts, int32 count, name, count x (int32 size, arg)
+
+typedef struct {
+    const char* name;
+    int         cmd;
+    int         args;
+    int         kind;
+    int         ecode;                  // reported when the status is not 0
+} _async_command;
+
+static const _async_command _async_commands[] = {
+    { "put",        TTCMDPUT,       ASYNC_ARGS_PAIR,    ASYNC_CODE,     TTEMISC },
+    { "putkeep",    TTCMDPUTKEEP,   ASYNC_ARGS_PAIR,    ASYNC_CODE,     TTEKEEP },
+    { "putcat",     TTCMDPUTCAT,    ASYNC_ARGS_PAIR,    ASYNC_CODE,     TTEMISC },
+    { "putnr",      TTCMDPUTNR,     ASYNC_ARGS_PAIR,    ASYNC_NONE,     TTEMISC },
+    { "out",        TTCMDOUT,       ASYNC_ARGS_KEY,     ASYNC_CODE,     TTENOREC },
+    { "get",        TTCMDGET,       ASYNC_ARGS_KEY,     ASYNC_VALUE,    TTENOREC },
+    { "vsiz",       TTCMDVSIZ,      ASYNC_ARGS_KEY,     ASYNC_INT32,    TTENOREC },
+    { "addint",     TTCMDADDINT,    ASYNC_ARGS_KEYNUM,  ASYNC_INT32,    TTEKEEP },
+    { "fwmkeys",    TTCMDFWMKEYS,   ASYNC_ARGS_KEYNUM,  ASYNC_LIST,     TTEMISC },
+    { "sync",       TTCMDSYNC,      ASYNC_ARGS_NONE,    ASYNC_CODE,     TTEMISC },
+    { "vanish",     TTCMDVANISH,    ASYNC_ARGS_NONE,    ASYNC_CODE,     TTEMISC },
+    { "rnum",       TTCMDRNUM,      ASYNC_ARGS_NONE,    ASYNC_INT64,    TTEMISC },
+    { "size",       TTCMDSIZE,      ASYNC_ARGS_NONE,    ASYNC_INT64,    TTEMISC },
+    { "misc",       TTCMDMISC,      ASYNC_ARGS_MISC,    ASYNC_LIST,     TTEMISC },
+    { NULL, 0, 0, 0, 0 }
+};
+
+typedef struct {
+    int         fd;                     // -1 once closed
+    TCXSTR*     out;                    // requests not yet written (from outpos)
+    int         outpos;
+    TCXSTR*     in;                     // responses not yet decoded (from inpos)
+    int         inpos;
+    TCXSTR*     expect;                 // _async_command pointers of pending responses
+    int         expectpos;
+} _async;
+
+static _async* _self_socket(lua_State* L) {
+    _async* sock = luaL_checkudata(L, 1, "ttyrant.socket");
+    if (sock->fd < 0) {
+        luaL_error(L, "Attempt to use a closed «ttyrant.socket» instance!");
+    }
+    return sock;
+}
 
-    // scalar indicator table
-    static const int operator_values[] = {
-        RDBQCSTREQ,
-        RDBQCSTRINC,
-        RDBQCSTRBW,
-        RDBQCSTREW,
-        RDBQCSTRAND,
-        RDBQCSTROR,
-        RDBQCSTROREQ,
-        RDBQCSTRRX,
-        RDBQCNUMEQ,
-        RDBQCNUMGT,
-        RDBQCNUMGE,
-        RDBQCNUMLT,
-        RDBQCNUMLE,
-        RDBQCNUMBT,
-        RDBQCNUMOREQ,
-        RDBQCFTSPH,
-        RDBQCFTSAND,
-        RDBQCFTSOR,
-        RDBQCFTSEX,
-        0
-    };
+/*
+ * Read a big-endian integer from a buffer.
+ */
+static int _async_int32(const char* buffer) {
+    uint32_t value;
+    memcpy(&value, buffer, sizeof(value));
+    return (int)ntohl(value);
+}
+static int64_t _async_int64(const char* buffer) {
+    return ((int64_t)_async_int32(buffer) << 32) | (uint32_t)_async_int32(buffer + 4);
+}
 
-    // extract indicator
-    const char* indicator = luaL_checkstring(L, 3);
-    char* p = (char*)indicator - 1;
-    while (*(++p)) if (islower(*p)) *p = toupper(*p);
-    
-    // make "RDBQC" prefix optional
-    if (strstr(indicator, "RDBQC") == indicator) {
-        indicator += 5; // strlen("RDBQC") == 5
+/*
+ * Drop the consumed part of a buffer (once all of it, or a large part of it,
+ * was consumed).
+ */
+static void _async_compact(TCXSTR** buffer, int* pos) {
+    if (*pos > 0 && *pos == tcxstrsize(*buffer)) {
+        tcxstrclear(*buffer);
+        *pos = 0;
+    } else if (*pos >= TTIOBUFSIZ) {
+        TCXSTR* rest = tcxstrnew();
+        tcxstrcat(rest, (const char*)tcxstrptr(*buffer) + *pos, tcxstrsize(*buffer) - *pos);
+        tcxstrdel(*buffer);
+        *buffer = rest;
+        *pos = 0;
     }
+}
 
-    // extract operator
-    lua_pushstring(L, indicator);
-    int operator = luaL_checkoption(L, -1, NULL, operator_names);
-    lua_pop(L, 1);
-
-    // operand expression
-    char buffer[64];
-    const char* expression = NULL;
-    if (lua_type(L, 4) == LUA_TSTRING) {
-        expression = luaL_checkstring(L, 4);
-    } else {
-        if (snprintf(buffer, 64, "%f", luaL_checknumber(L, 4)) >= 0) {
-            expression = buffer;
-        }
+/*
+ * Open a non-blocking connection (the connection itself completes while the
+ * first requests are flushed).
+ *
+ * <socket> = ttyrant.socket:connect('localhost', 1978)
+ * <socket> = ttyrant.socket:connect('localhost:1978')
+ */
+static int luaF_socket_connect(lua_State* L) {
+
+    // address
+    char host[256];
+    char service[16];
+    const char* address = luaL_checkstring(L, 2);
+    const char* colon = strrchr(address, ':');
+    int port = 1978;
+    if (!lua_isnoneornil(L, 3)) {
+        port = luaL_checkint(L, 3);
+        colon = NULL;
+    } else if (colon) {
+        port = atoi(colon + 1);
+    }
+    snprintf(host, sizeof(host), "%.*s", colon ? (int)(colon - address) : (int)strlen(address), address);
+    snprintf(service, sizeof(service), "%d", port);
+
+    // resolve
+    struct addrinfo hints, *info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, service, &hints, &info) != 0) {
+        _failure(L, tcrdberrmsg(TTENOHOST));
     }
 
-    // execute
-    if (expression) {
-        tcrdbqryaddcond(qry, column, operator_values[operator] | options, expression);
+    // connect
+    int fd = socket(info->ai_family, SOCK_STREAM, 0);
+    int nodelay = 1;
+    if (fd < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0 ||
+        (connect(fd, info->ai_addr, info->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+        int error = errno;
+        freeaddrinfo(info);
+        if (fd >= 0) {
+            close(fd);
+        }
+        _failure(L, strerror(error));
     }
+    freeaddrinfo(info);
+
+    // instance
+    _async* sock = lua_newuserdata(L, sizeof(_async));
+    sock->fd = fd;
+    sock->out = tcxstrnew();
+    sock->outpos = 0;
+    sock->in = tcxstrnew();
+    sock->inpos = 0;
+    sock->expect = tcxstrnew();
+    sock->expectpos = 0;
+    luaL_getmetatable(L, "ttyrant.socket");
+    lua_setmetatable(L, -2);
 
     // ready
-    lua_pushboolean(L, expression != NULL);
     return 1;
 }
 
 /*
- * Limit the query result set.
+ * Get the file descriptor (to wait on).
  *
- * <boolean> = ttyrant.query:setlimit([limit = -1[, offset = 0]])
+ * <number> = <socket>:fd()
  */
-static int luaF_query_setlimit(lua_State* L) {
+static int luaF_socket_fd(lua_State* L) {
+    lua_pushinteger(L, _self_socket(L)->fd);
+    return 1;
+}
 
-    // instance
-    RDBQRY* qry = _self_qry(L);
+/*
+ * Queue a request, to be written by the next flush(). Returns the number of
+ * responses pending ('putnr' has none).
+ *
+ * <number> = <socket>:request('put' | 'putkeep' | 'putcat' | 'putnr', key, value)
+ * <number> = <socket>:request('out' | 'get' | 'vsiz', key)
+ * <number> = <socket>:request('addint', key, num)
+ * <number> = <socket>:request('fwmkeys', prefix, max)
+ * <number> = <socket>:request('sync' | 'vanish' | 'rnum' | 'size')
+ * <number> = <socket>:request('misc', name, arg1, arg2, ...)
+ * <number> = <socket>:request('misc', name, { arg1, arg2, ... })
+ */
+static int luaF_socket_request(lua_State* L) {
+
+    // command
+    _async* sock = _self_socket(L);
+    const char* name = luaL_checkstring(L, 2);
+    const _async_command* command = _async_commands;
+    while (command->name && strcmp(command->name, name)) {
+        command++;
+    }
+    if (!command->name) {
+        luaL_error(L, "Invalid request «%s» for «ttyrant.socket»!", name);
+    }
 
-    // limits
-    int limit = -1;
-    if (!lua_isnoneornil(L, 2)) {
-        limit = luaL_checkint(L, 2);
+    // arguments
+    size_t keysz = 0, valuesz = 0;
+    const char* key = NULL;
+    const char* value = NULL;
+    TCLIST* args = NULL;
+    int num = 0, index;
+    switch (command->args) {
+        case ASYNC_ARGS_PAIR:
+            value = _checkvalue(L, 4, &valuesz);
+            // fall through
+        case ASYNC_ARGS_KEY:
+            key = _checkvalue(L, 3, &keysz);
+            break;
+        case ASYNC_ARGS_KEYNUM:
+            key = _checkvalue(L, 3, &keysz);
+            num = luaL_optint(L, 4, command->cmd == TTCMDADDINT ? 1 : -1);
+            break;
+        case ASYNC_ARGS_MISC:
+            key = luaL_checklstring(L, 3, &keysz);
+            args = lua_istable(L, 4) ? _luatable2tclist(L, 4, 0) : _lualist2tclist(L, 4);
+            break;
     }
-    int offset = lua_tointeger(L, 3);
 
-    // apply
-    tcrdbqrysetlimit(qry, limit, offset);
+    // encode
+    switch (command->args) {
+        case ASYNC_ARGS_NONE:
+            _tt_head(sock->out, command->cmd);
+            break;
+        case ASYNC_ARGS_KEY:
+            _tt_head(sock->out, command->cmd);
+            _tt_int32(sock->out, keysz);
+            tcxstrcat(sock->out, key, keysz);
+            break;
+        case ASYNC_ARGS_PAIR:
+            _tt_head(sock->out, command->cmd);
+            _tt_int32(sock->out, keysz);
+            _tt_int32(sock->out, valuesz);
+            tcxstrcat(sock->out, key, keysz);
+            tcxstrcat(sock->out, value, valuesz);
+            break;
+        case ASYNC_ARGS_KEYNUM:
+            _tt_head(sock->out, command->cmd);
+            _tt_int32(sock->out, keysz);
+            _tt_int32(sock->out, num);
+            tcxstrcat(sock->out, key, keysz);
+            break;
+        case ASYNC_ARGS_MISC:
+            _tt_misc(sock->out, key, 0, tclistnum(args));
+            for (index = 0; index < tclistnum(args); index++) {
+                _tt_misc_arg(sock->out, TCLISTVALPTR(args, index), TCLISTVALSIZ(args, index));
+            }
+            break;
+    }
+
+    // expect
+    if (command->kind != ASYNC_NONE) {
+        tcxstrcat(sock->expect, &command, sizeof(command));
+    }
 
     // ready
-    lua_pushboolean(L, 1);
+    lua_pushinteger(L, (tcxstrsize(sock->expect) - sock->expectpos) / sizeof(command));
     return 1;
 }
 
 /*
- * Choose a search ordering.
+ * Write as much of the queued requests as the socket takes: true once all are
+ * written, false if the socket is full (wait until it is writable and retry).
  *
- * <boolean> = ttyrant.query:setorder(column[, method = "STRASC"])
+ * <boolean> = <socket>:flush()
  */
-static int luaF_query_setorder(lua_State* L) {
-
-    // instance
-    RDBQRY* qry = _self_qry(L);
+static int luaF_socket_flush(lua_State* L) {
+
+    // write
+    _async* sock = _self_socket(L);
+    while (sock->outpos < tcxstrsize(sock->out)) {
+        ssize_t sent = send(sock->fd, (const char*)tcxstrptr(sock->out) + sock->outpos,
+                            tcxstrsize(sock->out) - sock->outpos, MSG_NOSIGNAL);
+        if (sent > 0) {
+            sock->outpos += sent;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN) {
+            lua_pushboolean(L, 0);
+            return 1;
+        } else if (errno != EINTR) {
+            _failure(L, strerror(errno));
+        }
+    }
 
-    // column
-    const char* column = luaL_checkstring(L, 2);
+    // done
+    tcxstrclear(sock->out);
+    sock->outpos = 0;
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-    // nominal indicator table
-    static const char* const method_names[] = {
-        "STRASC",
-        "STRDESC",
-        "NUMASC",
-        "NUMDESC",
-        NULL
-    };
+/*
+ * Read whatever has arrived: true if anything was read, false if nothing was
+ * available (wait until the socket is readable and retry).
+ *
+ * <boolean> = <socket>:fill()
+ */
+static int luaF_socket_fill(lua_State* L) {
+
+    // compact
+    _async* sock = _self_socket(L);
+    _async_compact(&sock->in, &sock->inpos);
+
+    // read
+    char buffer[TTIOBUFSIZ];
+    int got = 0;
+    for (;;) {
+        ssize_t received = recv(sock->fd, buffer, sizeof(buffer), 0);
+        if (received > 0) {
+            tcxstrcat(sock->in, buffer, received);
+            got = 1;
+            if (received < (ssize_t)sizeof(buffer)) {
+                break;
+            }
+        } else if (received == 0) {
+            _failure(L, tcrdberrmsg(TTERECV));
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN) {
+            break;
+        } else if (errno != EINTR) {
+            _failure(L, strerror(errno));
+        }
+    }
 
-    // scalar indicator table
-    static const int method_values[] = {
-        RDBQOSTRASC,
-        RDBQOSTRDESC,
-        RDBQONUMASC,
-        RDBQONUMDESC,
-        0
-    };
+    // ready
+    lua_pushboolean(L, got);
+    return 1;
+}
 
-    // extract indicator
-    int sort = 0;
-    if (!lua_isnoneornil(L, 3)) {
-        const char* method = luaL_checkstring(L, 3);
-        char* p = (char*)method - 1;
-        while (*(++p)) if (islower(*p)) *p = toupper(*p);
-        if (strstr(method, "RDBQO") == method) {
-            method += 5; // strlen("RDBQO") == 5
+/*
+ * Decode the next response if it has fully arrived: false if not (or if none
+ * is pending), otherwise true followed by the results of the request, as the
+ * ttyrant.hash methods give them (nil and a message on failure, a list for
+ * 'fwmkeys' and 'misc').
+ *
+ * <boolean>, ... = <socket>:response()
+ */
+static int luaF_socket_response(lua_State* L) {
+
+    // pending
+    _async* sock = _self_socket(L);
+    const char* buffer = (const char*)tcxstrptr(sock->in) + sock->inpos;
+    int size = tcxstrsize(sock->in) - sock->inpos;
+    if (sock->expectpos == tcxstrsize(sock->expect) || size < 1) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    const _async_command* command;
+    memcpy(&command, (const char*)tcxstrptr(sock->expect) + sock->expectpos, sizeof(command));
+
+    // measure (status, then the payload of successful responses)
+    int used = 1, count = 0, index;
+    if (buffer[0] == 0) {
+        switch (command->kind) {
+            case ASYNC_VALUE:
+                used = size < 5 ? -1 : 5 + _async_int32(buffer + 1);
+                break;
+            case ASYNC_INT32:
+                used = 5;
+                break;
+            case ASYNC_INT64:
+                used = 9;
+                break;
+            case ASYNC_LIST:
+                used = 5;
+                count = size < 5 ? 0 : _async_int32(buffer + 1);
+                for (index = 0; size >= 5 && index < count && used + 4 <= size; index++) {
+                    used += 4 + _async_int32(buffer + used);
+                }
+                if (size < 5 || index < count) {
+                    used = -1;
+                }
+                break;
         }
+    }
+    if (used < 0 || used > size) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
 
-        // extract method
-        lua_pushstring(L, method);
-        sort = luaL_checkoption(L, -1, NULL, method_names);
-        lua_pop(L, 1);
+    // decode
+    int top = lua_gettop(L);
+    lua_pushboolean(L, 1);
+    if (buffer[0] != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, tcrdberrmsg(command->ecode));
+    } else {
+        switch (command->kind) {
+            case ASYNC_CODE:
+                lua_pushboolean(L, 1);
+                break;
+            case ASYNC_VALUE:
+                lua_pushlstring(L, buffer + 5, used - 5);
+                break;
+            case ASYNC_INT32:
+                lua_pushinteger(L, _async_int32(buffer + 1));
+                break;
+            case ASYNC_INT64:
+                lua_pushnumber(L, _async_int64(buffer + 1));
+                break;
+            case ASYNC_LIST: {
+                int offset = 5;
+                lua_createtable(L, count, 0);
+                for (index = 0; index < count; index++) {
+                    int itemsz = _async_int32(buffer + offset);
+                    lua_pushlstring(L, buffer + offset + 4, itemsz);
+                    lua_rawseti(L, -2, index + 1);
+                    offset += 4 + itemsz;
+                }
+                break;
+            }
+        }
     }
-    
-    // execute
-    tcrdbqrysetorder(qry, column, method_values[sort]);
+
+    // consume
+    sock->inpos += used;
+    sock->expectpos += sizeof(command);
+    _async_compact(&sock->expect, &sock->expectpos);
 
     // ready
-    lua_pushboolean(L, 1);
-    return 1;
+    return lua_gettop(L) - top;
 }
 
 /*
- * Get the list of keys corresponding to the query object.
+ * Get the number of responses pending and whether requests are still queued
+ * for writing.
  *
- * <table> = ttyrant.query:search()
+ * <number>, <boolean> = <socket>:pending()
  */
-static int luaF_query_search(lua_State* L) {
-    RDBQRY* qry = _self_qry(L);
-    TCLIST* items = tcrdbqrysearch(qry);
-    _tclist2luatable(L, items, 0);
-    tclistdel(items);
-    return 1;
+static int luaF_socket_pending(lua_State* L) {
+    _async* sock = _self_socket(L);
+    lua_pushinteger(L, (tcxstrsize(sock->expect) - sock->expectpos) / sizeof(_async_command*));
+    lua_pushboolean(L, sock->outpos < tcxstrsize(sock->out));
+    return 2;
 }
 
 /*
- * Remove all tuples corresponding to the query object.
+ * Close the connection (also done when the object is collected); pending
+ * responses are lost.
  *
- * <boolean> = ttyrant.query:searchout()
+ * <boolean> = <socket>:close()
  */
-static int luaF_query_searchout(lua_State* L) {
-    RDBQRY* qry = _self_qry(L);
-    lua_pushboolean(L, tcrdbqrysearchout(qry));
+static int luaF_socket_close(lua_State* L) {
+    _async* sock = luaL_checkudata(L, 1, "ttyrant.socket");
+    if (sock->fd >= 0) {
+        close(sock->fd);
+        sock->fd = -1;
+        tcxstrdel(sock->out);
+        tcxstrdel(sock->in);
+        tcxstrdel(sock->expect);
+    }
+    lua_pushboolean(L, 1);
     return 1;
 }
 
 /*
- * Get the values of tuples which correspond to the query object.
+ * Wait until any of the given file descriptors is ready for reading ('r') or
+ * writing ('w'), or until 'timeout' seconds pass (forever if nil), returning
+ * the ready ones (errors and hangups count as ready).
  *
- * <table> = ttyrant.query:searchget()
+ * <table> = ttyrant.socket.poll({ [fd1] = 'r', [fd2] = 'w', [fd3] = 'rw', ... }[, timeout])
  */
-static int luaF_query_searchget(lua_State* L) {
+static int luaF_socket_poll(lua_State* L) {
 
-    // instance
-    RDBQRY* qry = _self_qry(L);
+    // initialize
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int timeout = lua_isnoneornil(L, 2) ? -1 : (int)(luaL_checknumber(L, 2) * 1000);
+    int count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+        count++;
+        lua_pop(L, 1);
+    }
 
-    // execute
-    TCLIST* items = tcrdbqrysearchget(qry);
+    // descriptors
+    struct pollfd* fds = malloc((count ? count : 1) * sizeof(struct pollfd));
+    int index = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+        const char* mode = lua_tostring(L, -1);
+        fds[index].fd = lua_tointeger(L, -2);
+        fds[index].events = (mode && strchr(mode, 'r') ? POLLIN : 0) |
+                            (mode && strchr(mode, 'w') ? POLLOUT : 0);
+        fds[index].revents = 0;
+        index++;
+        lua_pop(L, 1);
+    }
 
+    // wait
+    int result = poll(fds, count, timeout);
+    if (result < 0 && errno != EINTR) {
+        int error = errno;
+        free(fds);
+        _failure(L, strerror(error));
+    }
 
-    // initialize
+    // ready
     lua_newtable(L);
-    char* item;
-    int itemsz;
-    TCLIST* columns;
-    int count = tclistnum(items);
-
-    // traverse
-    for (; count > 0; count--) {
+    for (index = 0; result > 0 && index < count; index++) {
+        if (fds[index].revents) {
+            lua_pushboolean(L, 1);
+            lua_rawseti(L, -2, fds[index].fd);
+        }
+    }
+    free(fds);
+    return 1;
+}
 
-        // tuple
-        item = tclistshift(items, &itemsz);
-        columns = tcstrsplit2(item + 1, itemsz);
-        free(item);
+/*----------------------------------------------------------------------------------------------------------*/
 
-        // key/values
-        item = tclistshift(columns, &itemsz);
-        lua_pushlstring(L, item, itemsz);
-        free(item);
-        _tclist2luatable(L, columns, 1);
+/*
+ * Plain C interface (see src/ttyrant.h). Like the methods, every call first
+ * settles an iterator left in flight on the handle (see _handle_db()).
+ */
+int ttyrant_get(ttyrant_handle* handle, const void* key, int keysz, void* buffer, int buffersz) {
+    TCRDB* db = _handle_db(handle);
+    if (!db) {
+        return -2;
+    }
+    if (handle->filter && !_filter_test(handle->filter, key, keysz)) {
+        return -1;
+    }
+    int valuesz;
+    void* value = tcrdbget(db, key, keysz, &valuesz);
+    if (!value) {
+        return tcrdbecode(db) == TTENOREC ? -1 : -2;
+    }
+    memcpy(buffer, value, valuesz < buffersz ? valuesz : buffersz);
+    free(value);
+    return valuesz;
+}
+int ttyrant_put(ttyrant_handle* handle, const void* key, int keysz, const void* value, int valuesz) {
+    TCRDB* db = _handle_db(handle);
+    if (!db) {
+        return 0;
+    }
+    if (handle->cache) {
+        _cache_out(handle->cache, key, keysz);
+    }
+    if (handle->filter) {
+        _filter_add(handle->filter, key, keysz);
+    }
+    return tcrdbput(db, key, keysz, value, valuesz);
+}
+int ttyrant_getlist(ttyrant_handle* handle, int count, const char* const* keys, const int* keyszs,
+                    void* buffer, int buffersz, int* valueszs) {
+    TCRDB* db = _handle_db(handle);
+    if (!db) {
+        return -2;
+    }
 
-        // store
-        tclistdel(columns);
-        lua_settable(L, -3);
+    // fetch
+    TCMAP* recs = _scratch_tcmap();
+    int index;
+    for (index = 0; index < count; index++) {
+        if (!handle->filter || _filter_test(handle->filter, keys[index], keyszs[index])) {
+            tcmapput(recs, keys[index], keyszs[index], "", 0);
+        }
+    }
+    if (tcmaprnum(recs) > 0 && !tcrdbget3(db, recs)) {
+        return -2;
     }
-    tclistdel(items);
 
-    // ready
-    return 1;
+    // pack (in the order of the keys)
+    int total = 0;
+    for (index = 0; index < count; index++) {
+        int valuesz;
+        const char* value = tcmapget(recs, keys[index], keyszs[index], &valuesz);
+        valueszs[index] = value ? valuesz : -1;
+        if (value && total + valuesz <= buffersz) {
+            memcpy((char*)buffer + total, value, valuesz);
+        }
+        total += value ? valuesz : 0;
+    }
+    return total;
+}
+int ttyrant_putlist(ttyrant_handle* handle, int count, const char* const* keys, const int* keyszs,
+                    const char* const* values, const int* valueszs) {
+    TCRDB* db = _handle_db(handle);
+    if (!db) {
+        return 0;
+    }
+    TCLIST* items = _scratch_tclist();
+    int index;
+    for (index = 0; index < count; index++) {
+        tclistpush(items, keys[index], keyszs[index]);
+        tclistpush(items, values[index], valueszs[index]);
+    }
+    if (handle->cache) {
+        _cache_out_list(handle->cache, items, 2);
+    }
+    if (handle->filter) {
+        _filter_add_list(handle->filter, items, 2);
+    }
+    TCLIST* result = tcrdbmisc(db, "putlist", 0, items);
+    if (result) {
+        tclistdel(result);
+    }
+    return result != NULL;
+}
+int ttyrant_out(ttyrant_handle* handle, const void* key, int keysz) {
+    TCRDB* db = _handle_db(handle);
+    if (!db) {
+        return 0;
+    }
+    if (handle->cache) {
+        _cache_out(handle->cache, key, keysz);
+    }
+    return tcrdbout(db, key, keysz);
+}
+int ttyrant_addint(ttyrant_handle* handle, const void* key, int keysz, int num, int* result) {
+    TCRDB* db = _handle_db(handle);
+    if (!db) {
+        return 0;
+    }
+    if (handle->cache) {
+        _cache_out(handle->cache, key, keysz);
+    }
+    if (handle->filter) {
+        _filter_add(handle->filter, key, keysz);
+    }
+    *result = tcrdbaddint(db, key, keysz, num);
+    return *result != INT_MIN;
+}
+int ttyrant_ecode(ttyrant_handle* handle) {
+    return handle->db ? tcrdbecode(handle->db) : TTEINVALID;
+}
+const char* ttyrant_errmsg(int ecode) {
+    return tcrdberrmsg(ecode);
 }
 
 /*
- * Count the tuples which correspond to the query object.
+ * Get the time of the monotonic clock in seconds (e.g. for measuring calls).
  *
- * <table> = ttyrant.query:searchcount()
+ * <number> = ttyrant.clock()
  */
-static int luaF_query_searchcount(lua_State* L) {
-    RDBQRY* qry = _self_qry(L);
-    lua_pushinteger(L, tcrdbqrysearchcount(qry));
+static int luaF_clock(lua_State* L) {
+    lua_pushnumber(L, _nsec() / 1e9);
     return 1;
 }
 
 /*
- * Return the query hint string.
+ * Get the plain C interface of the library (for the LuaJIT FFI).
  *
- * <string> = ttyrant.query:hint()
+ * <userdata> = ttyrant.abi()
  */
-static int luaF_query_hint(lua_State* L) {
-    RDBQRY* qry = _self_qry(L);
-
-    // execute
-    lua_pushstring(L, tcrdbqryhint(qry));
+static int luaF_abi(lua_State* L) {
+    static const ttyrant_abi abi = {
+        TTYRANT_ABI_VERSION,
+        ttyrant_get,
+        ttyrant_put,
+        ttyrant_getlist,
+        ttyrant_putlist,
+        ttyrant_out,
+        ttyrant_addint,
+        ttyrant_ecode,
+        ttyrant_errmsg
+    };
+    lua_pushlightuserdata(L, (void*)&abi);
+    lua_pushinteger(L, TTYRANT_ABI_VERSION);
+    return 2;
+}
 
-    // ready
-    return 1;
+/*
+ * Set the given functions into the table at 'index', as closures over the
+ * instance metatables found at 'mts', 'mts' + 1 and 'mts' + 2 (hash, table and
+ * query, see UPV_*). If 'instrument' is 1 the calls are timed and counted into
+ * the metrics of the objects they are called upon (see _instrumented()).
+ */
+static void _publish_into(lua_State* L, int index, const luaL_Reg* regs, int mts, int instrument) {
+    for (; regs->name; regs++) {
+        int op = instrument && regs->func != luaF_any_metrics ? _op_register(regs->name, regs->func) : -1;
+        lua_pushvalue(L, mts);
+        lua_pushvalue(L, mts + 1);
+        lua_pushvalue(L, mts + 2);
+        if (op >= 0) {
+            lua_pushinteger(L, op);
+            lua_pushcclosure(L, _instrumented, 4);
+        } else {
+            lua_pushcclosure(L, regs->func, 3);
+        }
+        lua_setfield(L, index, regs->name);
+    }
 }
 
-/*----------------------------------------------------------------------------------------------------------*/
+/*
+ * Same as luaL_register() with closures over the instance metatables.
+ */
+static void _publish(lua_State* L, const char* name, const luaL_Reg* regs, int mts, int instrument) {
+    const luaL_Reg none[] = { { NULL, NULL } };
+    luaL_register(L, name, none);
+    _publish_into(L, lua_gettop(L), regs, mts, instrument);
+}
 
 /*
  * Entry point.
@@ -1303,6 +7950,8 @@ int luaopen_ttyrant(lua_State* L) {
 
     // base registry
     static const luaL_Reg ttyrant[] = {
+        { "abi",            luaF_abi },
+        { "clock",          luaF_clock },
         { NULL, NULL }
     };
     
@@ -1317,6 +7966,7 @@ int luaopen_ttyrant(lua_State* L) {
         { "putshl",         luaF_hash_putshl },
         { "putnr",          luaF_hash_putnr },
         { "get",            luaF_hash_get },
+        { "getbuffer",      luaF_hash_getbuffer },
         { "vsiz",           luaF_hash_vsiz },
         { "out",            luaF_any_out },
         { "vanish",         luaF_any_vanish },
@@ -1330,6 +7980,20 @@ int luaopen_ttyrant(lua_State* L) {
         { "fwmkeys",        luaF_any_fwmkeys },
         { "restore",        luaF_any_restore },
         { "optimize",       luaF_any_optimize },
+        { "metrics",        luaF_any_metrics },
+        { "hedgestats",     luaF_any_hedgestats },
+        { "parallel",       luaF_any_parallel },
+        { "parallelstats",  luaF_any_parallelstats },
+        { "batch",          luaF_any_batch },
+        { "ext",            luaF_any_ext },
+        { "extmany",        luaF_any_extmany },
+        { "import",         luaF_any_import },
+        { "export",         luaF_any_export },
+        { "cache",          luaF_hash_cache },
+        { "cachestats",     luaF_hash_cachestats },
+        { "filter",         luaF_hash_filter },
+        { "filtersave",     luaF_hash_filtersave },
+        { "filterstats",    luaF_hash_filterstats },
         { NULL, NULL }
     };
 
@@ -1342,6 +8006,7 @@ int luaopen_ttyrant(lua_State* L) {
         { "putcat",         luaF_table_putcat },
         { "putkeep",        luaF_table_putkeep },
         { "get",            luaF_table_get },
+        { "getbuffer",      luaF_table_getbuffer },
         { "setindex",       luaF_table_setindex },
         { "out",            luaF_any_out },
         { "vanish",         luaF_any_vanish },
@@ -1356,6 +8021,15 @@ int luaopen_ttyrant(lua_State* L) {
         { "restore",        luaF_any_restore },
         { "genuid",         luaF_table_genuid },
         { "optimize",       luaF_any_optimize },
+        { "metrics",        luaF_any_metrics },
+        { "hedgestats",     luaF_any_hedgestats },
+        { "parallel",       luaF_any_parallel },
+        { "parallelstats",  luaF_any_parallelstats },
+        { "batch",          luaF_any_batch },
+        { "ext",            luaF_any_ext },
+        { "extmany",        luaF_any_extmany },
+        { "import",         luaF_any_import },
+        { "export",         luaF_any_export },
         { NULL, NULL }
     };
 
@@ -1373,18 +8047,211 @@ int luaopen_ttyrant(lua_State* L) {
         { "searchget",      luaF_query_searchget },
         { "searchout",      luaF_query_searchout },
         { "searchcount",    luaF_query_searchcount },
+        { "cursor",         luaF_query_cursor },
+        { "parasearch",     luaF_query_parasearch },
+        { "metasearch",     luaF_query_metasearch },
+        { "metasearchget",  luaF_query_metasearchget },
+        { "metasearchcount", luaF_query_metasearchcount },
         { "hint",           luaF_query_hint },
         { NULL, NULL }
     };
 
+    // pool registry
+    static const luaL_Reg ttyrant_pool[] = {
+        { "open",           luaF_pool_open },
+        { "checkout",       luaF_pool_checkout },
+        { "checkin",        luaF_pool_checkin },
+        { "stats",          luaF_pool_stats },
+        { NULL, NULL }
+    };
+
+    // cluster registry
+    static const luaL_Reg ttyrant_cluster[] = {
+        { "new",            luaF_cluster_new },
+        { "add",            luaF_cluster_add },
+        { "node",           luaF_cluster_node },
+        { "put",            luaF_cluster_put },
+        { "get",            luaF_cluster_get },
+        { "out",            luaF_cluster_out },
+        { NULL, NULL }
+    };
+
+    // replica set registry
+    static const luaL_Reg ttyrant_replicaset[] = {
+        { "new",            luaF_replicaset_new },
+        { "master",         luaF_replicaset_master },
+        { "reader",         luaF_replicaset_reader },
+        { "get",            luaF_replicaset_get },
+        { "getbuffer",      luaF_replicaset_getbuffer },
+        { "vsiz",           luaF_replicaset_vsiz },
+        { "fwmkeys",        luaF_replicaset_fwmkeys },
+        { "iterator",       luaF_replicaset_iterator },
+        { "put",            luaF_replicaset_put },
+        { "putkeep",        luaF_replicaset_putkeep },
+        { "putcat",         luaF_replicaset_putcat },
+        { "putshl",         luaF_replicaset_putshl },
+        { "putnr",          luaF_replicaset_putnr },
+        { "out",            luaF_replicaset_out },
+        { "increment",      luaF_replicaset_increment },
+        { "failover",       luaF_replicaset_failover },
+        { "stats",          luaF_replicaset_stats },
+        { NULL, NULL }
+    };
+
+    // fake server registry
+    static const luaL_Reg ttyrant_fakes[] = {
+        { "start",          luaF_fake_start },
+        { "stop",           luaF_fake_stop },
+        { "port",           luaF_fake_port },
+        { "address",        luaF_fake_address },
+        { "delay",          luaF_fake_delay },
+        { "lag",            luaF_fake_lag },
+        { "requests",       luaF_fake_requests },
+        { NULL, NULL }
+    };
+
+    // batch registry
+    static const luaL_Reg ttyrant_batch[] = {
+        { "put",            luaF_batch_put },
+        { "putkeep",        luaF_batch_putkeep },
+        { "putcat",         luaF_batch_putcat },
+        { "putnr",          luaF_batch_putnr },
+        { "putshl",         luaF_batch_putshl },
+        { "get",            luaF_batch_get },
+        { "out",            luaF_batch_out },
+        { "vsiz",           luaF_batch_vsiz },
+        { "addint",         luaF_batch_addint },
+        { "increment",      luaF_batch_increment },
+        { "ext",            luaF_batch_ext },
+        { "flush",          luaF_batch_flush },
+        { "clear",          luaF_batch_clear },
+        { NULL, NULL }
+    };
+
+    // non-blocking connection registry
+    static const luaL_Reg ttyrant_socket[] = {
+        { "connect",        luaF_socket_connect },
+        { "poll",           luaF_socket_poll },
+        { "fd",             luaF_socket_fd },
+        { "request",        luaF_socket_request },
+        { "flush",          luaF_socket_flush },
+        { "fill",           luaF_socket_fill },
+        { "response",       luaF_socket_response },
+        { "pending",        luaF_socket_pending },
+        { "close",          luaF_socket_close },
+        { NULL, NULL }
+    };
+
+    // buffer registry
+    static const luaL_Reg ttyrant_buffer[] = {
+        { "free",           luaF_buffer_free },
+        { "tostring",       luaF_buffer_tostring },
+        { "sub",            luaF_buffer_sub },
+        { "write",          luaF_buffer_write },
+        { "ptr",            luaF_buffer_ptr },
+        { NULL, NULL }
+    };
+
+    // iterator state metatable
+    luaL_newmetatable(L, "ttyrant.iterator");
+    lua_pushcfunction(L, _iterator_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // cursor state metatable
+    luaL_newmetatable(L, "ttyrant.cursor");
+    lua_pushcfunction(L, _cursor_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // cluster ring metatable
+    luaL_newmetatable(L, "ttyrant.cluster.ring");
+    lua_pushcfunction(L, _cluster_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // replica set nodes metatable
+    luaL_newmetatable(L, "ttyrant.replicaset.nodes");
+    lua_pushcfunction(L, _replicaset_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // instance metatables
+    luaL_newmetatable(L, "ttyrant.hash.instance");
+    luaL_newmetatable(L, "ttyrant.table.instance");
+    luaL_newmetatable(L, "ttyrant.query.instance");
+    int mts = lua_gettop(L) - 2;
+
     // publish
-    luaL_register(L, "ttyrant", ttyrant);
-    luaL_register(L, "ttyrant", ttyrant_hash);          // depreciated
-    luaL_register(L, "ttyrant.hash", ttyrant_hash);
+    _publish(L, "ttyrant", ttyrant, mts, 0);
+    _publish(L, "ttyrant", ttyrant_hash, mts, 1);          // depreciated
+    _publish(L, "ttyrant.hash", ttyrant_hash, mts, 1);
+    lua_setfield(L, mts, "__index");
+    _publish(L, "ttyrant.table", ttyrant_table, mts, 1);
+    lua_setfield(L, mts + 1, "__index");
+    _publish(L, "ttyrant.query", ttyrant_query, mts, 1);
+    lua_setfield(L, mts + 2, "__index");
+    _publish(L, "ttyrant.pool", ttyrant_pool, mts, 0);
+    lua_pop(L, 1);
+    _publish(L, "ttyrant.cluster", ttyrant_cluster, mts, 0);
+    lua_pop(L, 1);
+    _publish(L, "ttyrant.replicaset", ttyrant_replicaset, mts, 0);
+    lua_pop(L, 1);
+
+    // instance metamethods
+    const luaL_Reg handle_meta[] = {
+        { "__gc",           _handle_gc },
+        { "__tostring",     _handle_tostring },
+        { NULL, NULL }
+    };
+    const luaL_Reg query_meta[] = {
+        { "__gc",           _luaF_query_gc },
+        { "__tostring",     _handle_tostring },
+        { NULL, NULL }
+    };
+    _publish_into(L, mts, handle_meta, mts, 0);
+    _publish_into(L, mts + 1, handle_meta, mts, 0);
+    _publish_into(L, mts + 2, query_meta, mts, 0);
+    lua_remove(L, mts);
+    lua_remove(L, mts);
+    lua_remove(L, mts);
+
+    // fake server metatable
+    luaL_newmetatable(L, "ttyrant.fake");
+    luaL_register(L, "ttyrant.fake", ttyrant_fakes);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, luaF_fake_stop);
+    lua_setfield(L, -2, "__gc");
     lua_pop(L, 1);
-    luaL_register(L, "ttyrant.table", ttyrant_table);
+
+    // batch metatable
+    luaL_newmetatable(L, "ttyrant.batch");
+    luaL_register(L, "ttyrant.batch", ttyrant_batch);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, luaF_batch_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, _batch_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // non-blocking connection metatable
+    luaL_newmetatable(L, "ttyrant.socket");
+    luaL_register(L, "ttyrant.socket", ttyrant_socket);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, luaF_socket_close);
+    lua_setfield(L, -2, "__gc");
     lua_pop(L, 1);
-    luaL_register(L, "ttyrant.query", ttyrant_query);
+
+    // buffer metatable
+    luaL_newmetatable(L, "ttyrant.buffer");
+    luaL_register(L, "ttyrant.buffer", ttyrant_buffer);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, luaF_buffer_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, luaF_buffer_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, luaF_buffer_free);
+    lua_setfield(L, -2, "__gc");
     lua_pop(L, 1);
 
     // ready
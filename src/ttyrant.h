@@ -0,0 +1,115 @@
+/*
+ * Lua-TTyrant
+ *
+ * TokyoTyrant API for Lua.
+ * Copyright (C)2010 by Valeriu Palos. All rights reserved.
+ * This library is under the MIT license (see doc/LICENSE).
+ */
+
+/*
+ * Plain C interface to the hash database objects of the library, for callers
+ * which cannot afford the Lua C API on hot paths (mainly the LuaJIT FFI, see
+ * src/ttyrant_ffi.lua). All functions work on caller-supplied buffers.
+ *
+ * The handle is the payload of a ttyrant.hash object (what the FFI gives when
+ * casting the object to a pointer); it must be kept alive by the caller. The
+ * same functions are reachable through the table returned by ttyrant.abi(),
+ * so there is no need to resolve symbols from the loaded module.
+ *
+ * Unless noted, functions return 1 on success and 0 on failure, in which case
+ * ttyrant_ecode() gives the error code (as tcrdbecode()).
+ *
+ * Keep this file and the ffi.cdef() block of src/ttyrant_ffi.lua in sync, and
+ * bump TTYRANT_ABI_VERSION on any change of layout or semantics.
+ */
+
+#ifndef _TTYRANT_H
+#define _TTYRANT_H
+
+#include <stdint.h>
+
+#define TTYRANT_ABI_VERSION     1
+
+typedef struct ttyrant_handle ttyrant_handle;
+
+/*
+ * Get the value of a key into 'buffer' (at most 'buffersz' bytes). Returns the
+ * size of the value, -1 if the key is missing and -2 on failure. A return value
+ * larger than 'buffersz' means the value did not fit (and only 'buffersz' bytes
+ * were written).
+ */
+int ttyrant_get(ttyrant_handle* handle, const void* key, int keysz, void* buffer, int buffersz);
+
+/*
+ * Store a value under a key (overwriting any existing value).
+ */
+int ttyrant_put(ttyrant_handle* handle, const void* key, int keysz, const void* value, int valuesz);
+
+/*
+ * Get the values of 'count' keys, packed one after the other into 'buffer' (in
+ * the order of the keys), with their sizes into 'valueszs' (-1 for missing
+ * keys). Returns the total size of the values or -2 on failure; if this is
+ * larger than 'buffersz' the call must be repeated with a larger buffer (the
+ * content of 'buffer' and 'valueszs' is then undefined).
+ */
+int ttyrant_getlist(ttyrant_handle* handle, int count, const char* const* keys, const int* keyszs,
+                    void* buffer, int buffersz, int* valueszs);
+
+/*
+ * Store 'count' key-value pairs at once.
+ */
+int ttyrant_putlist(ttyrant_handle* handle, int count, const char* const* keys, const int* keyszs,
+                    const char* const* values, const int* valueszs);
+
+/*
+ * Remove a key.
+ */
+int ttyrant_out(ttyrant_handle* handle, const void* key, int keysz);
+
+/*
+ * Add 'num' to the integer stored under a key, storing the new value into
+ * 'result'.
+ */
+int ttyrant_addint(ttyrant_handle* handle, const void* key, int keysz, int num, int* result);
+
+/*
+ * Get the code and message of the last error on a handle (TTEINVALID when the
+ * handle is closed).
+ */
+int ttyrant_ecode(ttyrant_handle* handle);
+const char* ttyrant_errmsg(int ecode);
+
+/*
+ * All of the above, as given (as a light userdata) by ttyrant.abi().
+ */
+typedef struct {
+    int         version;                // TTYRANT_ABI_VERSION
+    int         (*get)(ttyrant_handle*, const void*, int, void*, int);
+    int         (*put)(ttyrant_handle*, const void*, int, const void*, int);
+    int         (*getlist)(ttyrant_handle*, int, const char* const*, const int*, void*, int, int*);
+    int         (*putlist)(ttyrant_handle*, int, const char* const*, const int*, const char* const*, const int*);
+    int         (*out)(ttyrant_handle*, const void*, int);
+    int         (*addint)(ttyrant_handle*, const void*, int, int, int*);
+    int         (*ecode)(ttyrant_handle*);
+    const char* (*errmsg)(int);
+} ttyrant_abi;
+
+/*
+ * In-process fake server (src/ttyrant_fake.c; not part of the FFI interface).
+ *
+ * Starts listening on 'host' (an IPv4 address, NULL for 127.0.0.1) and 'port'
+ * (0 for any free port) with an in-memory hash (or table, if 'table' is 1)
+ * database, answering each request after 'delay' seconds plus up to 'jitter'
+ * random seconds. Returns NULL on failure (see errno). The replication delay
+ * it reports (set with ttyrant_fake_lag()) is 0 at first.
+ */
+typedef struct ttyrant_fake ttyrant_fake;
+
+ttyrant_fake* ttyrant_fake_start(const char* host, int port, int table, double delay, double jitter);
+void ttyrant_fake_delay(ttyrant_fake* fake, double delay, double jitter);
+void ttyrant_fake_lag(ttyrant_fake* fake, double lag);
+int ttyrant_fake_port(ttyrant_fake* fake);
+uint64_t ttyrant_fake_requests(ttyrant_fake* fake);
+void ttyrant_fake_stop(ttyrant_fake* fake);
+
+#endif
@@ -0,0 +1,407 @@
+--
+-- Lua-TTyrant
+--
+-- TokyoTyrant API for Lua (non-blocking, coroutine based I/O).
+-- Copyright (C)2010 by Valeriu Palos. All rights reserved.
+-- This library is under the MIT license (see doc/LICENSE).
+--
+-- Speaks the Tyrant protocol over non-blocking ttyrant.socket connections and
+-- suspends the calling coroutine whenever its socket is not ready, so that a
+-- single Lua state can keep many requests in flight (requests of different
+-- coroutines sharing a connection are pipelined).
+--
+-- How to wait is up to the host: by default the coroutine yields
+-- (ttyrant.async.WAIT, fd, 'r' | 'w') to whoever resumed it, which must resume
+-- it once the descriptor is ready; the spawn()/run() loop below does exactly
+-- that with poll(2). A 'wait' function given to open() replaces this (e.g. to
+-- hook into an existing event loop). Outside of any coroutine, calls simply
+-- block in poll(2).
+--
+-- Whoever reads the socket decodes the responses of other coroutines too; their
+-- owners, still waiting for the descriptor, are then woken through 'wake' (by
+-- default the spawn()/run() loop's, which hosts with their own 'wait' replace).
+--
+--     local async = require('ttyrant.async')
+--     local db = assert(async.open('localhost:1978'))
+--     for i = 1, 1000 do
+--         async.spawn(function()
+--             assert(db:put('key' .. i, 'value' .. i))
+--             assert(db:get('key' .. i) == 'value' .. i)
+--         end)
+--     end
+--     async.run()
+--
+
+
+--
+-- Import API.
+--
+local ttyrant = require('ttyrant')
+local socket = require('ttyrant.socket')
+
+
+--
+-- Module.
+--
+local M = { WAIT = setmetatable({}, { __tostring = function() return 'ttyrant.async.WAIT' end }) }
+local connection = {}
+connection.__index = connection
+
+
+--
+-- Default way of waiting for a descriptor.
+--
+local function wait(fd, mode)
+    if coroutine.running() then
+        coroutine.yield(M.WAIT, fd, mode)
+    else
+        socket.poll({ [fd] = mode })
+    end
+end
+
+
+--
+-- Break the connection, failing all pending calls.
+--
+local function fail(self, message)
+    if not self.failed then
+        self.failed = message
+        self.sock:close()
+        for ticket, owner in pairs(self.owners) do
+            self.owners[ticket] = nil
+            self.wake(owner)
+        end
+    end
+    return nil, self.failed
+end
+
+
+--
+-- Write all queued requests.
+--
+local function flush(self)
+    while not self.failed do
+        local done, message = self.sock:flush()
+        if done then
+            return true
+        elseif done == nil then
+            return fail(self, message)
+        end
+        self.wait(self.fd, 'w')
+    end
+    return nil, self.failed
+end
+
+
+--
+-- Store a decoded response (in the order of the requests), waking its owner if
+-- it is another coroutine waiting for the descriptor.
+--
+local function store(self, decoded, ...)
+    if not decoded then
+        return false
+    end
+    self.done = self.done + 1
+    self.results[self.done] = { n = select('#', ...), ... }
+    local owner = self.owners[self.done]
+    if owner then
+        self.owners[self.done] = nil
+        if owner ~= coroutine.running() then
+            self.wake(owner)
+        end
+    end
+    return true
+end
+
+
+--
+-- Wait for the response of a request, decoding whatever arrives meanwhile
+-- (possibly the responses of other coroutines).
+--
+local function receive(self, ticket)
+    local results = self.results
+    while true do
+        local result = results[ticket]
+        if result then
+            results[ticket] = nil
+            return unpack(result, 1, result.n)
+        elseif self.failed then
+            return nil, self.failed
+        end
+        if not store(self, self.sock:response()) then
+            local got, message = self.sock:fill()
+            if got == nil then
+                fail(self, message)
+            elseif not got then
+                self.owners[ticket] = coroutine.running()
+                self.wait(self.fd, 'r')
+                self.owners[ticket] = nil
+            end
+        end
+    end
+end
+
+
+--
+-- Send a request and wait for its response.
+--
+local function call(self, ...)
+    if self.failed then
+        return nil, self.failed
+    end
+    local pending = self.issued - self.done
+    local expected = self.sock:request(...) > pending
+    local ticket
+    if expected then
+        self.issued = self.issued + 1
+        ticket = self.issued
+    end
+    local ok, message = flush(self)
+    if not ok then
+        return nil, message
+    elseif not expected then
+        return true
+    end
+    return receive(self, ticket)
+end
+
+
+--
+-- Open a non-blocking connection.
+--
+-- <connection> = ttyrant.async.open('localhost', 1978[, { wait = function(fd, mode) ... end,
+--                                                        wake = function(co) ... end }])
+-- <connection> = ttyrant.async.open('localhost:1978'[, { wait = ..., wake = ... }])
+--
+function M.open(host, port, options)
+    if type(port) == 'table' then
+        port, options = nil, port
+    end
+    local sock, message = socket:connect(host, port)
+    if not sock then
+        return nil, message
+    end
+    return setmetatable({
+        sock = sock,
+        fd = sock:fd(),
+        wait = options and options.wait or wait,
+        wake = options and options.wake or M.wake,
+        issued = 0,
+        done = 0,
+        results = {},
+        owners = {},
+    }, connection)
+end
+
+
+--
+-- <value> = <connection>:get(key)
+-- <table> = <connection>:get{ key1, key2, ... }
+--
+function connection:get(key)
+    if type(key) ~= 'table' then
+        return call(self, 'get', key)
+    end
+    local items, message = call(self, 'misc', 'getlist', key)
+    if not items then
+        return nil, message
+    end
+    local result = {}
+    for index = 1, #items - 1, 2 do
+        result[items[index]] = items[index + 1]
+    end
+    return result
+end
+
+
+--
+-- <boolean> = <connection>:put(key, value)
+-- <boolean> = <connection>:put{ key1 = value1, key2 = value2, ... }
+--
+function connection:put(key, value)
+    if type(key) ~= 'table' then
+        return call(self, 'put', key, value)
+    end
+    local items = {}
+    for k, v in pairs(key) do
+        items[#items + 1] = k
+        items[#items + 1] = v
+    end
+    return call(self, 'misc', 'putlist', items)
+end
+
+
+--
+-- <boolean> = <connection>:putkeep(key, value)
+-- <boolean> = <connection>:putcat(key, value)
+-- <boolean> = <connection>:putnr(key, value)
+--
+function connection:putkeep(key, value)
+    return call(self, 'putkeep', key, value)
+end
+function connection:putcat(key, value)
+    return call(self, 'putcat', key, value)
+end
+function connection:putnr(key, value)
+    return call(self, 'putnr', key, value)
+end
+
+
+--
+-- <boolean> = <connection>:out(key)
+-- <boolean> = <connection>:out{ key1, key2, ... }
+--
+function connection:out(key)
+    if type(key) ~= 'table' then
+        return call(self, 'out', key)
+    end
+    local items, message = call(self, 'misc', 'outlist', key)
+    return items and true, message
+end
+
+
+--
+-- <number> = <connection>:vsiz(key)
+-- <number> = <connection>:addint(key[, num = 1])
+-- <table> = <connection>:fwmkeys(prefix[, max])
+--
+function connection:vsiz(key)
+    return call(self, 'vsiz', key)
+end
+function connection:addint(key, num)
+    return call(self, 'addint', key, num or 1)
+end
+function connection:fwmkeys(prefix, max)
+    return call(self, 'fwmkeys', prefix, max or -1)
+end
+
+
+--
+-- <number> = <connection>:rnum()
+-- <number> = <connection>:size()
+-- <boolean> = <connection>:sync()
+-- <boolean> = <connection>:vanish()
+--
+function connection:rnum()
+    return call(self, 'rnum')
+end
+function connection:size()
+    return call(self, 'size')
+end
+function connection:sync()
+    return call(self, 'sync')
+end
+function connection:vanish()
+    return call(self, 'vanish')
+end
+
+
+--
+-- Call a server-side 'misc' function, returning its result list.
+--
+-- <table> = <connection>:misc(name, { arg1, arg2, ... })
+--
+function connection:misc(name, args)
+    return call(self, 'misc', name, args or {})
+end
+
+
+--
+-- Close the connection (pending calls fail).
+--
+-- <boolean> = <connection>:close()
+--
+function connection:close()
+    fail(self, 'connection closed')
+    return true
+end
+
+
+--
+-- Bundled event loop.
+--
+local ready, waiting = {}, {}
+
+local function resume(co, ...)
+    local ok, signal, fd, mode = coroutine.resume(co, ...)
+    if not ok then
+        error(signal, 0)
+    elseif coroutine.status(co) ~= 'dead' then
+        if signal ~= M.WAIT then
+            error('ttyrant.async: unexpected yield from a spawned coroutine!', 0)
+        end
+        waiting[co] = { fd, mode }
+    end
+end
+
+
+--
+-- Make a coroutine waiting for its descriptor in the bundled loop ready again
+-- (its wait returns early).
+--
+-- ttyrant.async.wake(co)
+--
+function M.wake(co)
+    if waiting[co] then
+        waiting[co] = nil
+        ready[#ready + 1] = { co, n = 0 }
+    end
+end
+
+
+--
+-- Run a function in a new coroutine of the bundled loop (see run()).
+--
+-- <coroutine> = ttyrant.async.spawn(fn, ...)
+--
+function M.spawn(fn, ...)
+    local co = coroutine.create(fn)
+    ready[#ready + 1] = { co, n = select('#', ...), ... }
+    return co
+end
+
+
+--
+-- Run all spawned coroutines until they finish, waiting for their sockets
+-- with poll(2). Errors raised by the coroutines are raised again here. Returns
+-- false if 'timeout' seconds passed first (the rest keep waiting for the next
+-- run).
+--
+-- <boolean> = ttyrant.async.run([timeout])
+--
+function M.run(timeout)
+    local deadline = timeout and ttyrant.clock() + timeout
+    while #ready > 0 or next(waiting) do
+
+        -- run
+        local batch = ready
+        ready = {}
+        for _, item in ipairs(batch) do
+            resume(item[1], unpack(item, 2, item.n + 1))
+        end
+
+        -- wait
+        if next(waiting) then
+            local fds = {}
+            for _, descriptor in pairs(waiting) do
+                local fd, mode = descriptor[1], descriptor[2]
+                fds[fd] = fds[fd] and fds[fd] ~= mode and 'rw' or mode
+            end
+            local left = #ready > 0 and 0 or deadline and math.max(0, deadline - ttyrant.clock())
+            local active = assert(socket.poll(fds, left))
+            for co, descriptor in pairs(waiting) do
+                if active[descriptor[1]] then
+                    waiting[co] = nil
+                    ready[#ready + 1] = { co, n = 0 }
+                end
+            end
+            if #ready == 0 and deadline and ttyrant.clock() >= deadline then
+                return false
+            end
+        end
+    end
+    return true
+end
+
+
+return M
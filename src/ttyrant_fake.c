@@ -0,0 +1,1279 @@
+/*
+ * Lua-TTyrant
+ *
+ * TokyoTyrant API for Lua (in-process fake server).
+ * Copyright (C)2010 by Valeriu Palos. All rights reserved.
+ * This library is under the MIT license (see doc/LICENSE).
+ */
+
+/*
+ * A small stand-in for ttserver, listening on a local TCP port and speaking the
+ * subset of the binary Tyrant protocol used by this library (on an in-memory
+ * hash or table database), with each response held back until a configurable
+ * delay (plus random jitter) has passed since its request arrived. Requests
+ * keep being read meanwhile, so the delays of pipelined requests overlap the
+ * way network round trips do. It is meant for measuring and testing the
+ * batching and pipelining paths without external services, not for keeping
+ * data: there is no persistence, no update log, no replication (the master set
+ * by 'setmst' and the replication delay set by ttyrant_fake_lag() are only
+ * reported by 'stat') and no indexing, queries scan all
+ * records (full-text conditions are not supported) and the only extension
+ * functions are 'echo' and 'incr'.
+ *
+ * Every connection gets its own thread and its own iterator; all of them share
+ * one record map guarded by a mutex.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <tcrdb.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ttyrant.h"
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+#define FAKE_CONNS_MAX      256
+#define FAKE_BUFSIZ         65536
+#define FAKE_ITEM_MAX       (256 << 20)
+
+struct ttyrant_fake {
+    int                 listener;
+    int                 port;
+    int                 table;
+    double              delay;          // seconds
+    double              jitter;         // seconds
+    pthread_t           acceptor;
+    volatile int        stopping;
+    pthread_mutex_t     mutex;          // guards everything below
+    pthread_cond_t      idle;
+    TCMAP*              data;
+    int64_t             uid;
+    uint64_t            requests;
+    char                mhost[256];     // set by 'setmst'
+    int                 mport;
+    uint64_t            rts;
+    double              lag;            // replication delay reported by 'stat' (seconds)
+    int                 conns[FAKE_CONNS_MAX];
+    int                 nconns;
+};
+
+typedef struct {
+    ttyrant_fake*       fake;
+    int                 fd;
+    unsigned int        seed;
+    TCLIST*             iterator;       // keys snapshot taken by 'iterinit'
+    TCXSTR*             out;            // response being assembled
+    TCLIST*             queue;          // responses waiting for their deadline (deadline, then bytes)
+    double              last;           // deadline of the last queued response
+    double              arrival;        // moment the data in 'buffer' was received
+    double              stamp;          // arrival of the request being answered
+    int                 start;
+    int                 end;
+    char                buffer[FAKE_BUFSIZ];
+} _fake_conn;
+
+/*
+ * Query condition and order (see "search").
+ */
+typedef struct {
+    const char*         name;
+    int                 op;
+    int                 negate;
+    const char*         expr;
+    regex_t             regex;
+    int                 compiled;
+} _fake_cond;
+
+typedef struct {
+    const char*         name;           // NULL if unordered
+    int                 type;
+} _fake_order;
+
+typedef struct {
+    const char*         pk;
+    int                 pksz;
+    TCMAP*              cols;
+    const char*         sortval;
+    const _fake_order*  order;
+} _fake_row;
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Monotonic time in seconds.
+ */
+static double _fake_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Socket writing. Returns 0 on failure.
+ */
+static int _fake_send(_fake_conn* conn, const char* cursor, int size) {
+    while (size > 0) {
+        int sent = send(conn->fd, cursor, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return 0;
+        }
+        cursor += sent;
+        size -= sent;
+    }
+    return 1;
+}
+
+/*
+ * Send the queued responses whose deadline passed. Returns 0 on failure.
+ */
+static int _fake_release(_fake_conn* conn) {
+    double now = _fake_now();
+    while (tclistnum(conn->queue) > 0) {
+        int itemsz;
+        const char* item = tclistval(conn->queue, 0, &itemsz);
+        double deadline;
+        memcpy(&deadline, item, sizeof(deadline));
+        if (deadline > now) {
+            break;
+        }
+        int sent = _fake_send(conn, item + sizeof(deadline), itemsz - sizeof(deadline));
+        free(tclistshift(conn->queue, &itemsz));
+        if (!sent) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Socket reading (buffered). All return 0 on failure or end of stream. While
+ * responses are queued, the next request is waited for only until the first
+ * deadline, then that response is sent.
+ */
+static int _fake_fill(_fake_conn* conn) {
+    int size;
+    while (tclistnum(conn->queue) > 0) {
+        double deadline;
+        memcpy(&deadline, tclistval(conn->queue, 0, &size), sizeof(deadline));
+        double wait = deadline - _fake_now();
+        struct pollfd pfd = { conn->fd, POLLIN, 0 };
+        int ready = wait > 0 ? poll(&pfd, 1, (int)ceil(wait * 1000)) : 0;
+        if (ready > 0) {
+            break;
+        }
+        if ((ready < 0 && errno != EINTR) || !_fake_release(conn)) {
+            return 0;
+        }
+    }
+    do {
+        size = recv(conn->fd, conn->buffer, sizeof(conn->buffer), 0);
+    } while (size < 0 && errno == EINTR);
+    conn->arrival = _fake_now();
+    conn->start = 0;
+    conn->end = size > 0 ? size : 0;
+    return size > 0;
+}
+static int _fake_read(_fake_conn* conn, void* target, int size) {
+    char* cursor = target;
+    while (size > 0) {
+        if (conn->start == conn->end && !_fake_fill(conn)) {
+            return 0;
+        }
+        int chunk = conn->end - conn->start < size ? conn->end - conn->start : size;
+        memcpy(cursor, conn->buffer + conn->start, chunk);
+        conn->start += chunk;
+        cursor += chunk;
+        size -= chunk;
+    }
+    return 1;
+}
+static int _fake_getc(_fake_conn* conn) {
+    unsigned char c;
+    return _fake_read(conn, &c, 1) ? c : -1;
+}
+static int _fake_int32(_fake_conn* conn, int* value) {
+    uint32_t raw;
+    if (!_fake_read(conn, &raw, sizeof(raw))) {
+        return 0;
+    }
+    *value = (int)ntohl(raw);
+    return 1;
+}
+static int _fake_int64(_fake_conn* conn, int64_t* value) {
+    uint32_t raw[2];
+    if (!_fake_read(conn, raw, sizeof(raw))) {
+        return 0;
+    }
+    *value = (int64_t)(((uint64_t)ntohl(raw[0]) << 32) | ntohl(raw[1]));
+    return 1;
+}
+
+/*
+ * Read 'size' bytes into a new zero-terminated buffer (to be freed by the caller).
+ */
+static char* _fake_bytes(_fake_conn* conn, int size) {
+    if (size < 0 || size > FAKE_ITEM_MAX) {
+        return NULL;
+    }
+    char* buffer = malloc(size + 1);
+    if (buffer && !_fake_read(conn, buffer, size)) {
+        free(buffer);
+        return NULL;
+    }
+    if (buffer) {
+        buffer[size] = '\0';
+    }
+    return buffer;
+}
+
+/*
+ * Response assembly.
+ */
+static void _fake_code(_fake_conn* conn, int code) {
+    unsigned char c = code;
+    tcxstrcat(conn->out, &c, 1);
+}
+static void _fake_put32(_fake_conn* conn, int value) {
+    uint32_t raw = htonl((uint32_t)value);
+    tcxstrcat(conn->out, &raw, sizeof(raw));
+}
+static void _fake_put64(_fake_conn* conn, int64_t value) {
+    uint32_t raw[2] = { htonl((uint32_t)((uint64_t)value >> 32)), htonl((uint32_t)value) };
+    tcxstrcat(conn->out, raw, sizeof(raw));
+}
+static void _fake_item(_fake_conn* conn, const void* item, int itemsz) {
+    _fake_put32(conn, itemsz);
+    tcxstrcat(conn->out, item, itemsz);
+}
+
+/*
+ * Queue the assembled response until the configured delay (plus jitter) has
+ * passed since its request arrived (responses keep their order, so a deadline
+ * never precedes the previous one), then send whatever is due.
+ */
+static int _fake_flush(_fake_conn* conn) {
+
+    // deadline
+    pthread_mutex_lock(&conn->fake->mutex);
+    double delay = conn->fake->delay;
+    double jitter = conn->fake->jitter;
+    conn->fake->requests++;
+    pthread_mutex_unlock(&conn->fake->mutex);
+    if (jitter > 0) {
+        delay += jitter * rand_r(&conn->seed) / RAND_MAX;
+    }
+    double deadline = conn->stamp + delay;
+    if (deadline < conn->last) {
+        deadline = conn->last;
+    }
+    conn->last = deadline;
+
+    // queue
+    int size = tcxstrsize(conn->out);
+    char* item = malloc(sizeof(deadline) + size);
+    if (!item) {
+        return 0;
+    }
+    memcpy(item, &deadline, sizeof(deadline));
+    memcpy(item + sizeof(deadline), tcxstrptr(conn->out), size);
+    tclistpushmalloc(conn->queue, item, sizeof(deadline) + size);
+    tcxstrclear(conn->out);
+
+    // send
+    return _fake_release(conn);
+}
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Store a record as Tyrant does for the 'put*' commands.
+ */
+static int _fake_store(ttyrant_fake* fake, int cmd, const char* key, int keysz,
+                       const char* value, int valuesz, int width) {
+    switch (cmd) {
+        case TTCMDPUTKEEP:
+            return tcmapputkeep(fake->data, key, keysz, value, valuesz);
+        case TTCMDPUTCAT:
+            tcmapputcat(fake->data, key, keysz, value, valuesz);
+            return 1;
+        case TTCMDPUTSHL: {
+            int oldsz = 0;
+            const char* old = tcmapget(fake->data, key, keysz, &oldsz);
+            char* joined = malloc(oldsz + valuesz + 1);
+            if (!joined) {
+                return 0;
+            }
+            memcpy(joined, old ? old : "", oldsz);
+            memcpy(joined + oldsz, value, valuesz);
+            int size = oldsz + valuesz;
+            int skip = width >= 0 && size > width ? size - width : 0;
+            tcmapput(fake->data, key, keysz, joined + skip, size - skip);
+            free(joined);
+            return 1;
+        }
+        default:
+            tcmapput(fake->data, key, keysz, value, valuesz);
+            return 1;
+    }
+}
+
+/*
+ * Parse the numeric value of a column (or of a search expression).
+ */
+static double _fake_number(const char* value) {
+    return value ? tcatof(value) : 0;
+}
+
+/*
+ * Check whether any of the tokens (separated by spaces or commas) of 'expr'
+ * satisfies 'match' against 'value' ('all' requires all tokens to).
+ */
+static int _fake_tokens(const char* value, const char* expr, int all, int numeric) {
+    char* tokens = strdup(expr);
+    char* state = NULL;
+    char* token;
+    int   result = all;
+    for (token = strtok_r(tokens, " ,", &state); token; token = strtok_r(NULL, " ,", &state)) {
+        int hit;
+        if (numeric) {
+            hit = _fake_number(value) == _fake_number(token);
+        } else if (all < 0) {
+            hit = !strcmp(value, token);
+        } else {
+            // word match (tokens of the value separated by spaces or commas)
+            const char* found = value;
+            int tokensz = strlen(token);
+            hit = 0;
+            while ((found = strstr(found, token)) != NULL) {
+                int left = found == value || found[-1] == ' ' || found[-1] == ',';
+                int right = found[tokensz] == '\0' || found[tokensz] == ' ' || found[tokensz] == ',';
+                if (left && right) {
+                    hit = 1;
+                    break;
+                }
+                found++;
+            }
+        }
+        if (all > 0 && !hit) {
+            result = 0;
+            break;
+        } else if (all <= 0 && hit) {
+            result = 1;
+            break;
+        }
+    }
+    free(tokens);
+    return result;
+}
+
+/*
+ * Check one condition against a record (returns -1 for unsupported operators).
+ */
+static int _fake_match(_fake_cond* cond, const char* pk, TCMAP* cols) {
+    const char* value = cond->name[0] ? tcmapget2(cols, cond->name) : pk;
+    int hit = 0;
+    if (value) {
+        size_t valuesz = strlen(value);
+        size_t exprsz = strlen(cond->expr);
+        switch (cond->op) {
+            case RDBQCSTREQ:    hit = !strcmp(value, cond->expr); break;
+            case RDBQCSTRINC:   hit = strstr(value, cond->expr) != NULL; break;
+            case RDBQCSTRBW:    hit = !strncmp(value, cond->expr, exprsz); break;
+            case RDBQCSTREW:    hit = valuesz >= exprsz && !strcmp(value + valuesz - exprsz, cond->expr); break;
+            case RDBQCSTRAND:   hit = _fake_tokens(value, cond->expr, 1, 0); break;
+            case RDBQCSTROR:    hit = _fake_tokens(value, cond->expr, 0, 0); break;
+            case RDBQCSTROREQ:  hit = _fake_tokens(value, cond->expr, -1, 0); break;
+            case RDBQCSTRRX:
+                if (!cond->compiled) {
+                    if (regcomp(&cond->regex, cond->expr, REG_EXTENDED | REG_NOSUB)) {
+                        return -1;
+                    }
+                    cond->compiled = 1;
+                }
+                hit = !regexec(&cond->regex, value, 0, NULL, 0);
+                break;
+            case RDBQCNUMEQ:    hit = _fake_number(value) == _fake_number(cond->expr); break;
+            case RDBQCNUMGT:    hit = _fake_number(value) > _fake_number(cond->expr); break;
+            case RDBQCNUMGE:    hit = _fake_number(value) >= _fake_number(cond->expr); break;
+            case RDBQCNUMLT:    hit = _fake_number(value) < _fake_number(cond->expr); break;
+            case RDBQCNUMLE:    hit = _fake_number(value) <= _fake_number(cond->expr); break;
+            case RDBQCNUMBT: {
+                const char* second = cond->expr + strcspn(cond->expr, " ,");
+                double low = _fake_number(cond->expr);
+                double high = *second ? _fake_number(second + 1) : low;
+                if (low > high) {
+                    double swap = low;
+                    low = high;
+                    high = swap;
+                }
+                hit = _fake_number(value) >= low && _fake_number(value) <= high;
+                break;
+            }
+            case RDBQCNUMOREQ:  hit = _fake_tokens(value, cond->expr, 0, 1); break;
+            default:
+                return -1;
+        }
+    }
+    return cond->negate ? !hit : hit;
+}
+
+/*
+ * Order of two query results.
+ */
+static int _fake_compare(const void* a, const void* b) {
+    const _fake_row* first = a;
+    const _fake_row* second = b;
+    const char* x = first->sortval ? first->sortval : "";
+    const char* y = second->sortval ? second->sortval : "";
+    int result;
+    switch (first->order->type) {
+        case RDBQONUMASC:
+        case RDBQONUMDESC: {
+            double dx = _fake_number(x), dy = _fake_number(y);
+            result = dx < dy ? -1 : dx > dy;
+            break;
+        }
+        default:
+            result = strcmp(x, y);
+    }
+    return first->order->type == RDBQOSTRDESC || first->order->type == RDBQONUMDESC ? -result : result;
+}
+
+/*
+ * Run a 'search' (args as built by tcrdbqrysearch() and friends). Must be
+ * called with the record map locked.
+ */
+static TCLIST* _fake_search(ttyrant_fake* fake, const TCLIST* args) {
+
+    // initialize
+    int         argc = tclistnum(args);
+    _fake_cond* conds = calloc(argc + 1, sizeof(_fake_cond));
+    _fake_order order = { NULL, 0 };
+    TCLIST*     parts = tclistnew();
+    TCLIST*     get = NULL;
+    int         nconds = 0, max = -1, skip = 0, out = 0, count = 0;
+    int         index, partsz;
+
+    // parse
+    for (index = 0; index < argc; index++) {
+        int argsz;
+        const char* arg = tclistval(args, index, &argsz);
+        TCLIST* split = tcstrsplit2(arg, argsz);
+        const char* name = tclistval2(split, 0);
+        tclistpush(parts, &split, sizeof(split));
+        if (!strcmp(name, "addcond") && tclistnum(split) >= 4) {
+            int op = atoi(tclistval2(split, 2));
+            conds[nconds].name = tclistval2(split, 1);
+            conds[nconds].op = op & ~(RDBQCNEGATE | RDBQCNOIDX);
+            conds[nconds].negate = (op & RDBQCNEGATE) != 0;
+            conds[nconds].expr = tclistval2(split, 3);
+            nconds++;
+        } else if (!strcmp(name, "setorder") && tclistnum(split) >= 3) {
+            order.name = tclistval2(split, 1);
+            order.type = atoi(tclistval2(split, 2));
+        } else if (!strcmp(name, "setlimit") && tclistnum(split) >= 3) {
+            max = atoi(tclistval2(split, 1));
+            skip = atoi(tclistval2(split, 2));
+        } else if (!strcmp(name, "get")) {
+            get = split;
+        } else if (!strcmp(name, "out")) {
+            out = 1;
+        } else if (!strcmp(name, "count")) {
+            count = 1;
+        }
+    }
+
+    // scan
+    int         rnum = tcmaprnum(fake->data);
+    _fake_row*  rows = calloc(rnum + 1, sizeof(_fake_row));
+    int         nrows = 0, failed = 0;
+    const char* pk;
+    int         pksz;
+    tcmapiterinit(fake->data);
+    while (!failed && (pk = tcmapiternext(fake->data, &pksz)) != NULL) {
+        int valuesz;
+        const char* value = tcmapiterval(pk, &valuesz);
+        TCMAP* cols = tcstrsplit4(value, valuesz);
+        int hit = 1, cond;
+        for (cond = 0; hit > 0 && cond < nconds; cond++) {
+            hit = _fake_match(&conds[cond], pk, cols);
+        }
+        if (hit > 0) {
+            rows[nrows].pk = pk;
+            rows[nrows].pksz = pksz;
+            rows[nrows].cols = cols;
+            rows[nrows].order = &order;
+            if (order.name) {
+                rows[nrows].sortval = order.name[0] ? tcmapget2(cols, order.name) : pk;
+            }
+            nrows++;
+        } else {
+            failed = hit < 0;
+            tcmapdel(cols);
+        }
+    }
+
+    // order and limit
+    if (order.name) {
+        qsort(rows, nrows, sizeof(_fake_row), _fake_compare);
+    }
+    int first = skip > 0 ? (skip < nrows ? skip : nrows) : 0;
+    int last = max >= 0 && first + max < nrows ? first + max : nrows;
+
+    // results
+    TCLIST* result = failed ? NULL : tclistnew();
+    for (index = first; result && index < last; index++) {
+        if (get) {
+            TCMAP* row = tcmapnew();
+            tcmapput(row, "", 0, rows[index].pk, rows[index].pksz);
+            const char* col;
+            int colsz, valsz, column;
+            tcmapiterinit(rows[index].cols);
+            while ((col = tcmapiternext(rows[index].cols, &colsz)) != NULL) {
+                const char* val = tcmapiterval(col, &valsz);
+                int wanted = tclistnum(get) <= 1;
+                for (column = 1; !wanted && column < tclistnum(get); column++) {
+                    wanted = !strcmp(tclistval2(get, column), col);
+                }
+                if (wanted) {
+                    tcmapput(row, col, colsz, val, valsz);
+                }
+            }
+            int rowsz;
+            char* serialized = tcstrjoin4(row, &rowsz);
+            tclistpush(result, serialized, rowsz);
+            free(serialized);
+            tcmapdel(row);
+        } else if (!count) {
+            tclistpush(result, rows[index].pk, rows[index].pksz);
+        }
+    }
+    if (result && count) {
+        char number[32];
+        tclistpush(result, number, snprintf(number, sizeof(number), "%d", last - first));
+    }
+    if (result && out) {
+        TCLIST* keys = tclistnew();
+        for (index = first; index < last; index++) {
+            tclistpush(keys, rows[index].pk, rows[index].pksz);
+        }
+        for (index = 0; index < tclistnum(keys); index++) {
+            const char* key = tclistval(keys, index, &pksz);
+            tcmapout(fake->data, key, pksz);
+        }
+        tclistdel(keys);
+    }
+
+    // cleanup
+    for (index = 0; index < nrows; index++) {
+        tcmapdel(rows[index].cols);
+    }
+    for (index = 0; index < nconds; index++) {
+        if (conds[index].compiled) {
+            regfree(&conds[index].regex);
+        }
+    }
+    for (index = 0; index < tclistnum(parts); index++) {
+        tclistdel(*(TCLIST**)tclistval(parts, index, &partsz));
+    }
+    tclistdel(parts);
+    free(rows);
+    free(conds);
+
+    // ready
+    return result;
+}
+
+/*
+ * Run a 'misc' function (NULL on failure). Must be called with the record map
+ * locked.
+ */
+static TCLIST* _fake_misc(ttyrant_fake* fake, const char* name, const TCLIST* args) {
+
+    // initialize
+    int     argc = tclistnum(args);
+    int     index, keysz, valuesz;
+    TCLIST* result = tclistnew();
+
+    // hash and table
+    if (!strcmp(name, "putlist")) {
+        for (index = 0; index + 1 < argc; index += 2) {
+            const char* key = tclistval(args, index, &keysz);
+            const char* value = tclistval(args, index + 1, &valuesz);
+            tcmapput(fake->data, key, keysz, value, valuesz);
+        }
+        return result;
+    } else if (!strcmp(name, "outlist")) {
+        for (index = 0; index < argc; index++) {
+            const char* key = tclistval(args, index, &keysz);
+            tcmapout(fake->data, key, keysz);
+        }
+        return result;
+    } else if (!strcmp(name, "getlist")) {
+        for (index = 0; index < argc; index++) {
+            const char* key = tclistval(args, index, &keysz);
+            const char* value = tcmapget(fake->data, key, keysz, &valuesz);
+            if (value) {
+                tclistpush(result, key, keysz);
+                tclistpush(result, value, valuesz);
+            }
+        }
+        return result;
+    } else if (!strcmp(name, "vanish")) {
+        tcmapclear(fake->data);
+        return result;
+    } else if (!strcmp(name, "sync")) {
+        return result;
+    }
+
+    // hash only
+    if (!fake->table && argc >= 1) {
+        const char* key = tclistval(args, 0, &keysz);
+        if (!strcmp(name, "put") && argc >= 2) {
+            const char* value = tclistval(args, 1, &valuesz);
+            tcmapput(fake->data, key, keysz, value, valuesz);
+            return result;
+        } else if (!strcmp(name, "out")) {
+            if (tcmapout(fake->data, key, keysz)) {
+                return result;
+            }
+        } else if (!strcmp(name, "get")) {
+            const char* value = tcmapget(fake->data, key, keysz, &valuesz);
+            if (value) {
+                tclistpush(result, value, valuesz);
+                return result;
+            }
+        }
+        tclistdel(result);
+        return NULL;
+    }
+
+    // table only
+    if (fake->table) {
+        if ((!strcmp(name, "put") || !strcmp(name, "putkeep") || !strcmp(name, "putcat")) && argc >= 1) {
+            const char* pk = tclistval(args, 0, &keysz);
+            int oldsz;
+            const char* old = tcmapget(fake->data, pk, keysz, &oldsz);
+            if (old && !strcmp(name, "putkeep")) {
+                tclistdel(result);
+                return NULL;
+            }
+            TCMAP* cols = old && !strcmp(name, "putcat") ? tcstrsplit4(old, oldsz) : tcmapnew();
+            for (index = 1; index + 1 < argc; index += 2) {
+                const char* col = tclistval(args, index, &keysz);
+                const char* value = tclistval(args, index + 1, &valuesz);
+                if (strcmp(name, "putcat") || !tcmapget(cols, col, keysz, &oldsz)) {
+                    tcmapput(cols, col, keysz, value, valuesz);
+                }
+            }
+            char* serialized = tcstrjoin4(cols, &valuesz);
+            pk = tclistval(args, 0, &keysz);
+            tcmapput(fake->data, pk, keysz, serialized, valuesz);
+            free(serialized);
+            tcmapdel(cols);
+            return result;
+        } else if (!strcmp(name, "out") && argc >= 1) {
+            const char* pk = tclistval(args, 0, &keysz);
+            if (tcmapout(fake->data, pk, keysz)) {
+                return result;
+            }
+        } else if (!strcmp(name, "get") && argc >= 1) {
+            const char* pk = tclistval(args, 0, &keysz);
+            const char* value = tcmapget(fake->data, pk, keysz, &valuesz);
+            if (value) {
+                TCLIST* items = tcstrsplit2(value, valuesz);
+                tclistdel(result);
+                return items;
+            }
+        } else if (!strcmp(name, "setindex")) {
+            return result;
+        } else if (!strcmp(name, "genuid")) {
+            char number[32];
+            tclistpush(result, number, snprintf(number, sizeof(number), "%lld", (long long)++fake->uid));
+            return result;
+        } else if (!strcmp(name, "search")) {
+            tclistdel(result);
+            return _fake_search(fake, args);
+        }
+    }
+
+    // unsupported
+    tclistdel(result);
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Serve one request (0 to close the connection).
+ */
+static int _fake_request(_fake_conn* conn) {
+
+    // initialize
+    ttyrant_fake* fake = conn->fake;
+    int magic = _fake_getc(conn);
+    conn->stamp = conn->arrival;
+    int cmd = _fake_getc(conn);
+    int keysz = 0, valuesz = 0, num = 0, result = 1;
+    char* key = NULL;
+    char* value = NULL;
+    if (magic != TTMAGICNUM || cmd < 0) {
+        return 0;
+    }
+
+    // dispatch
+    switch (cmd) {
+
+        // value writers
+        case TTCMDPUT:
+        case TTCMDPUTKEEP:
+        case TTCMDPUTCAT:
+        case TTCMDPUTSHL:
+        case TTCMDPUTNR: {
+            if (!_fake_int32(conn, &keysz) || !_fake_int32(conn, &valuesz) ||
+                (cmd == TTCMDPUTSHL && !_fake_int32(conn, &num)) ||
+                !(key = _fake_bytes(conn, keysz)) || !(value = _fake_bytes(conn, valuesz))) {
+                result = 0;
+                break;
+            }
+            pthread_mutex_lock(&fake->mutex);
+            int stored = _fake_store(fake, cmd, key, keysz, value, valuesz, num);
+            pthread_mutex_unlock(&fake->mutex);
+            if (cmd == TTCMDPUTNR) {
+                break;
+            }
+            _fake_code(conn, stored ? 0 : 1);
+            result = _fake_flush(conn);
+            break;
+        }
+
+        // single key readers/removers
+        case TTCMDOUT:
+        case TTCMDGET:
+        case TTCMDVSIZ: {
+            if (!_fake_int32(conn, &keysz) || !(key = _fake_bytes(conn, keysz))) {
+                result = 0;
+                break;
+            }
+            pthread_mutex_lock(&fake->mutex);
+            if (cmd == TTCMDOUT) {
+                _fake_code(conn, tcmapout(fake->data, key, keysz) ? 0 : 1);
+            } else {
+                const char* found = tcmapget(fake->data, key, keysz, &valuesz);
+                _fake_code(conn, found ? 0 : 1);
+                if (found && cmd == TTCMDGET) {
+                    _fake_item(conn, found, valuesz);
+                } else if (found) {
+                    _fake_put32(conn, valuesz);
+                }
+            }
+            pthread_mutex_unlock(&fake->mutex);
+            result = _fake_flush(conn);
+            break;
+        }
+
+        // multiple keys reader
+        case TTCMDMGET: {
+            int count, index;
+            TCLIST* keys = tclistnew();
+            result = _fake_int32(conn, &count);
+            for (index = 0; result && index < count; index++) {
+                result = _fake_int32(conn, &keysz) && (key = _fake_bytes(conn, keysz));
+                if (result) {
+                    tclistpush(keys, key, keysz);
+                    free(key);
+                    key = NULL;
+                }
+            }
+            if (result) {
+                TCXSTR* found = tcxstrnew();
+                int hits = 0;
+                pthread_mutex_lock(&fake->mutex);
+                for (index = 0; index < tclistnum(keys); index++) {
+                    const char* k = tclistval(keys, index, &keysz);
+                    const char* v = tcmapget(fake->data, k, keysz, &valuesz);
+                    if (v) {
+                        uint32_t sizes[2] = { htonl(keysz), htonl(valuesz) };
+                        tcxstrcat(found, sizes, sizeof(sizes));
+                        tcxstrcat(found, k, keysz);
+                        tcxstrcat(found, v, valuesz);
+                        hits++;
+                    }
+                }
+                pthread_mutex_unlock(&fake->mutex);
+                _fake_code(conn, 0);
+                _fake_put32(conn, hits);
+                tcxstrcat(conn->out, tcxstrptr(found), tcxstrsize(found));
+                tcxstrdel(found);
+                result = _fake_flush(conn);
+            }
+            tclistdel(keys);
+            break;
+        }
+
+        // iterator
+        case TTCMDITERINIT:
+            if (conn->iterator) {
+                tclistdel(conn->iterator);
+            }
+            pthread_mutex_lock(&fake->mutex);
+            conn->iterator = tcmapkeys(fake->data);
+            pthread_mutex_unlock(&fake->mutex);
+            _fake_code(conn, 0);
+            result = _fake_flush(conn);
+            break;
+        case TTCMDITERNEXT: {
+            char* next = conn->iterator ? tclistshift(conn->iterator, &keysz) : NULL;
+            _fake_code(conn, next ? 0 : 1);
+            if (next) {
+                _fake_item(conn, next, keysz);
+                free(next);
+            }
+            result = _fake_flush(conn);
+            break;
+        }
+
+        // prefix matching
+        case TTCMDFWMKEYS: {
+            if (!_fake_int32(conn, &keysz) || !_fake_int32(conn, &num) || !(key = _fake_bytes(conn, keysz))) {
+                result = 0;
+                break;
+            }
+            TCLIST* matches = tclistnew();
+            const char* k;
+            pthread_mutex_lock(&fake->mutex);
+            tcmapiterinit(fake->data);
+            while ((num < 0 || tclistnum(matches) < num) && (k = tcmapiternext(fake->data, &valuesz)) != NULL) {
+                if (valuesz >= keysz && !memcmp(k, key, keysz)) {
+                    tclistpush(matches, k, valuesz);
+                }
+            }
+            pthread_mutex_unlock(&fake->mutex);
+            int index;
+            _fake_code(conn, 0);
+            _fake_put32(conn, tclistnum(matches));
+            for (index = 0; index < tclistnum(matches); index++) {
+                k = tclistval(matches, index, &valuesz);
+                _fake_item(conn, k, valuesz);
+            }
+            tclistdel(matches);
+            result = _fake_flush(conn);
+            break;
+        }
+
+        // counters
+        case TTCMDADDINT: {
+            if (!_fake_int32(conn, &keysz) || !_fake_int32(conn, &num) || !(key = _fake_bytes(conn, keysz))) {
+                result = 0;
+                break;
+            }
+            pthread_mutex_lock(&fake->mutex);
+            const char* old = tcmapget(fake->data, key, keysz, &valuesz);
+            int ok = !old || valuesz == sizeof(int);
+            if (old && ok) {
+                int current;
+                memcpy(&current, old, sizeof(current));
+                num += current;
+            }
+            if (ok) {
+                tcmapput(fake->data, key, keysz, &num, sizeof(num));
+            }
+            pthread_mutex_unlock(&fake->mutex);
+            _fake_code(conn, ok ? 0 : 1);
+            if (ok) {
+                _fake_put32(conn, num);
+            }
+            result = _fake_flush(conn);
+            break;
+        }
+        case TTCMDADDDOUBLE: {
+            int64_t integ, fract;
+            if (!_fake_int32(conn, &keysz) || !_fake_int64(conn, &integ) || !_fake_int64(conn, &fract) ||
+                !(key = _fake_bytes(conn, keysz))) {
+                result = 0;
+                break;
+            }
+            double sum = integ + fract / 1e12;
+            pthread_mutex_lock(&fake->mutex);
+            const char* old = tcmapget(fake->data, key, keysz, &valuesz);
+            int ok = !old || valuesz == sizeof(double);
+            if (old && ok) {
+                double current;
+                memcpy(&current, old, sizeof(current));
+                sum += current;
+            }
+            if (ok) {
+                tcmapput(fake->data, key, keysz, &sum, sizeof(sum));
+            }
+            pthread_mutex_unlock(&fake->mutex);
+            _fake_code(conn, ok ? 0 : 1);
+            if (ok) {
+                double whole;
+                double part = modf(sum, &whole);
+                _fake_put64(conn, (int64_t)whole);
+                _fake_put64(conn, (int64_t)(part * 1e12));
+            }
+            result = _fake_flush(conn);
+            break;
+        }
+
+        // database
+        case TTCMDSYNC:
+        case TTCMDVANISH:
+            if (cmd == TTCMDVANISH) {
+                pthread_mutex_lock(&fake->mutex);
+                tcmapclear(fake->data);
+                pthread_mutex_unlock(&fake->mutex);
+            }
+            _fake_code(conn, 0);
+            result = _fake_flush(conn);
+            break;
+        case TTCMDOPTIMIZE:
+        case TTCMDCOPY:
+            if (!_fake_int32(conn, &keysz) || !(key = _fake_bytes(conn, keysz))) {
+                result = 0;
+                break;
+            }
+            _fake_code(conn, cmd == TTCMDOPTIMIZE ? 0 : 1);
+            result = _fake_flush(conn);
+            break;
+        case TTCMDRNUM:
+        case TTCMDSIZE:
+            pthread_mutex_lock(&fake->mutex);
+            _fake_code(conn, 0);
+            _fake_put64(conn, cmd == TTCMDRNUM ? tcmaprnum(fake->data) : tcmapmsiz(fake->data));
+            pthread_mutex_unlock(&fake->mutex);
+            result = _fake_flush(conn);
+            break;
+        case TTCMDSTAT: {
+            char stat[512];
+            pthread_mutex_lock(&fake->mutex);
+            int statsz = snprintf(stat, sizeof(stat),
+                                  "version\t1.1.41 (fake)\ntype\t%s\nrnum\t%llu\nsize\t%llu\nrequests\t%llu\n"
+                                  "mhost\t%s\nmport\t%d\nrts\t%llu\ndelay\t%.6f\n",
+                                  fake->table ? "table" : "hash",
+                                  (unsigned long long)tcmaprnum(fake->data),
+                                  (unsigned long long)tcmapmsiz(fake->data),
+                                  (unsigned long long)fake->requests,
+                                  fake->mhost, fake->mport, (unsigned long long)fake->rts, fake->lag);
+            pthread_mutex_unlock(&fake->mutex);
+            _fake_code(conn, 0);
+            _fake_item(conn, stat, statsz);
+            result = _fake_flush(conn);
+            break;
+        }
+
+        // replication master (only recorded)
+        case TTCMDSETMST: {
+            int hostsz, mport, opts;
+            int64_t rts;
+            result = _fake_int32(conn, &hostsz) && _fake_int32(conn, &mport) &&
+                     _fake_int64(conn, &rts) && _fake_int32(conn, &opts);
+            char* host = result ? _fake_bytes(conn, hostsz) : NULL;
+            if (host) {
+                pthread_mutex_lock(&fake->mutex);
+                snprintf(fake->mhost, sizeof(fake->mhost), "%s", host);
+                fake->mport = mport;
+                fake->rts = rts;
+                pthread_mutex_unlock(&fake->mutex);
+                free(host);
+                _fake_code(conn, 0);
+                result = _fake_flush(conn);
+            } else {
+                result = 0;
+            }
+            break;
+        }
+
+        // extensions ('echo' answers the key followed by the value and 'incr' adds the value to the decimal
+        // number stored at the key and answers the sum, like the sample scripts of ttserver; others fail)
+        case TTCMDEXT: {
+            int namesz, opts;
+            result = _fake_int32(conn, &namesz) && _fake_int32(conn, &opts) &&
+                     _fake_int32(conn, &keysz) && _fake_int32(conn, &valuesz);
+            char* name = result ? _fake_bytes(conn, namesz) : NULL;
+            result = name && (key = _fake_bytes(conn, keysz)) && (value = _fake_bytes(conn, valuesz));
+            if (result && !strcmp(name, "echo")) {
+                _fake_code(conn, 0);
+                _fake_put32(conn, keysz + valuesz);
+                tcxstrcat(conn->out, key, keysz);
+                tcxstrcat(conn->out, value, valuesz);
+            } else if (result && !strcmp(name, "incr")) {
+                char number[32];
+                int size;
+                pthread_mutex_lock(&fake->mutex);
+                const char* found = tcmapget(fake->data, key, keysz, &size);
+                size = snprintf(number, sizeof(number), "%lld",
+                                (found ? strtoll(found, NULL, 10) : 0) + strtoll(value, NULL, 10));
+                tcmapput(fake->data, key, keysz, number, size);
+                pthread_mutex_unlock(&fake->mutex);
+                _fake_code(conn, 0);
+                _fake_item(conn, number, size);
+            } else if (result) {
+                _fake_code(conn, 1);
+            }
+            free(name);
+            if (result) {
+                result = _fake_flush(conn);
+            }
+            break;
+        }
+
+        // misc functions
+        case TTCMDMISC: {
+            int namesz, opts, count, index;
+            char* name = NULL;
+            TCLIST* args = tclistnew();
+            result = _fake_int32(conn, &namesz) && _fake_int32(conn, &opts) && _fake_int32(conn, &count) &&
+                     (name = _fake_bytes(conn, namesz)) != NULL;
+            for (index = 0; result && index < count; index++) {
+                result = _fake_int32(conn, &keysz) && (key = _fake_bytes(conn, keysz));
+                if (result) {
+                    tclistpush(args, key, keysz);
+                    free(key);
+                    key = NULL;
+                }
+            }
+            if (result) {
+                pthread_mutex_lock(&fake->mutex);
+                TCLIST* items = _fake_misc(fake, name, args);
+                pthread_mutex_unlock(&fake->mutex);
+                _fake_code(conn, items ? 0 : 1);
+                if (items) {
+                    _fake_put32(conn, tclistnum(items));
+                    for (index = 0; index < tclistnum(items); index++) {
+                        const char* item = tclistval(items, index, &valuesz);
+                        _fake_item(conn, item, valuesz);
+                    }
+                    tclistdel(items);
+                }
+                result = _fake_flush(conn);
+            }
+            free(name);
+            tclistdel(args);
+            break;
+        }
+
+        // anything else (restore, repl...) ends the connection
+        default:
+            result = 0;
+    }
+
+    // ready
+    free(key);
+    free(value);
+    return result;
+}
+
+/*
+ * Connection thread.
+ */
+static void* _fake_serve(void* arg) {
+
+    // serve
+    _fake_conn* conn = arg;
+    while (!conn->fake->stopping && _fake_request(conn));
+
+    // unregister
+    ttyrant_fake* fake = conn->fake;
+    pthread_mutex_lock(&fake->mutex);
+    int index;
+    for (index = 0; index < fake->nconns; index++) {
+        if (fake->conns[index] == conn->fd) {
+            fake->conns[index] = fake->conns[--fake->nconns];
+            break;
+        }
+    }
+    pthread_cond_broadcast(&fake->idle);
+    pthread_mutex_unlock(&fake->mutex);
+
+    // cleanup
+    close(conn->fd);
+    if (conn->iterator) {
+        tclistdel(conn->iterator);
+    }
+    tcxstrdel(conn->out);
+    tclistdel(conn->queue);
+    free(conn);
+    return NULL;
+}
+
+/*
+ * Listener thread.
+ */
+static void* _fake_accept(void* arg) {
+    ttyrant_fake* fake = arg;
+    while (!fake->stopping) {
+
+        // accept
+        int fd = accept(fake->listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+        // register
+        _fake_conn* conn = malloc(sizeof(_fake_conn));
+        pthread_t thread;
+        pthread_mutex_lock(&fake->mutex);
+        int admitted = conn && !fake->stopping && fake->nconns < FAKE_CONNS_MAX;
+        if (admitted) {
+            conn->fake = fake;
+            conn->fd = fd;
+            conn->seed = (unsigned int)(fd * 2654435761u) ^ (unsigned int)time(NULL);
+            conn->iterator = NULL;
+            conn->out = tcxstrnew();
+            conn->queue = tclistnew();
+            conn->last = conn->arrival = conn->stamp = 0;
+            conn->start = conn->end = 0;
+            admitted = !pthread_create(&thread, NULL, _fake_serve, conn);
+            if (admitted) {
+                fake->conns[fake->nconns++] = fd;
+                pthread_detach(thread);
+            } else {
+                tcxstrdel(conn->out);
+                tclistdel(conn->queue);
+            }
+        }
+        pthread_mutex_unlock(&fake->mutex);
+        if (!admitted) {
+            free(conn);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Start a fake server (see src/ttyrant.h).
+ */
+ttyrant_fake* ttyrant_fake_start(const char* host, int port, int table, double delay, double jitter) {
+
+    // initialize
+    ttyrant_fake* fake = calloc(1, sizeof(ttyrant_fake));
+    if (!fake) {
+        return NULL;
+    }
+    fake->table = table;
+    fake->delay = delay;
+    fake->jitter = jitter;
+    fake->data = tcmapnew();
+    pthread_mutex_init(&fake->mutex, NULL);
+    pthread_cond_init(&fake->idle, NULL);
+
+    // listen
+    struct sockaddr_in address;
+    socklen_t addresssz = sizeof(address);
+    int flag = 1;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port > 0 ? port : 0);
+    fake->listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (fake->listener < 0 ||
+        inet_pton(AF_INET, host ? host : "127.0.0.1", &address.sin_addr) != 1 ||
+        setsockopt(fake->listener, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) ||
+        bind(fake->listener, (struct sockaddr*)&address, sizeof(address)) ||
+        listen(fake->listener, 64) ||
+        getsockname(fake->listener, (struct sockaddr*)&address, &addresssz) ||
+        pthread_create(&fake->acceptor, NULL, _fake_accept, fake)) {
+        int error = errno;
+        if (fake->listener >= 0) {
+            close(fake->listener);
+        }
+        tcmapdel(fake->data);
+        pthread_mutex_destroy(&fake->mutex);
+        pthread_cond_destroy(&fake->idle);
+        free(fake);
+        errno = error;
+        return NULL;
+    }
+    fake->port = ntohs(address.sin_port);
+
+    // ready
+    return fake;
+}
+
+/*
+ * Change the response delay of a fake server.
+ */
+void ttyrant_fake_delay(ttyrant_fake* fake, double delay, double jitter) {
+    pthread_mutex_lock(&fake->mutex);
+    fake->delay = delay > 0 ? delay : 0;
+    fake->jitter = jitter > 0 ? jitter : 0;
+    pthread_mutex_unlock(&fake->mutex);
+}
+
+/*
+ * Change the replication delay reported by a fake server.
+ */
+void ttyrant_fake_lag(ttyrant_fake* fake, double lag) {
+    pthread_mutex_lock(&fake->mutex);
+    fake->lag = lag > 0 ? lag : 0;
+    pthread_mutex_unlock(&fake->mutex);
+}
+
+/*
+ * Get the listening port of a fake server.
+ */
+int ttyrant_fake_port(ttyrant_fake* fake) {
+    return fake->port;
+}
+
+/*
+ * Get the number of requests answered by a fake server.
+ */
+uint64_t ttyrant_fake_requests(ttyrant_fake* fake) {
+    pthread_mutex_lock(&fake->mutex);
+    uint64_t requests = fake->requests;
+    pthread_mutex_unlock(&fake->mutex);
+    return requests;
+}
+
+/*
+ * Stop a fake server, dropping its connections and records.
+ */
+void ttyrant_fake_stop(ttyrant_fake* fake) {
+
+    // stop listening
+    fake->stopping = 1;
+    shutdown(fake->listener, SHUT_RDWR);
+    pthread_join(fake->acceptor, NULL);
+    close(fake->listener);
+
+    // drop connections
+    pthread_mutex_lock(&fake->mutex);
+    int index;
+    for (index = 0; index < fake->nconns; index++) {
+        shutdown(fake->conns[index], SHUT_RDWR);
+    }
+    while (fake->nconns > 0) {
+        pthread_cond_wait(&fake->idle, &fake->mutex);
+    }
+    pthread_mutex_unlock(&fake->mutex);
+
+    // cleanup
+    tcmapdel(fake->data);
+    pthread_mutex_destroy(&fake->mutex);
+    pthread_cond_destroy(&fake->idle);
+    free(fake);
+}
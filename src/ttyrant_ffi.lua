@@ -0,0 +1,279 @@
+--
+-- Lua-TTyrant
+--
+-- TokyoTyrant API for Lua (LuaJIT FFI fast path).
+-- Copyright (C)2010 by Valeriu Palos. All rights reserved.
+-- This library is under the MIT license (see doc/LICENSE).
+--
+-- Wraps a ttyrant.hash object so that get/put/getlist/putlist/out/addint go
+-- through the plain C interface of src/ttyrant.h via the LuaJIT FFI (so hot
+-- loops stay compiled and keys are passed without temporary strings). Under
+-- plain Lua the same methods simply forward to the object.
+--
+--     local tf = require('ttyrant.ffi')
+--     local fh = tf.wrap(assert(ttyrant.hash:open('localhost', 1978)))
+--     fh:put('key', 'value')
+--     local value = fh:get('key')
+--
+
+
+--
+-- Import API.
+--
+local ttyrant = require('ttyrant')
+local hash = require('ttyrant.hash')
+local jit, ffi = pcall(require, 'ffi')
+
+
+--
+-- Module.
+--
+local M = { jit = jit }
+local wrapper = {}
+wrapper.__index = wrapper
+
+
+--
+-- Check the wrapped object.
+--
+local function check(db)
+    local mt = getmetatable(db)
+    if type(db) ~= 'userdata' or type(mt) ~= 'table' or mt.__index ~= hash then
+        error('Invalid object for ttyrant.ffi.wrap(), expected «ttyrant.hash» instance!', 3)
+    end
+    return db
+end
+
+
+--
+-- Plain Lua (forwarding) version.
+--
+if not jit then
+
+    function M.wrap(db)
+        return setmetatable({ db = check(db) }, wrapper)
+    end
+    function wrapper:get(key)
+        return self.db:get(key)
+    end
+    function wrapper:put(key, value)
+        return self.db:put(key, value)
+    end
+    function wrapper:getlist(keys)
+        return self.db:get(keys)
+    end
+    function wrapper:putlist(pairs)
+        return self.db:put(pairs)
+    end
+    function wrapper:out(key)
+        return self.db:out(key)
+    end
+    function wrapper:getinto()
+        error('ttyrant.ffi: getinto() needs LuaJIT!', 2)
+    end
+    function wrapper:addint()
+        error('ttyrant.ffi: addint() needs LuaJIT!', 2)
+    end
+
+    return M
+end
+
+
+--
+-- C interface (keep in sync with src/ttyrant.h).
+--
+ffi.cdef[[
+    typedef struct ttyrant_handle ttyrant_handle;
+    typedef struct {
+        int         version;
+        int         (*get)(ttyrant_handle*, const void*, int, void*, int);
+        int         (*put)(ttyrant_handle*, const void*, int, const void*, int);
+        int         (*getlist)(ttyrant_handle*, int, const char* const*, const int*, void*, int, int*);
+        int         (*putlist)(ttyrant_handle*, int, const char* const*, const int*, const char* const*, const int*);
+        int         (*out)(ttyrant_handle*, const void*, int);
+        int         (*addint)(ttyrant_handle*, const void*, int, int, int*);
+        int         (*ecode)(ttyrant_handle*);
+        const char* (*errmsg)(int);
+    } ttyrant_abi;
+]]
+
+local ABI_VERSION = 1
+local abi = ffi.cast('const ttyrant_abi*', (ttyrant.abi()))
+if abi.version ~= ABI_VERSION then
+    error(('ttyrant.ffi: C interface version %d, expected %d!'):format(abi.version, ABI_VERSION))
+end
+
+local strings = ffi.typeof('const char*[?]')
+local ints = ffi.typeof('int[?]')
+local chars = ffi.typeof('char[?]')
+local result = ffi.new('int[1]')
+
+
+--
+-- Failure (nil, message) of the last call on the handle.
+--
+local function failure(self)
+    return nil, ffi.string(abi.errmsg(abi.ecode(self.handle)))
+end
+
+
+--
+-- Make sure the value buffer holds at least 'size' bytes.
+--
+local function reserve(self, size)
+    if size > self.buffersz then
+        self.buffersz = math.max(size, self.buffersz * 2)
+        self.buffer = chars(self.buffersz)
+    end
+end
+
+
+--
+-- Make sure the key/value arrays hold at least 'count' items.
+--
+local function arrays(self, count)
+    if count > self.count then
+        self.count = math.max(count, self.count * 2)
+        self.keys, self.keyszs = strings(self.count), ints(self.count)
+        self.values, self.valueszs = strings(self.count), ints(self.count)
+    end
+end
+
+
+--
+-- Wrap a ttyrant.hash object (which is kept alive by the wrapper).
+--
+-- <wrapper> = ttyrant.ffi.wrap(<hash>)
+--
+function M.wrap(db)
+    return setmetatable({
+        db = check(db),
+        handle = ffi.cast('ttyrant_handle*', db),
+        buffer = chars(4096),
+        buffersz = 4096,
+        count = 0,
+    }, wrapper)
+end
+
+
+--
+-- <value> = <wrapper>:get(key)
+--
+function wrapper:get(key)
+    local size = abi.get(self.handle, key, #key, self.buffer, self.buffersz)
+    if size > self.buffersz then
+        reserve(self, size)
+        size = abi.get(self.handle, key, #key, self.buffer, self.buffersz)
+    end
+    if size < 0 or size > self.buffersz then
+        return failure(self)
+    end
+    return ffi.string(self.buffer, size)
+end
+
+
+--
+-- Get a value into a caller-supplied buffer (no allocations at all); a size
+-- larger than 'buffersz' means the value did not fit.
+--
+-- <size> = <wrapper>:getinto(key, buffer, buffersz)
+--
+function wrapper:getinto(key, buffer, buffersz)
+    local size = abi.get(self.handle, key, #key, buffer, buffersz)
+    if size < 0 then
+        return failure(self)
+    end
+    return size
+end
+
+
+--
+-- Values are strings or (pointer, size) pairs.
+--
+-- <boolean> = <wrapper>:put(key, value[, size])
+--
+function wrapper:put(key, value, size)
+    if abi.put(self.handle, key, #key, value, size or #value) == 0 then
+        return failure(self)
+    end
+    return true
+end
+
+
+--
+-- <table> = <wrapper>:getlist{key1, key2, ...}
+--
+function wrapper:getlist(keys)
+    local count = #keys
+    arrays(self, count)
+    for index = 1, count do
+        local key = keys[index]
+        self.keys[index - 1], self.keyszs[index - 1] = key, #key
+    end
+    local total = abi.getlist(self.handle, count, self.keys, self.keyszs, self.buffer, self.buffersz, self.valueszs)
+    if total > self.buffersz then
+        reserve(self, total)
+        total = abi.getlist(self.handle, count, self.keys, self.keyszs, self.buffer, self.buffersz, self.valueszs)
+    end
+    if total < 0 or total > self.buffersz then
+        return failure(self)
+    end
+    local items, offset = {}, 0
+    for index = 1, count do
+        local size = self.valueszs[index - 1]
+        if size >= 0 then
+            items[keys[index]] = ffi.string(self.buffer + offset, size)
+            offset = offset + size
+        end
+    end
+    return items
+end
+
+
+--
+-- <boolean> = <wrapper>:putlist{key1 = value1, key2 = value2, ...}
+--
+function wrapper:putlist(items)
+    local count = 0
+    for key, value in pairs(items) do
+        count = count + 1
+    end
+    arrays(self, count)
+    local index = 0
+    for key, value in pairs(items) do
+        self.keys[index], self.keyszs[index] = key, #key
+        self.values[index], self.valueszs[index] = value, #value
+        index = index + 1
+    end
+    if abi.putlist(self.handle, count, self.keys, self.keyszs, self.values, self.valueszs) == 0 then
+        return failure(self)
+    end
+    return true
+end
+
+
+--
+-- <boolean> = <wrapper>:out(key)
+--
+function wrapper:out(key)
+    if abi.out(self.handle, key, #key) == 0 then
+        return failure(self)
+    end
+    return true
+end
+
+
+--
+-- Integer addition (stored as a 4 byte integer, unlike <any>:increment()).
+--
+-- <number> = <wrapper>:addint(key[, num = 1])
+--
+function wrapper:addint(key, num)
+    if abi.addint(self.handle, key, #key, num or 1, result) == 0 then
+        return failure(self)
+    end
+    return result[0]
+end
+
+
+return M
@@ -63,6 +63,14 @@ assert(th:put{ martyr1 = 'Valeriu Gafencu',
 -- ttyrant.hash:putnr()
 assert(th:putnr('martyr6', 'Ianolide Ioan'))
 
+-- ttyrant.hash:putnr() - multiple keys at once given as table or list
+assert(th:putnr{ nr1 = 'one', nr2 = 'two' })
+assert(th:putnr('nr3', 'three', 'nr4', 'four'))
+local vnr = assert(th:get('nr1', 'nr2', 'nr3', 'nr4'))
+assert(vnr.nr1 == 'one')
+assert(vnr.nr4 == 'four')
+assert(th:out('nr1', 'nr2', 'nr3', 'nr4'))
+
 -- ttyrant.hash:putkeep()
 assert(th:putkeep('martyr7', 'Corneliu Zelea'))
 assert(not th:putkeep('martyr7', 'Corneliu Zelea Codreanu'))
@@ -129,6 +137,26 @@ assert(not vsnt.fake_key)
 -- test tcrdbget3 behaviour
 assert(not vsnt.fake1)
 
+-- ttyrant.hash:getbuffer()
+local buf = assert(th:getbuffer('saint7'))
+assert(#buf == #'Ilie Lăcătuşu')
+assert(buf:tostring() == 'Ilie Lăcătuşu')
+assert(tostring(buf) == 'Ilie Lăcătuşu')
+assert(buf:sub(1, 4) == 'Ilie')
+assert(buf:sub(-3) == 'şu')
+assert(select(2, buf:ptr()) == #buf)
+local tmp = io.tmpfile()
+assert(buf:write(tmp))
+tmp:seek('set')
+assert(tmp:read('*a') == 'Ilie Lăcătuşu')
+tmp:close()
+assert(th:put('saint8', buf))
+assert(th:get('saint8') == 'Ilie Lăcătuşu')
+assert(th:out('saint8'))
+assert(buf:free())
+assert(#buf == 0)
+assert(not th:getbuffer('fake1'))
+
 -- ttyrant.hash:out()
 assert(th:out('Key1'))
 assert(not th:get('Key1'))
@@ -184,6 +212,24 @@ for key in th:iterator() do
     keys[key] = nil
 end
 
+-- ttyrant.hash:iterator() - read-ahead keys and values
+local count = 0
+for key, value in th:iterator{ batch = 3, values = true } do
+    assert(value == th:get(key))
+    count = count + 1
+end
+assert(count == 8)
+local count = 0
+for key, value in th:iterator{ batch = 2, values = true, prefetch = true } do
+    count = count + 1
+end
+assert(count == 8)
+local count = 0
+for key in th:iterator{ batch = 5 } do
+    count = count + 1
+end
+assert(count == 8)
+
 -- ttyrant.hash:fwmkeys()
 local keys = {
     ["saint2"] = true,
@@ -199,8 +245,113 @@ end
 -- ttyrant.hash:optimize()
 assert(th:optimize())
 
+-- ttyrant.ffi.wrap()
+local tf = require('ttyrant.ffi')
+local fh = tf.wrap(th)
+assert(fh:put('ffi1', 'one'))
+assert(fh:get('ffi1') == 'one')
+assert(fh:get('ffi0') == nil)
+assert(fh:putlist{ ffi2 = 'two', ffi3 = ('3'):rep(10000) })
+local test = fh:getlist{ 'ffi1', 'ffi0', 'ffi3' }
+assert(test.ffi1 == 'one' and test.ffi0 == nil and #test.ffi3 == 10000)
+assert(fh:out('ffi2') and fh:get('ffi2') == nil)
+if tf.jit then
+    assert(fh:addint('ffi4', 3) == 3 and fh:addint('ffi4') == 4)
+end
+local it = th:iterator{ batch = 1, prefetch = true }
+assert(it() and fh:get('ffi1') == 'one' and fh:get('ffi0') == nil)
+it = nil
+assert(fh:out('ffi1') and fh:out('ffi3'))
+assert(not pcall(tf.wrap, {}))
+
+-- ttyrant.hash:metrics()
+assert(th:get{ 'saint1', 'saint2', 'saint3' })
+local test = th:metrics(true)
+assert(test.put.calls > 0 and test.get.calls > 0 and not test.metrics)
+assert(test.get.batchmax >= 3 and test.get.received > 0)
+assert(test.get.p50 <= test.get.p99 and test.get.p99 <= test.get.p999 and test.get.p999 <= test.get.max)
+assert(next(th:metrics()) == nil)
+
+-- ttyrant.hash:cache()
+assert(th:cachestats() == nil)
+assert(th:cache{ bytes = 4096 })
+assert(th:put('cache1', 'one') and th:put('cache2', 'two'))
+assert(th:get('cache1') == 'one' and th:get('cache1') == 'one')
+local test = th:cachestats()
+assert(test.hits == 1 and test.misses == 1 and test.entries == 1)
+local test = th:get{ 'cache1', 'cache2', 'cache0' }
+assert(test.cache1 == 'one' and test.cache2 == 'two' and test.cache0 == nil)
+assert(th:cachestats().hits == 2 and th:cachestats().entries == 2)
+assert(th:put('cache1', 'uno') and th:get('cache1') == 'uno')
+assert(th:out('cache2') and th:get('cache2') == nil)
+assert(th:cachestats(true).invalidations == 2)
+assert(th:put('cache3', ('3'):rep(5000)) and #th:get('cache3') == 5000)
+assert(th:cachestats().bytes <= 4096)
+assert(th:get('cache1') == 'uno' and th:get('cache1') == 'uno')
+assert(th:get('cache1') and th:cachestats().evictions == 0)
+assert(th:put(('k'):rep(10), ('v'):rep(1000), 'cache4', ('4'):rep(3000)))
+assert(th:get{ ('k'):rep(10), 'cache4' } and th:cachestats().evictions > 0)
+assert(th:cache(false) and th:cachestats() == nil)
+assert(th:out('cache1', 'cache3', 'cache4', ('k'):rep(10)))
+
+-- ttyrant.hash:filter()
+assert(th:filterstats() == nil)
+assert(th:put('filter1', 'one'))
+assert(th:filter{ keys = 1000, fpr = 0.001 })
+assert(th:get('filter1') == 'one' and th:vsiz('filter1') == 3)
+local test, message = th:get('filter0')
+assert(test == nil and message)
+assert(th:filterstats().negatives == 1 and th:filterstats().positives == 2)
+assert(th:put{ filter2 = 'two' } and th:putkeep('filter3', 'three'))
+local test = th:get{ 'filter1', 'filter2', 'filter3', 'filter0' }
+assert(test.filter1 == 'one' and test.filter2 == 'two' and test.filter3 == 'three' and test.filter0 == nil)
+assert(th:filterstats(true).keys >= 3 and th:filterstats().negatives == 0)
+assert(th:filtersave('/tmp/lua-ttyrant.filter'))
+assert(th:filter(false) and th:filterstats() == nil)
+assert(th:filter{ file = '/tmp/lua-ttyrant.filter' })
+assert(th:get('filter3') == 'three' and not th:get('filter0'))
+assert(th:filterstats().negatives == 1)
+assert(not th:filter{ file = '/tmp/lua-ttyrant.missing' })
+assert(th:filter(false))
+assert(th:out('filter1', 'filter2', 'filter3'))
+os.remove('/tmp/lua-ttyrant.filter')
+
+-- ttyrant.hash:batch()
+local batch = th:batch()
+assert(batch:put('batch1', 'one') == 1 and batch:putkeep('batch1', 'uno') == 2)
+assert(batch:putcat('batch1', '+') == 3 and batch:putshl('batch1', '23', 3) == 4)
+assert(batch:get('batch1') == 5 and batch:get('batch0') == 6 and batch:vsiz('batch1') == 7)
+assert(batch:addint('batch2', 2) == 8 and batch:increment('batch3', 1.5) == 9)
+assert(batch:putnr('batch4', 'four') == 10 and batch:out('batch0') == 11 and #batch == 11)
+local test, errors = batch:flush()
+assert(test[1] == true and test[2] == false and errors[2] and test[3] == true and test[4] == true)
+assert(test[5] == '+23' and test[6] == false and errors[6] and test[7] == 3)
+assert(test[8] == 2 and test[9] == 1.5 and test[10] == true and test[11] == false)
+assert(#batch == 0 and th:get('batch4') == 'four')
+assert(batch:out('batch1') and batch:out('batch2') and batch:out('batch3') and batch:out('batch4'))
+local test, errors = batch:flush()
+assert(#test == 4 and next(errors) == nil)
+assert(batch:get('batch1') and batch:clear() and #batch == 0)
+assert(th:cache{ bytes = 4096 } and th:put('batch5', 'old') and th:get('batch5') == 'old')
+assert(batch:put('batch5', 'new') and th:get('batch5') == 'old')
+assert(batch:flush() and th:get('batch5') == 'new')
+assert(th:out('batch5') and th:cache(false))
+local big = string.rep('x', 1000)
+for index = 1, 4000 do
+    batch:put('big' .. index, big)
+    batch:get('big' .. index)
+end
+local test, errors = batch:flush()
+assert(#test == 8000 and next(errors) == nil and test[8000] == big)
+for index = 1, 4000 do
+    batch:out('big' .. index)
+end
+local test, errors = batch:flush()
+assert(#test == 4000 and next(errors) == nil)
+
 -- ttyrant.hash:close()
 assert(th:close())
+assert(not pcall(th.get, th, 'test'))
 
 
 --
@@ -239,6 +390,10 @@ assert(tonumber(vabc['d']) == 9.10)
 assert(tonumber(v123['3']) == 3.33)
 assert(tonumber(v123['4']) == 4.44)
 
+-- ttyrant.table:getbuffer()
+assert(tonumber(tt:getbuffer('abc', 'a'):tostring()) == 1.23)
+assert(not tt:getbuffer('abc', 'fake'))
+
 -- ttyrant.table:out()
 assert(tt:out('123'))
 assert(not tt:get('123'))
@@ -283,6 +438,10 @@ for key in tt:iterator() do
     assert(keys[key] ~= nil)
     keys[key] = nil
 end
+for key, tuple in tt:iterator{ batch = 2, values = true } do
+    assert(type(tuple) == 'table')
+    assert(tuple.b == tt:get(key).b)
+end
 
 -- ttyrant.table:fwmkeys()
 local keys = {
@@ -306,6 +465,17 @@ assert(tt:genuid() < tt:genuid())
 -- ttyrant.table:optimize()
 assert(tt:optimize())
 
+-- ttyrant.table:batch()
+local batch = tt:batch()
+assert(batch:put('batch1', { a = 'one', b = 2 }) and batch:putkeep('batch1', { a = '-' }))
+assert(batch:get('batch1') and batch:get('batch0') and batch:increment('batch1', 2))
+assert(batch:out('batch1') and batch:get('batch1'))
+local test, errors = batch:flush()
+assert(test[1] == true and test[2] == false and errors[2])
+assert(test[3].a == 'one' and test[3].b == '2' and test[4] == false)
+assert(test[5] == 2 and test[6] == true and test[7] == false)
+assert(not pcall(batch.putnr, batch, 'batch1', 'one'))
+
 -- leaving table db open for query tests...
 
 
@@ -343,6 +513,31 @@ assert(#result == 3)
 assert(result[1] == 'student4')
 assert(result[2] == 'student3')
 assert(result[3] == 'student5')
+
+-- ttyrant.query.parasearch()
+local qp = assert(ttyrant.query:new(tt))
+assert(qp:addcond('grade', 'numlt', '50'))
+local keys, tuples = ttyrant.query.parasearch{ qr, qp }
+assert(#keys == 3)
+assert(keys[1] == 'student4')
+assert(tuples['student4']['grade'] == '999')
+
+-- ttyrant.query.metasearch()
+local qm1 = assert(ttyrant.query:new(tt))
+local qm2 = assert(ttyrant.query:new(tt))
+assert(qm1:addcond('grade', 'numge', '10'))
+assert(qm2:addcond('grade', 'numlt', '100'))
+assert(#ttyrant.query.metasearch({ qm1, qm2 }, 'isect') == 2)
+assert(#ttyrant.query.metasearch({ qm1, qm2 }, 'RDBMSUNION') == 5)
+assert(#ttyrant.query.metasearch({ qm1, qm2 }, 'diff') == 2)
+
+-- ttyrant.query.metasearchget()
+-- ttyrant.query.metasearchcount()
+local keys, tuples = ttyrant.query.metasearchget({ qm1, qm2 }, 'isect', { 'grade' })
+assert(#keys == 2)
+assert(tuples['student5']['grade'] == '43.7')
+assert(tuples['student5']['flowers'] == nil)
+assert(ttyrant.query.metasearchcount({ qm1, qm2 }, 'isect') == 2)
 assert(qr:delete())
 
 -- ttyrant.query:hint()
@@ -355,7 +550,34 @@ local qr = assert(ttyrant.query:new(tt))
 assert(qr:addcond('grade', 'numeq', '43.7'))
 local result = assert(qr:searchget())
 assert(result['student5']['flowers'] == 'roses')
+local result = assert(qr:searchget{ 'flowers' })
+assert(result['student5']['flowers'] == 'roses')
+assert(result['student5']['grade'] == nil)
 assert(qr:searchcount() == 1);
+
+-- ttyrant.query:cursor()
+local qc = assert(ttyrant.query:new(tt))
+assert(qc:addcond('grade', 'numge', '0'))
+assert(qc:setorder('grade', 'numasc'))
+local grades = {}
+for key, tuple in qc:cursor{ pagesize = 2 } do
+    grades[#grades + 1] = tuple.grade
+end
+assert(#grades == 5)
+assert(grades[1] == '1')
+for key, tuple in qc:cursor{ pagesize = 2, columns = { 'flowers' } } do
+    assert(tuple.grade == nil)
+end
+assert(grades[5] == '999')
+assert(qc:setlimit(2, 1))
+local grades = {}
+for key, tuple in qc:cursor{ pagesize = 1, prefetch = false } do
+    grades[#grades + 1] = tuple.grade
+end
+assert(#grades == 2)
+assert(grades[1] == '10')
+assert(grades[2] == '43.7')
+
 assert(qr:searchout());
 assert(qr:searchcount() == 0);
 assert(qr:delete())
@@ -364,8 +586,423 @@ assert(qr:delete())
 assert(tt:rnum() == 9)
 
 -- ttyrant.table:close()
+assert(tostring(tt):match('^ttyrant.table'))
 assert(tt:close())
+assert(not pcall(tt.get, tt, 'test'))
+
+
+--
+-- Pool tests.
+--
+
+-- ttyrant.pool:open()
+local tp = assert(ttyrant.pool:open('localhost', 1978, { size = 2, warm = 1, wait = 0.1 }))
+local ttp = assert(ttyrant.pool:open('localhost', 1979, { size = 1 }))
+assert(tp:stats().connected == 1)
+
+-- ttyrant.pool:checkout()
+local pc1 = assert(tp:checkout())
+local pc2 = assert(tp:checkout())
+local pct = assert(ttp:checkout(ttyrant.table))
+local start = ttyrant.clock()
+assert(not tp:checkout())
+assert(ttyrant.clock() - start >= 0.09)
+assert(pc1:put('pooled', 'yes'))
+assert(pc2:get('pooled') == 'yes')
+assert(pct:rnum() > 0)
+assert(tp:stats().busy == 2)
+
+-- ttyrant.pool:checkin()
+assert(tp:checkin(pc1))
+assert(pc2:close() and pct:close())
+assert(not pcall(pc1.get, pc1, 'pooled'))
+local pc3 = assert(tp:checkout())
+assert(pc3:out('pooled'))
+assert(pc3:close())
+
+-- ttyrant.pool:stats()
+local stats = tp:stats()
+assert(stats.size == 2)
+assert(stats.busy == 0)
+assert(stats.connected == 2)
+assert(stats.checkouts == 3)
+assert(stats.timeouts == 1)
+assert(stats.utilization > 0)
+
+-- idle connections are evicted at checkout too
+local ep = assert(ttyrant.pool:open('127.0.0.1', 1978, { size = 2, idle = 0.01 }))
+local ec1, ec2 = assert(ep:checkout()), assert(ep:checkout())
+assert(ec1:close() and ec2:close())
+local start = ttyrant.clock()
+while ttyrant.clock() - start < 0.02 do end
+local ec3 = assert(ep:checkout())
+assert(ep:stats().evictions >= 1 and ec3:close())
+
+-- checking in settles an open prefetching iterator first (and only into the right pool)
+local pc4 = assert(tp:checkout())
+assert(pc4:put{ pi1 = '1', pi2 = '2', pi3 = '3', pi4 = '4' })
+local it = pc4:iterator{ batch = 1, prefetch = true }
+assert(it())
+assert(not pcall(ep.checkin, ep, pc4))
+assert(tp:checkin(pc4) and not pcall(it))
+local pc5 = assert(tp:checkout())
+assert(pc5:get('pi1') == '1' and pc5:vsiz('pi2') == 1 and pc5:out{ 'pi1', 'pi2', 'pi3', 'pi4' })
+assert(pc5:close())
+it = nil
+
+
+--
+-- Cluster tests.
+--
+
+-- ttyrant.cluster:new()
+local tc1 = assert(ttyrant.hash:open('localhost', 1978))
+local tc2 = assert(ttyrant.hash:open('localhost', 1978))
+local tc3 = assert(ttyrant.hash:open('localhost', 1978))
+local cl = assert(ttyrant.cluster:new{ one = tc1, two = tc2, three = tc3 })
+
+-- ttyrant.cluster:put()
+assert(cl:put{ c1 = 'a', c2 = 'b', c3 = 'c', c4 = 'd' })
+assert(cl:put('c5', 'e', 'c6', 'f'))
+
+-- ttyrant.cluster:get()
+assert(cl:get('c1') == 'a')
+local vcl = assert(cl:get{ 'c1', 'c2', 'c3', 'c4', 'c5', 'c6', 'fake' })
+assert(vcl.c4 == 'd')
+assert(vcl.c6 == 'f')
+assert(not vcl.fake)
+
+-- ttyrant.cluster:out()
+assert(cl:out('c1', 'c2', 'c3'))
+assert(cl:out{ 'c4', 'c5', 'c6' })
+assert(not cl:get('c1'))
+
+-- node caches and filters follow cluster writes
+local cn = cl:node('c7')
+assert(cn:cache{ bytes = 4096 } and cn:filter{ keys = 100 })
+assert(cl:put('c7', 'g') and cn:get('c7') == 'g')
+assert(cl:put{ c7 = 'h' } and cn:get('c7') == 'h')
+assert(cl:out('c7') and cn:get('c7') == nil)
+assert(cn:cache(false) and cn:filter(false))
+
+-- ttyrant.cluster:node()
+-- ttyrant.cluster:add()
+local owners = {}
+for i = 1, 1000 do
+    owners[i] = select(2, cl:node('key' .. i))
+end
+local tc4 = assert(ttyrant.hash:open('localhost', 1978))
+assert(cl:add(tc4, 'four'))
+local moved = 0
+for i = 1, 1000 do
+    local _, owner = cl:node('key' .. i)
+    if owner ~= owners[i] then
+        assert(owner == 'four')
+        moved = moved + 1
+    end
+end
+assert(moved > 100 and moved < 400)
+assert(not pcall(cl.add, cl, tc4, 'five'))
+assert(tc1:close() and tc2:close() and tc3:close() and tc4:close())
+assert(not pcall(cl.get, cl, 'c1'))
+assert(not pcall(cl.put, cl, 'c1', 'a'))
+
+
+
+--
+-- Fake server tests.
+--
+
+-- ttyrant.fake:start()
+local fh = assert(ttyrant.fake:start())
+local ft = assert(ttyrant.fake:start{ table = true, delay = 0.001 })
+local th = assert(ttyrant.hash:open(fh:address()))
+local tt = assert(ttyrant.table:open('127.0.0.1', ft:port()))
+
+-- hash commands
+assert(th:put('f1', 'one') and th:put{ f2 = 'two', f3 = 'three' })
+assert(th:putcat('f1', '+') and th:get('f1') == 'one+')
+assert(th:putshl('f1', '23', 3) and th:get('f1') == '+23')
+assert(th:putnr{ f4 = 'four', f5 = 'five' })
+local test = th:get{ 'f2', 'f4', 'f5', 'f6' }
+assert(test.f2 == 'two' and test.f4 == 'four' and test.f5 == 'five' and test.f6 == nil)
+assert(th:increment('f7', 2) == 2 and th:increment('f7') == 3)
+assert(#th:fwmkeys('f') == 6 and th:rnum() == 6)
+local count = 0
+for key, value in th:iterator{ batch = 4, values = true, prefetch = true } do
+    count = count + 1
+end
+assert(count == 6)
+for key in th:iterator{ batch = 2, prefetch = true } do
+    break
+end
+local count = 0
+for key in th:iterator{ batch = 2, prefetch = true } do
+    assert(th:get(key))
+    count = count + 1
+end
+assert(count == 6)
+local count = 0
+for key, value in th:iterator{ batch = 4, values = true, prefetch = true } do
+    assert(th:get(key) == value and th:vsiz(key) == #value)
+    count = count + 1
+end
+assert(count == 6)
+assert(th:get('f3') == 'three' and th:vsiz('f4') == 4)
+assert(th:out{ 'f1', 'f2' } and not th:get('f1'))
+
+-- table commands
+assert(tt:put('r1', { name = 'alpha', grade = 10 }))
+assert(tt:put('r2', { name = 'beta', grade = 20 }))
+assert(tt:put('r3', { name = 'gamma', grade = 30 }))
+assert(tt:get('r2').name == 'beta')
+local fq = assert(ttyrant.query:new(tt))
+assert(fq:addcond('grade', 'numge', '20'))
+assert(fq:setorder('grade', 'numdesc'))
+local test = assert(fq:search())
+assert(#test == 2 and test[1] == 'r3' and test[2] == 'r2')
+local test = assert(fq:searchget{ 'name' })
+assert(test.r3.name == 'gamma' and test.r3.grade == nil)
+assert(fq:searchcount() == 2)
+
+-- objects depending on a closed database object
+local tc = assert(ttyrant.table:open(ft:address()))
+local cq = assert(ttyrant.query:new(tc))
+local keys = tc:iterator()
+local it = tc:iterator{ batch = 1, prefetch = true }
+local cursor = cq:cursor{ pagesize = 1 }
+assert(it())
+assert(tc:close())
+assert(not pcall(cq.search, cq) and not pcall(keys) and not pcall(it) and not pcall(cursor))
+keys, it, cursor, cq = nil, nil, nil, nil
+collectgarbage('collect')
+
+-- extension calls (the fake server knows 'echo' and 'incr' only)
+assert(th:ext('incr', 'x1', '2', 'record') == '2' and th:ext('incr', 'x1', 3) == '5' and th:get('x1') == '5')
+assert(th:ext('echo', 'key', 'value', 'global') == 'keyvalue')
+local test, message = th:ext('missing', 'x1')
+assert(test == nil and message)
+local test, errors = th:extmany({ { 'incr', 'x1', '1' }, { 'echo', 'f4', nil, 'global' }, { 'missing', 'x1', '1' },
+                                  { 'incr', 'x1', '1' } }, 'record')
+assert(test[1] == '6' and test[2] == 'f4' and test[3] == false and errors[3] and test[4] == '7')
+assert(errors[1] == nil and errors[2] == nil and errors[4] == nil)
+assert(not pcall(th.ext, th, 'incr', 'x1', '1', 'everything'))
+local calls, echo = {}, string.rep('e', 1000)
+for index = 1, 2000 do
+    calls[index] = { 'echo', 'x', echo }
+end
+local test, errors = th:extmany(calls)
+assert(#test == 2000 and next(errors) == nil and test[2000] == 'x' .. echo)
+local batch = th:batch()
+assert(batch:ext('incr', 'x1', '1') == 1 and batch:get('x1') == 2 and batch:ext('missing') == 3)
+assert(batch:get('f3') == 4)
+local test, errors = batch:flush()
+assert(test[1] == '8' and test[2] == '8' and test[3] == false and errors[3] and test[4] == 'three')
+assert(th:out('x1'))
+
+-- latency injection
+local start = ttyrant.clock()
+assert(tt:get('r1'))
+assert(ttyrant.clock() - start >= 0.001)
+assert(ft:delay(0))
+assert(fh:delay(0.05))
+local batch = th:batch()
+for index = 1, 8 do
+    batch:get('f3')
+end
+local start = ttyrant.clock()
+assert(#batch:flush() == 8)
+local elapsed = ttyrant.clock() - start
+assert(elapsed >= 0.05 and elapsed < 0.2)
+assert(fh:delay(0))
+local requests = fh:requests()
+assert(th:get{ 'f3', 'f4' })
+assert(fh:requests() == requests + 1)
+
+-- parallel batches
+assert(th:parallel{ connections = 3, chunk = 16, inflight = 256 })
+local items, keys = {}, {}
+for i = 1, 100 do
+    items['p' .. i] = 'v' .. i
+    keys[i] = 'p' .. i
+end
+assert(th:put(items))
+local count = 0
+for key, value in pairs(th:get(keys)) do
+    assert(value == items[key])
+    count = count + 1
+end
+assert(count == 100)
+local test = th:parallelstats()
+assert(test.batches == 2 and test.chunks == 14)
+assert(th:out(keys) and not th:get('p1'))
+assert(th:parallel(false) and th:parallelstats() == nil)
+
+-- open options and hedged reads
+assert(not ttyrant.hash:open('127.0.0.1', 1, { probe = 0.1 }))
+local fs = assert(ttyrant.fake:start{ delay = 0.05 })
+local hs = assert(ttyrant.hash:open(fs:address(), { timeout = 1, probe = 1, reconnect = true,
+                                                    hedge = { delay = 0.001, host = fh:address() } }))
+assert(hs:put('f3', 'slow') and hs:get('f4') == 'four')
+local test = assert(hs:hedgestats())
+assert(test.reads == 1 and test.hedged == 1 and test.wins == 1)
+assert(hs:get{ 'f3', 'f5' }.f5 == 'five')
+local test = assert(hs:hedgestats(true))
+assert(test.reads == 2 and test.wins >= 1)
+assert(hs:hedgestats().reads == 0 and th:hedgestats() == nil)
+local hp = assert(ttyrant.hash:open('127.0.0.1', fs:port(), { hedge = { delay = 0.001, port = fh:port() } }))
+assert(hp:get('f4') == 'four' and hp:hedgestats().wins == 1)
+assert(hp:close() and hs:close() and fs:stop())
+
+-- ttyrant.replicaset
+local fr = assert(ttyrant.fake:start())
+local hr = assert(ttyrant.hash:open(fr:address()))
+local rs = assert(ttyrant.replicaset:new(th, { hr }, { interval = 0 }))
+assert(rs:put('r1', 'master') and th:get('r1') == 'master' and hr:get('r1') == nil)
+assert(hr:put('r1', 'slave') and rs:get('r1') == 'slave')
+assert(rs:master() == th and rs:reader() == hr)
+local test = rs:stats()
+assert(test[1].master and not test[2].master and test[2].reads == 1 and test[2].delay == 0)
+assert(not pcall(rs.failover, rs, th))
+local test, errors = rs:failover(hr)
+assert(test and next(errors) == nil and rs:master() == hr)
+assert(th:stat().mport == tostring(fr:port()) and hr:stat().mport == '0')
+assert(rs:get('r1') == 'master' and rs:put('r2', 'new') and hr:get('r2') == 'new')
+
+-- ttyrant.replicaset - lagging and closed slaves
+local fa, fb = assert(ttyrant.fake:start()), assert(ttyrant.fake:start())
+local ha, hb = assert(ttyrant.hash:open(fa:address())), assert(ttyrant.hash:open(fb:address()))
+local rl = assert(ttyrant.replicaset:new(hr, { ha, hb }, { maxdelay = 0.5, interval = 0 }))
+assert(fa:lag(2) and ha:stat().delay == '2.000000')
+for index = 1, 8 do
+    assert(rl:reader() == hb)
+end
+assert(fb:lag(1) and rl:reader() == hr and rl:stats()[2].delay == 2)
+assert(fa:lag(0) and rl:reader() == ha)
+assert(hb:close() and rl:reader() == ha and rl:stats()[3].closed)
+assert(not pcall(rl.failover, rl, hb))
+local test, errors = rl:failover(ha, { address = '127.0.0.1:' .. fa:port() })
+assert(test and errors[fb:address()] and rl:master() == ha and rl:stats()[1].name == fr:address())
+assert(hr:stat().mport == tostring(fa:port()) and ha:stat().mport == '0')
+assert(ha:close() and fa:stop() and fb:stop())
+assert(hr:close() and fr:stop())
+assert(not pcall(rl.failover, rl, hr) and rl:stats()[1].closed)
+
+-- import and export
+local fi = assert(ttyrant.fake:start())
+local fj = assert(ttyrant.fake:start{ table = true })
+local hi = assert(ttyrant.hash:open(fi:address()))
+local ti = assert(ttyrant.table:open(fj:address()))
+local snapshot = os.tmpname()
+assert(th:export(snapshot, { batch = 2 }) == th:rnum())
+assert(hi:import(snapshot, { chunk = 2, window = 2 }) == th:rnum() and hi:get('f4') == 'four')
+assert(not ti:import(snapshot))
+assert(tt:export(snapshot, { format = 'tsv' }) == 3)
+assert(ti:import(snapshot) == 3 and ti:get('r2').name == 'beta' and ti:get('r3').grade == '30')
+assert(tt:export(snapshot) == 3 and ti:vanish() and ti:import(snapshot) == 3 and ti:get('r1').name == 'alpha')
+local file = assert(io.open(snapshot, 'w'))
+assert(file:write('t1\tone\n\nt2\ttwo\r\n') and file:close())
+assert(hi:import(snapshot) == 2 and hi:get('t2') == 'two')
+assert(hi:put('t\t3', 'a\tb\r\nc\\d\\n') and hi:export(snapshot, { format = 'tsv' }))
+local records = hi:rnum()
+assert(hi:vanish() and hi:import(snapshot) == records and hi:get('t\t3') == 'a\tb\r\nc\\d\\n')
+assert(ti:put('t4', { ['a\tb'] = 'c\nd', e = '\\' }) and ti:export(snapshot, { format = 'tsv' }))
+assert(ti:out('t4') and ti:import(snapshot) and ti:get('t4')['a\tb'] == 'c\nd' and ti:get('t4').e == '\\')
+assert(th:export(snapshot))
+local file = assert(io.open(snapshot, 'r+'))
+assert(file:seek('end', -4) and file:write('\0\0\0\0') and file:close())
+assert(not hi:import(snapshot))
+assert(not pcall(hi.import, hi, snapshot, { format = 'xml' }))
+os.remove(snapshot)
+assert(hi:close() and ti:close() and fi:stop() and fj:stop())
+
+-- batched table puts
+local test, errors = tt:put{ m1 = { name = 'delta', 4 }, [5] = { name = 'epsilon', grade = 50 } }
+assert(test.m1 and test['5'] and next(errors) == nil)
+assert(tt:get('m1')['1'] == '4' and tt:get('5').grade == '50')
+local test, errors = tt:putkeep{ m1 = { name = 'other' }, m2 = { name = 'zeta' } }
+assert(test.m1 == false and errors.m1 and test.m2 and tt:get('m1').name == 'delta')
+local test, errors = tt:putcat{ m2 = { name = 'eta', grade = 70 } }
+assert(test.m2 and tt:get('m2').name == 'zeta' and tt:get('m2').grade == '70')
+assert(not pcall(tt.put, tt, { m3 = 'flat' }))
+local test, message = pcall(tt.put, tt, { [-42] = { name = {} } })
+assert(not test and message:find('«-42»', 1, true))
+assert(tt:out{ 'm1', 'm2', '5' })
+local tuples, keys = {}, {}
+for index = 1, 3000 do
+    tuples['n' .. index] = { name = string.rep('n', 500), grade = index }
+    keys[index] = 'n' .. index
+end
+local test, errors = tt:put(tuples)
+assert(test.n1 and test.n3000 and next(errors) == nil and tt:get('n3000').grade == '3000')
+assert(tt:out(keys))
 
+-- ttyrant.fake:stop()
+assert(th:close() and tt:close())
+assert(fh:stop() and ft:stop())
+assert(not pcall(fh.port, fh))
+
+
+--
+-- Async tests.
+--
+
+-- ttyrant.async.open()
+local async = require('ttyrant.async')
+local fh = assert(ttyrant.fake:start())
+local ah = assert(async.open(fh:address()))
+
+-- blocking use (outside of coroutines)
+assert(ah:vanish())
+assert(ah:put('a1', 'one') and ah:get('a1') == 'one')
+local test, message = ah:get('a0')
+assert(test == nil and message)
+assert(ah:put{ a2 = 'two', a3 = 'three' } and ah:putkeep('a4', 'four') and not ah:putkeep('a4', '-'))
+assert(ah:putcat('a4', '!') and ah:vsiz('a4') == 5)
+assert(ah:putnr('a5', 'five') and ah:addint('a6', 2) == 2)
+local test = ah:get{ 'a1', 'a2', 'a5', 'a0' }
+assert(test.a1 == 'one' and test.a2 == 'two' and test.a5 == 'five' and test.a0 == nil)
+assert(#ah:fwmkeys('a') == 6 and ah:rnum() == 6)
+assert(ah:out('a6') and ah:out{ 'a4', 'a5' } and ah:rnum() == 3)
+
+-- ttyrant.async.spawn() and run() - requests of many coroutines pipelined on a few connections
+assert(fh:delay(0.01))
+local conns = { ah, assert(async.open(fh:address())), assert(async.open(fh:address())) }
+local done = 0
+for index = 1, 30 do
+    async.spawn(function(db, key)
+        assert(db:put(key, key) and db:get(key) == key)
+        done = done + 1
+    end, conns[index % 3 + 1], 'c' .. index)
+end
+assert(async.run(5) and done == 30)
+assert(fh:delay(0) and ah:rnum() == 33)
+
+-- ttyrant.async.wake() - a response read by another caller wakes its owner
+assert(fh:delay(0.01))
+local got
+async.spawn(function()
+    got = ah:get('c1')
+end)
+assert(not async.run(0) and got == nil)
+assert(ah:get('c2') == 'c2')
+assert(async.run(1) and got == 'c1')
+assert(fh:delay(0))
+
+-- custom wait function
+local waits = 0
+local aw = assert(async.open(fh:address(), { wait = function(fd, mode)
+    waits = waits + 1
+    ttyrant.socket.poll({ [fd] = mode })
+end }))
+assert(aw:get('c1') == 'c1' and waits > 0)
+
+-- <connection>:close()
+assert(aw:close() and not aw:get('c1'))
+for _, db in ipairs(conns) do
+    assert(db:close())
+end
+assert(fh:stop())
 
 --
 -- Success.